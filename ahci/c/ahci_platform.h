@@ -15,6 +15,12 @@ void *ahci_memcpy(void *dest, const void *src, uint64_t n);
 
 uint64_t ahci_malloc_align(uint64_t size, uint32_t align);
 
+// id of the current cpu
+uint32_t ahci_cpu_id();
+
+// monotonic time in microseconds
+uint64_t ahci_get_time_us();
+
 // sync all dcache data
 void ahci_sync_dcache();
 
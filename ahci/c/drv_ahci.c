@@ -1,5 +1,6 @@
 #include "libahci.h"
 #include "libata.h"
+#include "ahci_platform.h"
 
 // only for test
 uint8_t sector_data[512];
@@ -101,7 +102,6 @@ void ahci_dump_buffer(void *p, int len)
 // dump ahci info
 void ahci_print_info(struct ahci_device *ahci_dev)
 {
-    uint64_t host_mmio = ahci_dev->mmio_base;
     uint32_t vers, cap, cap2, impl, speed;
     const char *speed_s;
     const char *scc_s;
@@ -168,6 +168,9 @@ void ahci_sata_print_info(struct ahci_blk_dev *pdev)
     ahci_printf("Product model number: %s\n", pdev->product);
     ahci_printf("Firmware version: %s\n", pdev->revision);
     ahci_printf("Capacity: %lu sectors\n", pdev->lba);
+    ahci_printf("Sector size: %lu logical, %lu physical, lowest aligned lba %u\n",
+                pdev->blksz, pdev->phys_blksz, pdev->lowest_aligned);
+    ahci_printf("NCQ depth: %u\n", pdev->queue_depth);
 }
 
 // get base address of 'port'
@@ -221,6 +224,12 @@ int ahci_host_init(struct ahci_device *ahci_dev)
 
     // get how many ports the ahci supports
     ahci_dev->n_ports = (ahci_dev->cap & 0x1f) + 1;
+
+    // get which command slots the ahci supports
+    ahci_dev->slot_mask = 0xffffffffu >> (31 - ((ahci_dev->cap >> 8) & 0x1f));
+    // no ncq and no reserved slots until the device is identified
+    ahci_dev->ncq_mask = 0;
+    ahci_dev->prio_reserved = 0;
     
     // init each port
     // for ls2kla, only 1 port
@@ -257,7 +266,7 @@ int ahci_host_init(struct ahci_device *ahci_dev)
         {
             ahci_mdelay(1);
             tmp = ahci_readl(port_mmio + PORT_CMD);
-        } while (!(tmp | PORT_CMD_SPIN_UP) && --timeout);
+        } while (!(tmp & PORT_CMD_SPIN_UP) && --timeout);
         if (timeout <= 0)
         {
             ahci_printf("spin up cannot finish\n");
@@ -282,8 +291,8 @@ int ahci_host_init(struct ahci_device *ahci_dev)
         ahci_writel(tmp, port_mmio + PORT_SCR_ERR);
 
         // ack any pending irq events for this port
-        tmp = ahci_readl(host_mmio + PORT_IRQ_STAT);
-        ahci_writel(tmp, host_mmio + PORT_IRQ_STAT);
+        tmp = ahci_readl(port_mmio + PORT_IRQ_STAT);
+        ahci_writel(tmp, port_mmio + PORT_IRQ_STAT);
 
         ahci_writel(1 << i, host_mmio + HOST_IRQ_STAT);
 
@@ -306,12 +315,12 @@ int ahci_host_init(struct ahci_device *ahci_dev)
     return 0;
 }
 
-// configure sgdma
-uint32_t ahci_fill_sg(struct ahci_device *ahci_dev, uint8_t port,
+// configure sgdma of a command slot
+uint32_t ahci_fill_sg(struct ahci_ioport *pp, uint32_t cmd_slot,
                      uint8_t *buf, uint32_t buf_len)
 {
-    struct ahci_ioport *pp = &ahci_dev->port[port];
-    struct ahci_sg *ahci_sg = pp->cmd_tbl_sg;
+    struct ahci_sg *ahci_sg = (struct ahci_sg *)(pp->cmd_tbl + cmd_slot * AHCI_CMD_TBL_SZ +
+                                                 AHCI_CMD_TBL_HDR_SZ);
     uint32_t sg_count, max_bytes;
 
     max_bytes = AHCI_MAX_BYTES_PER_SG; // 4 MiB
@@ -337,373 +346,1716 @@ uint32_t ahci_fill_sg(struct ahci_device *ahci_dev, uint8_t port,
 }
 
 // fill cmd slot
+// each slot owns its command table
 void ahci_fill_cmd_slot(struct ahci_ioport *pp, uint32_t cmd_slot, uint32_t opts)
 {
-    struct ahci_cmd_hdr *cmd_hdr = (pp->cmd_slot + AHCI_CMD_SZ * cmd_slot);
+    struct ahci_cmd_hdr *cmd_hdr = &pp->cmd_slot[cmd_slot];
+    uint64_t tbl_dma = pp->cmd_tbl_dma + cmd_slot * AHCI_CMD_TBL_SZ;
 
     cmd_hdr->opts = opts;
     cmd_hdr->status = 0;
-    cmd_hdr->tbl_addr_lo = (uint32_t)(pp->cmd_tbl_dma & 0xffffffff);
-    cmd_hdr->tbl_addr_hi = (uint32_t)(pp->cmd_tbl_dma >> 32);
-}
-
-uint32_t ahci_get_cmd_slot(uint32_t value)
-{
-    uint32_t slot = value ? ahci_ffs32(value) : 0;
-    return slot;
+    cmd_hdr->tbl_addr_lo = (uint32_t)(tbl_dma & 0xffffffff);
+    cmd_hdr->tbl_addr_hi = (uint32_t)(tbl_dma >> 32);
 }
 
-// send ahci cmd
-uint32_t ahci_exec_ata_cmd(struct ahci_device *ahci_dev, uint8_t port,
-                      struct sata_fis_h2d *cfis, void *buf, uint32_t buf_len,
-                      uint32_t is_write)
+// build the command table and header of 'cmd_slot' for 'req'
+void ahci_fill_req(struct ahci_ioport *pp, struct ahci_request *req, uint32_t cmd_slot)
 {
-    struct ahci_ioport *pp = &ahci_dev->port[port];
-    uint64_t port_mmio = pp->port_mmio;
-    uint32_t opts;
-    uint32_t sg_count = 0, cmd_slot = 0;
-
-    // get available slot
-    cmd_slot = ahci_get_cmd_slot(ahci_readl(port_mmio + PORT_CMD_ISSUE));
-
-    if (cmd_slot == 32)
-    {
-        ahci_printf("cannot find empty command slot\n");
-        return 0;
-    }
+    uint64_t cmd_tbl = pp->cmd_tbl + cmd_slot * AHCI_CMD_TBL_SZ;
+    uint32_t opts, sg_count = 0;
 
-    // check xfer length
-    // 65536 * 512
-    if (buf_len > AHCI_MAX_BYTES_PER_TRANS)
-    {
-        ahci_printf("max transfer length is %u bytes\n", AHCI_MAX_BYTES_PER_TRANS);
-        return 0;
-    }
+    ahci_memcpy((void *)cmd_tbl, &req->cfis, sizeof(struct sata_fis_h2d));
 
-    ahci_memcpy((void *)pp->cmd_tbl, cfis, sizeof(struct sata_fis_h2d));
+    // ncq tag is the slot number
+    if (req->ncq)
+        ((struct sata_fis_h2d *)cmd_tbl)->sector_count = cmd_slot << 3;
 
-    if (buf && buf_len)
-        sg_count = ahci_fill_sg(ahci_dev, port, buf, buf_len);
-    opts = (sizeof(struct sata_fis_h2d) >> 2) | (sg_count << 16) | (is_write << 6);
+    if (req->buf && req->buf_len)
+        sg_count = ahci_fill_sg(pp, cmd_slot, req->buf, req->buf_len);
+    opts = (sizeof(struct sata_fis_h2d) >> 2) | (sg_count << 16) | (req->is_write << 6);
 
     ahci_fill_cmd_slot(pp, cmd_slot, opts);
+}
 
-    ahci_sync_dcache();
-    
-    // start transfer
-    ahci_writel(1 << cmd_slot, port_mmio + PORT_CMD_ISSUE);
+// allocate a free command slot from the port bitmap
+// ncq and non-ncq commands are never outstanding together, and
+// normal priority requests leave ahci_dev->prio_reserved slots free
+// return -1 if no slot fits
+int ahci_alloc_cmd_slot(struct ahci_device *ahci_dev, struct ahci_ioport *pp,
+                        uint32_t ncq, uint32_t prio)
+{
+    uint64_t busy = __atomic_load_n(&pp->slot_busy, __ATOMIC_RELAXED);
+    uint32_t mask = ncq ? ahci_dev->ncq_mask : ahci_dev->slot_mask;
+    uint32_t used, queued, free, slot;
 
-    // waiting for completion
-    while (ahci_readl(port_mmio + PORT_CMD_ISSUE) & (1 << cmd_slot));
+    do
+    {
+        used = (uint32_t)busy;
+        queued = (uint32_t)(busy >> 32);
 
-    ahci_sync_dcache();
+        if (ncq)
+        {
+            // let a waiting non-ncq command through first
+            if ((used & ~queued) || __atomic_load_n(&pp->ncq_drain, __ATOMIC_RELAXED))
+                return -1;
+        }
+        else if (queued)
+        {
+            __atomic_store_n(&pp->ncq_drain, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+
+        free = ~used & mask;
+        if (!free)
+            return -1;
+        if (prio != AHCI_PRIO_HIGH && __builtin_popcount(free) <= ahci_dev->prio_reserved)
+            return -1;
+        slot = ahci_ffs32(free) - 1;
+    } while (!__atomic_compare_exchange_n(&pp->slot_busy, &busy,
+                                          busy | (1ull << slot) | ((uint64_t)ncq << (slot + 32)),
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 
-    //ahci_printf("ahci_exec_ata_cmd: %d byte transferred.\n",
-    //        pp->cmd_slot->status);
+    if (!ncq)
+        __atomic_store_n(&pp->ncq_drain, 0, __ATOMIC_RELAXED);
 
-    return buf_len;
+    return slot;
 }
 
-void ahci_set_feature(struct ahci_device *ahci_dev, uint8_t subcmd, uint8_t action)
+void ahci_free_cmd_slot(struct ahci_ioport *pp, uint32_t cmd_slot)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
-
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D;
-    cfis.pm_port_c = 0x80;
-    cfis.command = ATA_CMD_SET_FEATURES;
-    cfis.features = subcmd;
-    cfis.sector_count = action;
+    __atomic_fetch_and(&pp->slot_busy, ~((1ull << cmd_slot) | (1ull << (cmd_slot + 32))),
+                       __ATOMIC_RELEASE);
+}
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, NULL, 0, READ_CMD);
+// ring of 'req' in its cpu queue, higher index is dispatched first
+uint32_t ahci_req_ring_idx(struct ahci_request *req)
+{
+    return (req->prio << 1) | req->ncq;
 }
 
-// init port
-int ahci_port_start(struct ahci_device *ahci_dev, uint8_t port)
+void ahci_queue_init(struct ahci_cpu_queue *q)
 {
-    struct ahci_ioport *pp = &ahci_dev->port[port];
-    uint64_t port_mmio = pp->port_mmio;
-    uint32_t port_status;
+    struct ahci_req_ring *r;
 
-    port_status = ahci_readl(port_mmio + PORT_SCR_STAT);
-    if ((port_status & 0xf) != 0x03)
+    for (uint32_t i = 0; i < AHCI_CPU_QUEUE_RINGS; ++ i)
     {
-        ahci_printf("no link on port %u\n", port);
-        return -1;
+        r = &q->rq[i];
+        r->head = 0;
+        r->tail = 0;
+
+        for (uint32_t j = 0; j < AHCI_CPU_QUEUE_DEPTH; ++ j)
+        {
+            r->seq[j] = j;
+            r->ring[j] = NULL;
+        }
     }
 
-    // align to 1024 bytes and set 0
-    // 32-lot cmd 32 * 32
-    // 256
-    // 128
-    // 56 * 16
-    uint64_t mem = (uint64_t)ahci_malloc_align(AHCI_PORT_PRIV_DMA_SZ, 1024);
-    ahci_memset((void *)mem, 0, AHCI_PORT_PRIV_DMA_SZ);
+    q->issued = 0;
+    q->polls = 0;
+    q->fis_seen = 0;
+    q->reaps = 0;
+    q->check_us = 0;
 
-    // First item in chunk of DMA memory
-    // 32-slot command table, 32 bytes each in size
-    pp->cmd_slot = (struct ahci_cmd_hdr *)mem;
-    pp->cmd_slot_dma = ahci_virt_to_phys(mem);
-    //ahci_printf("cmd_slot = 0x%016lx, cmd_slot_dma = 0x%016lx\n",
-    //        pp->cmd_slot, pp->cmd_slot_dma);
+    for (uint32_t i = 0; i < AHCI_MAX_CMDS; ++ i)
+        q->slot_req[i] = NULL;
+}
 
-    mem += AHCI_CMD_SLOT_SZ;
+// bounded lock-free queue, every cell carries a sequence number
+// threads preempting each other on the same cpu may push and pop concurrently
+// return -1 if the ring of 'req' is full
+int ahci_queue_push(struct ahci_cpu_queue *q, struct ahci_request *req)
+{
+    struct ahci_req_ring *r = &q->rq[ahci_req_ring_idx(req)];
+    uint32_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t idx, seq;
+    int32_t diff;
 
-    // Second item
-    // Received-FIS area, 256 bytes aligned
-    pp->rx_fis = mem;
-    pp->rx_fis_dma = ahci_virt_to_phys(mem);
-    //ahci_printf("rx_fis = 0x%016lx, rx_fis_dma = 0x%016lx\n",
-    //        pp->rx_fis, pp->rx_fis_dma);
+    while (1)
+    {
+        idx = pos & (AHCI_CPU_QUEUE_DEPTH - 1);
+        seq = __atomic_load_n(&r->seq[idx], __ATOMIC_ACQUIRE);
+        diff = (int32_t)(seq - pos);
 
-    mem += AHCI_RX_FIS_SZ;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
 
-    // Third item
-    // data area for storing a single command 128 bytes
-    // and its scatter-gather table 56 * 16 bytes
-    pp->cmd_tbl = mem;
-    pp->cmd_tbl_dma = ahci_virt_to_phys(mem);
-    //ahci_printf("cmd_tbl = 0x%016lx, cmd_tbl_dma = 0x%016lx\n",
-    //        pp->cmd_tbl, pp->cmd_tbl_dma);
-    mem += AHCI_CMD_TBL_HDR_SZ;
-    pp->cmd_tbl_sg = (struct ahci_sg *)mem;
-    //ahci_printf("cmd_tbl_sg = 0x%016lx,\n", pp->cmd_tbl_sg);
+    r->ring[idx] = req;
+    __atomic_store_n(&r->seq[idx], pos + 1, __ATOMIC_RELEASE);
 
-    ahci_writel((pp->cmd_slot_dma & 0xffffffff), port_mmio + PORT_LST_ADDR);
-    ahci_writel((pp->cmd_slot_dma >> 32), port_mmio + PORT_LST_ADDR_HI);
-    ahci_writel((pp->rx_fis_dma & 0xffffffff), port_mmio + PORT_FIS_ADDR);
-    ahci_writel((pp->rx_fis_dma >> 32), port_mmio + PORT_FIS_ADDR_HI);
+    return 0;
+}
 
-    // start port
-    ahci_writel(PORT_CMD_ICC_ACTIVE | PORT_CMD_FIS_RX |
-            PORT_CMD_POWER_ON | PORT_CMD_SPIN_UP | PORT_CMD_START,
-            port_mmio + PORT_CMD);
+// return NULL if ring 'ring' is empty
+struct ahci_request *ahci_queue_pop(struct ahci_cpu_queue *q, uint32_t ring)
+{
+    struct ahci_req_ring *r = &q->rq[ring];
+    uint32_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    struct ahci_request *req;
+    uint32_t idx, seq;
+    int32_t diff;
 
-    // wait port to be ready, ~3ms
-    uint32_t timeout = 200, tmp = 0;
-    do
+    while (1)
     {
-        ahci_mdelay(1);
-        tmp = ahci_readl(port_mmio + PORT_TFDATA);
-        tmp &= (ATA_ERR | ATA_DRQ | ATA_BUSY);
-    }
-    while (tmp && --timeout);
+        idx = pos & (AHCI_CPU_QUEUE_DEPTH - 1);
+        seq = __atomic_load_n(&r->seq[idx], __ATOMIC_ACQUIRE);
+        diff = (int32_t)(seq - (pos + 1));
 
-    if (timeout <= 0)
-    {
-        ahci_printf("ahci port %u failed to start\n", port);
-        return -1;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return NULL;
+        else
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
     }
 
-    return 0;
+    req = r->ring[idx];
+    __atomic_store_n(&r->seq[idx], pos + AHCI_CPU_QUEUE_DEPTH, __ATOMIC_RELEASE);
+
+    return req;
 }
 
-// get ata id
-void ahci_sata_identify(struct ahci_device *ahci_dev, uint16_t *id)
+// clear the type byte of the FIS areas written at command completion
+void ahci_arm_rx_fis(struct ahci_ioport *pp)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
-
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
-    cfis.pm_port_c = 0x80; // 1
-    cfis.command = ATA_CMD_ID_ATA; // 2
+    volatile struct sata_fis_d2h *d2h = (struct sata_fis_d2h *)(pp->rx_fis + AHCI_RX_FIS_D2H);
+    volatile struct sata_fis_pio_setup *pio = (struct sata_fis_pio_setup *)(pp->rx_fis + AHCI_RX_FIS_PIO_SETUP);
+    volatile struct sata_fis_sdb *sdb = (struct sata_fis_sdb *)(pp->rx_fis + AHCI_RX_FIS_SDB);
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, id, ATA_ID_WORDS * 2,
-                    READ_CMD);
+    d2h->fis_type = 0;
+    pio->fis_type = 0;
+    sdb->fis_type = 0;
 }
 
-// set cmd for lba28
-uint32_t ahci_sata_rw_cmd(struct ahci_device *ahci_dev, uint32_t start,
-                        uint32_t blkcnt, void *buffer, uint32_t is_write)
+// whether hba has posted a d2h register, pio setup or set device bits fis
+// since last armed, ncq commands complete with a set device bits fis
+// ls2k dma is cache coherent, so the FIS written by hba is visible here
+bool ahci_rx_fis_posted(struct ahci_ioport *pp)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
-    uint32_t block = start;
+    volatile struct sata_fis_d2h *d2h = (struct sata_fis_d2h *)(pp->rx_fis + AHCI_RX_FIS_D2H);
+    volatile struct sata_fis_pio_setup *pio = (struct sata_fis_pio_setup *)(pp->rx_fis + AHCI_RX_FIS_PIO_SETUP);
+    volatile struct sata_fis_sdb *sdb = (struct sata_fis_sdb *)(pp->rx_fis + AHCI_RX_FIS_SDB);
 
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
-    cfis.pm_port_c = 0x80; // 1
-    cfis.command = (is_write) ? ATA_CMD_WRITE : ATA_CMD_READ; // 2
-    cfis.lba_low = block & 0xff; // 4
-    cfis.lba_mid = (block >> 8) & 0xff; // 5
-    cfis.lba_high = (block >> 16) & 0xff; // 6
-    cfis.device = ATA_LBA; // 7
-    cfis.device |= (block >> 24) & 0xf;
-    cfis.sector_count = blkcnt & 0xff; // 12
-
-    if (ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer,
-                          ATA_SECT_SIZE * blkcnt, is_write) > 0)
-        return blkcnt;
-    else
-        return 0;
+    return d2h->fis_type == SATA_FIS_TYPE_REGISTER_D2H ||
+           pio->fis_type == SATA_FIS_TYPE_PIO_SETUP_D2H ||
+           sdb->fis_type == SATA_FIS_TYPE_SET_DEVICE_BITS_D2H;
 }
 
-// flush cache for lba28
-void ahci_sata_flush_cache(struct ahci_device *ahci_dev)
+// select how command completion is detected
+// AHCI_COMPLETION_FIS relies on the FIS receive engine enabled in ahci_port_start
+void ahci_set_completion_mode(struct ahci_device *ahci_dev, uint32_t mode)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
-
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
-    cfis.pm_port_c = 0x80; // 1
-    cfis.command = ATA_CMD_FLUSH; // 2
+    ahci_dev->completion_mode = mode;
+}
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, NULL, 0, READ_CMD);
+// set the deadline of each command
+void ahci_set_cmd_timeout(struct ahci_device *ahci_dev, uint32_t ms)
+{
+    ahci_dev->cmd_timeout_ms = ms;
 }
 
-// read/write for lba28
-uint32_t ata_low_level_rw_lba28(struct ahci_device *ahci_dev, uint64_t blknr,
-                            uint32_t blkcnt, void *buffer, uint32_t is_write)
+// dispatch and reap keep off the port while it is being recovered
+bool ahci_port_enter(struct ahci_ioport *pp)
 {
-    uint32_t start = blknr;
-    uint32_t blks = blkcnt;
-    uint32_t max_blks = ATA_MAX_SECTORS;
-    void *addr = buffer;
+    __atomic_fetch_add(&pp->users, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&pp->recovering, __ATOMIC_SEQ_CST))
+        return true;
 
-    max_blks = ATA_MAX_SECTORS;
-    do
-    {
-        if (blks > max_blks)
-        {
-            if (max_blks != ahci_sata_rw_cmd(ahci_dev, start, max_blks, addr, is_write))
-                return 0;
-            start += max_blks;
-            blks -= max_blks;
-            addr += ATA_SECT_SIZE * max_blks;
-        }
-        else
-        {
-            if (blks != ahci_sata_rw_cmd(ahci_dev, start, blks, addr, is_write))
-                return 0;
-            start += blks;
-            blks = 0;
-            addr += ATA_SECT_SIZE * blks;
-        }
-    } while (blks != 0);
+    __atomic_fetch_sub(&pp->users, 1, __ATOMIC_RELEASE);
+    return false;
+}
 
-    return blkcnt;
+void ahci_port_leave(struct ahci_ioport *pp)
+{
+    __atomic_fetch_sub(&pp->users, 1, __ATOMIC_RELEASE);
 }
 
-uint32_t ahci_sata_rw_cmd_ext(struct ahci_device *ahci_dev, uint64_t start,
-                            uint32_t blkcnt, void *buffer, uint32_t is_write)
+// clear ST and wait for the command list engine to stop
+// hba clears PORT_CMD_ISSUE afterwards
+int ahci_port_stop(uint64_t port_mmio)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
-    uint64_t block;
+    uint32_t tmp, timeout = AHCI_PORT_STOP_TIMEOUT_MS;
 
-    block = start;
+    tmp = ahci_readl(port_mmio + PORT_CMD);
+    ahci_writel(tmp & ~PORT_CMD_START, port_mmio + PORT_CMD);
 
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
-    cfis.pm_port_c = 0x80; // 1
-    cfis.command = (is_write) ? ATA_CMD_WRITE_EXT : ATA_CMD_READ_EXT; // 2
-    cfis.lba_low = block & 0xff; // 4
-    cfis.lba_mid = (block >> 8) & 0xff; // 5
-    cfis.lba_high = (block >> 16) & 0xff; // 6
-    cfis.device = ATA_LBA; // 7
-    cfis.lba_low_exp = (block >> 24) & 0xff; // 8
-    cfis.lba_mid_exp = (block >> 32) & 0xff; // 9
-    cfis.lba_high_exp = (block >> 40) & 0xff; // 10
-    cfis.sector_count = blkcnt & 0xff; // 12
-    cfis.sector_count_exp = (blkcnt >> 8) & 0xff; // 13
-
-    // 512 bytes * blkcnt
-    if (ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer,
-                          ATA_SECT_SIZE * blkcnt, is_write) > 0)
-        return blkcnt;
-    else
-        return 0;
+    while ((ahci_readl(port_mmio + PORT_CMD) & PORT_CMD_LIST_ON) && -- timeout)
+        ahci_mdelay(1);
+
+    return timeout ? 0 : -1;
 }
 
-// flush cache for lba48
-void ahci_sata_flush_cache_ext(struct ahci_device *ahci_dev)
+// command list override, clear BSY and DRQ of a stuck device
+int ahci_port_clo(struct ahci_device *ahci_dev, uint64_t port_mmio)
 {
-    struct sata_fis_h2d cfis = {0};
-    uint8_t port = ahci_dev->port_idx;
+    uint32_t tmp, timeout = AHCI_PORT_STOP_TIMEOUT_MS;
 
-    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
-    cfis.pm_port_c = 0x80; // 1
-    cfis.command = ATA_CMD_FLUSH_EXT; // 2
+    if (!(ahci_dev->cap & HOST_CAP_CLO))
+        return -1;
+
+    tmp = ahci_readl(port_mmio + PORT_CMD);
+    ahci_writel(tmp | PORT_CMD_CLO, port_mmio + PORT_CMD);
+
+    while ((ahci_readl(port_mmio + PORT_CMD) & PORT_CMD_CLO) && -- timeout)
+        ahci_mdelay(1);
+
+    if (!timeout || (ahci_readl(port_mmio + PORT_TFDATA) & (ATA_BUSY | ATA_DRQ)))
+        return -1;
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, NULL, 0, READ_CMD);
+    return 0;
 }
 
-// read/write for lba48
-uint32_t ata_low_level_rw_lba48(struct ahci_device *ahci_dev, uint64_t blknr,
-                                uint32_t blkcnt, void *buffer, uint32_t is_write)
+// COMRESET by SControl DET, the port must be stopped
+// see linux/drivers/ata/libata-sata.c sata_link_hardreset
+int ahci_port_comreset(uint64_t port_mmio)
 {
-    uint64_t start = blknr;
-    uint32_t blks = blkcnt;
-    uint32_t max_blks = ATA_MAX_SECTORS_LBA48;
-    void *addr = buffer;
+    uint32_t tmp, timeout;
+
+    tmp = ahci_readl(port_mmio + PORT_SCR_CTL) & ~0xfu;
+    ahci_writel(tmp | 0x1, port_mmio + PORT_SCR_CTL);
+    // DET = 1 must be held for at least 1 ms
+    ahci_mdelay(1);
+    ahci_writel(tmp, port_mmio + PORT_SCR_CTL);
 
+    // wait for link up
+    timeout = AHCI_LINK_TIMEOUT_MS;
     do
     {
-        if (blks > max_blks)
-        {
-            if (max_blks != ahci_sata_rw_cmd_ext(ahci_dev, start, max_blks, addr, is_write))
-                return 0;
-            start += max_blks;
-            blks -= max_blks;
-            addr += ATA_SECT_SIZE * max_blks;
-        }
-        else
-        {
-            if (blks != ahci_sata_rw_cmd_ext(ahci_dev, start, blks, addr, is_write))
-                return 0;
-            start += blks;
-            blks = 0;
-            addr += ATA_SECT_SIZE * blks;
-        }
-    } while (blks != 0);
+        ahci_mdelay(1);
+        tmp = ahci_readl(port_mmio + PORT_SCR_STAT) & 0xf;
+    } while (tmp != 0x3 && -- timeout);
+    if (!timeout)
+        return -1;
 
-    return blkcnt;
+    // clear serr raised by the reset
+    ahci_writel(0xffffffff, port_mmio + PORT_SCR_ERR);
+
+    // wait for device signature
+    timeout = AHCI_DEV_READY_TIMEOUT_MS;
+    do
+    {
+        ahci_mdelay(1);
+        tmp = ahci_readl(port_mmio + PORT_TFDATA);
+    } while ((tmp & (ATA_BUSY | ATA_DRQ)) && -- timeout);
+
+    return timeout ? 0 : -1;
 }
 
-int ahci_port_scan(struct ahci_device *ahci_dev)
+// clear the errors left by recovery and start the command list engine again
+void ahci_port_restart(struct ahci_device *ahci_dev, struct ahci_ioport *pp)
 {
-    uint32_t linkmap = ahci_dev->port_map_linkup;
+    uint64_t port_mmio = pp->port_mmio;
 
-    if (linkmap == 0)
+    ahci_writel(ahci_readl(port_mmio + PORT_SCR_ERR), port_mmio + PORT_SCR_ERR);
+    ahci_writel(ahci_readl(port_mmio + PORT_IRQ_STAT), port_mmio + PORT_IRQ_STAT);
+
+    if (ahci_dev->completion_mode == AHCI_COMPLETION_FIS)
     {
-        ahci_printf("no port device detected\n");
-        return -1;
+        __atomic_add_fetch(&pp->fis_seq, 1, __ATOMIC_SEQ_CST);
+        ahci_arm_rx_fis(pp);
     }
 
-    // get the lsb available port
-    for (uint8_t i = 0; i < ahci_dev->n_ports; ++ i)
-    {
-        if ((linkmap >> i) & 0x01)
-        {
-            if (ahci_port_start(ahci_dev, i))
-            {
-                ahci_printf("cannot start port %u\n", i);
-                return -1;
-            }
+    ahci_writel(ahci_readl(port_mmio + PORT_CMD) | PORT_CMD_START, port_mmio + PORT_CMD);
+}
 
-            ahci_dev->port_idx = i;
-            break;
-        }
+// read the ncq command error log on 'cmd_slot' of the restarted port,
+// polled since recovery holds off the queues
+// *tag is the failing ncq tag, or -1 if the error was not on a queued command
+int ahci_read_ncq_log(struct ahci_device *ahci_dev, struct ahci_ioport *pp,
+                      uint32_t cmd_slot, int *tag)
+{
+    uint64_t port_mmio = pp->port_mmio;
+    uint8_t *log = (uint8_t *)pp->log_buf;
+    uint32_t timeout = AHCI_DEV_READY_TIMEOUT_MS;
+    struct ahci_request req = {0};
+
+    req.cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D;
+    req.cfis.pm_port_c = 0x80;
+    req.cfis.command = ATA_CMD_READ_LOG_EXT;
+    req.cfis.lba_low = ATA_LOG_SATA_NCQ;
+    req.cfis.sector_count = 1;
+    req.buf = log;
+    req.buf_len = AHCI_LOG_BUF_SZ;
+    req.is_write = READ_CMD;
+
+    ahci_fill_req(pp, &req, cmd_slot);
+    ahci_sync_dcache();
+    ahci_writel(1u << cmd_slot, port_mmio + PORT_CMD_ISSUE);
+
+    while ((ahci_readl(port_mmio + PORT_CMD_ISSUE) & (1u << cmd_slot)) &&
+           !(ahci_readl(port_mmio + PORT_IRQ_STAT) & PORT_IRQ_TF_ERR) && -- timeout)
+        ahci_mdelay(1);
+
+    ahci_sync_dcache();
+
+    if (!timeout || (ahci_readl(port_mmio + PORT_IRQ_STAT) & PORT_IRQ_TF_ERR))
+    {
+        ahci_printf("ahci port %u READ LOG EXT failed\n", ahci_dev->port_idx);
+        return -1;
     }
 
+    *tag = (log[0] & ATA_LOG_NCQ_NQ) ? -1 : (log[0] & ATA_LOG_NCQ_TAG);
+
     return 0;
 }
 
-void ahci_sata_xfer_mode(struct ahci_device *ahci_dev, uint16_t *id)
+// recovery could not bring the port back, the hba keeps the slots issued
+// and would never complete them: fail every issued request here and let
+// dispatch fail the queued ones from now on
+void ahci_port_fail(struct ahci_device *ahci_dev, struct ahci_ioport *pp)
+{
+    struct ahci_cpu_queue *q;
+    struct ahci_request *req;
+    uint32_t issued, cmd_slot;
+
+    ahci_printf("ahci port %u is dead\n", ahci_dev->port_idx);
+    __atomic_store_n(&pp->dead, 1, __ATOMIC_SEQ_CST);
+
+    for (uint32_t cpu = 0; cpu < AHCI_MAX_CPUS; ++ cpu)
+    {
+        q = &ahci_dev->cpu_q[cpu];
+        issued = __atomic_exchange_n(&q->issued, 0, __ATOMIC_ACQ_REL);
+
+        while (issued)
+        {
+            cmd_slot = ahci_ffs32(issued) - 1;
+            issued &= ~(1u << cmd_slot);
+
+            req = q->slot_req[cmd_slot];
+            ahci_free_cmd_slot(pp, cmd_slot);
+            req->status = -1;
+            __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// staged recovery of the active port after a task file error or timeout
+// stop the port, try clo, fall back to COMRESET, then reissue the
+// outstanding commands; the command being executed is charged a retry
+// an ncq error aborts every queued command and the device rejects all
+// commands until the ncq command error log is read, which also names the
+// failing tag; without it (timeout, or the log names no tag) all ncq
+// commands are charged a retry
+// if COMRESET fails too the port is marked dead
+void ahci_port_recover(struct ahci_device *ahci_dev)
+{
+    struct ahci_ioport *pp = &ahci_dev->port[ahci_dev->port_idx];
+    uint64_t port_mmio = pp->port_mmio;
+    struct ahci_cpu_queue *q;
+    struct ahci_request *req;
+    uint32_t ci, sact, tfd, ccs, irq_stat, issued, reissue = 0, reissue_ncq = 0, cmd_slot;
+    uint32_t free, log_slot;
+    uint64_t now;
+    int ret, ncq_tag = -1;
+
+    // another cpu is recovering the port
+    if (__atomic_exchange_n(&pp->recovering, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    while (__atomic_load_n(&pp->users, __ATOMIC_SEQ_CST));
+
+    ci = ahci_readl(port_mmio + PORT_CMD_ISSUE);
+    sact = ahci_readl(port_mmio + PORT_SCR_ACT);
+    tfd = ahci_readl(port_mmio + PORT_TFDATA);
+    ccs = (ahci_readl(port_mmio + PORT_CMD) >> PORT_CMD_CCS_SHIFT) & 0x1f;
+    irq_stat = ahci_readl(port_mmio + PORT_IRQ_STAT);
+
+    ahci_printf("ahci port %u recovery, ci 0x%x, sact 0x%x, tfdata 0x%x, irq 0x%x, serr 0x%x\n",
+                ahci_dev->port_idx, ci, sact, tfd, irq_stat,
+                ahci_readl(port_mmio + PORT_SCR_ERR));
+
+    // stage 1: stop the engine, then clo if the device is still busy
+    ret = ahci_port_stop(port_mmio);
+    if (!ret && (ahci_readl(port_mmio + PORT_TFDATA) & (ATA_BUSY | ATA_DRQ)))
+        ret = ahci_port_clo(ahci_dev, port_mmio);
+
+    // stage 1b: after an ncq error read the log on a free slot, or borrow one
+    // still issued and rebuild its command table when it is reissued below;
+    // a completed slot not yet reaped keeps its byte count
+    free = ~(uint32_t)__atomic_load_n(&pp->slot_busy, __ATOMIC_RELAXED) & ahci_dev->slot_mask;
+    log_slot = ahci_ffs32(free ? free : (ci | sact) ? (ci | sact) : ahci_dev->slot_mask) - 1;
+    if (!ret && sact && (irq_stat & PORT_IRQ_TF_ERR))
+    {
+        ahci_port_restart(ahci_dev, pp);
+        ret = ahci_read_ncq_log(ahci_dev, pp, log_slot, &ncq_tag);
+        if (ret)
+            ahci_port_stop(port_mmio);
+    }
+
+    // stage 2: COMRESET
+    if (ret)
+    {
+        ahci_printf("ahci port %u COMRESET\n", ahci_dev->port_idx);
+        ret = ahci_port_comreset(port_mmio);
+        if (ret)
+        {
+            ahci_printf("ahci port %u COMRESET failed\n", ahci_dev->port_idx);
+            ahci_port_fail(ahci_dev, pp);
+            __atomic_store_n(&pp->recovering, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+    }
+
+    ahci_port_restart(ahci_dev, pp);
+
+    // stage 3: reissue; a request out of retries is not, the stopped hba
+    // has cleared PORT_CMD_ISSUE and PORT_SCR_ACT and the reaper of its
+    // cpu completes it with status -1
+    now = ahci_get_time_us();
+    for (uint32_t cpu = 0; cpu < AHCI_MAX_CPUS; ++ cpu)
+    {
+        q = &ahci_dev->cpu_q[cpu];
+        issued = __atomic_load_n(&q->issued, __ATOMIC_ACQUIRE) & (ci | sact);
+
+        while (issued)
+        {
+            cmd_slot = ahci_ffs32(issued) - 1;
+            issued &= ~(1u << cmd_slot);
+            req = q->slot_req[cmd_slot];
+
+            if (((req->ncq && (ncq_tag < 0 || (uint32_t)ncq_tag == cmd_slot)) ||
+                 cmd_slot == ccs || now >= req->deadline) &&
+                ++ req->retries > AHCI_CMD_RETRIES)
+            {
+                req->status = -1;
+                continue;
+            }
+
+            if (cmd_slot == log_slot)
+                ahci_fill_req(pp, req, cmd_slot);
+            pp->cmd_slot[cmd_slot].status = 0;
+            req->deadline = now + ahci_dev->cmd_timeout_ms * 1000ull;
+            reissue |= 1u << cmd_slot;
+            if (req->ncq)
+                reissue_ncq |= 1u << cmd_slot;
+        }
+    }
+
+    ahci_sync_dcache();
+
+    if (reissue)
+    {
+        if (reissue_ncq)
+            ahci_writel(reissue_ncq, port_mmio + PORT_SCR_ACT);
+        ahci_writel(reissue, port_mmio + PORT_CMD_ISSUE);
+    }
+
+    __atomic_store_n(&pp->recovering, 0, __ATOMIC_SEQ_CST);
+}
+
+// whether one of the slots issued from 'q' is past its deadline
+bool ahci_cpu_timed_out(struct ahci_cpu_queue *q, uint32_t issued)
+{
+    uint64_t now = ahci_get_time_us();
+    uint32_t cmd_slot;
+
+    while (issued)
+    {
+        cmd_slot = ahci_ffs32(issued) - 1;
+        issued &= ~(1u << cmd_slot);
+
+        if (now >= q->slot_req[cmd_slot]->deadline)
+            return true;
+    }
+
+    return false;
+}
+
+// whether the reaper of 'q' should look for a task file error or a timed
+// out command, the clock is read once every AHCI_HEALTH_CHECK_REAPS calls
+bool ahci_cpu_check_due(struct ahci_cpu_queue *q)
+{
+    uint64_t now;
+
+    if (++ q->reaps < AHCI_HEALTH_CHECK_REAPS)
+        return false;
+    q->reaps = 0;
+
+    now = ahci_get_time_us();
+    if (now < q->check_us)
+        return false;
+    q->check_us = now + AHCI_HEALTH_CHECK_MS * 1000ull;
+
+    return true;
+}
+
+// build the command table of 'cmd_slot' and start it
+void ahci_issue_req(struct ahci_device *ahci_dev, struct ahci_cpu_queue *q,
+                    struct ahci_request *req, uint32_t cmd_slot)
+{
+    struct ahci_ioport *pp = &ahci_dev->port[ahci_dev->port_idx];
+
+    ahci_fill_req(pp, req, cmd_slot);
+    req->deadline = ahci_get_time_us() + ahci_dev->cmd_timeout_ms * 1000ull;
+    q->slot_req[cmd_slot] = req;
+
+    ahci_sync_dcache();
+
+    // start transfer, PORT_SCR_ACT goes first for ncq
+    // hba ignores bits written as 0, so cores can issue without a lock
+    if (req->ncq)
+        ahci_writel(1 << cmd_slot, pp->port_mmio + PORT_SCR_ACT);
+    ahci_writel(1 << cmd_slot, pp->port_mmio + PORT_CMD_ISSUE);
+
+    // publish only after issue, or a reaper would see the bit clear
+    // in PORT_CMD_ISSUE and complete the request too early
+    __atomic_fetch_or(&q->issued, 1u << cmd_slot, __ATOMIC_RELEASE);
+}
+
+// move requests queued on 'cpu' onto free command slots
+void ahci_cpu_dispatch(struct ahci_device *ahci_dev, uint32_t cpu)
+{
+    struct ahci_cpu_queue *q = &ahci_dev->cpu_q[cpu];
+    struct ahci_ioport *pp = &ahci_dev->port[ahci_dev->port_idx];
+    struct ahci_request *req;
+    int cmd_slot;
+
+    if (!ahci_port_enter(pp))
+        return;
+
+    // nothing reaches a dead port, fail the queued requests
+    if (__atomic_load_n(&pp->dead, __ATOMIC_ACQUIRE))
+    {
+        for (uint32_t ring = 0; ring < AHCI_CPU_QUEUE_RINGS; ++ ring)
+        {
+            while ((req = ahci_queue_pop(q, ring)))
+            {
+                req->status = -1;
+                __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+            }
+        }
+
+        ahci_port_leave(pp);
+        return;
+    }
+
+    // high priority rings first
+    for (uint32_t ring = AHCI_CPU_QUEUE_RINGS; ring -- > 0;)
+    {
+        while (1)
+        {
+            // take the slot first, a popped request always has somewhere to go
+            cmd_slot = ahci_alloc_cmd_slot(ahci_dev, pp, ring & 1, ring >> 1);
+            if (cmd_slot < 0)
+                break;
+
+            req = ahci_queue_pop(q, ring);
+            if (!req)
+            {
+                ahci_free_cmd_slot(pp, cmd_slot);
+                break;
+            }
+
+            ahci_issue_req(ahci_dev, q, req, cmd_slot);
+        }
+    }
+
+    ahci_port_leave(pp);
+}
+
+// complete the finished slots issued from 'cpu'
+// only the submitting cpu looks at its own slots
+void ahci_cpu_reap(struct ahci_device *ahci_dev, uint32_t cpu)
+{
+    struct ahci_cpu_queue *q = &ahci_dev->cpu_q[cpu];
+    struct ahci_ioport *pp = &ahci_dev->port[ahci_dev->port_idx];
+    uint64_t port_mmio = pp->port_mmio;
+    struct ahci_request *req;
+    uint32_t issued, pending, done, cmd_slot;
+    bool check, recover = false;
+
+    issued = __atomic_load_n(&q->issued, __ATOMIC_ACQUIRE);
+    if (!issued || !ahci_port_enter(pp))
+        return;
+
+    // the health check runs on its own schedule, slots of this cpu that
+    // keep completing must not hold off a hung one
+    check = ahci_cpu_check_due(q);
+
+    // in fis mode PORT_CMD_ISSUE is only read when a FIS is posted,
+    // or once every AHCI_FIS_POLL_MMIO_INTERVAL calls as a fallback.
+    // the received FIS area is shared by all cpus, the reaper that
+    // re-arms it bumps fis_seq first so the others still check the FIS
+    // it has cleared under them
+    if (ahci_dev->completion_mode == AHCI_COMPLETION_FIS)
+    {
+        uint32_t seq;
+
+        if (ahci_rx_fis_posted(pp))
+        {
+            seq = __atomic_add_fetch(&pp->fis_seq, 1, __ATOMIC_SEQ_CST);
+
+            // re-arm before reading PORT_CMD_ISSUE, a FIS posted later is not lost
+            ahci_arm_rx_fis(pp);
+        }
+        else
+        {
+            // a cleared FIS implies the bump that preceded it is visible
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            seq = __atomic_load_n(&pp->fis_seq, __ATOMIC_RELAXED);
+            if (!check && seq == q->fis_seen && ++ q->polls < AHCI_FIS_POLL_MMIO_INTERVAL)
+                goto out;
+        }
+
+        q->fis_seen = seq;
+        q->polls = 0;
+    }
+
+    // an ncq command leaves PORT_CMD_ISSUE when sent, and PORT_SCR_ACT
+    // when the device reports completion
+    pending = ahci_readl(port_mmio + PORT_CMD_ISSUE);
+    if (issued & (uint32_t)(__atomic_load_n(&pp->slot_busy, __ATOMIC_RELAXED) >> 32))
+        pending |= ahci_readl(port_mmio + PORT_SCR_ACT);
+    done = issued & ~pending;
+
+    // hba stops on task file error and keeps the slots issued,
+    // a hung device never clears them, check both from time to time
+    if (check)
+        recover = (ahci_readl(port_mmio + PORT_IRQ_STAT) & PORT_IRQ_TF_ERR) ||
+                  ahci_cpu_timed_out(q, issued & ~done);
+
+    if (!done)
+        goto out;
+
+    // claim the slots, another thread may be reaping this cpu as well
+    done &= __atomic_fetch_and(&q->issued, ~done, __ATOMIC_ACQ_REL);
+
+    while (done)
+    {
+        cmd_slot = ahci_ffs32(done) - 1;
+        done &= ~(1u << cmd_slot);
+
+        req = q->slot_req[cmd_slot];
+
+        // a posted fis only prompts the PORT_CMD_ISSUE read, the prd byte
+        // count must still show the whole buffer moved. hba need not
+        // update it for ncq commands
+        if (ahci_dev->completion_mode == AHCI_COMPLETION_FIS && !req->ncq && req->buf_len &&
+            ((volatile struct ahci_cmd_hdr *)pp->cmd_slot)[cmd_slot].status < req->buf_len)
+        {
+            ahci_printf("ahci port %u command 0x%x moved %u of %u bytes\n",
+                        ahci_dev->port_idx, req->cfis.command,
+                        ((volatile struct ahci_cmd_hdr *)pp->cmd_slot)[cmd_slot].status,
+                        req->buf_len);
+            req->status = -1;
+        }
+
+        ahci_free_cmd_slot(pp, cmd_slot);
+        __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+    }
+
+out:
+    ahci_port_leave(pp);
+
+    if (recover)
+        ahci_port_recover(ahci_dev);
+}
+
+// queue a request on the current cpu and issue it if a slot is free
+// req must stay valid until ahci_wait_req() returns
+void ahci_submit_req(struct ahci_device *ahci_dev, struct ahci_request *req)
+{
+    struct ahci_cpu_queue *q;
+
+    req->cpu = ahci_cpu_id() % AHCI_MAX_CPUS;
+    req->done = 0;
+    req->status = 0;
+    req->retries = 0;
+
+    q = &ahci_dev->cpu_q[req->cpu];
+
+    // queue full, help to drain it
+    while (ahci_queue_push(q, req))
+    {
+        ahci_cpu_dispatch(ahci_dev, req->cpu);
+        ahci_cpu_reap(ahci_dev, req->cpu);
+    }
+
+    ahci_cpu_dispatch(ahci_dev, req->cpu);
+}
+
+// waiting for completion of a submitted request, return its status
+// stick to req->cpu even if the thread has migrated meanwhile
+int ahci_wait_req(struct ahci_device *ahci_dev, struct ahci_request *req)
+{
+    while (!__atomic_load_n(&req->done, __ATOMIC_ACQUIRE))
+    {
+        ahci_cpu_dispatch(ahci_dev, req->cpu);
+        ahci_cpu_reap(ahci_dev, req->cpu);
+    }
+
+    ahci_sync_dcache();
+
+    return req->status;
+}
+
+// execute 'req' and wait for it, return 0 or -1
+int ahci_exec_req(struct ahci_device *ahci_dev, struct ahci_request *req)
+{
+    // check xfer length
+    // 65536 * 512
+    if (req->buf_len > AHCI_MAX_BYTES_PER_TRANS)
+    {
+        ahci_printf("max transfer length is %u bytes\n", AHCI_MAX_BYTES_PER_TRANS);
+        return -1;
+    }
+
+    ahci_submit_req(ahci_dev, req);
+
+    if (ahci_wait_req(ahci_dev, req))
+    {
+        ahci_printf("ahci port %u command 0x%x failed, tfdata 0x%x\n",
+                    ahci_dev->port_idx, req->cfis.command,
+                    ahci_readl(ahci_dev->port[ahci_dev->port_idx].port_mmio + PORT_TFDATA));
+        return -1;
+    }
+
+    return 0;
+}
+
+// send ahci cmd
+// the request is queued on the current cpu and reaped from the same queue
+uint32_t ahci_exec_ata_cmd(struct ahci_device *ahci_dev, struct sata_fis_h2d *cfis,
+                           void *buf, uint32_t buf_len, uint32_t is_write)
+{
+    struct ahci_request req;
+
+    ahci_memcpy(&req.cfis, cfis, sizeof(struct sata_fis_h2d));
+    req.buf = buf;
+    req.buf_len = buf_len;
+    req.is_write = is_write;
+    req.prio = AHCI_PRIO_NORMAL;
+    req.ncq = 0;
+
+    if (ahci_exec_req(ahci_dev, &req))
+        return 0;
+
+    return buf_len;
+}
+
+// no data is moved, so the request status is the only result, return 0 or -1
+int ahci_set_feature(struct ahci_device *ahci_dev, uint8_t subcmd, uint8_t action)
+{
+    struct ahci_request req = {0};
+
+    req.cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D;
+    req.cfis.pm_port_c = 0x80;
+    req.cfis.command = ATA_CMD_SET_FEATURES;
+    req.cfis.features = subcmd;
+    req.cfis.sector_count = action;
+    req.is_write = READ_CMD;
+    req.prio = AHCI_PRIO_NORMAL;
+
+    return ahci_exec_req(ahci_dev, &req);
+}
+
+// init port
+int ahci_port_start(struct ahci_device *ahci_dev, uint8_t port)
+{
+    struct ahci_ioport *pp = &ahci_dev->port[port];
+    uint64_t port_mmio = pp->port_mmio;
+    uint32_t port_status;
+
+    port_status = ahci_readl(port_mmio + PORT_SCR_STAT);
+    if ((port_status & 0xf) != 0x03)
+    {
+        ahci_printf("no link on port %u\n", port);
+        return -1;
+    }
+
+    // align to 1024 bytes and set 0
+    // 32-lot cmd 32 * 32
+    // 256
+    // 128
+    // 56 * 16
+    uint64_t mem = (uint64_t)ahci_malloc_align(AHCI_PORT_PRIV_DMA_SZ, 1024);
+    ahci_memset((void *)mem, 0, AHCI_PORT_PRIV_DMA_SZ);
+
+    // First item in chunk of DMA memory
+    // 32-slot command table, 32 bytes each in size
+    pp->cmd_slot = (struct ahci_cmd_hdr *)mem;
+    pp->cmd_slot_dma = ahci_virt_to_phys(mem);
+    //ahci_printf("cmd_slot = 0x%016lx, cmd_slot_dma = 0x%016lx\n",
+    //        pp->cmd_slot, pp->cmd_slot_dma);
+
+    mem += AHCI_CMD_SLOT_SZ;
+
+    // Second item
+    // Received-FIS area, 256 bytes aligned
+    pp->rx_fis = mem;
+    pp->rx_fis_dma = ahci_virt_to_phys(mem);
+    //ahci_printf("rx_fis = 0x%016lx, rx_fis_dma = 0x%016lx\n",
+    //        pp->rx_fis, pp->rx_fis_dma);
+
+    mem += AHCI_RX_FIS_SZ;
+
+    // Third item
+    // 32 command tables, each of them stores a command 128 bytes
+    // and its scatter-gather table 56 * 16 bytes
+    pp->cmd_tbl = mem;
+    pp->cmd_tbl_dma = ahci_virt_to_phys(mem);
+    //ahci_printf("cmd_tbl = 0x%016lx, cmd_tbl_dma = 0x%016lx\n",
+    //        pp->cmd_tbl, pp->cmd_tbl_dma);
+    mem += AHCI_CMD_TBL_HDR_SZ;
+    pp->cmd_tbl_sg = (struct ahci_sg *)mem;
+    //ahci_printf("cmd_tbl_sg = 0x%016lx,\n", pp->cmd_tbl_sg);
+
+    // Fourth item
+    // one sector for READ LOG EXT during recovery
+    pp->log_buf = pp->cmd_tbl + AHCI_CMD_TBL_AR_SZ;
+
+    pp->slot_busy = 0;
+    pp->ncq_drain = 0;
+    pp->users = 0;
+    pp->recovering = 0;
+    pp->fis_seq = 0;
+    pp->dead = 0;
+
+    ahci_writel((pp->cmd_slot_dma & 0xffffffff), port_mmio + PORT_LST_ADDR);
+    ahci_writel((pp->cmd_slot_dma >> 32), port_mmio + PORT_LST_ADDR_HI);
+    ahci_writel((pp->rx_fis_dma & 0xffffffff), port_mmio + PORT_FIS_ADDR);
+    ahci_writel((pp->rx_fis_dma >> 32), port_mmio + PORT_FIS_ADDR_HI);
+
+    // start port
+    ahci_writel(PORT_CMD_ICC_ACTIVE | PORT_CMD_FIS_RX |
+            PORT_CMD_POWER_ON | PORT_CMD_SPIN_UP | PORT_CMD_START,
+            port_mmio + PORT_CMD);
+
+    // wait port to be ready, ~3ms
+    uint32_t timeout = 200, tmp = 0;
+    do
+    {
+        ahci_mdelay(1);
+        tmp = ahci_readl(port_mmio + PORT_TFDATA);
+        tmp &= (ATA_ERR | ATA_DRQ | ATA_BUSY);
+    }
+    while (tmp && --timeout);
+
+    if (timeout <= 0)
+    {
+        ahci_printf("ahci port %u failed to start\n", port);
+        return -1;
+    }
+
+    return 0;
+}
+
+// get ata id
+int ahci_sata_identify(struct ahci_device *ahci_dev, uint16_t *id)
+{
+    struct sata_fis_h2d cfis = {0};
+
+    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis.pm_port_c = 0x80; // 1
+    cfis.command = ATA_CMD_ID_ATA; // 2
+
+    if (!ahci_exec_ata_cmd(ahci_dev, &cfis, id, ATA_ID_WORDS * 2,
+                           READ_CMD))
+        return -1;
+
+    return 0;
+}
+
+// set cmd for lba28
+uint32_t ahci_sata_rw_cmd(struct ahci_device *ahci_dev, uint32_t start,
+                        uint32_t blkcnt, void *buffer, uint32_t is_write, uint32_t prio)
+{
+    struct ahci_request req = {0};
+    struct sata_fis_h2d *cfis = &req.cfis;
+    uint32_t block = start;
+
+    cfis->fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis->pm_port_c = 0x80; // 1
+    cfis->command = (is_write) ? ATA_CMD_WRITE : ATA_CMD_READ; // 2
+    cfis->lba_low = block & 0xff; // 4
+    cfis->lba_mid = (block >> 8) & 0xff; // 5
+    cfis->lba_high = (block >> 16) & 0xff; // 6
+    cfis->device = ATA_LBA; // 7
+    cfis->device |= (block >> 24) & 0xf;
+    cfis->sector_count = blkcnt & 0xff; // 12
+
+    req.buf = buffer;
+    req.buf_len = ahci_dev->blk_dev.blksz * blkcnt;
+    req.is_write = is_write;
+    req.prio = prio;
+
+    if (!ahci_exec_req(ahci_dev, &req))
+        return blkcnt;
+    else
+        return 0;
+}
+
+// flush cache for lba28
+void ahci_sata_flush_cache(struct ahci_device *ahci_dev)
+{
+    struct sata_fis_h2d cfis = {0};
+
+    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis.pm_port_c = 0x80; // 1
+    cfis.command = ATA_CMD_FLUSH; // 2
+
+    ahci_exec_ata_cmd(ahci_dev, &cfis, NULL, 0, READ_CMD);
+}
+
+// sectors per command, limited by the prd table for large logical sectors
+// and rounded down to whole physical sectors, so that an aligned
+// transfer stays aligned when it is split
+uint32_t ahci_max_xfer_blks(struct ahci_device *ahci_dev, uint32_t max_blks)
+{
+    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+    uint32_t per_phys = 1u << pdev->log2_per_phys;
+
+    if (max_blks > AHCI_MAX_BYTES_PER_TRANS / pdev->blksz)
+        max_blks = AHCI_MAX_BYTES_PER_TRANS / pdev->blksz;
+
+    if (max_blks > per_phys)
+        max_blks &= ~(per_phys - 1);
+
+    return max_blks;
+}
+
+// read/write for lba28
+uint32_t ata_low_level_rw_lba28(struct ahci_device *ahci_dev, uint64_t blknr,
+                            uint32_t blkcnt, void *buffer, uint32_t is_write, uint32_t prio)
+{
+    uint32_t start = blknr;
+    uint32_t blks = blkcnt;
+    uint32_t max_blks = ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS);
+    uint64_t blksz = ahci_dev->blk_dev.blksz;
+    void *addr = buffer;
+
+    do
+    {
+        if (blks > max_blks)
+        {
+            if (max_blks != ahci_sata_rw_cmd(ahci_dev, start, max_blks, addr, is_write, prio))
+                return 0;
+            start += max_blks;
+            blks -= max_blks;
+            addr += blksz * max_blks;
+        }
+        else
+        {
+            if (blks != ahci_sata_rw_cmd(ahci_dev, start, blks, addr, is_write, prio))
+                return 0;
+            start += blks;
+            blks = 0;
+            addr += blksz * blks;
+        }
+    } while (blks != 0);
+
+    return blkcnt;
+}
+
+void ahci_fill_rw_cmd_ext(struct sata_fis_h2d *cfis, uint64_t start,
+                          uint32_t blkcnt, uint32_t is_write)
+{
+    uint64_t block;
+
+    block = start;
+
+    cfis->fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis->pm_port_c = 0x80; // 1
+    cfis->command = (is_write) ? ATA_CMD_WRITE_EXT : ATA_CMD_READ_EXT; // 2
+    cfis->lba_low = block & 0xff; // 4
+    cfis->lba_mid = (block >> 8) & 0xff; // 5
+    cfis->lba_high = (block >> 16) & 0xff; // 6
+    cfis->device = ATA_LBA; // 7
+    cfis->lba_low_exp = (block >> 24) & 0xff; // 8
+    cfis->lba_mid_exp = (block >> 32) & 0xff; // 9
+    cfis->lba_high_exp = (block >> 40) & 0xff; // 10
+    cfis->sector_count = blkcnt & 0xff; // 12
+    cfis->sector_count_exp = (blkcnt >> 8) & 0xff; // 13
+}
+
+// FPDMA QUEUED command, the tag is filled in when a slot is issued
+void ahci_fill_rw_cmd_ncq(struct sata_fis_h2d *cfis, uint64_t start,
+                          uint32_t blkcnt, uint32_t is_write, uint32_t prio)
+{
+    uint64_t block;
+
+    block = start;
+
+    cfis->fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis->pm_port_c = 0x80; // 1
+    cfis->command = (is_write) ? ATA_CMD_FPDMA_WRITE : ATA_CMD_FPDMA_READ; // 2
+    cfis->features = blkcnt & 0xff; // 3
+    cfis->lba_low = block & 0xff; // 4
+    cfis->lba_mid = (block >> 8) & 0xff; // 5
+    cfis->lba_high = (block >> 16) & 0xff; // 6
+    cfis->device = ATA_LBA; // 7
+    cfis->lba_low_exp = (block >> 24) & 0xff; // 8
+    cfis->lba_mid_exp = (block >> 32) & 0xff; // 9
+    cfis->lba_high_exp = (block >> 40) & 0xff; // 10
+    cfis->features_exp = (blkcnt >> 8) & 0xff; // 11
+    if (prio == AHCI_PRIO_HIGH)
+        cfis->sector_count_exp = ATA_PRIO_HIGH << ATA_SHIFT_PRIO; // 13
+}
+
+// build a lba48 read/write request, queued if the device does ncq
+void ahci_fill_rw_req(struct ahci_device *ahci_dev, struct ahci_request *req,
+                      uint64_t start, uint32_t blkcnt, void *buffer,
+                      uint32_t is_write, uint32_t prio)
+{
+    ahci_memset(&req->cfis, 0, sizeof(struct sata_fis_h2d));
+
+    if (ahci_dev->flags & SATA_FLAG_NCQ)
+    {
+        ahci_fill_rw_cmd_ncq(&req->cfis, start, blkcnt, is_write,
+                             (ahci_dev->flags & SATA_FLAG_NCQ_PRIO) ? prio : AHCI_PRIO_NORMAL);
+        req->ncq = 1;
+    }
+    else
+    {
+        ahci_fill_rw_cmd_ext(&req->cfis, start, blkcnt, is_write);
+        req->ncq = 0;
+    }
+
+    // logical sector size * blkcnt
+    req->buf = buffer;
+    req->buf_len = ahci_dev->blk_dev.blksz * blkcnt;
+    req->is_write = is_write;
+    req->prio = prio;
+}
+
+uint32_t ahci_sata_rw_cmd_ext(struct ahci_device *ahci_dev, uint64_t start,
+                            uint32_t blkcnt, void *buffer, uint32_t is_write, uint32_t prio)
+{
+    struct ahci_request req;
+
+    ahci_fill_rw_req(ahci_dev, &req, start, blkcnt, buffer, is_write, prio);
+
+    if (!ahci_exec_req(ahci_dev, &req))
+        return blkcnt;
+    else
+        return 0;
+}
+
+// flush cache for lba48
+void ahci_sata_flush_cache_ext(struct ahci_device *ahci_dev)
+{
+    struct sata_fis_h2d cfis = {0};
+
+    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D; // 0
+    cfis.pm_port_c = 0x80; // 1
+    cfis.command = ATA_CMD_FLUSH_EXT; // 2
+
+    ahci_exec_ata_cmd(ahci_dev, &cfis, NULL, 0, READ_CMD);
+}
+
+// flush the volatile write cache, if it is enabled
+void ahci_sata_flush_wcache(struct ahci_device *ahci_dev)
+{
+    uint32_t flags = ahci_dev->flags;
+
+    if (!(flags & SATA_FLAG_WCACHE))
+        return;
+
+    if (ahci_dev->blk_dev.lba48)
+    {
+        if (flags & SATA_FLAG_FLUSH_EXT)
+            ahci_sata_flush_cache_ext(ahci_dev);
+    }
+    else
+    {
+        if (flags & SATA_FLAG_FLUSH)
+            ahci_sata_flush_cache(ahci_dev);
+    }
+}
+
+// read/write for lba48
+uint32_t ata_low_level_rw_lba48(struct ahci_device *ahci_dev, uint64_t blknr,
+                                uint32_t blkcnt, void *buffer, uint32_t is_write, uint32_t prio)
+{
+    uint64_t start = blknr;
+    uint32_t blks = blkcnt;
+    uint32_t max_blks = ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS_LBA48);
+    uint64_t blksz = ahci_dev->blk_dev.blksz;
+    void *addr = buffer;
+
+    do
+    {
+        if (blks > max_blks)
+        {
+            if (max_blks != ahci_sata_rw_cmd_ext(ahci_dev, start, max_blks, addr, is_write, prio))
+                return 0;
+            start += max_blks;
+            blks -= max_blks;
+            addr += blksz * max_blks;
+        }
+        else
+        {
+            if (blks != ahci_sata_rw_cmd_ext(ahci_dev, start, blks, addr, is_write, prio))
+                return 0;
+            start += blks;
+            blks = 0;
+            addr += blksz * blks;
+        }
+    } while (blks != 0);
+
+    return blkcnt;
+}
+
+uint32_t ata_low_level_rw(struct ahci_device *ahci_dev, uint64_t blknr,
+                          uint32_t blkcnt, void *buffer, uint32_t is_write, uint32_t prio)
+{
+    if (ahci_dev->blk_dev.lba48)
+        return ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, is_write, prio);
+    else
+        return ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, is_write, prio);
+}
+
+// record foreground activity, background work waits idle_ms after it
+void ahci_fg_mark(struct ahci_device *ahci_dev)
+{
+    __atomic_store_n(&ahci_dev->idle.last_fg_us, ahci_get_time_us(), __ATOMIC_RELAXED);
+}
+
+void ahci_fg_begin(struct ahci_device *ahci_dev)
+{
+    __atomic_fetch_add(&ahci_dev->idle.fg_active, 1, __ATOMIC_ACQUIRE);
+    ahci_fg_mark(ahci_dev);
+}
+
+void ahci_fg_end(struct ahci_device *ahci_dev)
+{
+    ahci_fg_mark(ahci_dev);
+    __atomic_fetch_sub(&ahci_dev->idle.fg_active, 1, __ATOMIC_RELEASE);
+}
+
+// no foreground read/write in progress or seen for idle_ms
+bool ahci_dev_idle(struct ahci_device *ahci_dev)
+{
+    struct ahci_idle *idle = &ahci_dev->idle;
+    uint64_t now = ahci_get_time_us();
+    uint64_t last;
+
+    if (__atomic_load_n(&idle->fg_active, __ATOMIC_ACQUIRE))
+        return false;
+
+    last = __atomic_load_n(&idle->last_fg_us, __ATOMIC_RELAXED);
+
+    return now >= last && now - last >= idle->idle_ms * 1000ull;
+}
+
+// queue chunk 'idx' of the stream in its ring buffer
+void ahci_stream_submit(struct ahci_stream *st, uint64_t idx)
+{
+    struct ahci_request *req = &st->req[idx % st->nbufs];
+    uint64_t start = st->blknr + idx * st->buf_blks;
+    uint64_t blks = st->blkcnt - idx * st->buf_blks;
+
+    if (blks > st->buf_blks)
+        blks = st->buf_blks;
+
+    ahci_fill_rw_req(st->ahci_dev, req, start, blks,
+                     st->mem + (idx % st->nbufs) * st->buf_blks * st->ahci_dev->blk_dev.blksz,
+                     st->is_write, AHCI_PRIO_NORMAL);
+
+    ahci_fg_mark(st->ahci_dev);
+    ahci_submit_req(st->ahci_dev, req);
+    st->submitted = idx + 1;
+}
+
+// open a stream over [blknr, blknr + blkcnt)
+// mem holds nbufs buffers of buf_blks logical sectors each, dma capable
+// a read stream starts filling all buffers at once
+int ahci_stream_open(struct ahci_device *ahci_dev, struct ahci_stream *st,
+                     uint64_t blknr, uint64_t blkcnt, uint32_t is_write,
+                     void *mem, uint32_t nbufs, uint32_t buf_blks)
+{
+    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+
+    if (!pdev->lba48)
+    {
+        ahci_printf("stream needs a lba48 device\n");
+        return -1;
+    }
+
+    if (nbufs == 0 || nbufs > AHCI_STREAM_MAX_BUFS || blkcnt == 0 ||
+        buf_blks == 0 || buf_blks > ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS_LBA48))
+    {
+        ahci_printf("invalid stream of %u buffers of %u blocks\n", nbufs, buf_blks);
+        return -1;
+    }
+
+    if (blknr + blkcnt > pdev->lba)
+    {
+        ahci_printf("stream beyond the end of the disk\n");
+        return -1;
+    }
+
+    st->ahci_dev = ahci_dev;
+    st->mem = mem;
+    st->blknr = blknr;
+    st->blkcnt = blkcnt;
+    st->is_write = is_write;
+    st->nbufs = nbufs;
+    st->buf_blks = buf_blks;
+    st->status = 0;
+    st->nchunks = (blkcnt + buf_blks - 1) / buf_blks;
+    st->submitted = 0;
+    st->acquired = 0;
+    st->released = 0;
+
+    // 还没提交过的缓冲区算作成功完成，写流第一次acquire和close都要看status
+    for (uint32_t i = 0; i < nbufs; ++ i)
+    {
+        st->req[i].status = 0;
+        st->req[i].done = 1;
+    }
+
+    if (!is_write)
+    {
+        while (st->submitted < st->nchunks && st->submitted < nbufs)
+            ahci_stream_submit(st, st->submitted);
+    }
+
+    return 0;
+}
+
+// get the next buffer of the ring
+// read: wait until it holds data, write: wait until its previous write is done
+// return NULL at the end of the stream, after an error,
+// or if the caller already holds all buffers
+void *ahci_stream_acquire(struct ahci_stream *st, uint64_t *blknr, uint32_t *blkcnt)
+{
+    uint64_t idx = st->acquired;
+    uint64_t blks;
+
+    if (st->status || idx == st->nchunks || idx - st->released == st->nbufs)
+        return NULL;
+
+    if (ahci_wait_req(st->ahci_dev, &st->req[idx % st->nbufs]))
+    {
+        ahci_printf("stream transfer at block 0x%lx failed\n", st->blknr + idx * st->buf_blks);
+        st->status = -1;
+        return NULL;
+    }
+
+    ahci_fg_mark(st->ahci_dev);
+
+    blks = st->blkcnt - idx * st->buf_blks;
+    if (blks > st->buf_blks)
+        blks = st->buf_blks;
+
+    if (blknr)
+        *blknr = st->blknr + idx * st->buf_blks;
+    if (blkcnt)
+        *blkcnt = blks;
+
+    st->acquired = idx + 1;
+
+    return st->mem + (idx % st->nbufs) * st->buf_blks * st->ahci_dev->blk_dev.blksz;
+}
+
+// hand the oldest acquired buffer back
+// read: refill it with the next chunk, write: queue its data to the drive
+int ahci_stream_release(struct ahci_stream *st)
+{
+    uint64_t idx = st->released;
+
+    if (idx == st->acquired)
+        return -1;
+
+    st->released = idx + 1;
+
+    if (st->is_write)
+        ahci_stream_submit(st, idx);
+    else if (st->submitted < st->nchunks)
+        ahci_stream_submit(st, st->submitted);
+
+    return st->status;
+}
+
+// wait for the transfers in flight, flush the write cache of a write stream
+// return 0 if every transfer of the stream succeeded
+int ahci_stream_close(struct ahci_stream *st)
+{
+    struct ahci_device *ahci_dev = st->ahci_dev;
+
+    for (uint32_t i = 0; i < st->nbufs; ++ i)
+    {
+        if (ahci_wait_req(ahci_dev, &st->req[i]))
+            st->status = -1;
+    }
+
+    if (st->is_write)
+        ahci_sata_flush_wcache(ahci_dev);
+
+    return st->status;
+}
+
+// take a physical sector bounce buffer, NULL if all are in use
+void *ahci_get_align_buf(struct ahci_blk_dev *pdev)
+{
+    uint32_t busy = __atomic_load_n(&pdev->align_busy, __ATOMIC_RELAXED);
+    uint32_t idx;
+
+    do
+    {
+        if (!pdev->align_buf || busy == (1u << AHCI_MAX_CPUS) - 1)
+            return NULL;
+        idx = ahci_ffs32(~busy) - 1;
+    } while (!__atomic_compare_exchange_n(&pdev->align_busy, &busy, busy | (1u << idx),
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return (void *)(pdev->align_buf + idx * pdev->phys_blksz);
+}
+
+void ahci_put_align_buf(struct ahci_blk_dev *pdev, void *buf)
+{
+    uint32_t idx = ((uint64_t)buf - pdev->align_buf) / pdev->phys_blksz;
+
+    __atomic_fetch_and(&pdev->align_busy, ~(1u << idx), __ATOMIC_RELEASE);
+}
+
+// write part of one physical sector by read-modify-write of the whole sector
+// the sectors around [blknr, blknr + blkcnt) must not be written concurrently
+// fall back to a plain write without bounce buffer or at the disk edges
+uint32_t ahci_sata_write_padded(struct ahci_device *ahci_dev, uint64_t blknr,
+                                uint32_t blkcnt, void *buffer, uint32_t prio)
+{
+    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+    uint32_t per_phys = 1u << pdev->log2_per_phys;
+    uint32_t ofs = (blknr + per_phys - pdev->lowest_aligned) & (per_phys - 1);
+    uint64_t start = blknr - ofs;
+    uint32_t rc = 0;
+    uint8_t *buf;
+
+    if (blknr < ofs || start + per_phys > pdev->lba)
+        return ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+
+    buf = ahci_get_align_buf(pdev);
+    if (!buf)
+        return ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+
+    if (ata_low_level_rw(ahci_dev, start, per_phys, buf, READ_CMD, prio) == per_phys)
+    {
+        ahci_memcpy(buf + ofs * pdev->blksz, buffer, blkcnt * pdev->blksz);
+        if (ata_low_level_rw(ahci_dev, start, per_phys, buf, WRITE_CMD, prio) == per_phys)
+            rc = blkcnt;
+    }
+
+    ahci_put_align_buf(pdev, buf);
+
+    return rc;
+}
+
+// split a write at physical sector boundaries
+// the partial head and tail are padded to whole physical sectors,
+// the body is written in chunks of whole physical sectors
+uint32_t ahci_sata_write_aligned(struct ahci_device *ahci_dev, uint64_t blknr,
+                                 uint32_t blkcnt, void *buffer, uint32_t prio)
+{
+    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+    uint32_t per_phys = 1u << pdev->log2_per_phys;
+    uint32_t ofs = (blknr + per_phys - pdev->lowest_aligned) & (per_phys - 1);
+    uint32_t head = 0, tail, body;
+    uint8_t *addr = buffer;
+
+    if (ofs)
+    {
+        head = per_phys - ofs;
+        if (head > blkcnt)
+            head = blkcnt;
+    }
+    tail = (blkcnt - head) & (per_phys - 1);
+    body = blkcnt - head - tail;
+
+    if (head)
+    {
+        if (ahci_sata_write_padded(ahci_dev, blknr, head, addr, prio) != head)
+            return 0;
+        blknr += head;
+        addr += head * pdev->blksz;
+    }
+
+    if (body)
+    {
+        if (ata_low_level_rw(ahci_dev, blknr, body, addr, WRITE_CMD, prio) != body)
+            return 0;
+        blknr += body;
+        addr += body * pdev->blksz;
+    }
+
+    if (tail)
+    {
+        if (ahci_sata_write_padded(ahci_dev, blknr, tail, addr, prio) != tail)
+            return 0;
+    }
+
+    return blkcnt;
+}
+
+// pad writes that cover part of a physical sector
+// only effective if the device reports physical sectors larger than logical
+void ahci_set_write_align(struct ahci_device *ahci_dev, bool enable)
+{
+    if (enable)
+        ahci_dev->flags |= SATA_FLAG_ALIGN_WRITE;
+    else
+        ahci_dev->flags &= ~SATA_FLAG_ALIGN_WRITE;
+}
+
+int ahci_port_scan(struct ahci_device *ahci_dev)
+{
+    uint32_t linkmap = ahci_dev->port_map_linkup;
+
+    if (linkmap == 0)
+    {
+        ahci_printf("no port device detected\n");
+        return -1;
+    }
+
+    // get the lsb available port
+    for (uint8_t i = 0; i < ahci_dev->n_ports; ++ i)
+    {
+        if ((linkmap >> i) & 0x01)
+        {
+            if (ahci_port_start(ahci_dev, i))
+            {
+                ahci_printf("cannot start port %u\n", i);
+                return -1;
+            }
+
+            ahci_dev->port_idx = i;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void ahci_sata_xfer_mode(struct ahci_device *ahci_dev, uint16_t *id)
 {
     // get pio and udma
     ahci_dev->pio_mask = id[ATA_ID_PIO_MODES];
     ahci_dev->udma_mask = id[ATA_ID_UDMA_MODES];
 }
 
+// read/write with FPDMA QUEUED commands if both hba and device do ncq,
+// tags are limited to the device queue depth
+void ahci_sata_init_ncq(struct ahci_device *ahci_dev, uint16_t *id)
+{
+    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+    uint32_t mask = ahci_dev->slot_mask;
+
+    if ((ahci_dev->cap & HOST_CAP_NCQ) && ata_id_has_ncq(id) &&
+        pdev->lba48 && pdev->queue_depth > 1)
+    {
+        ahci_dev->flags |= SATA_FLAG_NCQ;
+        if (ata_id_has_ncq_prio(id))
+            ahci_dev->flags |= SATA_FLAG_NCQ_PRIO;
+
+        if (pdev->queue_depth < 32)
+            ahci_dev->ncq_mask = mask & ((1u << pdev->queue_depth) - 1);
+        else
+            ahci_dev->ncq_mask = mask;
+        mask = ahci_dev->ncq_mask;
+    }
+
+    // never reserve more than half of the slots
+    ahci_dev->prio_reserved = __builtin_popcount(mask) / 2;
+    if (ahci_dev->prio_reserved > AHCI_PRIO_RESERVED_SLOTS)
+        ahci_dev->prio_reserved = AHCI_PRIO_RESERVED_SLOTS;
+}
+
 void ahci_sata_init_wcache(struct ahci_device *ahci_dev, uint16_t *id)
 {
+    ahci_dev->flags &= ~(SATA_FLAG_WCACHE | SATA_FLAG_RAHEAD);
     if (ata_id_has_wcache(id) && ata_id_wcache_enabled(id))
         ahci_dev->flags |= SATA_FLAG_WCACHE;
+    if (ata_id_has_rahead(id) && ata_id_rahead_enabled(id))
+        ahci_dev->flags |= SATA_FLAG_RAHEAD;
     if (ata_id_has_flush(id))
         ahci_dev->flags |= SATA_FLAG_FLUSH;
     if (ata_id_has_flush_ext(id))
         ahci_dev->flags |= SATA_FLAG_FLUSH_EXT;
 }
 
+// re-read the write cache and read look-ahead state from the device
+// into SATA_FLAG_WCACHE and SATA_FLAG_RAHEAD
+int ahci_sata_query_cache(struct ahci_device *ahci_dev)
+{
+    uint16_t id[ATA_ID_WORDS + 1];
+
+    if (ahci_sata_identify(ahci_dev, id))
+        return -1;
+
+    ahci_sata_init_wcache(ahci_dev, id);
+
+    return 0;
+}
+
+// enable or disable the volatile write cache of the device
+// the cache is flushed before it is disabled
+// no i/o may be in flight, return -1 if the device did not follow
+int ahci_sata_set_wcache(struct ahci_device *ahci_dev, bool enable)
+{
+    if (!enable)
+        ahci_sata_flush_wcache(ahci_dev);
+
+    if (ahci_set_feature(ahci_dev, enable ? SETFEATURES_WC_ON : SETFEATURES_WC_OFF, 0))
+        return -1;
+
+    if (ahci_sata_query_cache(ahci_dev))
+        return -1;
+
+    return (!!(ahci_dev->flags & SATA_FLAG_WCACHE) == enable) ? 0 : -1;
+}
+
+// enable or disable read look-ahead of the device
+// no i/o may be in flight, return -1 if the device did not follow
+int ahci_sata_set_rahead(struct ahci_device *ahci_dev, bool enable)
+{
+    if (ahci_set_feature(ahci_dev, enable ? SETFEATURES_RA_ON : SETFEATURES_RA_OFF, 0))
+        return -1;
+
+    if (ahci_sata_query_cache(ahci_dev))
+        return -1;
+
+    return (!!(ahci_dev->flags & SATA_FLAG_RAHEAD) == enable) ? 0 : -1;
+}
+
+void ahci_set_idle_time(struct ahci_device *ahci_dev, uint32_t ms)
+{
+    ahci_dev->idle.idle_ms = ms;
+}
+
+// leave the cache flush after each write to ahci_idle_poll
+// writes are durable only after the idle flush or ahci_sata_sync
+void ahci_set_deferred_flush(struct ahci_device *ahci_dev, bool enable)
+{
+    if (enable)
+        ahci_dev->flags |= SATA_FLAG_DEFER_FLUSH;
+    else
+        ahci_dev->flags &= ~SATA_FLAG_DEFER_FLUSH;
+}
+
+// flush the write cache now, including a deferred flush
+void ahci_sata_sync(struct ahci_device *ahci_dev)
+{
+    __atomic_store_n(&ahci_dev->idle.flush_pending, 0, __ATOMIC_RELAXED);
+    ahci_sata_flush_wcache(ahci_dev);
+}
+
+// queue [blknr, blknr + blkcnt) to be trimmed once the device is idle
+// return -1 if the device has no trim or the queue is full
+int ahci_sata_queue_trim(struct ahci_device *ahci_dev, uint64_t blknr, uint64_t blkcnt)
+{
+    struct ahci_idle *idle = &ahci_dev->idle;
+    uint32_t busy = __atomic_load_n(&idle->trim_alloc, __ATOMIC_RELAXED);
+    uint32_t idx;
+
+    if (!(ahci_dev->flags & SATA_FLAG_TRIM) || blkcnt == 0 ||
+        blknr + blkcnt > ahci_dev->blk_dev.lba)
+        return -1;
+
+    do
+    {
+        if (busy == 0xffffffff)
+            return -1;
+        idx = ahci_ffs32(~busy) - 1;
+    } while (!__atomic_compare_exchange_n(&idle->trim_alloc, &busy, busy | (1u << idx),
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    idle->trim_q[idx].blknr = blknr;
+    idle->trim_q[idx].blkcnt = blkcnt;
+    __atomic_fetch_or(&idle->trim_ready, 1u << idx, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// fill one dsm block from the trim queue and send it
+// return the number of ranges sent, 0 if nothing was queued
+// ranges are dropped if the command fails, trim is only a hint
+uint32_t ahci_sata_trim_batch(struct ahci_device *ahci_dev)
+{
+    struct ahci_idle *idle = &ahci_dev->idle;
+    struct ahci_trim_range *cur = &idle->trim_cur;
+    uint64_t *ent = (uint64_t *)idle->trim_buf;
+    struct sata_fis_h2d cfis = {0};
+    uint32_t ready, idx, blks, n = 0;
+
+    while (n < AHCI_TRIM_RANGES_PER_CMD)
+    {
+        if (cur->blkcnt == 0)
+        {
+            ready = __atomic_load_n(&idle->trim_ready, __ATOMIC_ACQUIRE);
+            if (!ready)
+                break;
+            idx = ahci_ffs32(ready) - 1;
+            *cur = idle->trim_q[idx];
+            __atomic_fetch_and(&idle->trim_ready, ~(1u << idx), __ATOMIC_RELAXED);
+            __atomic_fetch_and(&idle->trim_alloc, ~(1u << idx), __ATOMIC_RELEASE);
+        }
+
+        blks = cur->blkcnt > AHCI_TRIM_MAX_BLKS ? AHCI_TRIM_MAX_BLKS : cur->blkcnt;
+        ent[n++] = cur->blknr | ((uint64_t)blks << 48);
+        cur->blknr += blks;
+        cur->blkcnt -= blks;
+    }
+
+    if (n == 0)
+        return 0;
+
+    ahci_memset(ent + n, 0, (AHCI_TRIM_RANGES_PER_CMD - n) * sizeof(uint64_t));
+
+    cfis.fis_type = SATA_FIS_TYPE_REGISTER_H2D;
+    cfis.pm_port_c = 0x80;
+    cfis.command = ATA_CMD_DSM;
+    cfis.features = ATA_DSM_TRIM;
+    cfis.device = ATA_LBA;
+    cfis.sector_count = 1;
+
+    if (!ahci_exec_ata_cmd(ahci_dev, &cfis, ent, ATA_SECT_SIZE, WRITE_CMD))
+        ahci_printf("trim of %u ranges failed\n", n);
+
+    return n;
+}
+
+// send a deferred flush, then queued trims, while the device stays idle
+// to be called periodically from a low priority thread, stops after the
+// command in flight once foreground io shows up
+// return the number of background commands sent
+uint32_t ahci_idle_poll(struct ahci_device *ahci_dev)
+{
+    struct ahci_idle *idle = &ahci_dev->idle;
+    uint32_t running = 0;
+    uint32_t cmds = 0;
+
+    // one runner at a time, other callers return at once
+    if (!__atomic_compare_exchange_n(&idle->running, &running, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    while (ahci_dev_idle(ahci_dev))
+    {
+        if (__atomic_exchange_n(&idle->flush_pending, 0, __ATOMIC_ACQUIRE))
+            ahci_sata_flush_wcache(ahci_dev);
+        else if (!idle->trim_buf || !ahci_sata_trim_batch(ahci_dev))
+            break;
+        ++ cmds;
+    }
+
+    __atomic_store_n(&idle->running, 0, __ATOMIC_RELEASE);
+
+    return cmds;
+}
+
 void ahci_sata_scan(struct ahci_device *ahci_dev)
 {
     struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
@@ -731,11 +2083,26 @@ void ahci_sata_scan(struct ahci_device *ahci_dev)
 
     // get sector nums
     pdev->lba = ata_id_n_sectors(id);
-    // set vector size fixed 512
-    pdev->blksz = ATA_SECT_SIZE;
+    // get logical and physical sector size
+    pdev->blksz = ata_id_logical_sector_size(id);
+    pdev->log2_per_phys = ata_id_log2_per_physical_sector(id);
+    pdev->phys_blksz = pdev->blksz << pdev->log2_per_phys;
+    pdev->lowest_aligned = ata_id_logical_sector_offset(id, pdev->log2_per_phys);
+
+    // bounce buffers for padding partial physical sector writes
+    pdev->align_busy = 0;
+    if (pdev->log2_per_phys)
+        pdev->align_buf = ahci_malloc_align(pdev->phys_blksz * AHCI_MAX_CPUS, 1024);
     pdev->lba48 = ata_id_has_lba48(id);
+    // one dsm block for background trim
+    if (pdev->lba48 && ata_id_has_trim(id))
+    {
+        ahci_dev->flags |= SATA_FLAG_TRIM;
+        ahci_dev->idle.trim_buf = ahci_malloc_align(ATA_SECT_SIZE, 1024);
+    }
     // get ncq depth
     pdev->queue_depth = ata_id_queue_depth(id);
+    ahci_sata_init_ncq(ahci_dev, id);
 
     // get the xfer mode from device
     ahci_sata_xfer_mode(ahci_dev, id);
@@ -756,43 +2123,197 @@ void ahci_sata_scan(struct ahci_device *ahci_dev)
     // dump_buffer(sector_data, 512);
 }
 
-// 读函数
-uint32_t ahci_sata_read_common(struct ahci_device *ahci_dev, uint64_t blknr,
-                               uint32_t blkcnt, void *buffer)
+// 带优先级的读函数，prio为AHCI_PRIO_*，其他值不传输任何块
+uint32_t ahci_sata_read_prio(struct ahci_device *ahci_dev, uint64_t blknr,
+                             uint32_t blkcnt, void *buffer, uint32_t prio)
+{
+    uint32_t rc;
+
+    // prio is part of the ring index, see ahci_req_ring_idx
+    if (prio > AHCI_PRIO_HIGH)
+        return 0;
+
+    ahci_fg_begin(ahci_dev);
+    rc = ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, READ_CMD, prio);
+    ahci_fg_end(ahci_dev);
+
+    return rc;
+}
+
+// 带优先级的写函数，prio为AHCI_PRIO_*，其他值不传输任何块
+uint32_t ahci_sata_write_prio(struct ahci_device *ahci_dev, uint64_t blknr,
+                              uint32_t blkcnt, void *buffer, uint32_t prio)
 {
     struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
+    uint32_t flags = ahci_dev->flags;
 
     uint32_t rc;
-    if (pdev->lba48)
-        rc = ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, READ_CMD);
+    if (prio > AHCI_PRIO_HIGH)
+        return 0;
+
+    ahci_fg_begin(ahci_dev);
+
+    if ((flags & SATA_FLAG_ALIGN_WRITE) && pdev->log2_per_phys)
+        rc = ahci_sata_write_aligned(ahci_dev, blknr, blkcnt, buffer, prio);
+    else
+        rc = ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+
+    if (flags & SATA_FLAG_DEFER_FLUSH)
+        __atomic_store_n(&ahci_dev->idle.flush_pending, 1, __ATOMIC_RELEASE);
     else
-        rc = ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, READ_CMD);
+        ahci_sata_flush_wcache(ahci_dev);
+
+    ahci_fg_end(ahci_dev);
 
     return rc;
 }
 
+// 读函数
+uint32_t ahci_sata_read_common(struct ahci_device *ahci_dev, uint64_t blknr,
+                               uint32_t blkcnt, void *buffer)
+{
+    return ahci_sata_read_prio(ahci_dev, blknr, blkcnt, buffer, AHCI_PRIO_NORMAL);
+}
+
 // 写函数
 uint32_t ahci_sata_write_common(struct ahci_device *ahci_dev, uint64_t blknr,
                                 uint32_t blkcnt, void *buffer)
 {
-    struct ahci_blk_dev *pdev = &ahci_dev->blk_dev;
-    uint32_t flags = ahci_dev->flags;
+    return ahci_sata_write_prio(ahci_dev, blknr, blkcnt, buffer, AHCI_PRIO_NORMAL);
+}
 
-    uint32_t rc;
-    if (pdev->lba48)
+// set up write combining with a staging area of max_blks logical sectors
+// mem must be dma capable, timeout_ms 0 leaves staged data until full or sync
+// writes to the disk that bypass wc must sync it first
+int ahci_wcomb_open(struct ahci_device *ahci_dev, struct ahci_wcomb *wc,
+                    void *mem, uint32_t max_blks, uint32_t timeout_ms)
+{
+    if (!mem || max_blks == 0)
     {
-        rc = ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD);
-        if ((flags & SATA_FLAG_WCACHE) && (flags & SATA_FLAG_FLUSH_EXT))
-            ahci_sata_flush_cache_ext(ahci_dev);
+        ahci_printf("invalid write combining area of %u blocks\n", max_blks);
+        return -1;
     }
-    else
+
+    wc->ahci_dev = ahci_dev;
+    wc->mem = mem;
+    wc->max_blks = max_blks;
+    wc->timeout_ms = timeout_ms;
+    wc->start = 0;
+    wc->count = 0;
+    wc->staged_us = 0;
+
+    return 0;
+}
+
+// write the staged range as one command, followed by a cache flush
+// staged data is kept on failure so a later sync can retry
+int ahci_wcomb_sync(struct ahci_wcomb *wc)
+{
+    if (wc->count == 0)
+        return 0;
+
+    if (ahci_sata_write_common(wc->ahci_dev, wc->start, wc->count, wc->mem) != wc->count)
     {
-        rc = ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD);
-        if ((flags & SATA_FLAG_WCACHE) && (flags & SATA_FLAG_FLUSH))
-            ahci_sata_flush_cache(ahci_dev);
+        ahci_printf("write combining sync at block 0x%lx failed\n", wc->start);
+        return -1;
     }
 
-    return rc;
+    wc->count = 0;
+
+    return 0;
+}
+
+bool ahci_wcomb_expired(struct ahci_wcomb *wc)
+{
+    return wc->count && wc->timeout_ms &&
+           ahci_get_time_us() - wc->staged_us >= wc->timeout_ms * 1000ull;
+}
+
+// sync if the staged data is older than timeout_ms
+// to be called periodically when the writer may go idle
+int ahci_wcomb_poll(struct ahci_wcomb *wc)
+{
+    if (!ahci_wcomb_expired(wc))
+        return 0;
+
+    return ahci_wcomb_sync(wc);
+}
+
+// write through the staging area, return blkcnt or 0 on error
+// writes of max_blks or more go to the drive directly after a sync
+uint32_t ahci_wcomb_write(struct ahci_wcomb *wc, uint64_t blknr,
+                          uint32_t blkcnt, void *buffer)
+{
+    struct ahci_blk_dev *pdev = &wc->ahci_dev->blk_dev;
+    uint64_t end;
+
+    if (blkcnt == 0 || blknr + blkcnt > pdev->lba)
+        return 0;
+
+    if (blkcnt >= wc->max_blks)
+    {
+        if (ahci_wcomb_sync(wc))
+            return 0;
+        return ahci_sata_write_common(wc->ahci_dev, blknr, blkcnt, buffer);
+    }
+
+    if (wc->count == 0 || blknr < wc->start || blknr > wc->start + wc->count ||
+        blknr + blkcnt > wc->start + wc->max_blks)
+    {
+        if (ahci_wcomb_sync(wc))
+            return 0;
+        wc->start = blknr;
+        wc->staged_us = ahci_get_time_us();
+    }
+
+    ahci_memcpy(wc->mem + (blknr - wc->start) * pdev->blksz, buffer, blkcnt * pdev->blksz);
+
+    end = blknr + blkcnt - wc->start;
+    if (end > wc->count)
+        wc->count = end;
+
+    if (wc->count == wc->max_blks || ahci_wcomb_expired(wc))
+    {
+        if (ahci_wcomb_sync(wc))
+            return 0;
+    }
+
+    return blkcnt;
+}
+
+// read through the staging area, staged sectors take precedence over the disk
+uint32_t ahci_wcomb_read(struct ahci_wcomb *wc, uint64_t blknr,
+                         uint32_t blkcnt, void *buffer)
+{
+    struct ahci_blk_dev *pdev = &wc->ahci_dev->blk_dev;
+    uint64_t lo = blknr, hi = blknr + blkcnt;
+
+    // served from staging only
+    if (wc->count && lo >= wc->start && hi <= wc->start + wc->count)
+    {
+        ahci_memcpy(buffer, wc->mem + (lo - wc->start) * pdev->blksz, blkcnt * pdev->blksz);
+        return blkcnt;
+    }
+
+    if (ahci_sata_read_common(wc->ahci_dev, blknr, blkcnt, buffer) != blkcnt)
+        return 0;
+
+    if (lo < wc->start)
+        lo = wc->start;
+    if (hi > wc->start + wc->count)
+        hi = wc->start + wc->count;
+
+    if (lo < hi)
+        ahci_memcpy((uint8_t *)buffer + (lo - blknr) * pdev->blksz,
+                    wc->mem + (lo - wc->start) * pdev->blksz, (hi - lo) * pdev->blksz);
+
+    return blkcnt;
+}
+
+// sync the staged data, wc can be reopened afterwards
+int ahci_wcomb_close(struct ahci_wcomb *wc)
+{
+    return ahci_wcomb_sync(wc);
 }
 
 int ahci_init(struct ahci_device *ahci_dev)
@@ -800,6 +2321,13 @@ int ahci_init(struct ahci_device *ahci_dev)
     // set ahci base
     ahci_dev->mmio_base = ahci_phys_to_uncached(0x400e0000);
 
+    ahci_dev->cmd_timeout_ms = AHCI_CMD_TIMEOUT_MS;
+    ahci_dev->idle.idle_ms = AHCI_IDLE_MS;
+
+    // init per-cpu submission queues
+    for (uint32_t i = 0; i < AHCI_MAX_CPUS; ++ i)
+        ahci_queue_init(&ahci_dev->cpu_q[i]);
+
     // init ahci host and port
     int ret = ahci_host_init(ahci_dev);
     if (ret)
@@ -25,14 +25,26 @@ enum {
     AHCI_CMD_TBL_SZ            = AHCI_CMD_TBL_HDR_SZ + (AHCI_MAX_SG * 16),
     // (0x80 + 56 * 16) * 32
     AHCI_CMD_TBL_AR_SZ         = AHCI_CMD_TBL_SZ * AHCI_MAX_CMDS,
-    // 32 * 32 + (0x80 + 56 * 16) * 32 + 256
-    // AHCI_PORT_PRIV_DMA_SZ      = AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + AHCI_RX_FIS_SZ,
-    AHCI_PORT_PRIV_DMA_SZ      = AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_SZ + AHCI_RX_FIS_SZ,
+    // one sector for the ncq command error log
+    AHCI_LOG_BUF_SZ            = 512,
+    // 32 * 32 + (0x80 + 56 * 16) * 32 + 256 + 512
+    AHCI_PORT_PRIV_DMA_SZ      = AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + AHCI_RX_FIS_SZ +
+                                 AHCI_LOG_BUF_SZ,
     AHCI_PORT_PRIV_FBS_DMA_SZ  = AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + (AHCI_RX_FIS_SZ * 16),
 
     AHCI_MAX_BYTES_PER_SG = 4 * 1024 * 1024, // 4 MiB
     AHCI_MAX_BYTES_PER_TRANS = AHCI_MAX_SG * AHCI_MAX_BYTES_PER_SG,
 
+    /* received FIS area layout */
+    AHCI_RX_FIS_DMA_SETUP = 0x00, /* DMA Setup FIS */
+    AHCI_RX_FIS_PIO_SETUP = 0x20, /* PIO Setup FIS */
+    AHCI_RX_FIS_D2H       = 0x40, /* D2H Register FIS */
+    AHCI_RX_FIS_SDB       = 0x58, /* Set Device Bits FIS */
+    AHCI_RX_FIS_UNK       = 0x60, /* Unknown FIS */
+
+    // confirm with PORT_CMD_ISSUE every n spins while polling FIS memory
+    AHCI_FIS_POLL_MMIO_INTERVAL = 1024,
+
     /* SATA global controller registers */
     // sata_host_regs
     HOST_CAP            = 0x00, /* host capabilities */
@@ -134,6 +146,7 @@ enum {
     PORT_CMD_HPCP        = (0x1u << 18), /* HotPlug Capable Port */
     PORT_CMD_PMP         = (0x1u << 17), /* PMP attached */
     PORT_CMD_LIST_ON     = (0x1u << 15), /* cmd list DMA engine running */
+    PORT_CMD_CCS_SHIFT   = 8, /* current command slot */
     PORT_CMD_FIS_ON      = (0x1u << 14), /* FIS DMA engine running */
     PORT_CMD_FIS_RX      = (0x1u << 4), /* Enable FIS receive DMA engine */
     PORT_CMD_CLO         = (0x1u << 3), /* Command list override */
@@ -151,10 +164,60 @@ enum {
                            PORT_CMD_ESP | PORT_CMD_FBSCP,
 };
 
+// how ahci_exec_ata_cmd detects command completion
+enum {
+    AHCI_COMPLETION_MMIO = 0, // poll PORT_CMD_ISSUE
+    AHCI_COMPLETION_FIS  = 1, // poll received FIS area
+};
+
+// per-cpu software submission queues
+enum {
+    AHCI_MAX_CPUS        = 4, // ls2k1000la has 2 cores
+    AHCI_CPU_QUEUE_DEPTH = 32, // power of 2
+    AHCI_CPU_QUEUE_RINGS = 4, // one ring per priority class, ncq or not
+};
+
+// priority class of a block request
+enum {
+    AHCI_PRIO_NORMAL         = 0,
+    AHCI_PRIO_HIGH           = 1, // ncq high priority, may take the reserved slots
+    AHCI_PRIO_RESERVED_SLOTS = 4, // slots normal priority requests leave free
+};
+
+// command timeout and port recovery
+enum {
+    AHCI_CMD_TIMEOUT_MS         = 5000, // default per-command deadline
+    AHCI_CMD_RETRIES            = 2, // reissues of a failed command
+    AHCI_PORT_STOP_TIMEOUT_MS   = 500, // PORT_CMD_LIST_ON / PORT_CMD_CLO clear
+    AHCI_LINK_TIMEOUT_MS        = 1000, // link up after COMRESET
+    AHCI_DEV_READY_TIMEOUT_MS   = 5000, // BSY clear after COMRESET
+    AHCI_HEALTH_CHECK_REAPS     = 64, // reap calls between two clock reads
+    AHCI_HEALTH_CHECK_MS        = 1, // task file error and timeout check period
+};
+
+// background work run while the device is idle
+enum {
+    AHCI_IDLE_MS             = 50, // default idle time before background work
+    AHCI_TRIM_QUEUE_DEPTH    = 32, // queued trim ranges, one bit each
+    AHCI_TRIM_RANGES_PER_CMD = 64, // ranges in one 512-byte dsm block
+    AHCI_TRIM_MAX_BLKS       = 0xffff, // sectors of one range
+};
+
+// streaming transfers
+enum {
+    AHCI_STREAM_MAX_BUFS = 16, // in-flight buffers of one stream
+};
+
 enum {
     SATA_FLAG_WCACHE = 0x00000100,
     SATA_FLAG_FLUSH = 0x00000200,
     SATA_FLAG_FLUSH_EXT = 0x00000400,
+    SATA_FLAG_ALIGN_WRITE = 0x00000800, // pad partial physical sector writes
+    SATA_FLAG_NCQ = 0x00001000, // read/write with FPDMA QUEUED commands
+    SATA_FLAG_NCQ_PRIO = 0x00002000, // device honours the ncq PRIO field
+    SATA_FLAG_RAHEAD = 0x00004000, // read look-ahead enabled
+    SATA_FLAG_TRIM = 0x00008000, // device supports dsm trim
+    SATA_FLAG_DEFER_FLUSH = 0x00010000, // flush after writes from ahci_idle_poll
 };
 
 struct ahci_cmd_hdr
@@ -188,13 +251,70 @@ struct ahci_ioport
     uint64_t cmd_tbl_dma;
 
     struct ahci_sg *cmd_tbl_sg;
+
+    uint64_t log_buf; // ncq command error log, read by recovery
+
+    // allocated command slots in the low half, those holding ncq commands
+    // in the high half, updated atomically
+    uint64_t slot_busy;
+    uint32_t ncq_drain; // a non-ncq command waits for the ncq slots to drain
+    uint32_t users; // threads dispatching or reaping on this port
+    uint32_t recovering; // set while the port is being recovered
+    uint32_t fis_seq; // bumped each time the received FIS area is re-armed
+    uint32_t dead; // recovery failed, requests fail without reaching the hba
 };
 
+// an ata command waiting in or issued from a per-cpu queue
+struct ahci_request
+{
+    struct sata_fis_h2d cfis;
+    void *buf;
+    uint32_t buf_len;
+    uint32_t is_write;
+    uint32_t prio; // AHCI_PRIO_*
+    uint32_t ncq; // FPDMA QUEUED command, the tag is filled in at issue
+
+    uint32_t cpu; // submitting cpu, completion is reaped there
+    volatile uint32_t done;
+    int32_t status; // 0 or -1 if the command failed
+
+    uint64_t deadline; // ahci_get_time_us() at which the command times out
+    uint32_t retries;
+};
+
+// bounded lock-free ring of requests
+struct ahci_req_ring
+{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t seq[AHCI_CPU_QUEUE_DEPTH];
+    struct ahci_request *ring[AHCI_CPU_QUEUE_DEPTH];
+};
+
+// submission queue of one cpu, indexed by ahci_req_ring_idx()
+struct ahci_cpu_queue
+{
+    struct ahci_req_ring rq[AHCI_CPU_QUEUE_RINGS];
+
+    uint32_t issued; // slots issued from this cpu and not reaped yet
+    uint32_t polls; // reap calls since PORT_CMD_ISSUE was last checked
+    uint32_t fis_seen; // port fis_seq as of the last PORT_CMD_ISSUE check
+    uint32_t reaps; // reap calls since the clock was last read
+    uint64_t check_us; // ahci_get_time_us() of the next health check
+    struct ahci_request *slot_req[AHCI_MAX_CMDS];
+} __attribute__((aligned(64)));
+
 struct ahci_blk_dev
 {
     bool lba48;
     uint64_t lba;
-    uint64_t blksz;
+    uint64_t blksz; // logical sector size
+    uint64_t phys_blksz; // physical sector size
+    uint32_t log2_per_phys; // logical sectors per physical sector
+    uint32_t lowest_aligned; // lowest lba aligned to a physical sector
+
+    uint64_t align_buf; // AHCI_MAX_CPUS bounce buffers of phys_blksz
+    uint32_t align_busy; // bounce buffers in use, updated atomically
 
     uint32_t queue_depth; // ncq depth
 
@@ -203,17 +323,46 @@ struct ahci_blk_dev
     uint8_t revision[ATA_ID_FW_REV_LEN + 1];
 };
 
+struct ahci_trim_range
+{
+    uint64_t blknr;
+    uint64_t blkcnt;
+};
+
+// trims and deferred flushes, sent by ahci_idle_poll once no foreground
+// read/write has been seen for idle_ms
+struct ahci_idle
+{
+    uint32_t idle_ms;
+    uint32_t fg_active; // foreground reads/writes in progress
+    uint64_t last_fg_us; // ahci_get_time_us() of the last foreground activity
+    uint32_t running; // set while ahci_idle_poll runs
+    uint32_t flush_pending; // a write cache flush was deferred
+
+    // queued trim ranges, entries are taken and filled by bit
+    uint32_t trim_alloc;
+    uint32_t trim_ready;
+    struct ahci_trim_range trim_q[AHCI_TRIM_QUEUE_DEPTH];
+    struct ahci_trim_range trim_cur; // rest of a range split across commands
+    uint64_t trim_buf; // one dsm block
+};
+
 struct ahci_device
 {
     uint64_t mmio_base; // address of ahci reg
 
     uint32_t flags;
+    uint32_t completion_mode; // AHCI_COMPLETION_*
+    uint32_t cmd_timeout_ms; // per-command deadline
     uint32_t cap; // HOST_CAP
     uint32_t cap2; // HOST_CAP2
     uint32_t version; // HOST_VERSION
     uint32_t port_map; // HOST_PORTS_IMPL
     uint32_t pio_mask;
     uint32_t udma_mask;
+    uint32_t slot_mask; // command slots supported by HOST_CAP
+    uint32_t ncq_mask; // slots usable as ncq tags
+    uint32_t prio_reserved; // slots kept free for high priority requests
 
     uint8_t n_ports; // number of available ports
     uint32_t port_map_linkup; // linkup port map
@@ -222,6 +371,47 @@ struct ahci_device
     // we only support one port / block device
     uint8_t port_idx; // index of the active port
     struct ahci_blk_dev blk_dev;
+
+    struct ahci_idle idle;
+
+    // submission queues, indexed by ahci_cpu_id()
+    struct ahci_cpu_queue cpu_q[AHCI_MAX_CPUS];
+};
+
+// sequential lba48 transfer with up to AHCI_STREAM_MAX_BUFS buffers in flight
+// buffers go around the ring in order: acquire -> caller -> release -> drive
+struct ahci_stream
+{
+    struct ahci_device *ahci_dev;
+    uint8_t *mem; // nbufs buffers of buf_blks logical sectors
+    uint64_t blknr; // first lba of the stream
+    uint64_t blkcnt;
+    uint32_t is_write;
+    uint32_t nbufs;
+    uint32_t buf_blks;
+    int32_t status; // 0 or -1 once a transfer failed
+
+    uint64_t nchunks; // buffers needed to cover the range
+    uint64_t submitted; // chunks handed to the drive
+    uint64_t acquired; // chunks handed to the caller
+    uint64_t released; // chunks handed back by the caller
+
+    struct ahci_request req[AHCI_STREAM_MAX_BUFS]; // last request of each buffer
+};
+
+// write combining over a staging area of max_blks logical sectors
+// writes that land inside or right after the staged range are merged in memory,
+// the range goes to the drive as one write once full, timeout_ms after the
+// first staged write, or on sync
+struct ahci_wcomb
+{
+    struct ahci_device *ahci_dev;
+    uint8_t *mem; // staging area, dma capable
+    uint32_t max_blks;
+    uint32_t timeout_ms;
+    uint64_t start; // first staged lba
+    uint32_t count; // staged logical sectors, 0 if empty
+    uint64_t staged_us; // ahci_get_time_us() of the first staged write
 };
 
 #endif // __LS2K_LIBAHCI_H__
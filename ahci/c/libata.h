@@ -72,6 +72,7 @@ enum {
     ATA_ID_CFA_MODES        = 163,
     ATA_ID_DATA_SET_MGMT    = 169,
     ATA_ID_SCT_CMD_XPORT    = 206,
+    ATA_ID_LOGICAL_SECTOR_ALIGN = 209,
     ATA_ID_ROT_SPEED        = 217,
     ATA_ID_PIO4             = (1 << 1),
 
@@ -201,8 +202,24 @@ enum {
     ATA_CMD_ZAC_MGMT_IN         = 0x4A,
     ATA_CMD_ZAC_MGMT_OUT        = 0x9F,
 
+    /* NCQ priority, bits 15:14 of the count field of FPDMA QUEUED commands */
+    ATA_SHIFT_PRIO      = 6,
+    ATA_PRIO_HIGH       = 2,
+
+    /* DATA SET MANAGEMENT, 8-byte lba/count ranges in 512-byte blocks */
+    ATA_DSM_TRIM        = 0x01,
+
+    /* READ LOG EXT, NCQ command error log, byte 0 holds NQ and the failing tag */
+    ATA_LOG_SATA_NCQ    = 0x10,
+    ATA_LOG_NCQ_NQ      = 0x80,
+    ATA_LOG_NCQ_TAG     = 0x1f,
+
     /* SETFEATURES stuff */
     SETFEATURES_XFER    = 0x03,
+    SETFEATURES_WC_ON   = 0x02, /* Enable write cache */
+    SETFEATURES_WC_OFF  = 0x82, /* Disable write cache */
+    SETFEATURES_RA_ON   = 0xaa, /* Enable read look-ahead */
+    SETFEATURES_RA_OFF  = 0x55, /* Disable read look-ahead */
     XFER_UDMA_7         = 0x47,
     XFER_UDMA_6         = 0x46,
     XFER_UDMA_5         = 0x45,
@@ -251,6 +268,59 @@ struct sata_fis_h2d
     uint8_t res2[4];
 };
 
+// Register - Device to Host FIS
+struct sata_fis_d2h
+{
+    uint8_t fis_type; // 0
+    uint8_t pm_port_i; // 1
+    uint8_t status; // 2
+    uint8_t error; // 3
+    uint8_t lba_low; // 4
+    uint8_t lba_mid; // 5
+    uint8_t lba_high; // 6
+    uint8_t device; // 7
+    uint8_t lba_low_exp; // 8
+    uint8_t lba_mid_exp; // 9
+    uint8_t lba_high_exp; // 10
+    uint8_t res1; // 11
+    uint8_t sector_count; // 12
+    uint8_t sector_count_exp; // 13
+    uint8_t res2[6];
+};
+
+// PIO Setup - Device to Host FIS
+struct sata_fis_pio_setup
+{
+    uint8_t fis_type; // 0
+    uint8_t pm_port_i; // 1
+    uint8_t status; // 2
+    uint8_t error; // 3
+    uint8_t lba_low; // 4
+    uint8_t lba_mid; // 5
+    uint8_t lba_high; // 6
+    uint8_t device; // 7
+    uint8_t lba_low_exp; // 8
+    uint8_t lba_mid_exp; // 9
+    uint8_t lba_high_exp; // 10
+    uint8_t res1; // 11
+    uint8_t sector_count; // 12
+    uint8_t sector_count_exp; // 13
+    uint8_t res2; // 14
+    uint8_t e_status; // 15
+    uint16_t transfer_count; // 16
+    uint8_t res3[2];
+};
+
+// Set Device Bits - Device to Host FIS
+struct sata_fis_sdb
+{
+    uint8_t fis_type; // 0
+    uint8_t pm_port_i; // 1
+    uint8_t status; // 2
+    uint8_t error; // 3
+    uint32_t sactive; // 4, completed ncq tags
+};
+
 // fis_type - SATA FIS type
 enum sata_fis_type
 {
@@ -264,35 +334,39 @@ enum sata_fis_type
     SATA_FIS_TYPE_SET_DEVICE_BITS_D2H = 0xA1,
 };
 
-static bool ata_id_is_ata(const uint16_t *id)
+static inline bool ata_id_is_ata(const uint16_t *id)
 {
     return (id[ATA_ID_CONFIG] & (1 << 15)) == 0;
 }
-static bool ata_id_has_lba(const uint16_t *id)
+static inline bool ata_id_has_lba(const uint16_t *id)
 {
     return (id[ATA_ID_CAPABILITY] & (1 << 9)) != 0;
 }
-static bool ata_id_has_dma(const uint16_t *id)
+static inline bool ata_id_has_dma(const uint16_t *id)
 {
     return (id[ATA_ID_CAPABILITY] & (1 << 8)) != 0;
 }
-static bool ata_id_has_ncq(const uint16_t *id)
+static inline bool ata_id_has_ncq(const uint16_t *id)
 {
     return (id[ATA_ID_SATA_CAPABILITY] & (1 << 8)) != 0;
 }
-static uint32_t ata_id_queue_depth(const uint16_t *id)
+static inline bool ata_id_has_ncq_prio(const uint16_t *id)
+{
+    return (id[ATA_ID_SATA_CAPABILITY] & (1 << 12)) != 0;
+}
+static inline uint32_t ata_id_queue_depth(const uint16_t *id)
 {
     return (id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1;
 }
-static bool ata_id_removable(const uint16_t *id)
+static inline bool ata_id_removable(const uint16_t *id)
 {
     return (id[ATA_ID_CONFIG] & (1 << 7)) != 0;
 }
-static uint32_t ata_id_u32(const uint16_t *id, uint32_t n)
+static inline uint32_t ata_id_u32(const uint16_t *id, uint32_t n)
 {
     return ((uint32_t)(id[n + 1]) << 16) | id[n];
 }
-static uint64_t ata_id_u64(const uint16_t *id, uint32_t n)
+static inline uint64_t ata_id_u64(const uint16_t *id, uint32_t n)
 {
     uint64_t val;
     val  = (uint64_t)id[n + 3] << 48;
@@ -301,21 +375,51 @@ static uint64_t ata_id_u64(const uint16_t *id, uint32_t n)
     val |= (uint64_t)id[n + 0];
     return val;
 }
-static bool ata_id_has_flush(const uint16_t *id)
+// see linux/include/linux/ata.h
+static inline uint8_t ata_id_log2_per_physical_sector(const uint16_t *id)
+{
+    // bit 15 must be 0, bit 14 must be 1 and bit 13 multiple logical per physical
+    if ((id[ATA_ID_SECTOR_SIZE] & 0xe000) == 0x6000)
+        return id[ATA_ID_SECTOR_SIZE] & 0xf;
+    return 0;
+}
+// lowest lba aligned to a physical sector
+static inline uint16_t ata_id_logical_sector_offset(const uint16_t *id, uint8_t log2_per_phys)
+{
+    uint16_t word_209 = id[ATA_ID_LOGICAL_SECTOR_ALIGN];
+    uint16_t first;
+
+    if ((log2_per_phys > 1) && (word_209 & 0xc000) == 0x4000)
+    {
+        first = word_209 & 0x3fff;
+        if (first > 0)
+            return (1 << log2_per_phys) - first;
+    }
+    return 0;
+}
+// words 117-118 in bytes, 0xd000 ignores bit 13 (logical:physical > 1)
+// see linux/drivers/ata/libata-scsi.c
+static inline uint32_t ata_id_logical_sector_size(const uint16_t *id)
+{
+    if ((id[ATA_ID_SECTOR_SIZE] & 0xd000) == 0x5000)
+        return ata_id_u32(id, ATA_ID_LOGICAL_SECTOR_SIZE) * sizeof(uint16_t);
+    return ATA_SECT_SIZE;
+}
+static inline bool ata_id_has_flush(const uint16_t *id)
 {
     if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
         return 0;
     return id[ATA_ID_COMMAND_SET_2] & (1 << 12);
 }
 
-static bool ata_id_has_flush_ext(const uint16_t *id)
+static inline bool ata_id_has_flush_ext(const uint16_t *id)
 {
     if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
         return 0;
     return id[ATA_ID_COMMAND_SET_2] & (1 << 13);
 }
 
-static bool ata_id_has_lba48(const uint16_t *id)
+static inline bool ata_id_has_lba48(const uint16_t *id)
 {
     if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
         return 0;
@@ -324,7 +428,7 @@ static bool ata_id_has_lba48(const uint16_t *id)
     return id[ATA_ID_COMMAND_SET_2] & (1 << 10);
 }
 
-static bool ata_id_hpa_enabled(const uint16_t *id)
+static inline bool ata_id_hpa_enabled(const uint16_t *id)
 {
     // word 83 valid bits cover word 82 data
     if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
@@ -338,7 +442,7 @@ static bool ata_id_hpa_enabled(const uint16_t *id)
     return id[ATA_ID_COMMAND_SET_1] & (1 << 10);
 }
 
-static bool ata_id_has_wcache(const uint16_t *id)
+static inline bool ata_id_has_wcache(const uint16_t *id)
 {
     // word 83 valid bits cover word 82 data
     if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
@@ -346,11 +450,31 @@ static bool ata_id_has_wcache(const uint16_t *id)
     return id[ATA_ID_COMMAND_SET_1] & (1 << 5);
 }
 
-static bool ata_id_wcache_enabled(const uint16_t *id)
+static inline bool ata_id_wcache_enabled(const uint16_t *id)
 {
     if ((id[ATA_ID_CSF_DEFAULT] & 0xC000) != 0x4000)
         return 0;
     return id[ATA_ID_CFS_ENABLE_1] & (1 << 5);
 }
 
+static inline bool ata_id_has_trim(const uint16_t *id)
+{
+    return id[ATA_ID_DATA_SET_MGMT] & 1;
+}
+
+static inline bool ata_id_has_rahead(const uint16_t *id)
+{
+    // word 83 valid bits cover word 82 data
+    if ((id[ATA_ID_COMMAND_SET_2] & 0xC000) != 0x4000)
+        return 0;
+    return id[ATA_ID_COMMAND_SET_1] & (1 << 6);
+}
+
+static inline bool ata_id_rahead_enabled(const uint16_t *id)
+{
+    if ((id[ATA_ID_CSF_DEFAULT] & 0xC000) != 0x4000)
+        return 0;
+    return id[ATA_ID_CFS_ENABLE_1] & (1 << 6);
+}
+
 #endif // __LS2K_LIBATA_H__
@@ -28,34 +28,154 @@ typedef struct ahci_ioport {
   uint64_t cmd_tbl;
   uint64_t cmd_tbl_dma;
   struct ahci_sg *cmd_tbl_sg;
+  uint64_t log_buf;
+  uint64_t slot_busy;
+  uint32_t ncq_drain;
+  uint32_t users;
+  uint32_t recovering;
+  uint32_t fis_seq;
+  uint32_t dead;
 } ahci_ioport;
 
+typedef struct sata_fis_h2d {
+  uint8_t fis_type;
+  uint8_t pm_port_c;
+  uint8_t command;
+  uint8_t features;
+  uint8_t lba_low;
+  uint8_t lba_mid;
+  uint8_t lba_high;
+  uint8_t device;
+  uint8_t lba_low_exp;
+  uint8_t lba_mid_exp;
+  uint8_t lba_high_exp;
+  uint8_t features_exp;
+  uint8_t sector_count;
+  uint8_t sector_count_exp;
+  uint8_t res1;
+  uint8_t control;
+  uint8_t res2[4];
+} sata_fis_h2d;
+
+typedef struct ahci_request {
+  struct sata_fis_h2d cfis;
+  uint8_t *buf;
+  uint32_t buf_len;
+  uint32_t is_write;
+  uint32_t prio;
+  uint32_t ncq;
+  uint32_t cpu;
+  uint32_t done;
+  int32_t status;
+  uint64_t deadline;
+  uint32_t retries;
+  void (*complete)(struct ahci_request *req);
+  void *ctx;
+} ahci_request;
+
+typedef struct ahci_req_ring {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t seq[32];
+  struct ahci_request *ring[32];
+} ahci_req_ring;
+
+typedef struct __attribute__((aligned(64))) ahci_cpu_queue {
+  struct ahci_req_ring rq[4];
+  uint32_t issued;
+  uint32_t polls;
+  uint32_t fis_seen;
+  uint32_t reaps;
+  uint64_t check_us;
+  struct ahci_request *slot_req[32];
+} ahci_cpu_queue;
+
 typedef struct ahci_blk_dev {
   bool lba48;
   uint64_t lba;
   uint64_t blksz;
+  uint64_t phys_blksz;
+  uint32_t log2_per_phys;
+  uint32_t lowest_aligned;
+  uint64_t align_buf;
+  uint32_t align_busy;
   uint32_t queue_depth;
   uint8_t product[41];
   uint8_t serial[21];
   uint8_t revision[9];
 } ahci_blk_dev;
 
+typedef struct ahci_trim_range {
+  uint64_t blknr;
+  uint64_t blkcnt;
+} ahci_trim_range;
+
+typedef struct ahci_idle {
+  uint32_t idle_ms;
+  uint32_t fg_active;
+  uint64_t last_fg_us;
+  uint32_t running;
+  uint32_t flush_pending;
+  uint32_t trim_alloc;
+  uint32_t trim_ready;
+  struct ahci_trim_range trim_q[32];
+  struct ahci_trim_range trim_cur;
+  uint64_t trim_buf;
+} ahci_idle;
+
 typedef struct ahci_device {
   uint64_t mmio_base;
   uint32_t flags;
+  uint32_t completion_mode;
+  uint32_t cmd_timeout_ms;
   uint32_t cap;
   uint32_t cap2;
   uint32_t version;
   uint32_t port_map;
   uint32_t pio_mask;
   uint32_t udma_mask;
+  uint32_t slot_mask;
+  uint32_t ncq_mask;
+  uint32_t prio_reserved;
   uint8_t n_ports;
   uint32_t port_map_linkup;
   struct ahci_ioport port[32];
   uint8_t port_idx;
   struct ahci_blk_dev blk_dev;
+  struct ahci_idle idle;
+  struct ahci_cpu_queue cpu_q[4];
 } ahci_device;
 
+typedef struct ahci_stream {
+  const struct ahci_device *ahci_dev;
+  uint8_t *mem;
+  uint64_t blknr;
+  uint64_t blkcnt;
+  uint32_t is_write;
+  uint32_t nbufs;
+  uint32_t buf_blks;
+  int32_t status;
+  uint64_t nchunks;
+  uint64_t submitted;
+  uint64_t acquired;
+  uint64_t released;
+  struct ahci_request req[16];
+} ahci_stream;
+
+typedef struct ahci_wcomb {
+  const struct ahci_device *ahci_dev;
+  uint8_t *mem;
+  uint32_t max_blks;
+  uint32_t timeout_ms;
+  uint64_t start;
+  uint32_t count;
+  uint64_t staged_us;
+} ahci_wcomb;
+
+extern uint32_t ahci_cpu_id(void);
+
+extern uint64_t ahci_get_time_us(void);
+
 extern uint64_t ahci_malloc_align(uint64_t size, uint32_t align);
 
 extern void ahci_mdelay(uint32_t ms);
@@ -64,18 +184,91 @@ extern uint64_t ahci_phys_to_uncached(uint64_t va);
 
 extern int32_t ahci_printf(const char *fmt, ...);
 
+extern uint32_t ahci_idle_poll(const struct ahci_device *ahci_dev);
+
 extern int32_t ahci_init(struct ahci_device *ahci_dev);
 
+extern int32_t ahci_sata_query_cache(struct ahci_device *ahci_dev);
+
+extern int32_t ahci_sata_queue_trim(const struct ahci_device *ahci_dev,
+                                    uint64_t blknr,
+                                    uint64_t blkcnt);
+
 extern uint64_t ahci_sata_read_common(const struct ahci_device *ahci_dev,
                                     uint64_t blknr,
                                     uint32_t blkcnt,
                                     void *buffer);
 
+extern uint64_t ahci_sata_read_prio(const struct ahci_device *ahci_dev,
+                                  uint64_t blknr,
+                                  uint32_t blkcnt,
+                                  void *buffer,
+                                  uint32_t prio);
+
+extern int32_t ahci_sata_set_rahead(struct ahci_device *ahci_dev, bool enable);
+
+extern int32_t ahci_sata_set_wcache(struct ahci_device *ahci_dev, bool enable);
+
+extern void ahci_sata_sync(const struct ahci_device *ahci_dev);
+
 extern uint64_t ahci_sata_write_common(const struct ahci_device *ahci_dev,
                                      uint64_t blknr,
                                      uint32_t blkcnt,
                                      void *buffer);
 
+extern uint64_t ahci_sata_write_prio(const struct ahci_device *ahci_dev,
+                                   uint64_t blknr,
+                                   uint32_t blkcnt,
+                                   void *buffer,
+                                   uint32_t prio);
+
+extern void ahci_set_cmd_timeout(struct ahci_device *ahci_dev, uint32_t ms);
+
+extern void ahci_set_completion_mode(struct ahci_device *ahci_dev, uint32_t mode);
+
+extern void ahci_set_deferred_flush(struct ahci_device *ahci_dev, bool enable);
+
+extern void ahci_set_idle_time(struct ahci_device *ahci_dev, uint32_t ms);
+
+extern void ahci_set_write_align(struct ahci_device *ahci_dev, bool enable);
+
+extern uint8_t *ahci_stream_acquire(struct ahci_stream *st, uint64_t *blknr, uint32_t *blkcnt);
+
+extern int32_t ahci_stream_close(struct ahci_stream *st);
+
+extern int32_t ahci_stream_open(const struct ahci_device *ahci_dev,
+                                struct ahci_stream *st,
+                                uint64_t blknr,
+                                uint64_t blkcnt,
+                                uint32_t is_write,
+                                uint8_t *mem,
+                                uint32_t nbufs,
+                                uint32_t buf_blks);
+
+extern int32_t ahci_stream_release(struct ahci_stream *st);
+
 extern void ahci_sync_dcache(void);
 
+extern int32_t ahci_wcomb_close(struct ahci_wcomb *wc);
+
+extern int32_t ahci_wcomb_open(const struct ahci_device *ahci_dev,
+                               struct ahci_wcomb *wc,
+                               uint8_t *mem,
+                               uint32_t max_blks,
+                               uint32_t timeout_ms);
+
+extern int32_t ahci_wcomb_poll(struct ahci_wcomb *wc);
+
+extern uint64_t ahci_wcomb_read(struct ahci_wcomb *wc,
+                                uint64_t blknr,
+                                uint32_t blkcnt,
+                                uint8_t *buffer);
+
+extern int32_t ahci_wcomb_sync(struct ahci_wcomb *wc);
+
+extern uint64_t ahci_wcomb_write(struct ahci_wcomb *wc,
+                                 uint64_t blknr,
+                                 uint32_t blkcnt,
+                                 uint8_t *buffer);
+
 extern uint64_t ahci_virt_to_phys(uint64_t va);
@@ -0,0 +1,421 @@
+#![allow(dead_code, non_camel_case_types)]
+
+// 异步块读写和no_std执行器
+// 每次读写是一个Future，命令完成时由回收它的线程通过ahci_request.complete唤醒，
+// 执行器在同一个线程上轮询多个任务，不需要线程即可让多个读写同时在途
+
+use crate::drv_ahci::*;
+use crate::libahci::*;
+use crate::libata::*;
+use crate::platform::*;
+
+use core::cell::UnsafeCell;
+use core::ffi::c_void;
+use core::future::Future;
+use core::marker::PhantomPinned;
+use core::pin::Pin;
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicU32, Ordering};
+use core::task::{Context, Poll, RawWaker, RawWakerVTable, Waker};
+
+const AHCI_IO_NEW: u32 = 0;
+const AHCI_IO_SUBMITTED: u32 = 1;
+const AHCI_IO_DONE: u32 = 2;
+
+// complete回调与poll之间无锁交接waker的状态位
+// 回调可能在同一cpu上被poll所在的线程抢占，双方都不能等待对方
+const AHCI_WAKE_REGISTERING: u32 = 1 << 0; // poll正在更新waker
+const AHCI_WAKE_CLAIMED: u32 = 1 << 1; // 回调已开始，之后不能再注册waker
+const AHCI_WAKE_FIRED: u32 = 1 << 2; // 回调已执行完毕，此后不再访问本结构
+
+// 完成回调唤醒poll注册的waker
+// 回调开始时poll正在注册，就由poll唤醒自己的waker，否则回调取走waker唤醒
+struct ahci_wake {
+    state: AtomicU32, // AHCI_WAKE_*
+    waker: UnsafeCell<Option<Waker>>,
+}
+
+impl ahci_wake {
+    const fn new() -> Self {
+        return ahci_wake {
+            state: AtomicU32::new(0),
+            waker: UnsafeCell::new(None),
+        };
+    }
+
+    // 提交之前设置第一个waker，此时回调还不可能执行
+    fn set(&mut self, waker: &Waker) {
+        *self.waker.get_mut() = Some(waker.clone());
+    }
+
+    fn fired(&self) -> bool {
+        return self.state.load(Ordering::Acquire) & AHCI_WAKE_FIRED != 0;
+    }
+
+    // 回调已执行完毕时返回true，否则保证waker之后会被唤醒
+    fn register(&self, waker: &Waker) -> bool {
+        let state: u32 = self.state.load(Ordering::Acquire);
+
+        if state & AHCI_WAKE_FIRED != 0 {
+            return true;
+        }
+
+        // 回调已开始但还没结束，不等它，让任务再被poll一次
+        if state != 0
+            || self
+                .state
+                .compare_exchange(0, AHCI_WAKE_REGISTERING, Ordering::Acquire, Ordering::Acquire)
+                .is_err()
+        {
+            waker.wake_by_ref();
+            return false;
+        }
+
+        let slot: &mut Option<Waker> = unsafe { &mut *self.waker.get() };
+        if !slot.as_ref().is_some_and(|w| w.will_wake(waker)) {
+            *slot = Some(waker.clone());
+        }
+
+        // 注册期间回调开始了，它没有取走waker，由这里唤醒
+        if self
+            .state
+            .compare_exchange(AHCI_WAKE_REGISTERING, 0, Ordering::AcqRel, Ordering::Acquire)
+            .is_err()
+        {
+            self.state.fetch_and(!AHCI_WAKE_REGISTERING, Ordering::Relaxed);
+            waker.wake_by_ref();
+        }
+
+        return false;
+    }
+
+    // 只调用一次，返回后调用者不能再访问本结构
+    fn fire(&self) {
+        let prev: u32 = self.state.fetch_or(AHCI_WAKE_CLAIMED, Ordering::AcqRel);
+        let waker: Option<Waker> = if prev & AHCI_WAKE_REGISTERING == 0 {
+            unsafe { (*self.waker.get()).take() }
+        } else {
+            None
+        };
+
+        self.state.fetch_or(AHCI_WAKE_FIRED, Ordering::Release);
+
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+}
+
+// 一条lba48读写命令，第一次poll时提交，结果为0或-1
+// req在命令完成前被硬件队列引用，因此不能移动
+pub struct ahci_io<'a> {
+    ahci_dev: &'a ahci_device,
+    req: ahci_request,
+    state: u32, // AHCI_IO_*
+    status: i32,
+
+    wake: ahci_wake,
+
+    _pin: PhantomPinned,
+}
+
+// 在回收命令的线程上执行，io在fire返回之前必须保持有效
+extern "C" fn ahci_io_complete(req: *mut ahci_request) {
+    let io: &ahci_io = unsafe { &*((*req).ctx as *const ahci_io) };
+
+    if io.req.is_write != 0 {
+        io.ahci_dev.idle.flush_pending.store(1, Ordering::Release);
+    }
+    ahci_fg_end(io.ahci_dev);
+
+    io.wake.fire();
+}
+
+fn ahci_io_new<'a>(
+    ahci_dev: &'a ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+) -> ahci_io<'a> {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+    let mut io: ahci_io = ahci_io {
+        ahci_dev: ahci_dev,
+        req: ahci_new_req(sata_fis_h2d::default(), null_mut(), 0, is_write, AHCI_PRIO_NORMAL),
+        state: AHCI_IO_NEW,
+        status: 0,
+        wake: ahci_wake::new(),
+        _pin: PhantomPinned,
+    };
+
+    if !pdev.lba48
+        || blkcnt == 0
+        || blkcnt > ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS_LBA48)
+        || blknr + blkcnt as u64 > pdev.lba
+    {
+        unsafe {
+            ahci_printf(
+                b"invalid async transfer of %u blocks at 0x%lx\n\0" as *const u8,
+                blkcnt,
+                blknr,
+            )
+        };
+        io.state = AHCI_IO_DONE;
+        io.status = -1;
+        return io;
+    }
+
+    ahci_fill_rw_req(ahci_dev, &mut io.req, blknr, blkcnt, buffer, is_write, AHCI_PRIO_NORMAL);
+    io.req.complete = Some(ahci_io_complete);
+
+    return io;
+}
+
+// 异步读，blkcnt不能超过一条命令的传输长度
+pub fn ahci_sata_read_async<'a>(
+    ahci_dev: &'a ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+) -> ahci_io<'a> {
+    return ahci_io_new(ahci_dev, blknr, blkcnt, buffer, READ_CMD);
+}
+
+// 异步写，完成时不刷新写缓存，而是记为推迟的刷新，
+// 由ahci_idle_poll或ahci_sata_sync发出
+pub fn ahci_sata_write_async<'a>(
+    ahci_dev: &'a ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+) -> ahci_io<'a> {
+    return ahci_io_new(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD);
+}
+
+impl<'a> Future for ahci_io<'a> {
+    type Output = i32;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<i32> {
+        // 不会移出self
+        let io: &mut ahci_io = unsafe { self.get_unchecked_mut() };
+
+        if io.state == AHCI_IO_NEW {
+            io.wake.set(cx.waker());
+            io.req.ctx = io as *mut ahci_io as *mut c_void;
+            io.state = AHCI_IO_SUBMITTED;
+
+            ahci_fg_begin(io.ahci_dev);
+            ahci_submit_req(io.ahci_dev, &mut io.req);
+        }
+
+        if io.state == AHCI_IO_SUBMITTED {
+            if !io.wake.register(cx.waker()) {
+                return Poll::Pending;
+            }
+
+            ahci_sync_dcache();
+
+            io.state = AHCI_IO_DONE;
+            io.status = io.req.status;
+            if io.status != 0 {
+                unsafe {
+                    ahci_printf(
+                        b"async command 0x%x failed\n\0" as *const u8,
+                        io.req.cfis.command as u32,
+                    )
+                };
+            }
+        }
+
+        return Poll::Ready(io.status);
+    }
+}
+
+// 提前丢弃时等待在途的命令完成，硬件不能再访问req和缓冲区
+impl<'a> Drop for ahci_io<'a> {
+    fn drop(&mut self) {
+        if self.state != AHCI_IO_SUBMITTED {
+            return;
+        }
+
+        ahci_wait_req(self.ahci_dev, &mut self.req);
+        while !self.wake.fired() {}
+    }
+}
+
+// 任务的waker只置位该任务的ready标志
+static AHCI_WAKER_VTABLE: RawWakerVTable =
+    RawWakerVTable::new(ahci_waker_clone, ahci_waker_wake, ahci_waker_wake, ahci_waker_drop);
+
+unsafe fn ahci_waker_clone(data: *const ()) -> RawWaker {
+    return RawWaker::new(data, &AHCI_WAKER_VTABLE);
+}
+
+unsafe fn ahci_waker_wake(data: *const ()) {
+    unsafe { (*(data as *const AtomicU32)).store(1, Ordering::Release) };
+}
+
+unsafe fn ahci_waker_drop(_data: *const ()) {}
+
+struct ahci_task<'a> {
+    fut: Option<Pin<&'a mut dyn Future<Output = i32>>>,
+    ready: AtomicU32, // 被唤醒，下次轮询时poll
+    status: i32,      // 任务结束时的结果
+}
+
+// 最多AHCI_EXEC_MAX_TASKS个任务的单线程执行器
+// 任务由调用者固定在内存中，执行器不分配内存；waker指向执行器内部，
+// 有任务之后执行器不能再移动
+pub struct ahci_executor<'a> {
+    ahci_dev: &'a ahci_device,
+    tasks: [ahci_task<'a>; AHCI_EXEC_MAX_TASKS as usize],
+}
+
+impl<'a> ahci_executor<'a> {
+    pub fn new(ahci_dev: &'a ahci_device) -> Self {
+        return ahci_executor {
+            ahci_dev: ahci_dev,
+            tasks: [const {
+                ahci_task {
+                    fut: None,
+                    ready: AtomicU32::new(0),
+                    status: 0,
+                }
+            }; AHCI_EXEC_MAX_TASKS as usize],
+        };
+    }
+
+    // 加入任务，返回任务号，没有空位时返回-1
+    pub fn spawn(&mut self, fut: Pin<&'a mut dyn Future<Output = i32>>) -> i32 {
+        for (id, task) in self.tasks.iter_mut().enumerate() {
+            if task.fut.is_none() {
+                task.fut = Some(fut);
+                task.status = 0;
+                task.ready.store(1, Ordering::Relaxed);
+                return id as i32;
+            }
+        }
+
+        return -1;
+    }
+
+    // 已结束任务的结果，任务仍在运行时返回None
+    pub fn status(&self, id: i32) -> Option<i32> {
+        let task: &ahci_task = &self.tasks[id as usize];
+
+        if task.fut.is_some() {
+            return None;
+        }
+
+        return Some(task.status);
+    }
+
+    // 回收所有cpu队列中完成的命令，唤醒对应的任务，再poll被唤醒的任务
+    // 返回尚未结束的任务数
+    pub fn poll(&mut self) -> u32 {
+        let mut live: u32 = 0;
+
+        for cpu in 0..AHCI_MAX_CPUS {
+            ahci_cpu_dispatch(self.ahci_dev, cpu);
+            ahci_cpu_reap(self.ahci_dev, cpu);
+        }
+
+        for task in self.tasks.iter_mut() {
+            let Some(fut) = task.fut.as_mut() else {
+                continue;
+            };
+
+            if task.ready.swap(0, Ordering::Acquire) != 0 {
+                let raw: RawWaker =
+                    RawWaker::new(&task.ready as *const AtomicU32 as *const (), &AHCI_WAKER_VTABLE);
+                let waker: Waker = unsafe { Waker::from_raw(raw) };
+                let mut cx: Context = Context::from_waker(&waker);
+
+                if let Poll::Ready(status) = fut.as_mut().poll(&mut cx) {
+                    task.status = status;
+                    task.fut = None;
+                    continue;
+                }
+            }
+
+            live += 1;
+        }
+
+        return live;
+    }
+
+    // 运行到所有任务结束
+    pub fn run(&mut self) {
+        while self.poll() != 0 {}
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    extern crate std;
+
+    use super::*;
+
+    use std::sync::Arc;
+    use std::task::Wake;
+    use std::thread;
+    use std::time::{Duration, Instant};
+
+    // 记录被唤醒次数的waker
+    struct ahci_test_waker(AtomicU32);
+
+    impl Wake for ahci_test_waker {
+        fn wake(self: Arc<Self>) {
+            self.0.fetch_add(1, Ordering::Release);
+        }
+    }
+
+    // 测试中跨线程共享，回调和poll各自只用自己的一侧
+    struct ahci_test_wake(ahci_wake);
+
+    unsafe impl Sync for ahci_test_wake {}
+    unsafe impl Send for ahci_test_wake {}
+
+    // 回调在另一个线程上与注册交错执行，不能丢失唤醒，也不能互相等待
+    #[test]
+    fn wake_handoff_never_lost() {
+        for _ in 0..2000 {
+            let count: Arc<ahci_test_waker> = Arc::new(ahci_test_waker(AtomicU32::new(1)));
+            let waker: Waker = Waker::from(count.clone());
+            let mut wake: ahci_wake = ahci_wake::new();
+            wake.set(&waker);
+
+            let wake: Arc<ahci_test_wake> = Arc::new(ahci_test_wake(wake));
+            let remote: Arc<ahci_test_wake> = wake.clone();
+            let fire = thread::spawn(move || remote.0.fire());
+
+            // 只在被唤醒后poll，唤醒丢失时会一直等下去
+            let start: Instant = Instant::now();
+            loop {
+                if count.0.swap(0, Ordering::Acquire) != 0 && wake.0.register(&waker) {
+                    break;
+                }
+                assert!(start.elapsed() < Duration::from_secs(5), "wakeup lost");
+                thread::yield_now();
+            }
+            fire.join().unwrap();
+        }
+    }
+
+    // poll换了waker之后回调唤醒新的waker
+    #[test]
+    fn wake_uses_latest_waker() {
+        let first: Arc<ahci_test_waker> = Arc::new(ahci_test_waker(AtomicU32::new(0)));
+        let second: Arc<ahci_test_waker> = Arc::new(ahci_test_waker(AtomicU32::new(0)));
+        let mut wake: ahci_wake = ahci_wake::new();
+
+        wake.set(&Waker::from(first.clone()));
+        assert!(!wake.register(&Waker::from(second.clone())));
+        wake.fire();
+
+        assert_eq!(first.0.load(Ordering::Acquire), 0);
+        assert_eq!(second.0.load(Ordering::Acquire), 1);
+        assert!(wake.fired());
+        assert!(wake.register(&Waker::from(second.clone())));
+    }
+}
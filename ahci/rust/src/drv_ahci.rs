@@ -2,19 +2,11 @@
 
 use crate::libahci::*;
 use crate::libata::*;
+use crate::mmio::Mmio;
 use crate::platform::*;
 
 use core::ptr::{null_mut, read_volatile, write_volatile};
-
-fn ahci_readl(addr: u64) -> u32 {
-    let mut data: u32 = 0;
-    unsafe { data = read_volatile(addr as *mut u32) };
-    return data;
-}
-
-fn ahci_writel(data: u32, addr: u64) {
-    unsafe { write_volatile(addr as *mut u32, data) };
-}
+use core::sync::atomic::{AtomicU32, Ordering, fence};
 
 fn ahci_ffs32(val: u32) -> u32 {
     let mut bit: u32 = 1;
@@ -38,7 +30,7 @@ fn ahci_print_info(ahci_dev: &ahci_device) {
     let cap: u32 = ahci_dev.cap;
     let cap2: u32 = ahci_dev.cap2;
     let impl_0: u32 = ahci_dev.port_map;
-    let speed: u32 = (ahci_dev.cap >> 20) & 0xf;
+    let speed: u32 = HOST_CAP_ISS.get(cap);
 
     let scc_s: *const u8 = b"SATA\0" as *const u8;
     let mut speed_s: *const u8 = null_mut();
@@ -60,8 +52,8 @@ fn ahci_print_info(ahci_dev: &ahci_device) {
             vers >> 16 & 0xff,
             vers >> 8 & 0xff,
             vers & 0xff,
-            (cap >> 8 & 0x1f) + 1,
-            (cap & 0x1f) + 1,
+            HOST_CAP_NCS.get(cap) + 1,
+            HOST_CAP_NP.get(cap) + 1,
             speed_s,
             impl_0,
             scc_s,
@@ -198,80 +190,89 @@ fn ahci_sata_print_info(pdev: &ahci_blk_dev) {
         );
         ahci_printf(b"Firmware version: %s\n\0" as *const u8, &(pdev.revision));
         ahci_printf(b"Capacity: %lu sectors\n\0" as *const u8, pdev.lba);
+        ahci_printf(
+            b"Sector size: %lu logical, %lu physical, lowest aligned lba %u\n\0" as *const u8,
+            pdev.blksz,
+            pdev.phys_blksz,
+            pdev.lowest_aligned,
+        );
+        ahci_printf(b"NCQ depth: %u\n\0" as *const u8, pdev.queue_depth);
     }
 }
 
-fn ahci_port_base(base: u64, port: u8) -> u64 {
-    return base + 0x100 + (port as u64 * 0x80);
+fn ahci_port_base(host_mmio: Mmio<HostRegs>, port: u8) -> Mmio<PortRegs> {
+    return Mmio::new(host_mmio.base() + 0x100 + (port as u64 * 0x80));
 }
 
 // ahci初始化
 fn ahci_host_init(ahci_dev: &mut ahci_device) -> i32 {
     let mut tmp: u32 = 0;
     let mut timeout: u32 = 0;
-    let mut port_mmio: u64 = 0;
-    let host_mmio: u64 = ahci_dev.mmio_base;
+    let host_mmio: Mmio<HostRegs> = Mmio::new(ahci_dev.mmio_base);
 
     // reset ahci controller
-    tmp = ahci_readl(host_mmio + HOST_CTL);
+    tmp = host_mmio.read(HOST_CTL);
     if tmp & HOST_RESET == 0 {
-        ahci_writel(tmp | HOST_RESET, host_mmio + HOST_CTL);
+        host_mmio.write(HOST_CTL, tmp | HOST_RESET);
     }
     // wait for reset done
     loop {
-        unsafe { ahci_mdelay(1) };
-        tmp = ahci_readl(host_mmio + HOST_CTL);
+        ahci_mdelay(1);
+        tmp = host_mmio.read(HOST_CTL);
         if tmp & HOST_RESET == 0 {
             break;
         }
     }
 
     // enable ahci
-    tmp = ahci_readl(host_mmio + HOST_CTL);
-    ahci_writel(tmp | HOST_AHCI_EN, host_mmio + HOST_CTL);
-    unsafe { ahci_mdelay(1) };
+    host_mmio.set_bits(HOST_CTL, HOST_AHCI_EN);
+    ahci_mdelay(1);
 
     // init cap and pi
     // beware if no firmware initialized before
     // these bits are ready-only after write-once
     tmp = HOST_CAP_MPS | HOST_CAP_SSS;
-    ahci_writel(tmp, host_mmio + HOST_CAP);
-    ahci_writel(0xf, host_mmio + HOST_PORTS_IMPL);
-    ahci_readl(host_mmio + HOST_PORTS_IMPL); // flush
+    host_mmio.write(HOST_CAP, tmp);
+    host_mmio.write(HOST_PORTS_IMPL, 0xf);
+    host_mmio.read(HOST_PORTS_IMPL); // flush
 
     // get ahci info
-    ahci_dev.cap = ahci_readl(host_mmio + HOST_CAP);
-    ahci_dev.cap2 = ahci_readl(host_mmio + HOST_CAP2);
-    ahci_dev.version = ahci_readl(host_mmio + HOST_VERSION);
-    ahci_dev.port_map = ahci_readl(host_mmio + HOST_PORTS_IMPL);
-    ahci_dev.n_ports = ((ahci_dev.cap & 0x1f) + 1) as u8;
+    ahci_dev.cap = host_mmio.read(HOST_CAP);
+    ahci_dev.cap2 = host_mmio.read(HOST_CAP2);
+    ahci_dev.version = host_mmio.read(HOST_VERSION);
+    ahci_dev.port_map = host_mmio.read(HOST_PORTS_IMPL);
+    ahci_dev.n_ports = (HOST_CAP_NP.get(ahci_dev.cap) + 1) as u8;
+    // 命令槽表可以在编译时配置得比hba支持的少
+    ahci_dev.slot_mask = 0xffffffff >> (31 - HOST_CAP_NCS.get(ahci_dev.cap));
+    ahci_dev.slot_mask &= AhciSlotTable::<()>::ALL;
+    // 识别设备之前不使用ncq，也不保留命令槽
+    ahci_dev.ncq_mask = 0;
+    ahci_dev.prio_reserved = 0;
 
     // init each port
     // for ls2kla, only 1 port available
     for i in 0..ahci_dev.n_ports {
-        ahci_dev.port[i as usize].port_mmio = ahci_port_base(host_mmio, i);
-        port_mmio = ahci_dev.port[i as usize].port_mmio;
+        let port_mmio: Mmio<PortRegs> = ahci_port_base(host_mmio, i);
+        ahci_dev.port[i as usize].port_mmio = port_mmio;
 
         // ensure sata is in idle state
-        tmp = ahci_readl(port_mmio + PORT_CMD);
+        tmp = port_mmio.read(PORT_CMD);
         if tmp & (PORT_CMD_LIST_ON | PORT_CMD_FIS_ON | PORT_CMD_FIS_RX | PORT_CMD_START) != 0 {
-            tmp &= !(PORT_CMD_START);
-            ahci_writel(tmp, port_mmio + PORT_CMD);
-            unsafe { ahci_mdelay(500) };
-            while ahci_readl(port_mmio + PORT_CMD) & PORT_CMD_LIST_ON != 0 {}
+            port_mmio.write(PORT_CMD, tmp & !PORT_CMD_START);
+            ahci_mdelay(500);
+            while port_mmio.read(PORT_CMD) & PORT_CMD_LIST_ON != 0 {}
         }
 
         // set spin up
-        tmp = ahci_readl(port_mmio + PORT_CMD);
-        ahci_writel(tmp | PORT_CMD_SPIN_UP, port_mmio + PORT_CMD);
+        port_mmio.set_bits(PORT_CMD, PORT_CMD_SPIN_UP);
 
         // wait for spin up
         timeout = 1000;
         loop {
-            unsafe { ahci_mdelay(1) };
-            tmp = ahci_readl(port_mmio + PORT_CMD);
+            ahci_mdelay(1);
+            tmp = port_mmio.read(PORT_CMD);
             timeout -= 1;
-            if !(tmp | PORT_CMD_SPIN_UP == 0 && timeout != 0) {
+            if tmp & PORT_CMD_SPIN_UP != 0 || timeout == 0 {
                 break;
             }
         }
@@ -283,11 +284,10 @@ fn ahci_host_init(ahci_dev: &mut ahci_device) -> i32 {
         // wait for port link up
         timeout = 1000;
         loop {
-            unsafe { ahci_mdelay(1) };
-            tmp = ahci_readl(port_mmio + PORT_SCR_STAT);
-            tmp &= 0xf;
+            ahci_mdelay(1);
+            tmp = port_mmio.read_field(PORT_SCR_STAT, PORT_SCR_DET);
             timeout -= 1;
-            if (tmp == 0x3 || tmp == 0x1) || timeout == 0 {
+            if (tmp == PORT_SCR_DET_PRESENT || tmp == 0x1) || timeout == 0 {
                 break;
             }
         }
@@ -298,38 +298,34 @@ fn ahci_host_init(ahci_dev: &mut ahci_device) -> i32 {
         }
 
         // clear serr
-        tmp = ahci_readl(port_mmio + PORT_SCR_ERR);
-        ahci_writel(tmp, port_mmio + PORT_SCR_ERR);
+        port_mmio.ack(PORT_SCR_ERR);
 
         // ack any pending irq events for this port
-        tmp = ahci_readl(host_mmio + PORT_IRQ_STAT);
-        ahci_writel(tmp, host_mmio + PORT_IRQ_STAT);
+        port_mmio.ack(PORT_IRQ_STAT);
 
-        ahci_writel(0x1 << i, host_mmio + HOST_IRQ_STAT);
+        host_mmio.write(HOST_IRQ_STAT, 0x1 << i);
 
         // set irq mask
-        ahci_writel(DEF_PORT_IRQ, port_mmio + PORT_IRQ_MASK);
+        port_mmio.write(PORT_IRQ_MASK, DEF_PORT_IRQ);
 
         // detect port status
-        tmp = ahci_readl(port_mmio + PORT_SCR_STAT);
-        if (tmp & 0xf) == 0x3 {
+        if port_mmio.read_field(PORT_SCR_STAT, PORT_SCR_DET) == PORT_SCR_DET_PRESENT {
             ahci_dev.port_map_linkup |= 0x1 << i;
         }
     }
 
     // interrupt enable
     // we dont use interrupt actually
-    tmp = ahci_readl(host_mmio + HOST_CTL);
-    ahci_writel(tmp | HOST_IRQ_EN, host_mmio + HOST_CTL);
-    tmp = ahci_readl(host_mmio + HOST_CTL);
+    host_mmio.set_bits(HOST_CTL, HOST_IRQ_EN);
+    host_mmio.read(HOST_CTL); // flush
 
     return 0;
 }
 
 // ahci填充sgdma
-fn ahci_fill_sg(ahci_dev: &ahci_device, port: u8, buf: *mut u8, mut buf_len: u32) -> u32 {
-    let pp: &ahci_ioport = &ahci_dev.port[port as usize];
-    let mut ahci_sg: *mut ahci_sg = pp.cmd_tbl_sg;
+fn ahci_fill_sg(pp: &ahci_ioport, cmd_slot: u32, buf: *mut u8, mut buf_len: u32) -> u32 {
+    let mut ahci_sg: *mut ahci_sg =
+        (pp.cmd_tbl + (cmd_slot * AHCI_CMD_TBL_SZ + AHCI_CMD_TBL_HDR_SZ) as u64) as *mut ahci_sg;
 
     let max_bytes: u32 = AHCI_MAX_BYTES_PER_SG;
     let sg_count: u32 = ((buf_len - 1) / max_bytes) + 1;
@@ -357,189 +353,354 @@ fn ahci_fill_sg(ahci_dev: &ahci_device, port: u8, buf: *mut u8, mut buf_len: u32
     return sg_count;
 }
 
+// 每个命令槽使用自己的命令表
 fn ahci_fill_cmd_slot(pp: &ahci_ioport, cmd_slot: u32, opts: u32) {
-    let mut cmd_hdr: *mut ahci_cmd_hdr =
-        unsafe { (pp.cmd_slot).offset((AHCI_CMD_SZ * cmd_slot) as isize) };
+    let cmd_hdr: *mut ahci_cmd_hdr = unsafe { pp.cmd_slot.add(cmd_slot as usize) };
+    let tbl_dma: u64 = pp.cmd_tbl_dma + (cmd_slot * AHCI_CMD_TBL_SZ) as u64;
 
     unsafe {
         (*cmd_hdr).opts = opts;
         (*cmd_hdr).status = 0;
-        (*cmd_hdr).tbl_addr_lo = (pp.cmd_tbl_dma & 0xffffffff) as u32;
-        (*cmd_hdr).tbl_addr_hi = (pp.cmd_tbl_dma >> 32) as u32;
+        (*cmd_hdr).tbl_addr_lo = (tbl_dma & 0xffffffff) as u32;
+        (*cmd_hdr).tbl_addr_hi = (tbl_dma >> 32) as u32;
     }
 }
 
-fn ahci_get_cmd_slot(value: u32) -> u32 {
-    let slot: u32 = if value != 0 { ahci_ffs32(value) } else { 0 };
-    return slot;
-}
-
-// ahci命令执行
-fn ahci_exec_ata_cmd(
-    ahci_dev: &ahci_device,
-    port: u8,
-    cfis: *const sata_fis_h2d,
-    buf: *mut u8,
-    buf_len: u32,
-    is_write: u32,
-) -> u32 {
-    let pp: &ahci_ioport = &ahci_dev.port[port as usize];
-    let port_mmio: u64 = pp.port_mmio;
+// 按req填写cmd_slot的命令表和命令头
+fn ahci_fill_req(pp: &ahci_ioport, req: *const ahci_request, cmd_slot: u32) {
+    let cmd_tbl: u64 = pp.cmd_tbl + (cmd_slot * AHCI_CMD_TBL_SZ) as u64;
     let mut sg_count: u32 = 0;
 
-    let cmd_slot: u32 = ahci_get_cmd_slot(ahci_readl(port_mmio + PORT_CMD_ISSUE));
-    if cmd_slot == 32 {
-        unsafe { ahci_printf(b"cannot find empty command slot\n\0" as *const u8) };
-        return 0;
-    }
-
-    if buf_len > AHCI_MAX_BYTES_PER_TRANS {
-        unsafe {
-            ahci_printf(
-                b"max transfer length is %u bytes\n\0" as *const u8,
-                AHCI_MAX_BYTES_PER_TRANS,
-            )
-        };
-        return 0;
-    }
-
     unsafe {
-        (pp.cmd_tbl as *mut sata_fis_h2d).write_volatile(*cfis);
-    }
+        (cmd_tbl as *mut sata_fis_h2d).write_volatile((*req).cfis);
+
+        // ncq的tag即命令槽号
+        if (*req).ncq != 0 {
+            (*(cmd_tbl as *mut sata_fis_h2d)).sector_count = (cmd_slot << 3) as u8;
+        }
 
-    if !buf.is_null() && buf_len != 0 {
-        sg_count = ahci_fill_sg(ahci_dev, port, buf, buf_len);
+        if !(*req).buf.is_null() && (*req).buf_len != 0 {
+            sg_count = ahci_fill_sg(pp, cmd_slot, (*req).buf, (*req).buf_len);
+        }
     }
 
     let opts: u32 = (size_of::<sata_fis_h2d>() as u64 >> 2
         | (sg_count << 16) as u64
-        | (is_write << 6) as u64) as u32;
+        | (unsafe { (*req).is_write } << 6) as u64) as u32;
 
     ahci_fill_cmd_slot(pp, cmd_slot, opts);
+}
 
-    unsafe { ahci_sync_dcache() };
+// 从端口位图中原子地分配空闲命令槽
+// ncq和非ncq命令不会同时在途，普通优先级请求留出prio_reserved个空闲槽
+// 没有合适的命令槽时返回-1
+fn ahci_alloc_cmd_slot(ahci_dev: &ahci_device, pp: &ahci_ioport, ncq: u32, prio: u32) -> i32 {
+    let mut busy: u64 = pp.slot_busy.load(Ordering::Relaxed);
+    let mask: u32 = if ncq != 0 { ahci_dev.ncq_mask } else { ahci_dev.slot_mask };
 
-    ahci_writel((1 << cmd_slot) as u32, port_mmio + PORT_CMD_ISSUE);
+    loop {
+        let used: u32 = busy as u32;
+        let queued: u32 = (busy >> 32) as u32;
 
-    while ahci_readl(port_mmio + PORT_CMD_ISSUE) & (1 << cmd_slot) as u32 != 0 {}
+        if ncq != 0 {
+            // 先让等待中的非ncq命令发出
+            if (used & !queued) != 0 || pp.ncq_drain.load(Ordering::Relaxed) != 0 {
+                return -1;
+            }
+        } else if queued != 0 {
+            pp.ncq_drain.store(1, Ordering::Relaxed);
+            return -1;
+        }
 
-    unsafe { ahci_sync_dcache() };
+        let free: u32 = !used & mask;
+        if free == 0 {
+            return -1;
+        }
+        if prio != AHCI_PRIO_HIGH && free.count_ones() <= ahci_dev.prio_reserved {
+            return -1;
+        }
+        let slot: u32 = ahci_ffs32(free) - 1;
+
+        match pp.slot_busy.compare_exchange_weak(
+            busy,
+            busy | (1u64 << slot) | ((ncq as u64) << (slot + 32)),
+            Ordering::Acquire,
+            Ordering::Relaxed,
+        ) {
+            Ok(_) => {
+                if ncq == 0 {
+                    pp.ncq_drain.store(0, Ordering::Relaxed);
+                }
+                return slot as i32;
+            }
+            Err(cur) => busy = cur,
+        }
+    }
+}
 
-    return buf_len;
+fn ahci_free_cmd_slot(pp: &ahci_ioport, cmd_slot: u32) {
+    pp.slot_busy
+        .fetch_and(!((1u64 << cmd_slot) | (1u64 << (cmd_slot + 32))), Ordering::Release);
 }
 
-fn ahci_set_feature(ahci_dev: &ahci_device, subcmd: u8, action: u8) {
-    let port: u8 = ahci_dev.port_idx;
-    let cfis: sata_fis_h2d = sata_fis_h2d {
-        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
-        pm_port_c: 0x80,
-        command: ATA_CMD_SET_FEATURES,
-        features: subcmd,
-        lba_low: 0,
-        lba_mid: 0,
-        lba_high: 0,
-        device: 0,
-        lba_low_exp: 0,
-        lba_mid_exp: 0,
-        lba_high_exp: 0,
-        features_exp: 0,
-        sector_count: action,
-        sector_count_exp: 0,
-        res1: 0,
-        control: 0,
-        res2: [0; 4],
-    };
+// 请求在cpu队列中所属的环，序号大的先发出
+fn ahci_req_ring_idx(req: *const ahci_request) -> u32 {
+    return unsafe { ((*req).prio << 1) | (*req).ncq };
+}
+
+fn ahci_queue_init(q: &ahci_cpu_queue) {
+    for r in q.rq.iter() {
+        r.head.store(0, Ordering::Relaxed);
+        r.tail.store(0, Ordering::Relaxed);
+
+        for (i, seq) in r.seq.iter().enumerate() {
+            seq.store(i as u32, Ordering::Relaxed);
+        }
+        for req in r.ring.iter() {
+            req.store(null_mut(), Ordering::Relaxed);
+        }
+    }
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, null_mut(), 0, READ_CMD);
+    q.issued.store(0, Ordering::Relaxed);
+    q.polls.store(0, Ordering::Relaxed);
+    q.fis_seen.store(0, Ordering::Relaxed);
+    q.reaps.store(0, Ordering::Relaxed);
+    q.check_us.store(0, Ordering::Relaxed);
+
+    for req in q.slot_req.iter() {
+        req.store(null_mut(), Ordering::Relaxed);
+    }
 }
 
-// 初始化ahci端口
-fn ahci_port_start(ahci_dev: &mut ahci_device, port: u8) -> i32 {
-    let pp: &mut ahci_ioport = &mut ahci_dev.port[port as usize];
-    let port_mmio: u64 = pp.port_mmio;
+// 有界无锁队列，每个单元带序号
+// 同一cpu上互相抢占的线程可以并发入队和出队，req所属的环满时返回-1
+fn ahci_queue_push(q: &ahci_cpu_queue, req: *mut ahci_request) -> i32 {
+    let r: &ahci_req_ring = &q.rq[ahci_req_ring_idx(req) as usize];
+    let mut pos: u32 = r.tail.load(Ordering::Relaxed);
 
-    let port_status: u32 = ahci_readl(port_mmio + PORT_SCR_STAT);
-    if (port_status & 0xf) != 0x3 {
-        unsafe { ahci_printf(b"no link on port %u\n\0" as *const u8, port as u32) };
-        return -1;
+    loop {
+        let seq: u32 = r.seq[pos].load(Ordering::Acquire);
+        let diff: i32 = seq.wrapping_sub(pos) as i32;
+
+        if diff == 0 {
+            match r.tail.compare_exchange_weak(
+                pos,
+                pos.wrapping_add(1),
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(cur) => pos = cur,
+            }
+        } else if diff < 0 {
+            return -1;
+        } else {
+            pos = r.tail.load(Ordering::Relaxed);
+        }
     }
 
-    let mut mem: u64;
+    r.ring[pos].store(req, Ordering::Relaxed);
+    r.seq[pos].store(pos.wrapping_add(1), Ordering::Release);
+
+    return 0;
+}
+
+// 环ring为空时返回空指针
+fn ahci_queue_pop(q: &ahci_cpu_queue, ring: u32) -> *mut ahci_request {
+    let r: &ahci_req_ring = &q.rq[ring as usize];
+    let mut pos: u32 = r.head.load(Ordering::Relaxed);
+
+    loop {
+        let seq: u32 = r.seq[pos].load(Ordering::Acquire);
+        let diff: i32 = seq.wrapping_sub(pos.wrapping_add(1)) as i32;
+
+        if diff == 0 {
+            match r.head.compare_exchange_weak(
+                pos,
+                pos.wrapping_add(1),
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => break,
+                Err(cur) => pos = cur,
+            }
+        } else if diff < 0 {
+            return null_mut();
+        } else {
+            pos = r.head.load(Ordering::Relaxed);
+        }
+    }
+
+    let req: *mut ahci_request = r.ring[pos].load(Ordering::Relaxed);
+    r.seq[pos].store(pos.wrapping_add(r.ring.depth()), Ordering::Release);
+
+    return req;
+}
+
+// 清除命令完成时hba写入的FIS类型字节
+fn ahci_arm_rx_fis(pp: &ahci_ioport) {
     unsafe {
-        mem = ahci_malloc_align(AHCI_PORT_PRIV_DMA_SZ as u64, 1024);
-        (mem as *mut u8).write_bytes(0, AHCI_PORT_PRIV_DMA_SZ as usize);
+        write_volatile((pp.rx_fis + AHCI_RX_FIS_D2H) as *mut u8, 0);
+        write_volatile((pp.rx_fis + AHCI_RX_FIS_PIO_SETUP) as *mut u8, 0);
+        write_volatile((pp.rx_fis + AHCI_RX_FIS_SDB) as *mut u8, 0);
     }
+}
 
-    pp.cmd_slot = mem as *mut ahci_cmd_hdr;
-    pp.cmd_slot_dma = unsafe { ahci_virt_to_phys(mem) };
+// 上次清除后hba是否写入了d2h寄存器FIS、pio setup FIS或set device bits FIS
+// ncq命令以set device bits FIS完成
+// ls2k的dma是缓存一致的，hba写入的FIS在这里可见
+fn ahci_rx_fis_posted(pp: &ahci_ioport) -> bool {
+    let d2h: *const sata_fis_d2h = (pp.rx_fis + AHCI_RX_FIS_D2H) as *const sata_fis_d2h;
+    let pio: *const sata_fis_pio_setup =
+        (pp.rx_fis + AHCI_RX_FIS_PIO_SETUP) as *const sata_fis_pio_setup;
+    let sdb: *const sata_fis_sdb = (pp.rx_fis + AHCI_RX_FIS_SDB) as *const sata_fis_sdb;
 
-    mem += AHCI_CMD_SLOT_SZ as u64;
+    unsafe {
+        return read_volatile(&(*d2h).fis_type) == SATA_FIS_TYPE_REGISTER_D2H
+            || read_volatile(&(*pio).fis_type) == SATA_FIS_TYPE_PIO_SETUP_D2H
+            || read_volatile(&(*sdb).fis_type) == SATA_FIS_TYPE_SET_DEVICE_BITS_D2H;
+    }
+}
 
-    pp.rx_fis = mem;
-    pp.rx_fis_dma = unsafe { ahci_virt_to_phys(mem) };
+// 设置检测命令完成的方式
+// AHCI_COMPLETION_FIS依赖ahci_port_start中开启的FIS接收
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_set_completion_mode(ahci_dev: &mut ahci_device, mode: u32) {
+    ahci_dev.completion_mode = mode;
+}
 
-    mem += AHCI_RX_FIS_SZ as u64;
+// 设置命令超时
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_set_cmd_timeout(ahci_dev: &mut ahci_device, ms: u32) {
+    ahci_dev.cmd_timeout_ms = ms;
+}
 
-    pp.cmd_tbl = mem;
-    pp.cmd_tbl_dma = unsafe { ahci_virt_to_phys(mem) };
+// 端口恢复期间不发出和回收命令
+fn ahci_port_enter(pp: &ahci_ioport) -> bool {
+    pp.users.fetch_add(1, Ordering::SeqCst);
+    if pp.recovering.load(Ordering::SeqCst) == 0 {
+        return true;
+    }
 
-    mem += AHCI_CMD_TBL_HDR_SZ as u64;
+    pp.users.fetch_sub(1, Ordering::Release);
+    return false;
+}
 
-    pp.cmd_tbl_sg = mem as *mut ahci_sg;
+fn ahci_port_leave(pp: &ahci_ioport) {
+    pp.users.fetch_sub(1, Ordering::Release);
+}
 
-    ahci_writel(
-        (pp.cmd_slot_dma & 0xffffffff) as u32,
-        port_mmio + PORT_LST_ADDR,
-    );
-    ahci_writel((pp.cmd_slot_dma >> 32) as u32, port_mmio + PORT_LST_ADDR_HI);
-    ahci_writel(
-        (pp.rx_fis_dma & 0xffffffff) as u32,
-        port_mmio + PORT_FIS_ADDR,
-    );
-    ahci_writel((pp.rx_fis_dma >> 32) as u32, port_mmio + PORT_FIS_ADDR_HI);
+// 清除ST并等待命令列表引擎停止，之后hba会清零PORT_CMD_ISSUE
+fn ahci_port_stop(port_mmio: Mmio<PortRegs>) -> i32 {
+    let mut timeout: u32 = AHCI_PORT_STOP_TIMEOUT_MS;
 
-    ahci_writel(
-        PORT_CMD_ICC_ACTIVE
-            | PORT_CMD_FIS_RX
-            | PORT_CMD_POWER_ON
-            | PORT_CMD_SPIN_UP
-            | PORT_CMD_START,
-        port_mmio + PORT_CMD,
-    );
+    port_mmio.clear_bits(PORT_CMD, PORT_CMD_START);
 
-    let mut timeout: u32 = 200;
+    while port_mmio.read(PORT_CMD) & PORT_CMD_LIST_ON != 0 {
+        timeout -= 1;
+        if timeout == 0 {
+            return -1;
+        }
+        ahci_mdelay(1);
+    }
+
+    return 0;
+}
+
+// command list override，清除卡住设备的BSY和DRQ
+fn ahci_port_clo(ahci_dev: &ahci_device, port_mmio: Mmio<PortRegs>) -> i32 {
+    let mut timeout: u32 = AHCI_PORT_STOP_TIMEOUT_MS;
+
+    if ahci_dev.cap & HOST_CAP_CLO == 0 {
+        return -1;
+    }
+
+    port_mmio.set_bits(PORT_CMD, PORT_CMD_CLO);
+
+    while port_mmio.read(PORT_CMD) & PORT_CMD_CLO != 0 {
+        timeout -= 1;
+        if timeout == 0 {
+            return -1;
+        }
+        ahci_mdelay(1);
+    }
+
+    if port_mmio.read(PORT_TFDATA) & (ATA_BUSY | ATA_DRQ) as u32 != 0 {
+        return -1;
+    }
+
+    return 0;
+}
+
+// 通过SControl的DET发出COMRESET，端口必须已停止
+// 参考linux/drivers/ata/libata-sata.c sata_link_hardreset
+fn ahci_port_comreset(port_mmio: Mmio<PortRegs>) -> i32 {
     let mut tmp: u32 = 0;
+    let mut timeout: u32;
+
+    port_mmio.write_field(PORT_SCR_CTL, PORT_SCR_DET, PORT_SCR_DET_COMRESET);
+    // DET = 1至少保持1ms
+    ahci_mdelay(1);
+    port_mmio.write_field(PORT_SCR_CTL, PORT_SCR_DET, 0);
+
+    // 等待链路建立
+    timeout = AHCI_LINK_TIMEOUT_MS;
     loop {
-        unsafe { ahci_mdelay(1) };
-        tmp = ahci_readl(port_mmio + PORT_TFDATA);
-        tmp &= (ATA_ERR | ATA_DRQ | ATA_BUSY) as u32;
+        ahci_mdelay(1);
+        tmp = port_mmio.read_field(PORT_SCR_STAT, PORT_SCR_DET);
+        timeout -= 1;
+        if tmp == PORT_SCR_DET_PRESENT || timeout == 0 {
+            break;
+        }
+    }
+    if tmp != PORT_SCR_DET_PRESENT {
+        return -1;
+    }
+
+    // 清除复位产生的serr
+    port_mmio.write(PORT_SCR_ERR, 0xffffffff);
+
+    // 等待设备就绪
+    timeout = AHCI_DEV_READY_TIMEOUT_MS;
+    loop {
+        ahci_mdelay(1);
+        tmp = port_mmio.read(PORT_TFDATA) & (ATA_BUSY | ATA_DRQ) as u32;
         timeout -= 1;
         if tmp == 0 || timeout == 0 {
             break;
         }
     }
 
-    if timeout <= 0 {
-        unsafe {
-            ahci_printf(
-                b"ahci port %u failed to start\n\0" as *const u8,
-                port as u32,
-            )
-        };
-        return -1;
+    return if tmp == 0 { 0 } else { -1 };
+}
+
+// 清除恢复过程留下的错误，重新启动命令列表引擎
+fn ahci_port_restart(ahci_dev: &ahci_device, pp: &ahci_ioport) {
+    let port_mmio: Mmio<PortRegs> = pp.port_mmio;
+
+    port_mmio.ack(PORT_SCR_ERR);
+    port_mmio.ack(PORT_IRQ_STAT);
+
+    if ahci_dev.completion_mode == AHCI_COMPLETION_FIS {
+        pp.fis_seq.fetch_add(1, Ordering::SeqCst);
+        ahci_arm_rx_fis(pp);
     }
-    return 0;
+
+    port_mmio.set_bits(PORT_CMD, PORT_CMD_START);
 }
 
-fn ahci_sata_identify(ahci_dev: &ahci_device, id: &mut [u16]) {
-    let port: u8 = ahci_dev.port_idx;
-    let buf_len: u32 = ATA_ID_WORDS * 2;
+// 在重新启动的端口的cmd_slot上读取ncq命令错误日志，恢复期间队列不工作，轮询完成
+// 返回出错的ncq tag，错误不是排队命令产生的时为-1；读取失败返回Err
+fn ahci_read_ncq_log(ahci_dev: &ahci_device, pp: &ahci_ioport, cmd_slot: u32) -> Result<i32, ()> {
+    let port_mmio: Mmio<PortRegs> = pp.port_mmio;
+    let log: *mut u8 = pp.log_buf as *mut u8;
+    let mut timeout: u32 = AHCI_DEV_READY_TIMEOUT_MS;
     let cfis: sata_fis_h2d = sata_fis_h2d {
         fis_type: SATA_FIS_TYPE_REGISTER_H2D,
         pm_port_c: 0x80,
-        command: ATA_CMD_ID_ATA,
+        command: ATA_CMD_READ_LOG_EXT,
         features: 0,
-        lba_low: 0,
+        lba_low: ATA_LOG_SATA_NCQ,
         lba_mid: 0,
         lba_high: 0,
         device: 0,
@@ -547,224 +708,1496 @@ fn ahci_sata_identify(ahci_dev: &ahci_device, id: &mut [u16]) {
         lba_mid_exp: 0,
         lba_high_exp: 0,
         features_exp: 0,
-        sector_count: 0,
+        sector_count: 1,
         sector_count_exp: 0,
         res1: 0,
         control: 0,
         res2: [0; 4],
     };
+    let req: ahci_request = ahci_new_req(cfis, log, AHCI_LOG_BUF_SZ, READ_CMD, AHCI_PRIO_NORMAL);
 
-    ahci_exec_ata_cmd(
-        ahci_dev,
-        port,
-        &cfis,
-        id.as_mut_ptr() as *mut u8,
-        buf_len,
-        READ_CMD,
-    );
-}
+    ahci_fill_req(pp, &req, cmd_slot);
+    ahci_sync_dcache();
+    port_mmio.write(PORT_CMD_ISSUE, 1 << cmd_slot);
 
-fn ahci_sata_rw_cmd(
-    ahci_dev: &ahci_device,
-    start: u32,
-    blkcnt: u32,
-    buffer: *mut u8,
-    is_write: u32,
-) -> u32 {
-    let port: u8 = ahci_dev.port_idx;
-    let block: u32 = start;
-    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
-    let cfis: sata_fis_h2d = sata_fis_h2d {
-        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
-        pm_port_c: 0x80,
-        command: if is_write != 0 {
-            ATA_CMD_WRITE
-        } else {
-            ATA_CMD_READ
-        },
-        features: 0,
-        lba_low: (block & 0xff) as u8,
-        lba_mid: (block >> 8 & 0xff) as u8,
-        lba_high: (block >> 16 & 0xff) as u8,
-        device: (block >> 24 & 0xf) as u8 | ATA_LBA,
-        lba_low_exp: 0,
-        lba_mid_exp: 0,
-        lba_high_exp: 0,
-        features_exp: 0,
-        sector_count: (blkcnt & 0xff) as u8,
-        sector_count_exp: 0,
-        res1: 0,
-        control: 0,
-        res2: [0; 4],
-    };
+    while port_mmio.read(PORT_CMD_ISSUE) & (1 << cmd_slot) != 0
+        && port_mmio.read(PORT_IRQ_STAT) & PORT_IRQ_TF_ERR == 0
+    {
+        timeout -= 1;
+        if timeout == 0 {
+            break;
+        }
+        ahci_mdelay(1);
+    }
 
-    if ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer, buf_len, is_write) > 0 {
-        return blkcnt;
-    } else {
-        return 0;
-    };
+    ahci_sync_dcache();
+
+    if timeout == 0 || port_mmio.read(PORT_IRQ_STAT) & PORT_IRQ_TF_ERR != 0 {
+        unsafe { ahci_printf(b"ahci port %u READ LOG EXT failed\n\0" as *const u8, ahci_dev.port_idx as u32) };
+        return Err(());
+    }
+
+    let nq_tag: u8 = unsafe { log.read_volatile() };
+    return Ok(if nq_tag & ATA_LOG_NCQ_NQ != 0 { -1 } else { (nq_tag & ATA_LOG_NCQ_TAG) as i32 });
 }
 
-fn ahci_sata_flush_cache(ahci_dev: &ahci_device) {
-    let port: u8 = ahci_dev.port_idx;
-    let cfis: sata_fis_h2d = sata_fis_h2d {
-        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
-        pm_port_c: 0x80,
-        command: ATA_CMD_FLUSH,
-        features: 0,
-        lba_low: 0,
-        lba_mid: 0,
-        lba_high: 0,
-        device: 0,
-        lba_low_exp: 0,
-        lba_mid_exp: 0,
-        lba_high_exp: 0,
-        features_exp: 0,
-        sector_count: 0,
-        sector_count_exp: 0,
-        res1: 0,
-        control: 0,
-        res2: [0; 4],
-    };
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, null_mut(), 0, READ_CMD);
+// 以status完成请求
+// 置位done之后没有complete的请求可能立即被释放
+fn ahci_complete_req(req: *mut ahci_request) {
+    unsafe {
+        let complete = (*req).complete;
+        (*req).done.store(1, Ordering::Release);
+        if let Some(complete) = complete {
+            complete(req);
+        }
+    }
 }
 
-fn ata_low_level_rw_lba28(
-    ahci_dev: &ahci_device,
+// 恢复没能让端口重新工作，hba的命令槽保持置位，永远不会完成：
+// 在这里让所有已发出的请求失败，之后由分发让排队的请求失败
+fn ahci_port_fail(ahci_dev: &ahci_device, pp: &ahci_ioport) {
+    unsafe { ahci_printf(b"ahci port %u is dead\n\0" as *const u8, ahci_dev.port_idx as u32) };
+    pp.dead.store(1, Ordering::SeqCst);
+
+    for cpu in 0..AHCI_MAX_CPUS as usize {
+        let q: &ahci_cpu_queue = &ahci_dev.cpu_q[cpu];
+        let mut issued: u32 = q.issued.swap(0, Ordering::AcqRel);
+
+        while issued != 0 {
+            let cmd_slot: u32 = ahci_ffs32(issued) - 1;
+            issued &= !(1 << cmd_slot);
+
+            let req: *mut ahci_request = q.slot_req[cmd_slot].load(Ordering::Relaxed);
+            ahci_free_cmd_slot(pp, cmd_slot);
+            unsafe { (*req).status = -1 };
+            ahci_complete_req(req);
+        }
+    }
+}
+
+// task file错误或超时后分级恢复当前端口
+// 停止端口，尝试clo，失败则COMRESET，最后重发未完成的命令
+// 正在执行的命令计一次重试
+// ncq出错时设备中止所有排队的命令，并拒绝之后的所有命令，直到读取ncq命令错误日志，
+// 日志同时给出出错的tag；没有日志时（超时，或日志中没有tag）所有ncq命令都计一次重试
+// COMRESET也失败时端口标记为dead
+fn ahci_port_recover(ahci_dev: &ahci_device) {
+    let pp: &ahci_ioport = &ahci_dev.port[ahci_dev.port_idx as usize];
+    let port_mmio: Mmio<PortRegs> = pp.port_mmio;
+    let mut reissue: u32 = 0;
+    let mut reissue_ncq: u32 = 0;
+    let mut ncq_tag: i32 = -1;
+
+    // 其他cpu正在恢复该端口
+    if pp.recovering.swap(1, Ordering::SeqCst) != 0 {
+        return;
+    }
+
+    while pp.users.load(Ordering::SeqCst) != 0 {}
+
+    let ci: u32 = port_mmio.read(PORT_CMD_ISSUE);
+    let sact: u32 = port_mmio.read(PORT_SCR_ACT);
+    let tfd: u32 = port_mmio.read(PORT_TFDATA);
+    let ccs: u32 = port_mmio.read_field(PORT_CMD, PORT_CMD_CCS);
+    let irq_stat: u32 = port_mmio.read(PORT_IRQ_STAT);
+
+    unsafe {
+        ahci_printf(
+            b"ahci port %u recovery, ci 0x%x, sact 0x%x, tfdata 0x%x, irq 0x%x, serr 0x%x\n\0"
+                as *const u8,
+            ahci_dev.port_idx as u32,
+            ci,
+            sact,
+            tfd,
+            irq_stat,
+            port_mmio.read(PORT_SCR_ERR),
+        )
+    };
+
+    // 第一级：停止端口，设备仍忙则clo
+    let mut ret: i32 = ahci_port_stop(port_mmio);
+    if ret == 0 && port_mmio.read(PORT_TFDATA) & (ATA_BUSY | ATA_DRQ) as u32 != 0 {
+        ret = ahci_port_clo(ahci_dev, port_mmio);
+    }
+
+    // ncq出错后在空闲的命令槽上读取日志，没有空闲的就借用一个仍在发出的槽，
+    // 下面重发时重新填写它的命令表；已完成还没回收的槽要保留字节数
+    let free: u32 = !(pp.slot_busy.load(Ordering::Relaxed) as u32) & ahci_dev.slot_mask;
+    let log_slot: u32 = ahci_ffs32(if free != 0 {
+        free
+    } else if ci | sact != 0 {
+        ci | sact
+    } else {
+        ahci_dev.slot_mask
+    }) - 1;
+    if ret == 0 && sact != 0 && irq_stat & PORT_IRQ_TF_ERR != 0 {
+        ahci_port_restart(ahci_dev, pp);
+        match ahci_read_ncq_log(ahci_dev, pp, log_slot) {
+            Ok(tag) => ncq_tag = tag,
+            Err(()) => {
+                ahci_port_stop(port_mmio);
+                ret = -1;
+            }
+        }
+    }
+
+    // 第二级：COMRESET
+    if ret != 0 {
+        unsafe { ahci_printf(b"ahci port %u COMRESET\n\0" as *const u8, ahci_dev.port_idx as u32) };
+        if ahci_port_comreset(port_mmio) != 0 {
+            unsafe {
+                ahci_printf(
+                    b"ahci port %u COMRESET failed\n\0" as *const u8,
+                    ahci_dev.port_idx as u32,
+                )
+            };
+            ahci_port_fail(ahci_dev, pp);
+            pp.recovering.store(0, Ordering::SeqCst);
+            return;
+        }
+    }
+
+    ahci_port_restart(ahci_dev, pp);
+
+    // 第三级：重发命令，用完重试次数的请求不再重发，停止的hba已经清除了
+    // PORT_CMD_ISSUE和PORT_SCR_ACT，由其所属cpu回收，状态为-1
+    let now: u64 = ahci_get_time_us();
+    for cpu in 0..AHCI_MAX_CPUS as usize {
+        let q: &ahci_cpu_queue = &ahci_dev.cpu_q[cpu];
+        let mut issued: u32 = q.issued.load(Ordering::Acquire) & (ci | sact);
+
+        while issued != 0 {
+            let cmd_slot: u32 = ahci_ffs32(issued) - 1;
+            issued &= !(1 << cmd_slot);
+            let req: *mut ahci_request = q.slot_req[cmd_slot].load(Ordering::Relaxed);
+
+            unsafe {
+                let ncq_failed: bool = (*req).ncq != 0 && (ncq_tag < 0 || ncq_tag as u32 == cmd_slot);
+                if (ncq_failed || cmd_slot == ccs || now >= (*req).deadline) && {
+                    (*req).retries += 1;
+                    (*req).retries > AHCI_CMD_RETRIES
+                } {
+                    (*req).status = -1;
+                    continue;
+                }
+
+                if cmd_slot == log_slot {
+                    ahci_fill_req(pp, req, cmd_slot);
+                }
+                (*pp.cmd_slot.add(cmd_slot as usize)).status = 0;
+                (*req).deadline = now + ahci_dev.cmd_timeout_ms as u64 * 1000;
+                if (*req).ncq != 0 {
+                    reissue_ncq |= 1 << cmd_slot;
+                }
+            }
+            reissue |= 1 << cmd_slot;
+        }
+    }
+
+    ahci_sync_dcache();
+
+    if reissue != 0 {
+        if reissue_ncq != 0 {
+            port_mmio.write(PORT_SCR_ACT, reissue_ncq);
+        }
+        port_mmio.write(PORT_CMD_ISSUE, reissue);
+    }
+
+    pp.recovering.store(0, Ordering::SeqCst);
+}
+
+// 该cpu发出的命令中是否有超时的
+fn ahci_cpu_timed_out(q: &ahci_cpu_queue, mut issued: u32) -> bool {
+    let now: u64 = ahci_get_time_us();
+
+    while issued != 0 {
+        let cmd_slot: u32 = ahci_ffs32(issued) - 1;
+        issued &= !(1 << cmd_slot);
+
+        let req: *mut ahci_request = q.slot_req[cmd_slot].load(Ordering::Relaxed);
+        if now >= unsafe { (*req).deadline } {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// 是否该检查task file错误和超时的命令，每AHCI_HEALTH_CHECK_REAPS次回收读取一次时钟
+fn ahci_cpu_check_due(q: &ahci_cpu_queue) -> bool {
+    if q.reaps.fetch_add(1, Ordering::Relaxed) + 1 < AHCI_HEALTH_CHECK_REAPS {
+        return false;
+    }
+    q.reaps.store(0, Ordering::Relaxed);
+
+    let now: u64 = ahci_get_time_us();
+    if now < q.check_us.load(Ordering::Relaxed) {
+        return false;
+    }
+    q.check_us.store(now + AHCI_HEALTH_CHECK_MS as u64 * 1000, Ordering::Relaxed);
+
+    return true;
+}
+
+// 填写cmd_slot的命令表并发出命令
+fn ahci_issue_req(ahci_dev: &ahci_device, q: &ahci_cpu_queue, req: *mut ahci_request, cmd_slot: u32) {
+    let pp: &ahci_ioport = &ahci_dev.port[ahci_dev.port_idx as usize];
+
+    ahci_fill_req(pp, req, cmd_slot);
+    unsafe { (*req).deadline = ahci_get_time_us() + ahci_dev.cmd_timeout_ms as u64 * 1000 };
+    q.slot_req[cmd_slot].store(req, Ordering::Relaxed);
+
+    ahci_sync_dcache();
+
+    // ncq命令先写PORT_SCR_ACT
+    // hba忽略写0的位，多个核无需加锁即可发出命令
+    if unsafe { (*req).ncq } != 0 {
+        pp.port_mmio.write(PORT_SCR_ACT, (1 << cmd_slot) as u32);
+    }
+    pp.port_mmio.write(PORT_CMD_ISSUE, (1 << cmd_slot) as u32);
+
+    // 发出命令后再登记，否则回收时会看到PORT_CMD_ISSUE中该位为0而提前完成
+    q.issued.fetch_or(1 << cmd_slot, Ordering::Release);
+}
+
+// 把cpu队列中的请求放到空闲命令槽上
+pub fn ahci_cpu_dispatch(ahci_dev: &ahci_device, cpu: u32) {
+    let q: &ahci_cpu_queue = &ahci_dev.cpu_q[cpu as usize];
+    let pp: &ahci_ioport = &ahci_dev.port[ahci_dev.port_idx as usize];
+
+    if !ahci_port_enter(pp) {
+        return;
+    }
+
+    // 请求不再发给dead的端口，排队的请求直接失败
+    if pp.dead.load(Ordering::Acquire) != 0 {
+        for ring in 0..AHCI_CPU_QUEUE_RINGS {
+            loop {
+                let req: *mut ahci_request = ahci_queue_pop(q, ring);
+                if req.is_null() {
+                    break;
+                }
+                unsafe { (*req).status = -1 };
+                ahci_complete_req(req);
+            }
+        }
+
+        ahci_port_leave(pp);
+        return;
+    }
+
+    // 高优先级的环优先
+    for ring in (0..AHCI_CPU_QUEUE_RINGS).rev() {
+        loop {
+            // 先取得命令槽，出队的请求总能发出
+            let cmd_slot: i32 = ahci_alloc_cmd_slot(ahci_dev, pp, ring & 1, ring >> 1);
+            if cmd_slot < 0 {
+                break;
+            }
+
+            let req: *mut ahci_request = ahci_queue_pop(q, ring);
+            if req.is_null() {
+                ahci_free_cmd_slot(pp, cmd_slot as u32);
+                break;
+            }
+
+            ahci_issue_req(ahci_dev, q, req, cmd_slot as u32);
+        }
+    }
+
+    ahci_port_leave(pp);
+}
+
+// 回收由cpu发出且已完成的命令槽
+// 每个cpu只处理自己发出的命令
+pub fn ahci_cpu_reap(ahci_dev: &ahci_device, cpu: u32) {
+    let q: &ahci_cpu_queue = &ahci_dev.cpu_q[cpu as usize];
+    let pp: &ahci_ioport = &ahci_dev.port[ahci_dev.port_idx as usize];
+
+    let issued: u32 = q.issued.load(Ordering::Acquire);
+    if issued == 0 || !ahci_port_enter(pp) {
+        return;
+    }
+
+    let recover: bool = ahci_cpu_reap_port(ahci_dev, q, pp, issued);
+
+    ahci_port_leave(pp);
+
+    if recover {
+        ahci_port_recover(ahci_dev);
+    }
+}
+
+// 返回是否需要恢复端口
+fn ahci_cpu_reap_port(ahci_dev: &ahci_device, q: &ahci_cpu_queue, pp: &ahci_ioport, issued: u32) -> bool {
+    let port_mmio: Mmio<PortRegs> = pp.port_mmio;
+
+    // 检查按自己的周期进行，该cpu其他命令槽不断完成时也不能推迟对挂起命令的检查
+    let check: bool = ahci_cpu_check_due(q);
+
+    // fis模式下只在收到FIS时读取PORT_CMD_ISSUE，
+    // 或者每AHCI_FIS_POLL_MMIO_INTERVAL次读取一次作为兜底
+    // 接收FIS区由所有cpu共享，清除它的线程先把fis_seq加1，
+    // 其他cpu据此得知自己可能错过了FIS，仍然检查一次
+    if ahci_dev.completion_mode == AHCI_COMPLETION_FIS {
+        let seq: u32;
+
+        if ahci_rx_fis_posted(pp) {
+            seq = pp.fis_seq.fetch_add(1, Ordering::SeqCst).wrapping_add(1);
+
+            // 先清除再读取PORT_CMD_ISSUE，之后收到的FIS不会丢失
+            ahci_arm_rx_fis(pp);
+        } else {
+            // 看到FIS已被清除，则清除之前的加1也可见
+            fence(Ordering::Acquire);
+            seq = pp.fis_seq.load(Ordering::Relaxed);
+            if !check
+                && seq == q.fis_seen.load(Ordering::Relaxed)
+                && q.polls.fetch_add(1, Ordering::Relaxed) + 1 < AHCI_FIS_POLL_MMIO_INTERVAL
+            {
+                return false;
+            }
+        }
+
+        q.fis_seen.store(seq, Ordering::Relaxed);
+        q.polls.store(0, Ordering::Relaxed);
+    }
+
+    // ncq命令发送后即离开PORT_CMD_ISSUE，设备报告完成后才离开PORT_SCR_ACT
+    let mut pending: u32 = port_mmio.read(PORT_CMD_ISSUE);
+    if issued & (pp.slot_busy.load(Ordering::Relaxed) >> 32) as u32 != 0 {
+        pending |= port_mmio.read(PORT_SCR_ACT);
+    }
+    let mut done: u32 = issued & !pending;
+
+    // 出现task file错误时hba停止执行，命令槽保持置位，
+    // 设备挂起时命令槽也不会清零，定期检查这两种情况
+    let recover: bool = check
+        && (port_mmio.read(PORT_IRQ_STAT) & PORT_IRQ_TF_ERR != 0
+            || ahci_cpu_timed_out(q, issued & !done));
+
+    if done == 0 {
+        return recover;
+    }
+
+    // 其他线程可能也在回收这个cpu的命令
+    done &= q.issued.fetch_and(!done, Ordering::AcqRel);
+
+    while done != 0 {
+        let cmd_slot: u32 = ahci_ffs32(done) - 1;
+        done &= !(1 << cmd_slot);
+
+        let req: *mut ahci_request = q.slot_req[cmd_slot].load(Ordering::Relaxed);
+
+        // 收到FIS只是触发读取PORT_CMD_ISSUE，prd字节数仍要表明整个缓冲区都传输了，
+        // ncq命令hba可以不更新字节数
+        unsafe {
+            if ahci_dev.completion_mode == AHCI_COMPLETION_FIS
+                && (*req).ncq == 0
+                && (*req).buf_len != 0
+            {
+                let hdr: *const ahci_cmd_hdr = pp.cmd_slot.add(cmd_slot as usize);
+                let moved: u32 = read_volatile(&(*hdr).status);
+                if moved < (*req).buf_len {
+                    ahci_printf(
+                        b"ahci port %u command 0x%x moved %u of %u bytes\n\0" as *const u8,
+                        ahci_dev.port_idx as u32,
+                        (*req).cfis.command as u32,
+                        moved,
+                        (*req).buf_len,
+                    );
+                    (*req).status = -1;
+                }
+            }
+        }
+
+        ahci_free_cmd_slot(pp, cmd_slot);
+        ahci_complete_req(req);
+    }
+
+    return recover;
+}
+
+// 把请求放入当前cpu的队列，有空闲命令槽时立即发出
+// 在ahci_wait_req()返回之前req必须保持有效
+pub fn ahci_submit_req(ahci_dev: &ahci_device, req: *mut ahci_request) {
+    let cpu: u32 = ahci_cpu_id() % AHCI_MAX_CPUS;
+
+    unsafe {
+        (*req).cpu = cpu;
+        (*req).done.store(0, Ordering::Relaxed);
+        (*req).status = 0;
+        (*req).retries = 0;
+    }
+
+    let q: &ahci_cpu_queue = &ahci_dev.cpu_q[cpu as usize];
+
+    // 队列已满，帮助处理队列中的请求
+    while ahci_queue_push(q, req) != 0 {
+        ahci_cpu_dispatch(ahci_dev, cpu);
+        ahci_cpu_reap(ahci_dev, cpu);
+    }
+
+    ahci_cpu_dispatch(ahci_dev, cpu);
+}
+
+// 等待已提交的请求完成，返回其状态
+// 即使线程已迁移到其他cpu，也从提交时的cpu队列回收
+pub fn ahci_wait_req(ahci_dev: &ahci_device, req: *mut ahci_request) -> i32 {
+    let cpu: u32 = unsafe { (*req).cpu };
+
+    while unsafe { (*req).done.load(Ordering::Acquire) } == 0 {
+        ahci_cpu_dispatch(ahci_dev, cpu);
+        ahci_cpu_reap(ahci_dev, cpu);
+    }
+
+    ahci_sync_dcache();
+
+    return unsafe { (*req).status };
+}
+
+// 执行请求并等待完成，返回0或-1
+fn ahci_exec_req(ahci_dev: &ahci_device, req: *mut ahci_request) -> i32 {
+    if unsafe { (*req).buf_len } > AHCI_MAX_BYTES_PER_TRANS {
+        unsafe {
+            ahci_printf(
+                b"max transfer length is %u bytes\n\0" as *const u8,
+                AHCI_MAX_BYTES_PER_TRANS,
+            )
+        };
+        return -1;
+    }
+
+    ahci_submit_req(ahci_dev, req);
+
+    if ahci_wait_req(ahci_dev, req) != 0 {
+        let pp: &ahci_ioport = &ahci_dev.port[ahci_dev.port_idx as usize];
+        unsafe {
+            ahci_printf(
+                b"ahci port %u command 0x%x failed, tfdata 0x%x\n\0" as *const u8,
+                ahci_dev.port_idx as u32,
+                (*req).cfis.command as u32,
+                pp.port_mmio.read(PORT_TFDATA),
+            )
+        };
+        return -1;
+    }
+
+    return 0;
+}
+
+// 构造请求
+pub fn ahci_new_req(cfis: sata_fis_h2d, buf: *mut u8, buf_len: u32, is_write: u32, prio: u32) -> ahci_request {
+    return ahci_request {
+        cfis: cfis,
+        buf: buf,
+        buf_len: buf_len,
+        is_write: is_write,
+        prio: prio,
+        ncq: 0,
+        cpu: 0,
+        done: AtomicU32::new(0),
+        status: 0,
+        deadline: 0,
+        retries: 0,
+        complete: None,
+        ctx: null_mut(),
+    };
+}
+
+// ahci命令执行
+// 请求放入当前cpu的队列，并由同一个队列回收
+fn ahci_exec_ata_cmd(
+    ahci_dev: &ahci_device,
+    cfis: *const sata_fis_h2d,
+    buf: *mut u8,
+    buf_len: u32,
+    is_write: u32,
+) -> u32 {
+    let mut req: ahci_request =
+        ahci_new_req(unsafe { *cfis }, buf, buf_len, is_write, AHCI_PRIO_NORMAL);
+
+    if ahci_exec_req(ahci_dev, &mut req) != 0 {
+        return 0;
+    }
+
+    return buf_len;
+}
+
+// 不传输数据，请求的状态就是唯一的结果，返回0或-1
+fn ahci_set_feature(ahci_dev: &ahci_device, subcmd: u8, action: u8) -> i32 {
+    let cfis: sata_fis_h2d = sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: ATA_CMD_SET_FEATURES,
+        features: subcmd,
+        lba_low: 0,
+        lba_mid: 0,
+        lba_high: 0,
+        device: 0,
+        lba_low_exp: 0,
+        lba_mid_exp: 0,
+        lba_high_exp: 0,
+        features_exp: 0,
+        sector_count: action,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+
+    let mut req: ahci_request = ahci_new_req(cfis, null_mut(), 0, READ_CMD, AHCI_PRIO_NORMAL);
+
+    return ahci_exec_req(ahci_dev, &mut req);
+}
+
+// 初始化ahci端口
+fn ahci_port_start(ahci_dev: &mut ahci_device, port: u8) -> i32 {
+    let pp: &mut ahci_ioport = &mut ahci_dev.port[port as usize];
+    let port_mmio: Mmio<PortRegs> = pp.port_mmio;
+
+    if port_mmio.read_field(PORT_SCR_STAT, PORT_SCR_DET) != PORT_SCR_DET_PRESENT {
+        unsafe { ahci_printf(b"no link on port %u\n\0" as *const u8, port as u32) };
+        return -1;
+    }
+
+    let mut mem: u64;
+    unsafe {
+        mem = ahci_malloc_align(AHCI_PORT_PRIV_DMA_SZ as u64, 1024);
+        (mem as *mut u8).write_bytes(0, AHCI_PORT_PRIV_DMA_SZ as usize);
+    }
+
+    pp.cmd_slot = mem as *mut ahci_cmd_hdr;
+    pp.cmd_slot_dma = ahci_virt_to_phys(mem);
+
+    mem += AHCI_CMD_SLOT_SZ as u64;
+
+    pp.rx_fis = mem;
+    pp.rx_fis_dma = ahci_virt_to_phys(mem);
+
+    mem += AHCI_RX_FIS_SZ as u64;
+
+    pp.cmd_tbl = mem;
+    pp.cmd_tbl_dma = ahci_virt_to_phys(mem);
+
+    mem += AHCI_CMD_TBL_HDR_SZ as u64;
+
+    pp.cmd_tbl_sg = mem as *mut ahci_sg;
+
+    // 恢复时READ LOG EXT用的一个扇区
+    pp.log_buf = pp.cmd_tbl + AHCI_CMD_TBL_AR_SZ as u64;
+
+    pp.slot_busy.store(0, Ordering::Relaxed);
+    pp.ncq_drain.store(0, Ordering::Relaxed);
+    pp.users.store(0, Ordering::Relaxed);
+    pp.recovering.store(0, Ordering::Relaxed);
+    pp.fis_seq.store(0, Ordering::Relaxed);
+    pp.dead.store(0, Ordering::Relaxed);
+
+    port_mmio.write(PORT_LST_ADDR, (pp.cmd_slot_dma & 0xffffffff) as u32);
+    port_mmio.write(PORT_LST_ADDR_HI, (pp.cmd_slot_dma >> 32) as u32);
+    port_mmio.write(PORT_FIS_ADDR, (pp.rx_fis_dma & 0xffffffff) as u32);
+    port_mmio.write(PORT_FIS_ADDR_HI, (pp.rx_fis_dma >> 32) as u32);
+
+    port_mmio.write(
+        PORT_CMD,
+        PORT_CMD_ICC_ACTIVE
+            | PORT_CMD_FIS_RX
+            | PORT_CMD_POWER_ON
+            | PORT_CMD_SPIN_UP
+            | PORT_CMD_START,
+    );
+
+    let mut timeout: u32 = 200;
+    let mut tmp: u32 = 0;
+    loop {
+        ahci_mdelay(1);
+        tmp = port_mmio.read(PORT_TFDATA);
+        tmp &= (ATA_ERR | ATA_DRQ | ATA_BUSY) as u32;
+        timeout -= 1;
+        if tmp == 0 || timeout == 0 {
+            break;
+        }
+    }
+
+    if timeout <= 0 {
+        unsafe {
+            ahci_printf(
+                b"ahci port %u failed to start\n\0" as *const u8,
+                port as u32,
+            )
+        };
+        return -1;
+    }
+    return 0;
+}
+
+fn ahci_sata_identify(ahci_dev: &ahci_device, id: &mut [u16]) -> i32 {
+    let buf_len: u32 = ATA_ID_WORDS * 2;
+    let cfis: sata_fis_h2d = sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: ATA_CMD_ID_ATA,
+        features: 0,
+        lba_low: 0,
+        lba_mid: 0,
+        lba_high: 0,
+        device: 0,
+        lba_low_exp: 0,
+        lba_mid_exp: 0,
+        lba_high_exp: 0,
+        features_exp: 0,
+        sector_count: 0,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+
+    if ahci_exec_ata_cmd(
+        ahci_dev,
+        &cfis,
+        id.as_mut_ptr() as *mut u8,
+        buf_len,
+        READ_CMD,
+    ) == 0
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+fn ahci_sata_rw_cmd(
+    ahci_dev: &ahci_device,
+    start: u32,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+    prio: u32,
+) -> u32 {
+    let block: u32 = start;
+    let buf_len: u32 = ahci_dev.blk_dev.blksz as u32 * blkcnt;
+    let cfis: sata_fis_h2d = sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: if is_write != 0 {
+            ATA_CMD_WRITE
+        } else {
+            ATA_CMD_READ
+        },
+        features: 0,
+        lba_low: (block & 0xff) as u8,
+        lba_mid: (block >> 8 & 0xff) as u8,
+        lba_high: (block >> 16 & 0xff) as u8,
+        device: (block >> 24 & 0xf) as u8 | ATA_LBA,
+        lba_low_exp: 0,
+        lba_mid_exp: 0,
+        lba_high_exp: 0,
+        features_exp: 0,
+        sector_count: (blkcnt & 0xff) as u8,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+
+    let mut req: ahci_request = ahci_new_req(cfis, buffer, buf_len, is_write, prio);
+
+    if ahci_exec_req(ahci_dev, &mut req) == 0 {
+        return blkcnt;
+    } else {
+        return 0;
+    };
+}
+
+fn ahci_sata_flush_cache(ahci_dev: &ahci_device) {
+    let cfis: sata_fis_h2d = sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: ATA_CMD_FLUSH,
+        features: 0,
+        lba_low: 0,
+        lba_mid: 0,
+        lba_high: 0,
+        device: 0,
+        lba_low_exp: 0,
+        lba_mid_exp: 0,
+        lba_high_exp: 0,
+        features_exp: 0,
+        sector_count: 0,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+    ahci_exec_ata_cmd(ahci_dev, &cfis, null_mut(), 0, READ_CMD);
+}
+
+// 每条命令的扇区数，大逻辑扇区时受prd表限制，
+// 并向下取整到完整的物理扇区，对齐的传输拆分后仍然对齐
+pub fn ahci_max_xfer_blks(ahci_dev: &ahci_device, mut max_blks: u32) -> u32 {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+    let per_phys: u32 = 1 << pdev.log2_per_phys;
+
+    max_blks = max_blks.min((AHCI_MAX_BYTES_PER_TRANS as u64 / pdev.blksz) as u32);
+
+    if max_blks > per_phys {
+        max_blks &= !(per_phys - 1);
+    }
+
+    return max_blks;
+}
+
+fn ata_low_level_rw_lba28(
+    ahci_dev: &ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+    prio: u32,
+) -> u32 {
+    let mut start: u32 = blknr as u32;
+    let mut blks: u32 = blkcnt;
+    let mut addr: *mut u8 = buffer;
+    let max_blks: u32 = ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS);
+    let blksz: u32 = ahci_dev.blk_dev.blksz as u32;
+
+    loop {
+        if blks > max_blks {
+            if max_blks != ahci_sata_rw_cmd(ahci_dev, start, max_blks, addr, is_write, prio) {
+                return 0;
+            }
+            start += max_blks;
+            blks -= max_blks;
+            addr = addr.wrapping_add((blksz * max_blks) as usize);
+        } else {
+            if blks != ahci_sata_rw_cmd(ahci_dev, start, blks, addr, is_write, prio) {
+                return 0;
+            }
+            start += blks;
+            blks = 0;
+            addr = addr.wrapping_add((blksz * blks) as usize);
+        }
+        if blks == 0 {
+            break;
+        }
+    }
+    return blkcnt;
+}
+
+fn ahci_fill_rw_cmd_ext(start: u64, blkcnt: u32, is_write: u32) -> sata_fis_h2d {
+    let block: u64 = start;
+    return sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: if is_write != 0 {
+            ATA_CMD_WRITE_EXT
+        } else {
+            ATA_CMD_READ_EXT
+        },
+        features: 0,
+        lba_low: (block & 0xff) as u8,
+        lba_mid: (block >> 8 & 0xff) as u8,
+        lba_high: (block >> 16 & 0xff) as u8,
+        device: ATA_LBA,
+        lba_low_exp: (block >> 24 & 0xff) as u8,
+        lba_mid_exp: (block >> 32 & 0xff) as u8,
+        lba_high_exp: (block >> 40 & 0xff) as u8,
+        features_exp: 0,
+        sector_count: (blkcnt & 0xff) as u8,
+        sector_count_exp: (blkcnt >> 8 & 0xff) as u8,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+}
+
+// FPDMA QUEUED命令，tag在发出命令时填入
+fn ahci_fill_rw_cmd_ncq(start: u64, blkcnt: u32, is_write: u32, prio: u32) -> sata_fis_h2d {
+    let block: u64 = start;
+    return sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: if is_write != 0 {
+            ATA_CMD_FPDMA_WRITE
+        } else {
+            ATA_CMD_FPDMA_READ
+        },
+        features: (blkcnt & 0xff) as u8,
+        lba_low: (block & 0xff) as u8,
+        lba_mid: (block >> 8 & 0xff) as u8,
+        lba_high: (block >> 16 & 0xff) as u8,
+        device: ATA_LBA,
+        lba_low_exp: (block >> 24 & 0xff) as u8,
+        lba_mid_exp: (block >> 32 & 0xff) as u8,
+        lba_high_exp: (block >> 40 & 0xff) as u8,
+        features_exp: (blkcnt >> 8 & 0xff) as u8,
+        sector_count: 0,
+        sector_count_exp: if prio == AHCI_PRIO_HIGH {
+            ATA_PRIO_HIGH << ATA_SHIFT_PRIO
+        } else {
+            0
+        },
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+}
+
+// 构造lba48读写请求，设备支持ncq时使用排队命令
+pub fn ahci_fill_rw_req(
+    ahci_dev: &ahci_device,
+    req: &mut ahci_request,
+    start: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+    prio: u32,
+) {
+    if ahci_dev.flags & SATA_FLAG_NCQ != 0 {
+        let ncq_prio: u32 = if ahci_dev.flags & SATA_FLAG_NCQ_PRIO != 0 {
+            prio
+        } else {
+            AHCI_PRIO_NORMAL
+        };
+        req.cfis = ahci_fill_rw_cmd_ncq(start, blkcnt, is_write, ncq_prio);
+        req.ncq = 1;
+    } else {
+        req.cfis = ahci_fill_rw_cmd_ext(start, blkcnt, is_write);
+        req.ncq = 0;
+    }
+
+    // 逻辑扇区大小 * blkcnt
+    req.buf = buffer;
+    req.buf_len = ahci_dev.blk_dev.blksz as u32 * blkcnt;
+    req.is_write = is_write;
+    req.prio = prio;
+}
+
+fn ahci_sata_rw_cmd_ext(
+    ahci_dev: &ahci_device,
+    start: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+    prio: u32,
+) -> u32 {
+    let mut req: ahci_request = ahci_new_req(
+        ahci_fill_rw_cmd_ext(start, blkcnt, is_write),
+        buffer,
+        0,
+        is_write,
+        prio,
+    );
+
+    ahci_fill_rw_req(ahci_dev, &mut req, start, blkcnt, buffer, is_write, prio);
+
+    if ahci_exec_req(ahci_dev, &mut req) == 0 {
+        return blkcnt;
+    } else {
+        return 0;
+    };
+}
+
+fn ahci_sata_flush_cache_ext(ahci_dev: &ahci_device) {
+    let cfis: sata_fis_h2d = sata_fis_h2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: ATA_CMD_FLUSH_EXT,
+        features: 0,
+        lba_low: 0,
+        lba_mid: 0,
+        lba_high: 0,
+        device: 0,
+        lba_low_exp: 0,
+        lba_mid_exp: 0,
+        lba_high_exp: 0,
+        features_exp: 0,
+        sector_count: 0,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    };
+
+    ahci_exec_ata_cmd(ahci_dev, &cfis, null_mut(), 0, READ_CMD);
+}
+
+// 写缓存开启时刷新写缓存
+fn ahci_sata_flush_wcache(ahci_dev: &ahci_device) {
+    let flags: u32 = ahci_dev.flags;
+
+    if flags & SATA_FLAG_WCACHE == 0 {
+        return;
+    }
+
+    if ahci_dev.blk_dev.lba48 {
+        if flags & SATA_FLAG_FLUSH_EXT != 0 {
+            ahci_sata_flush_cache_ext(ahci_dev);
+        }
+    } else {
+        if flags & SATA_FLAG_FLUSH != 0 {
+            ahci_sata_flush_cache(ahci_dev);
+        }
+    }
+}
+
+fn ata_low_level_rw_lba48(
+    ahci_dev: &ahci_device,
     blknr: u64,
     blkcnt: u32,
     buffer: *mut u8,
     is_write: u32,
+    prio: u32,
 ) -> u32 {
-    let mut start: u32 = blknr as u32;
+    let mut start: u64 = blknr;
     let mut blks: u32 = blkcnt;
     let mut addr: *mut u8 = buffer;
-    let max_blks: u32 = ATA_MAX_SECTORS;
+    let max_blks: u32 = ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS_LBA48);
+    let blksz: u32 = ahci_dev.blk_dev.blksz as u32;
 
     loop {
         if blks > max_blks {
-            if max_blks != ahci_sata_rw_cmd(ahci_dev, start, max_blks, addr, is_write) {
+            if max_blks != ahci_sata_rw_cmd_ext(ahci_dev, start, max_blks, addr, is_write, prio) {
                 return 0;
             }
-            start += max_blks;
+            start += max_blks as u64;
             blks -= max_blks;
-            addr = addr.wrapping_add((ATA_SECT_SIZE * max_blks) as usize);
+            addr = addr.wrapping_add((blksz * max_blks) as usize);
         } else {
-            if blks != ahci_sata_rw_cmd(ahci_dev, start, blks, addr, is_write) {
+            if blks != ahci_sata_rw_cmd_ext(ahci_dev, start, blks, addr, is_write, prio) {
                 return 0;
             }
-            start += blks;
+            start += blks as u64;
             blks = 0;
-            addr = addr.wrapping_add((ATA_SECT_SIZE * blks) as usize);
+            addr = addr.wrapping_add((blksz * blks) as usize);
+        }
+
+        if blks == 0 {
+            break;
+        }
+    }
+
+    return blkcnt;
+}
+
+fn ata_low_level_rw(
+    ahci_dev: &ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+    prio: u32,
+) -> u32 {
+    if ahci_dev.blk_dev.lba48 {
+        return ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, is_write, prio);
+    } else {
+        return ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, is_write, prio);
+    }
+}
+
+// 记录前台活动，后台工作在其后idle_ms才开始
+pub fn ahci_fg_mark(ahci_dev: &ahci_device) {
+    ahci_dev.idle.last_fg_us.store(ahci_get_time_us(), Ordering::Relaxed);
+}
+
+pub fn ahci_fg_begin(ahci_dev: &ahci_device) {
+    ahci_dev.idle.fg_active.fetch_add(1, Ordering::Acquire);
+    ahci_fg_mark(ahci_dev);
+}
+
+pub fn ahci_fg_end(ahci_dev: &ahci_device) {
+    ahci_fg_mark(ahci_dev);
+    ahci_dev.idle.fg_active.fetch_sub(1, Ordering::Release);
+}
+
+// 没有进行中的前台读写，且idle_ms内没有前台活动
+fn ahci_dev_idle(ahci_dev: &ahci_device) -> bool {
+    let idle: &ahci_idle = &ahci_dev.idle;
+    let now: u64 = ahci_get_time_us();
+
+    if idle.fg_active.load(Ordering::Acquire) != 0 {
+        return false;
+    }
+
+    let last: u64 = idle.last_fg_us.load(Ordering::Relaxed);
+
+    return now >= last && now - last >= idle.idle_ms as u64 * 1000;
+}
+
+// 第idx块数据的缓冲区和长度
+fn ahci_stream_chunk(st: &ahci_stream, idx: u64) -> (*mut u8, u32) {
+    let blksz: u64 = unsafe { (*st.ahci_dev).blk_dev.blksz };
+    let mut blks: u64 = st.blkcnt - idx * st.buf_blks as u64;
+
+    if blks > st.buf_blks as u64 {
+        blks = st.buf_blks as u64;
+    }
+
+    let buf: *mut u8 =
+        unsafe { st.mem.add(((idx % st.nbufs as u64) * st.buf_blks as u64 * blksz) as usize) };
+    return (buf, blks as u32);
+}
+
+// 把第idx块数据放入它在环中的缓冲区并提交
+fn ahci_stream_submit(st: &mut ahci_stream, idx: u64) {
+    let ahci_dev: &ahci_device = unsafe { &*st.ahci_dev };
+    let (buf, blks) = ahci_stream_chunk(st, idx);
+    let start: u64 = st.blknr + idx * st.buf_blks as u64;
+    let is_write: u32 = st.is_write;
+    let req: &mut ahci_request = &mut st.req[(idx % st.nbufs as u64) as usize];
+
+    ahci_fill_rw_req(ahci_dev, req, start, blks, buf, is_write, AHCI_PRIO_NORMAL);
+
+    ahci_fg_mark(ahci_dev);
+    ahci_submit_req(ahci_dev, req);
+    st.submitted = idx + 1;
+}
+
+// 打开[blknr, blknr + blkcnt)上的流
+// mem包含nbufs个buf_blks逻辑扇区大小的缓冲区，必须可用于dma
+// 读流打开时即开始填充所有缓冲区
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_stream_open(
+    ahci_dev: &ahci_device,
+    st: &mut ahci_stream,
+    blknr: u64,
+    blkcnt: u64,
+    is_write: u32,
+    mem: *mut u8,
+    nbufs: u32,
+    buf_blks: u32,
+) -> i32 {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+
+    if !pdev.lba48 {
+        unsafe { ahci_printf(b"stream needs a lba48 device\n\0" as *const u8) };
+        return -1;
+    }
+
+    if nbufs == 0
+        || nbufs > AHCI_STREAM_MAX_BUFS
+        || blkcnt == 0
+        || buf_blks == 0
+        || buf_blks > ahci_max_xfer_blks(ahci_dev, ATA_MAX_SECTORS_LBA48)
+    {
+        unsafe {
+            ahci_printf(
+                b"invalid stream of %u buffers of %u blocks\n\0" as *const u8,
+                nbufs,
+                buf_blks,
+            )
+        };
+        return -1;
+    }
+
+    if blknr + blkcnt > pdev.lba {
+        unsafe { ahci_printf(b"stream beyond the end of the disk\n\0" as *const u8) };
+        return -1;
+    }
+
+    st.ahci_dev = ahci_dev;
+    st.mem = mem;
+    st.blknr = blknr;
+    st.blkcnt = blkcnt;
+    st.is_write = is_write;
+    st.nbufs = nbufs;
+    st.buf_blks = buf_blks;
+    st.status = 0;
+    st.nchunks = (blkcnt + buf_blks as u64 - 1) / buf_blks as u64;
+    st.submitted = 0;
+    st.acquired = 0;
+    st.released = 0;
+
+    // 还没提交过的缓冲区算作成功完成，写流第一次acquire和close都要看status
+    for i in 0..nbufs as usize {
+        st.req[i].status = 0;
+        st.req[i].done.store(1, Ordering::Relaxed);
+        st.req[i].complete = None;
+        st.req[i].ctx = null_mut();
+    }
+
+    if is_write == 0 {
+        while st.submitted < st.nchunks && st.submitted < nbufs as u64 {
+            ahci_stream_submit(st, st.submitted);
+        }
+    }
+
+    return 0;
+}
+
+// 获取环中的下一个缓冲区
+// 读流等待其中的数据就绪，写流等待其上一次写入完成
+// 流结束、传输失败或调用者已持有全部缓冲区时返回空指针
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_stream_acquire(
+    st: &mut ahci_stream,
+    blknr: *mut u64,
+    blkcnt: *mut u32,
+) -> *mut u8 {
+    let ahci_dev: &ahci_device = unsafe { &*st.ahci_dev };
+    let idx: u64 = st.acquired;
+
+    if st.status != 0 || idx == st.nchunks || idx - st.released == st.nbufs as u64 {
+        return null_mut();
+    }
+
+    if ahci_wait_req(ahci_dev, &mut st.req[(idx % st.nbufs as u64) as usize]) != 0 {
+        unsafe {
+            ahci_printf(
+                b"stream transfer at block 0x%lx failed\n\0" as *const u8,
+                st.blknr + idx * st.buf_blks as u64,
+            )
+        };
+        st.status = -1;
+        return null_mut();
+    }
+
+    ahci_fg_mark(ahci_dev);
+
+    let (buf, blks) = ahci_stream_chunk(st, idx);
+
+    if !blknr.is_null() {
+        unsafe { *blknr = st.blknr + idx * st.buf_blks as u64 };
+    }
+    if !blkcnt.is_null() {
+        unsafe { *blkcnt = blks };
+    }
+
+    st.acquired = idx + 1;
+
+    return buf;
+}
+
+// 归还最早获取的缓冲区
+// 读流用下一块数据重新填充，写流把其中的数据提交给设备
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_stream_release(st: &mut ahci_stream) -> i32 {
+    let idx: u64 = st.released;
+
+    if idx == st.acquired {
+        return -1;
+    }
+
+    st.released = idx + 1;
+
+    if st.is_write != 0 {
+        ahci_stream_submit(st, idx);
+    } else if st.submitted < st.nchunks {
+        ahci_stream_submit(st, st.submitted);
+    }
+
+    return st.status;
+}
+
+// 等待在途的传输完成，写流还要刷新写缓存
+// 流的所有传输都成功时返回0
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_stream_close(st: &mut ahci_stream) -> i32 {
+    let ahci_dev: &ahci_device = unsafe { &*st.ahci_dev };
+
+    for i in 0..st.nbufs as usize {
+        if ahci_wait_req(ahci_dev, &mut st.req[i]) != 0 {
+            st.status = -1;
+        }
+    }
+
+    if st.is_write != 0 {
+        ahci_sata_flush_wcache(ahci_dev);
+    }
+
+    return st.status;
+}
+
+// 获取一个物理扇区大小的缓冲区，全部在使用时返回空指针
+fn ahci_get_align_buf(pdev: &ahci_blk_dev) -> *mut u8 {
+    let mut busy: u32 = pdev.align_busy.load(Ordering::Relaxed);
+
+    loop {
+        if pdev.align_buf == 0 || busy == (1 << AHCI_MAX_CPUS) - 1 {
+            return null_mut();
+        }
+        let idx: u32 = ahci_ffs32(!busy) - 1;
+
+        match pdev.align_busy.compare_exchange_weak(
+            busy,
+            busy | (1 << idx),
+            Ordering::Acquire,
+            Ordering::Relaxed,
+        ) {
+            Ok(_) => return (pdev.align_buf + idx as u64 * pdev.phys_blksz) as *mut u8,
+            Err(cur) => busy = cur,
+        }
+    }
+}
+
+fn ahci_put_align_buf(pdev: &ahci_blk_dev, buf: *mut u8) {
+    let idx: u64 = (buf as u64 - pdev.align_buf) / pdev.phys_blksz;
+
+    pdev.align_busy.fetch_and(!(1 << idx), Ordering::Release);
+}
+
+// 读出整个物理扇区，修改后写回，完成对物理扇区一部分的写入
+// [blknr, blknr + blkcnt)所在的物理扇区不能被并发写入
+// 没有缓冲区或位于磁盘两端时直接写入
+fn ahci_sata_write_padded(
+    ahci_dev: &ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    prio: u32,
+) -> u32 {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+    let per_phys: u32 = 1 << pdev.log2_per_phys;
+    let ofs: u32 = ((blknr + (per_phys - pdev.lowest_aligned) as u64) & (per_phys - 1) as u64) as u32;
+    let mut rc: u32 = 0;
+
+    if blknr < ofs as u64 || blknr - ofs as u64 + per_phys as u64 > pdev.lba {
+        return ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+    }
+    let start: u64 = blknr - ofs as u64;
+
+    let buf: *mut u8 = ahci_get_align_buf(pdev);
+    if buf.is_null() {
+        return ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+    }
+
+    if ata_low_level_rw(ahci_dev, start, per_phys, buf, READ_CMD, prio) == per_phys {
+        unsafe {
+            core::ptr::copy_nonoverlapping(
+                buffer,
+                buf.add(ofs as usize * pdev.blksz as usize),
+                blkcnt as usize * pdev.blksz as usize,
+            );
+        }
+        if ata_low_level_rw(ahci_dev, start, per_phys, buf, WRITE_CMD, prio) == per_phys {
+            rc = blkcnt;
+        }
+    }
+
+    ahci_put_align_buf(pdev, buf);
+
+    return rc;
+}
+
+// 在物理扇区边界处拆分写入
+// 不完整的头部和尾部填充为完整的物理扇区，中间部分按完整物理扇区写入
+fn ahci_sata_write_aligned(
+    ahci_dev: &ahci_device,
+    mut blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    prio: u32,
+) -> u32 {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+    let per_phys: u32 = 1 << pdev.log2_per_phys;
+    let ofs: u32 = ((blknr + (per_phys - pdev.lowest_aligned) as u64) & (per_phys - 1) as u64) as u32;
+    let mut addr: *mut u8 = buffer;
+    let mut head: u32 = 0;
+
+    if ofs != 0 {
+        head = (per_phys - ofs).min(blkcnt);
+    }
+    let tail: u32 = (blkcnt - head) & (per_phys - 1);
+    let body: u32 = blkcnt - head - tail;
+
+    if head != 0 {
+        if ahci_sata_write_padded(ahci_dev, blknr, head, addr, prio) != head {
+            return 0;
+        }
+        blknr += head as u64;
+        addr = addr.wrapping_add((head as u64 * pdev.blksz) as usize);
+    }
+
+    if body != 0 {
+        if ata_low_level_rw(ahci_dev, blknr, body, addr, WRITE_CMD, prio) != body {
+            return 0;
+        }
+        blknr += body as u64;
+        addr = addr.wrapping_add((body as u64 * pdev.blksz) as usize);
+    }
+
+    if tail != 0 {
+        if ahci_sata_write_padded(ahci_dev, blknr, tail, addr, prio) != tail {
+            return 0;
+        }
+    }
+
+    return blkcnt;
+}
+
+// 对覆盖物理扇区一部分的写入进行填充
+// 仅在设备的物理扇区大于逻辑扇区时有效
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_set_write_align(ahci_dev: &mut ahci_device, enable: bool) {
+    if enable {
+        ahci_dev.flags |= SATA_FLAG_ALIGN_WRITE;
+    } else {
+        ahci_dev.flags &= !SATA_FLAG_ALIGN_WRITE;
+    }
+}
+
+// 设置开始后台工作前的空闲时间
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_set_idle_time(ahci_dev: &mut ahci_device, ms: u32) {
+    ahci_dev.idle.idle_ms = ms;
+}
+
+// 每次写入后的刷新推迟到ahci_idle_poll进行
+// 写入只有在空闲时的刷新或ahci_sata_sync之后才持久
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_set_deferred_flush(ahci_dev: &mut ahci_device, enable: bool) {
+    if enable {
+        ahci_dev.flags |= SATA_FLAG_DEFER_FLUSH;
+    } else {
+        ahci_dev.flags &= !SATA_FLAG_DEFER_FLUSH;
+    }
+}
+
+// 立即刷新写缓存，包括被推迟的刷新
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_sync(ahci_dev: &ahci_device) {
+    ahci_dev.idle.flush_pending.store(0, Ordering::Relaxed);
+    ahci_sata_flush_wcache(ahci_dev);
+}
+
+// 把[blknr, blknr + blkcnt)加入队列，设备空闲时trim
+// 设备不支持trim或队列已满时返回-1
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_queue_trim(ahci_dev: &ahci_device, blknr: u64, blkcnt: u64) -> i32 {
+    let idle: &ahci_idle = &ahci_dev.idle;
+    let mut busy: u32 = idle.trim_alloc.load(Ordering::Relaxed);
+    let mut idx: u32 = 0;
+
+    if ahci_dev.flags & SATA_FLAG_TRIM == 0 || blkcnt == 0 || blknr + blkcnt > ahci_dev.blk_dev.lba
+    {
+        return -1;
+    }
+
+    loop {
+        if busy == 0xffffffff {
+            return -1;
+        }
+        idx = ahci_ffs32(!busy) - 1;
+
+        match idle.trim_alloc.compare_exchange_weak(
+            busy,
+            busy | (1 << idx),
+            Ordering::Acquire,
+            Ordering::Relaxed,
+        ) {
+            Ok(_) => break,
+            Err(cur) => busy = cur,
+        }
+    }
+
+    idle.trim_q[idx as usize].blknr.store(blknr, Ordering::Relaxed);
+    idle.trim_q[idx as usize].blkcnt.store(blkcnt, Ordering::Relaxed);
+    idle.trim_ready.fetch_or(1 << idx, Ordering::Release);
+
+    return 0;
+}
+
+// 从trim队列填写一个dsm块并发出
+// 返回发出的范围数，队列为空时返回0
+// trim只是提示，命令失败时直接丢弃这些范围
+fn ahci_sata_trim_batch(ahci_dev: &ahci_device) -> u32 {
+    let idle: &ahci_idle = &ahci_dev.idle;
+    let cur: &ahci_trim_range = &idle.trim_cur;
+    let ent: *mut u64 = idle.trim_buf as *mut u64;
+    let mut n: u32 = 0;
+
+    while n < AHCI_TRIM_RANGES_PER_CMD {
+        if cur.blkcnt.load(Ordering::Relaxed) == 0 {
+            let ready: u32 = idle.trim_ready.load(Ordering::Acquire);
+            if ready == 0 {
+                break;
+            }
+            let idx: u32 = ahci_ffs32(ready) - 1;
+            let q: &ahci_trim_range = &idle.trim_q[idx as usize];
+            cur.blknr.store(q.blknr.load(Ordering::Relaxed), Ordering::Relaxed);
+            cur.blkcnt.store(q.blkcnt.load(Ordering::Relaxed), Ordering::Relaxed);
+            idle.trim_ready.fetch_and(!(1 << idx), Ordering::Relaxed);
+            idle.trim_alloc.fetch_and(!(1 << idx), Ordering::Release);
         }
-        if blks == 0 {
-            break;
+
+        let blknr: u64 = cur.blknr.load(Ordering::Relaxed);
+        let mut blks: u64 = cur.blkcnt.load(Ordering::Relaxed);
+        if blks > AHCI_TRIM_MAX_BLKS {
+            blks = AHCI_TRIM_MAX_BLKS;
         }
-    }
-    return blkcnt;
-}
 
-fn ahci_sata_rw_cmd_ext(
-    ahci_dev: &ahci_device,
-    start: u64,
-    blkcnt: u32,
-    buffer: *mut u8,
-    is_write: u32,
-) -> u32 {
-    let port: u8 = ahci_dev.port_idx;
-    let block: u64 = start;
-    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
-    let cfis: sata_fis_h2d = sata_fis_h2d {
-        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
-        pm_port_c: 0x80,
-        command: if is_write != 0 {
-            ATA_CMD_WRITE_EXT
-        } else {
-            ATA_CMD_READ_EXT
-        },
-        features: 0,
-        lba_low: (block & 0xff) as u8,
-        lba_mid: (block >> 8 & 0xff) as u8,
-        lba_high: (block >> 16 & 0xff) as u8,
-        device: ATA_LBA,
-        lba_low_exp: (block >> 24 & 0xff) as u8,
-        lba_mid_exp: (block >> 32 & 0xff) as u8,
-        lba_high_exp: (block >> 40 & 0xff) as u8,
-        features_exp: 0,
-        sector_count: (blkcnt & 0xff) as u8,
-        sector_count_exp: (blkcnt >> 8 & 0xff) as u8,
-        res1: 0,
-        control: 0,
-        res2: [0; 4],
-    };
+        unsafe { *ent.add(n as usize) = blknr | (blks << 48) };
+        n += 1;
+        cur.blknr.store(blknr + blks, Ordering::Relaxed);
+        cur.blkcnt.fetch_sub(blks, Ordering::Relaxed);
+    }
 
-    if ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer, buf_len, is_write) > 0 {
-        return blkcnt;
-    } else {
+    if n == 0 {
         return 0;
-    };
-}
+    }
+
+    for i in n..AHCI_TRIM_RANGES_PER_CMD {
+        unsafe { *ent.add(i as usize) = 0 };
+    }
 
-fn ahci_sata_flush_cache_ext(ahci_dev: &ahci_device) {
-    let port: u8 = ahci_dev.port_idx;
     let cfis: sata_fis_h2d = sata_fis_h2d {
         fis_type: SATA_FIS_TYPE_REGISTER_H2D,
         pm_port_c: 0x80,
-        command: ATA_CMD_FLUSH_EXT,
-        features: 0,
+        command: ATA_CMD_DSM,
+        features: ATA_DSM_TRIM,
         lba_low: 0,
         lba_mid: 0,
         lba_high: 0,
-        device: 0,
+        device: ATA_LBA,
         lba_low_exp: 0,
         lba_mid_exp: 0,
         lba_high_exp: 0,
         features_exp: 0,
-        sector_count: 0,
+        sector_count: 1,
         sector_count_exp: 0,
         res1: 0,
         control: 0,
         res2: [0; 4],
     };
 
-    ahci_exec_ata_cmd(ahci_dev, port, &cfis, null_mut(), 0, READ_CMD);
-}
+    if ahci_exec_ata_cmd(ahci_dev, &cfis, ent as *mut u8, ATA_SECT_SIZE, WRITE_CMD) == 0 {
+        unsafe { ahci_printf(b"trim of %u ranges failed\n\0" as *const u8, n) };
+    }
 
-fn ata_low_level_rw_lba48(
-    ahci_dev: &ahci_device,
-    blknr: u64,
-    blkcnt: u32,
-    buffer: *mut u8,
-    is_write: u32,
-) -> u32 {
-    let mut start: u64 = blknr;
-    let mut blks: u32 = blkcnt;
-    let mut addr: *mut u8 = buffer;
-    let max_blks: u32 = ATA_MAX_SECTORS_LBA48;
+    return n;
+}
 
-    loop {
-        if blks > max_blks {
-            if max_blks != ahci_sata_rw_cmd_ext(ahci_dev, start, max_blks, addr, is_write) {
-                return 0;
-            }
-            start += max_blks as u64;
-            blks -= max_blks;
-            addr = addr.wrapping_add((ATA_SECT_SIZE * max_blks) as usize);
-        } else {
-            if blks != ahci_sata_rw_cmd_ext(ahci_dev, start, blks, addr, is_write) {
-                return 0;
-            }
-            start += blks as u64;
-            blks = 0;
-            addr = addr.wrapping_add((ATA_SECT_SIZE * blks) as usize);
-        }
+// 设备保持空闲时，先发出被推迟的刷新，再发出排队的trim
+// 由低优先级线程周期性调用，出现前台读写时在当前命令完成后返回
+// 返回发出的后台命令数
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_idle_poll(ahci_dev: &ahci_device) -> u32 {
+    let idle: &ahci_idle = &ahci_dev.idle;
+    let mut cmds: u32 = 0;
+
+    // 同一时间只有一个调用者运行，其他调用者直接返回
+    if idle
+        .running
+        .compare_exchange(0, 1, Ordering::Acquire, Ordering::Relaxed)
+        .is_err()
+    {
+        return 0;
+    }
 
-        if blks == 0 {
+    while ahci_dev_idle(ahci_dev) {
+        if idle.flush_pending.swap(0, Ordering::Acquire) != 0 {
+            ahci_sata_flush_wcache(ahci_dev);
+        } else if idle.trim_buf == 0 || ahci_sata_trim_batch(ahci_dev) == 0 {
             break;
         }
+        cmds += 1;
     }
 
-    return blkcnt;
+    idle.running.store(0, Ordering::Release);
+
+    return cmds;
 }
 
 // 扫描ahci端口
@@ -794,10 +2227,41 @@ fn ahci_sata_xfer_mode(ahci_dev: &mut ahci_device, id: &[u16]) {
     ahci_dev.udma_mask = id[ATA_ID_UDMA_MODES as usize] as u32;
 }
 
+// hba和设备都支持ncq时使用FPDMA QUEUED命令读写，tag不超过设备的队列深度
+fn ahci_sata_init_ncq(ahci_dev: &mut ahci_device, id: &[u16]) {
+    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
+    let mut mask: u32 = ahci_dev.slot_mask;
+
+    if ahci_dev.cap & HOST_CAP_NCQ != 0
+        && ata_id_has_ncq(&id)
+        && pdev.lba48
+        && pdev.queue_depth > 1
+    {
+        ahci_dev.flags |= SATA_FLAG_NCQ;
+        if ata_id_has_ncq_prio(&id) {
+            ahci_dev.flags |= SATA_FLAG_NCQ_PRIO;
+        }
+
+        if pdev.queue_depth < 32 {
+            ahci_dev.ncq_mask = mask & ((1 << pdev.queue_depth) - 1);
+        } else {
+            ahci_dev.ncq_mask = mask;
+        }
+        mask = ahci_dev.ncq_mask;
+    }
+
+    // 最多保留一半的命令槽
+    ahci_dev.prio_reserved = (mask.count_ones() / 2).min(AHCI_PRIO_RESERVED_SLOTS);
+}
+
 fn ahci_sata_init_wcache(ahci_dev: &mut ahci_device, id: &[u16]) {
+    ahci_dev.flags &= !(SATA_FLAG_WCACHE | SATA_FLAG_RAHEAD);
     if ata_id_has_wcache(&id) && ata_id_wcache_enabled(&id) {
         ahci_dev.flags |= SATA_FLAG_WCACHE;
     }
+    if ata_id_has_rahead(&id) && ata_id_rahead_enabled(&id) {
+        ahci_dev.flags |= SATA_FLAG_RAHEAD;
+    }
     if ata_id_has_flush(&id) {
         ahci_dev.flags |= SATA_FLAG_FLUSH;
     }
@@ -806,6 +2270,57 @@ fn ahci_sata_init_wcache(ahci_dev: &mut ahci_device, id: &[u16]) {
     }
 }
 
+// 重新从设备读取写缓存和预读状态，更新SATA_FLAG_WCACHE和SATA_FLAG_RAHEAD
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_query_cache(ahci_dev: &mut ahci_device) -> i32 {
+    const id_len: usize = (ATA_ID_WORDS + 1) as usize;
+    let mut id: [u16; id_len] = [0; id_len];
+
+    if ahci_sata_identify(ahci_dev, &mut id) != 0 {
+        return -1;
+    }
+
+    ahci_sata_init_wcache(ahci_dev, &id);
+
+    return 0;
+}
+
+// 开启或关闭设备的易失性写缓存，关闭前先刷新
+// 调用时不能有在途的读写，设备未按要求设置时返回-1
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_set_wcache(ahci_dev: &mut ahci_device, enable: bool) -> i32 {
+    if !enable {
+        ahci_sata_flush_wcache(ahci_dev);
+    }
+
+    let subcmd: u8 = if enable { SETFEATURES_WC_ON } else { SETFEATURES_WC_OFF };
+    if ahci_set_feature(ahci_dev, subcmd, 0) != 0 {
+        return -1;
+    }
+
+    if ahci_sata_query_cache(ahci_dev) != 0 {
+        return -1;
+    }
+
+    return if ((ahci_dev.flags & SATA_FLAG_WCACHE) != 0) == enable { 0 } else { -1 };
+}
+
+// 开启或关闭设备的预读
+// 调用时不能有在途的读写，设备未按要求设置时返回-1
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_set_rahead(ahci_dev: &mut ahci_device, enable: bool) -> i32 {
+    let subcmd: u8 = if enable { SETFEATURES_RA_ON } else { SETFEATURES_RA_OFF };
+    if ahci_set_feature(ahci_dev, subcmd, 0) != 0 {
+        return -1;
+    }
+
+    if ahci_sata_query_cache(ahci_dev) != 0 {
+        return -1;
+    }
+
+    return if ((ahci_dev.flags & SATA_FLAG_RAHEAD) != 0) == enable { 0 } else { -1 };
+}
+
 // 扫描sata
 fn ahci_sata_scan(ahci_dev: &mut ahci_device) {
     const id_len: usize = (ATA_ID_WORDS + 1) as usize;
@@ -820,9 +2335,25 @@ fn ahci_sata_scan(ahci_dev: &mut ahci_device) {
     ata_id_c_string(&id, &mut pdev.revision, ATA_ID_FW_REV as usize);
 
     pdev.lba = ata_id_n_sectors(&id);
-    pdev.blksz = ATA_SECT_SIZE as u64;
+    pdev.blksz = ata_id_logical_sector_size(&id) as u64;
+    pdev.log2_per_phys = ata_id_log2_per_physical_sector(&id) as u32;
+    pdev.phys_blksz = pdev.blksz << pdev.log2_per_phys;
+    pdev.lowest_aligned = ata_id_logical_sector_offset(&id, pdev.log2_per_phys as u8) as u32;
+
+    // 用于填充不完整物理扇区写入的缓冲区
+    pdev.align_busy.store(0, Ordering::Relaxed);
+    if pdev.log2_per_phys != 0 {
+        pdev.align_buf =
+            ahci_malloc_align(pdev.phys_blksz * AHCI_MAX_CPUS as u64, 1024);
+    }
     pdev.lba48 = ata_id_has_lba48(&id);
+    // 后台trim使用的dsm块
+    if pdev.lba48 && ata_id_has_trim(&id) {
+        ahci_dev.flags |= SATA_FLAG_TRIM;
+        ahci_dev.idle.trim_buf = ahci_malloc_align(ATA_SECT_SIZE as u64, 1024);
+    }
     pdev.queue_depth = ata_id_queue_depth(&id);
+    ahci_sata_init_ncq(ahci_dev, &id);
 
     ahci_sata_xfer_mode(ahci_dev, &id);
 
@@ -845,16 +2376,7 @@ pub extern "C" fn ahci_sata_read_common(
     blkcnt: u32,
     buffer: *mut u8,
 ) -> u64 {
-    let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
-    let mut rc: u32 = 0;
-
-    if pdev.lba48 {
-        rc = ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, READ_CMD);
-    } else {
-        rc = ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, READ_CMD);
-    }
-
-    return rc as u64;
+    return ahci_sata_read_prio(ahci_dev, blknr, blkcnt, buffer, AHCI_PRIO_NORMAL);
 }
 
 // ahci sata写函数
@@ -866,30 +2388,264 @@ pub extern "C" fn ahci_sata_write_common(
     blknr: u64,
     blkcnt: u32,
     buffer: *mut u8,
+) -> u64 {
+    return ahci_sata_write_prio(ahci_dev, blknr, blkcnt, buffer, AHCI_PRIO_NORMAL);
+}
+
+// 带优先级的读函数，prio为AHCI_PRIO_*，其他值不传输任何块
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_read_prio(
+    ahci_dev: &ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    prio: u32,
+) -> u64 {
+    // prio是环下标的一部分，见ahci_req_ring_idx
+    if prio > AHCI_PRIO_HIGH {
+        return 0;
+    }
+
+    ahci_fg_begin(ahci_dev);
+    let rc: u32 = ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, READ_CMD, prio);
+    ahci_fg_end(ahci_dev);
+
+    return rc as u64;
+}
+
+// 带优先级的写函数，prio为AHCI_PRIO_*，其他值不传输任何块
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_sata_write_prio(
+    ahci_dev: &ahci_device,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    prio: u32,
 ) -> u64 {
     let pdev: &ahci_blk_dev = &ahci_dev.blk_dev;
     let mut flags: u32 = ahci_dev.flags;
     let mut rc: u32 = 0;
 
-    if pdev.lba48 {
-        rc = ata_low_level_rw_lba48(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD);
-        if flags & SATA_FLAG_WCACHE != 0 && flags & SATA_FLAG_FLUSH_EXT != 0 {
-            ahci_sata_flush_cache_ext(ahci_dev);
-        }
+    if prio > AHCI_PRIO_HIGH {
+        return 0;
+    }
+
+    ahci_fg_begin(ahci_dev);
+
+    if flags & SATA_FLAG_ALIGN_WRITE != 0 && pdev.log2_per_phys != 0 {
+        rc = ahci_sata_write_aligned(ahci_dev, blknr, blkcnt, buffer, prio);
     } else {
-        rc = ata_low_level_rw_lba28(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD);
-        if flags & SATA_FLAG_WCACHE != 0 && flags & SATA_FLAG_FLUSH != 0 {
-            ahci_sata_flush_cache(ahci_dev);
-        }
+        rc = ata_low_level_rw(ahci_dev, blknr, blkcnt, buffer, WRITE_CMD, prio);
+    }
+
+    if flags & SATA_FLAG_DEFER_FLUSH != 0 {
+        ahci_dev.idle.flush_pending.store(1, Ordering::Release);
+    } else {
+        ahci_sata_flush_wcache(ahci_dev);
     }
 
+    ahci_fg_end(ahci_dev);
+
     return rc as u64;
 }
 
+// 在max_blks个逻辑扇区的暂存区mem上开启写合并
+// mem必须可用于dma，timeout_ms为0时暂存数据保留到写满或sync
+// 绕过wc直接写磁盘之前必须先sync
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_open(
+    ahci_dev: &ahci_device,
+    wc: &mut ahci_wcomb,
+    mem: *mut u8,
+    max_blks: u32,
+    timeout_ms: u32,
+) -> i32 {
+    if mem.is_null() || max_blks == 0 {
+        unsafe {
+            ahci_printf(
+                b"invalid write combining area of %u blocks\n\0" as *const u8,
+                max_blks,
+            )
+        };
+        return -1;
+    }
+
+    wc.ahci_dev = ahci_dev;
+    wc.mem = mem;
+    wc.max_blks = max_blks;
+    wc.timeout_ms = timeout_ms;
+    wc.start = 0;
+    wc.count = 0;
+    wc.staged_us = 0;
+
+    return 0;
+}
+
+// 把暂存范围作为一次写入交给设备，然后刷新写缓存
+// 失败时保留暂存数据，之后的sync可以重试
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_sync(wc: &mut ahci_wcomb) -> i32 {
+    let ahci_dev: &ahci_device = unsafe { &*wc.ahci_dev };
+
+    if wc.count == 0 {
+        return 0;
+    }
+
+    if ahci_sata_write_common(ahci_dev, wc.start, wc.count, wc.mem) != wc.count as u64 {
+        unsafe {
+            ahci_printf(
+                b"write combining sync at block 0x%lx failed\n\0" as *const u8,
+                wc.start,
+            )
+        };
+        return -1;
+    }
+
+    wc.count = 0;
+
+    return 0;
+}
+
+fn ahci_wcomb_expired(wc: &ahci_wcomb) -> bool {
+    return wc.count != 0
+        && wc.timeout_ms != 0
+        && ahci_get_time_us() - wc.staged_us >= wc.timeout_ms as u64 * 1000;
+}
+
+// 暂存数据超过timeout_ms时sync
+// 写入者可能空闲时需要周期性调用
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_poll(wc: &mut ahci_wcomb) -> i32 {
+    if !ahci_wcomb_expired(wc) {
+        return 0;
+    }
+
+    return ahci_wcomb_sync(wc);
+}
+
+// 经过暂存区写入，返回blkcnt，出错时返回0
+// max_blks及以上的写入先sync再直接交给设备
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_write(
+    wc: &mut ahci_wcomb,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+) -> u64 {
+    let ahci_dev: &ahci_device = unsafe { &*wc.ahci_dev };
+    let blksz: u64 = ahci_dev.blk_dev.blksz;
+
+    if blkcnt == 0 || blknr + blkcnt as u64 > ahci_dev.blk_dev.lba {
+        return 0;
+    }
+
+    if blkcnt >= wc.max_blks {
+        if ahci_wcomb_sync(wc) != 0 {
+            return 0;
+        }
+        return ahci_sata_write_common(ahci_dev, blknr, blkcnt, buffer);
+    }
+
+    if wc.count == 0
+        || blknr < wc.start
+        || blknr > wc.start + wc.count as u64
+        || blknr + blkcnt as u64 > wc.start + wc.max_blks as u64
+    {
+        if ahci_wcomb_sync(wc) != 0 {
+            return 0;
+        }
+        wc.start = blknr;
+        wc.staged_us = ahci_get_time_us();
+    }
+
+    unsafe {
+        core::ptr::copy_nonoverlapping(
+            buffer,
+            wc.mem.add(((blknr - wc.start) * blksz) as usize),
+            (blkcnt as u64 * blksz) as usize,
+        );
+    }
+
+    let end: u64 = blknr + blkcnt as u64 - wc.start;
+    if end > wc.count as u64 {
+        wc.count = end as u32;
+    }
+
+    if wc.count == wc.max_blks || ahci_wcomb_expired(wc) {
+        if ahci_wcomb_sync(wc) != 0 {
+            return 0;
+        }
+    }
+
+    return blkcnt as u64;
+}
+
+// 经过暂存区读取，暂存的扇区优先于磁盘上的数据
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_read(
+    wc: &mut ahci_wcomb,
+    blknr: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+) -> u64 {
+    let ahci_dev: &ahci_device = unsafe { &*wc.ahci_dev };
+    let blksz: u64 = ahci_dev.blk_dev.blksz;
+    let staged_end: u64 = wc.start + wc.count as u64;
+    let mut lo: u64 = blknr;
+    let mut hi: u64 = blknr + blkcnt as u64;
+
+    // 完全在暂存区中
+    if wc.count != 0 && lo >= wc.start && hi <= staged_end {
+        unsafe {
+            core::ptr::copy_nonoverlapping(
+                wc.mem.add(((lo - wc.start) * blksz) as usize),
+                buffer,
+                (blkcnt as u64 * blksz) as usize,
+            );
+        }
+        return blkcnt as u64;
+    }
+
+    if ahci_sata_read_common(ahci_dev, blknr, blkcnt, buffer) != blkcnt as u64 {
+        return 0;
+    }
+
+    if lo < wc.start {
+        lo = wc.start;
+    }
+    if hi > staged_end {
+        hi = staged_end;
+    }
+
+    if lo < hi {
+        unsafe {
+            core::ptr::copy_nonoverlapping(
+                wc.mem.add(((lo - wc.start) * blksz) as usize),
+                buffer.add(((lo - blknr) * blksz) as usize),
+                ((hi - lo) * blksz) as usize,
+            );
+        }
+    }
+
+    return blkcnt as u64;
+}
+
+// sync暂存数据，之后可以重新open
+#[unsafe(no_mangle)]
+pub extern "C" fn ahci_wcomb_close(wc: &mut ahci_wcomb) -> i32 {
+    return ahci_wcomb_sync(wc);
+}
+
 // ahci初始化函数
 #[unsafe(no_mangle)]
 pub extern "C" fn ahci_init(ahci_dev: &mut ahci_device) -> i32 {
-    ahci_dev.mmio_base = unsafe { ahci_phys_to_uncached(0x400e0000) };
+    ahci_dev.mmio_base = ahci_phys_to_uncached(0x400e0000);
+    ahci_dev.cmd_timeout_ms = AHCI_CMD_TIMEOUT_MS;
+    ahci_dev.idle.idle_ms = AHCI_IDLE_MS;
+
+    for i in 0..AHCI_MAX_CPUS as usize {
+        ahci_queue_init(&ahci_dev.cpu_q[i]);
+    }
 
     let mut ret: i32 = ahci_host_init(ahci_dev);
     if ret != 0 {
@@ -1,13 +1,20 @@
 #![no_std]
 #![allow(dead_code, unused_assignments, unused_mut)]
 
+pub mod async_io;
 pub mod drv_ahci;
 pub mod libahci;
 pub mod libata;
+#[path = "../../../common/rust/mmio.rs"]
+pub mod mmio;
 pub mod platform;
+#[path = "../../../common/rust/ring.rs"]
+pub mod ring;
 
+#[cfg(not(test))]
 use core::panic::PanicInfo;
 
+#[cfg(not(test))]
 #[panic_handler]
 fn panic(_info: &PanicInfo) -> ! {
     loop {}
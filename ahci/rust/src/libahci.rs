@@ -1,7 +1,13 @@
 #![allow(dead_code, unused_assignments, unused_mut, non_upper_case_globals)]
 
 use crate::libata::*;
+use crate::mmio::{Field, Mmio, Reg};
+use crate::ring::{Ring, SlotTable};
 
+use core::ffi::c_void;
+use core::sync::atomic::{AtomicPtr, AtomicU32, AtomicU64};
+
+pub const PORT_CMD_ICC: Field = Field::new(28, 4);
 pub const PORT_CMD_ICC_MASK: u32 = 0xf << 28;
 pub const PORT_CMD_ICC_ACTIVE: u32 = 0x1 << 28;
 pub const PORT_CMD_ICC_PARTIAL: u32 = 0x2 << 28;
@@ -17,6 +23,7 @@ pub const PORT_CMD_MPSP: u32 = 0x1 << 19;
 pub const PORT_CMD_HPCP: u32 = 0x1 << 18;
 pub const PORT_CMD_PMP: u32 = 0x1 << 17;
 pub const PORT_CMD_LIST_ON: u32 = 0x1 << 15;
+pub const PORT_CMD_CCS: Field = Field::new(8, 5); // 当前命令槽
 pub const PORT_CMD_FIS_ON: u32 = 0x1 << 14;
 pub const PORT_CMD_FIS_RX: u32 = 0x1 << 4;
 pub const PORT_CMD_CLO: u32 = 0x1 << 3;
@@ -58,24 +65,35 @@ pub const DEF_PORT_IRQ: u32 = PORT_IRQ_ERROR
     | PORT_IRQ_PIOS_FIS
     | PORT_IRQ_D2H_REG_FIS;
 
-pub const PORT_LST_ADDR: u64 = 0x00;
-pub const PORT_LST_ADDR_HI: u64 = 0x04;
-pub const PORT_FIS_ADDR: u64 = 0x08;
-pub const PORT_FIS_ADDR_HI: u64 = 0x0c;
-pub const PORT_IRQ_STAT: u64 = 0x10;
-pub const PORT_IRQ_MASK: u64 = 0x14;
-pub const PORT_CMD: u64 = 0x18;
-pub const PORT_TFDATA: u64 = 0x20;
-pub const PORT_SIG: u64 = 0x24;
-pub const PORT_CMD_ISSUE: u64 = 0x38;
-pub const PORT_SCR_STAT: u64 = 0x28;
-pub const PORT_SCR_CTL: u64 = 0x2c;
-pub const PORT_SCR_ERR: u64 = 0x30;
-pub const PORT_SCR_ACT: u64 = 0x34;
-pub const PORT_SCR_NTF: u64 = 0x3c;
-pub const PORT_FBS: u64 = 0x40;
-pub const PORT_DEVSLP: u64 = 0x44;
+// 每个端口的寄存器块
+pub enum PortRegs {}
+
+pub const PORT_LST_ADDR: Reg<PortRegs> = Reg::new(0x00);
+pub const PORT_LST_ADDR_HI: Reg<PortRegs> = Reg::new(0x04);
+pub const PORT_FIS_ADDR: Reg<PortRegs> = Reg::new(0x08);
+pub const PORT_FIS_ADDR_HI: Reg<PortRegs> = Reg::new(0x0c);
+pub const PORT_IRQ_STAT: Reg<PortRegs> = Reg::new(0x10);
+pub const PORT_IRQ_MASK: Reg<PortRegs> = Reg::new(0x14);
+pub const PORT_CMD: Reg<PortRegs> = Reg::new(0x18);
+pub const PORT_TFDATA: Reg<PortRegs> = Reg::new(0x20);
+pub const PORT_SIG: Reg<PortRegs> = Reg::new(0x24);
+pub const PORT_CMD_ISSUE: Reg<PortRegs> = Reg::new(0x38);
+pub const PORT_SCR_STAT: Reg<PortRegs> = Reg::new(0x28);
+pub const PORT_SCR_CTL: Reg<PortRegs> = Reg::new(0x2c);
+pub const PORT_SCR_ERR: Reg<PortRegs> = Reg::new(0x30);
+pub const PORT_SCR_ACT: Reg<PortRegs> = Reg::new(0x34);
+pub const PORT_SCR_NTF: Reg<PortRegs> = Reg::new(0x3c);
+pub const PORT_FBS: Reg<PortRegs> = Reg::new(0x40);
+pub const PORT_DEVSLP: Reg<PortRegs> = Reg::new(0x44);
+
+// PORT_SCR_STAT / PORT_SCR_CTL的DET位域
+pub const PORT_SCR_DET: Field = Field::new(0, 4);
+pub const PORT_SCR_DET_PRESENT: u32 = 0x3; // 设备存在且phy通信已建立
+pub const PORT_SCR_DET_COMRESET: u32 = 0x1; // 发出COMRESET
 
+pub const HOST_CAP_NP: Field = Field::new(0, 5); // 端口数减1
+pub const HOST_CAP_NCS: Field = Field::new(8, 5); // 命令槽数减1
+pub const HOST_CAP_ISS: Field = Field::new(20, 4); // 接口速度
 pub const HOST_CAP_SXS: u32 = 0x1 << 5;
 pub const HOST_CAP_EMS: u32 = 0x1 << 6;
 pub const HOST_CAP_CCC: u32 = 0x1 << 7;
@@ -105,14 +123,17 @@ pub const HOST_IRQ_EN: u32 = 0x1 << 1;
 pub const HOST_MRSM: u32 = 0x1 << 2;
 pub const HOST_AHCI_EN: u32 = 0x1 << 31;
 
-pub const HOST_CAP: u64 = 0x0;
-pub const HOST_CTL: u64 = 0x4;
-pub const HOST_IRQ_STAT: u64 = 0x8;
-pub const HOST_PORTS_IMPL: u64 = 0xC;
-pub const HOST_VERSION: u64 = 0x10;
-pub const HOST_EM_LOC: u64 = 0x1C;
-pub const HOST_EM_CTL: u64 = 0x20;
-pub const HOST_CAP2: u64 = 0x24;
+// hba全局寄存器块
+pub enum HostRegs {}
+
+pub const HOST_CAP: Reg<HostRegs> = Reg::new(0x0);
+pub const HOST_CTL: Reg<HostRegs> = Reg::new(0x4);
+pub const HOST_IRQ_STAT: Reg<HostRegs> = Reg::new(0x8);
+pub const HOST_PORTS_IMPL: Reg<HostRegs> = Reg::new(0xC);
+pub const HOST_VERSION: Reg<HostRegs> = Reg::new(0x10);
+pub const HOST_EM_LOC: Reg<HostRegs> = Reg::new(0x1C);
+pub const HOST_EM_CTL: Reg<HostRegs> = Reg::new(0x20);
+pub const HOST_CAP2: Reg<HostRegs> = Reg::new(0x24);
 
 pub const AHCI_MAX_PORTS: u32 = 32;
 pub const AHCI_MAX_SG: u32 = 56;
@@ -125,12 +146,61 @@ pub const AHCI_CMD_TBL_CDB: u32 = 64;
 pub const AHCI_CMD_TBL_HDR_SZ: u32 = 128;
 pub const AHCI_CMD_TBL_SZ: u32 = AHCI_CMD_TBL_HDR_SZ + (AHCI_MAX_SG * 16);
 pub const AHCI_CMD_TBL_AR_SZ: u32 = AHCI_CMD_TBL_SZ * AHCI_MAX_CMDS;
-pub const AHCI_PORT_PRIV_DMA_SZ: u32 = AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_SZ + AHCI_RX_FIS_SZ;
+pub const AHCI_LOG_BUF_SZ: u32 = 512; // ncq命令错误日志，一个扇区
+pub const AHCI_PORT_PRIV_DMA_SZ: u32 =
+    AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + AHCI_RX_FIS_SZ + AHCI_LOG_BUF_SZ;
 pub const AHCI_PORT_PRIV_FBS_DMA_SZ: u32 =
     AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + (AHCI_RX_FIS_SZ * 16);
 pub const AHCI_MAX_BYTES_PER_SG: u32 = 4 * 1024 * 1024; // 4 MiB
 pub const AHCI_MAX_BYTES_PER_TRANS: u32 = AHCI_MAX_SG * AHCI_MAX_BYTES_PER_SG;
 
+// offsets of the received FIS area
+pub const AHCI_RX_FIS_DMA_SETUP: u64 = 0x00;
+pub const AHCI_RX_FIS_PIO_SETUP: u64 = 0x20;
+pub const AHCI_RX_FIS_D2H: u64 = 0x40;
+pub const AHCI_RX_FIS_SDB: u64 = 0x58;
+pub const AHCI_RX_FIS_UNK: u64 = 0x60;
+pub const AHCI_FIS_POLL_MMIO_INTERVAL: u32 = 1024;
+
+// how ahci_exec_ata_cmd detects command completion
+pub const AHCI_COMPLETION_MMIO: u32 = 0;
+pub const AHCI_COMPLETION_FIS: u32 = 1;
+
+// 每个cpu的软件提交队列
+pub const AHCI_MAX_CPUS: u32 = 4; // ls2k1000la有2个核
+pub const AHCI_CPU_QUEUE_DEPTH: u32 = 32; // 2的幂，编译期检查
+pub const AHCI_CPU_QUEUE_RINGS: u32 = 4; // 每个优先级分ncq和非ncq各一个环
+
+// 块请求的优先级
+pub const AHCI_PRIO_NORMAL: u32 = 0;
+pub const AHCI_PRIO_HIGH: u32 = 1; // ncq高优先级，可以使用保留的命令槽
+pub const AHCI_PRIO_RESERVED_SLOTS: u32 = 4; // 普通优先级请求留空的命令槽数
+
+// 命令超时和端口恢复
+pub const AHCI_CMD_TIMEOUT_MS: u32 = 5000; // 默认的命令超时
+pub const AHCI_CMD_RETRIES: u32 = 2; // 失败命令的重发次数
+pub const AHCI_PORT_STOP_TIMEOUT_MS: u32 = 500; // 等待PORT_CMD_LIST_ON / PORT_CMD_CLO清零
+pub const AHCI_LINK_TIMEOUT_MS: u32 = 1000; // COMRESET后等待链路建立
+pub const AHCI_DEV_READY_TIMEOUT_MS: u32 = 5000; // COMRESET后等待BSY清零
+pub const AHCI_HEALTH_CHECK_REAPS: u32 = 64; // 两次读取时钟之间的回收次数
+pub const AHCI_HEALTH_CHECK_MS: u32 = 1; // 检查task file错误和超时的周期
+
+// 设备空闲时进行的后台工作
+pub const AHCI_IDLE_MS: u32 = 50; // 开始后台工作前的默认空闲时间
+pub const AHCI_TRIM_QUEUE_DEPTH: u32 = 32; // 排队的trim范围数，每个占一位
+pub const AHCI_TRIM_RANGES_PER_CMD: u32 = 64; // 一个512字节dsm块中的范围数
+pub const AHCI_TRIM_MAX_BLKS: u64 = 0xffff; // 一个范围的扇区数
+
+// 流式传输
+pub const AHCI_STREAM_MAX_BUFS: u32 = 16; // 一个流同时在途的缓冲区数
+pub const AHCI_EXEC_MAX_TASKS: u32 = 16; // 一个执行器中的任务数
+
+pub const SATA_FLAG_DEFER_FLUSH: u32 = 65536; // 写入后的刷新由ahci_idle_poll进行
+pub const SATA_FLAG_TRIM: u32 = 32768; // 设备支持dsm trim
+pub const SATA_FLAG_RAHEAD: u32 = 16384; // 预读已开启
+pub const SATA_FLAG_NCQ_PRIO: u32 = 8192; // 设备支持ncq的PRIO字段
+pub const SATA_FLAG_NCQ: u32 = 4096; // 使用FPDMA QUEUED命令读写
+pub const SATA_FLAG_ALIGN_WRITE: u32 = 2048; // 对不完整的物理扇区写入进行填充
 pub const SATA_FLAG_FLUSH_EXT: u32 = 1024;
 pub const SATA_FLAG_FLUSH: u32 = 512;
 pub const SATA_FLAG_WCACHE: u32 = 256;
@@ -157,10 +227,9 @@ pub struct ahci_sg {
     pub flags_size: u32,
 }
 
-#[derive(Copy, Clone)]
 #[repr(C)]
 pub struct ahci_ioport {
-    pub port_mmio: u64,
+    pub port_mmio: Mmio<PortRegs>,
     pub cmd_slot: *mut ahci_cmd_hdr,
     pub cmd_slot_dma: u64,
     pub rx_fis: u64,
@@ -168,26 +237,112 @@ pub struct ahci_ioport {
     pub cmd_tbl: u64,
     pub cmd_tbl_dma: u64,
     pub cmd_tbl_sg: *mut ahci_sg,
+
+    pub log_buf: u64, // ncq命令错误日志，恢复时读取
+
+    // 低32位为已分配的命令槽，高32位为其中执行ncq命令的槽
+    pub slot_busy: AtomicU64,
+    pub ncq_drain: AtomicU32,  // 有非ncq命令在等待ncq命令全部完成
+    pub users: AtomicU32,      // 正在该端口上发出或回收命令的线程数
+    pub recovering: AtomicU32, // 端口恢复期间置1
+    pub fis_seq: AtomicU32,    // 每次重新清除接收FIS区时加1
+    pub dead: AtomicU32,       // 恢复失败，请求不再发给hba而直接失败
+}
+
+// 在cpu队列中等待或已发出的ata命令
+#[repr(C)]
+pub struct ahci_request {
+    pub cfis: sata_fis_h2d,
+    pub buf: *mut u8,
+    pub buf_len: u32,
+    pub is_write: u32,
+    pub prio: u32, // AHCI_PRIO_*
+    pub ncq: u32,  // FPDMA QUEUED命令，tag在发出时填入
+
+    pub cpu: u32, // 提交请求的cpu，也在这个cpu上回收
+    pub done: AtomicU32,
+    pub status: i32, // 0，命令失败时为-1
+
+    pub deadline: u64, // 命令超时的ahci_get_time_us()时刻
+    pub retries: u32,
+
+    // 置位done之后在回收它的线程上调用，返回之前req必须保持有效
+    pub complete: Option<extern "C" fn(req: *mut ahci_request)>,
+    pub ctx: *mut c_void, // 供complete使用
+}
+
+// 每个命令槽一个单元，命令槽数在编译期确定
+pub type AhciSlotTable<T> = SlotTable<T, { AHCI_MAX_CMDS as usize }>;
+
+// 有界无锁请求环
+#[repr(C)]
+pub struct ahci_req_ring {
+    pub head: AtomicU32,
+    pub tail: AtomicU32,
+    pub seq: Ring<AtomicU32, { AHCI_CPU_QUEUE_DEPTH as usize }>,
+    pub ring: Ring<AtomicPtr<ahci_request>, { AHCI_CPU_QUEUE_DEPTH as usize }>,
+}
+
+// 每个cpu的提交队列，按ahci_req_ring_idx()索引
+#[repr(C, align(64))]
+pub struct ahci_cpu_queue {
+    pub rq: [ahci_req_ring; AHCI_CPU_QUEUE_RINGS as usize],
+
+    pub issued: AtomicU32,   // 由该cpu发出且尚未回收的命令槽
+    pub polls: AtomicU32,    // 上次检查PORT_CMD_ISSUE以来的回收次数
+    pub fis_seen: AtomicU32, // 上次检查PORT_CMD_ISSUE时端口的fis_seq
+    pub reaps: AtomicU32,    // 上次读取时钟以来的回收次数
+    pub check_us: AtomicU64, // 下次检查的ahci_get_time_us()时刻
+    pub slot_req: AhciSlotTable<AtomicPtr<ahci_request>>,
 }
 
-#[derive(Copy, Clone)]
 #[repr(C)]
 pub struct ahci_blk_dev {
     pub lba48: bool,
     pub lba: u64,
-    pub blksz: u64,
+    pub blksz: u64,          // 逻辑扇区大小
+    pub phys_blksz: u64,     // 物理扇区大小
+    pub log2_per_phys: u32,  // 每个物理扇区的逻辑扇区数
+    pub lowest_aligned: u32, // 与物理扇区对齐的最小lba
+
+    pub align_buf: u64,        // AHCI_MAX_CPUS个phys_blksz大小的缓冲区
+    pub align_busy: AtomicU32, // 正在使用的缓冲区
     pub queue_depth: u32,
     pub product: [u8; (ATA_ID_PROD_LEN + 1) as usize],
     pub serial: [u8; (ATA_ID_SERNO_LEN + 1) as usize],
     pub revision: [u8; (ATA_ID_FW_REV_LEN + 1) as usize],
 }
 
-#[derive(Copy, Clone)]
+#[repr(C)]
+pub struct ahci_trim_range {
+    pub blknr: AtomicU64,
+    pub blkcnt: AtomicU64,
+}
+
+// 没有前台读写idle_ms后，由ahci_idle_poll发出的trim和推迟的刷新
+#[repr(C)]
+pub struct ahci_idle {
+    pub idle_ms: u32,
+    pub fg_active: AtomicU32,     // 进行中的前台读写
+    pub last_fg_us: AtomicU64,    // 最近一次前台活动的ahci_get_time_us()
+    pub running: AtomicU32,       // ahci_idle_poll运行时置位
+    pub flush_pending: AtomicU32, // 有被推迟的写缓存刷新
+
+    // 排队的trim范围，按位分配和填写
+    pub trim_alloc: AtomicU32,
+    pub trim_ready: AtomicU32,
+    pub trim_q: [ahci_trim_range; AHCI_TRIM_QUEUE_DEPTH as usize],
+    pub trim_cur: ahci_trim_range, // 跨多个命令的范围的剩余部分
+    pub trim_buf: u64,             // 一个dsm块
+}
+
 #[repr(C)]
 pub struct ahci_device {
     pub mmio_base: u64,
 
     pub flags: u32,
+    pub completion_mode: u32, // AHCI_COMPLETION_*
+    pub cmd_timeout_ms: u32,  // 命令超时
 
     pub cap: u32,
     pub cap2: u32,
@@ -196,6 +351,9 @@ pub struct ahci_device {
 
     pub pio_mask: u32,
     pub udma_mask: u32,
+    pub slot_mask: u32,     // HOST_CAP支持的命令槽
+    pub ncq_mask: u32,      // 可用作ncq tag的命令槽
+    pub prio_reserved: u32, // 为高优先级请求保留的命令槽数
 
     pub n_ports: u8, // num of ports
     pub port_map_linkup: u32,
@@ -203,4 +361,43 @@ pub struct ahci_device {
     pub port_idx: u8, // the enabled port
 
     pub blk_dev: ahci_blk_dev,
+
+    pub idle: ahci_idle,
+
+    pub cpu_q: [ahci_cpu_queue; AHCI_MAX_CPUS as usize], // 按ahci_cpu_id()索引
+}
+
+// 最多AHCI_STREAM_MAX_BUFS个缓冲区在途的lba48顺序传输
+// 缓冲区按顺序在环中流转: acquire -> 调用者 -> release -> 设备
+#[repr(C)]
+pub struct ahci_stream {
+    pub ahci_dev: *const ahci_device,
+    pub mem: *mut u8, // nbufs个buf_blks逻辑扇区大小的缓冲区
+    pub blknr: u64, // 流的起始lba
+    pub blkcnt: u64,
+    pub is_write: u32,
+    pub nbufs: u32,
+    pub buf_blks: u32,
+    pub status: i32, // 0，传输失败后为-1
+
+    pub nchunks: u64, // 覆盖整个范围所需的缓冲区次数
+    pub submitted: u64, // 已交给设备的块
+    pub acquired: u64, // 已交给调用者的块
+    pub released: u64, // 调用者已归还的块
+
+    pub req: [ahci_request; AHCI_STREAM_MAX_BUFS as usize], // 每个缓冲区最近一次的请求
+}
+
+// 在max_blks个逻辑扇区的暂存区上合并写入
+// 落在暂存范围内或紧接其后的写入在内存中合并，
+// 暂存区写满、第一次暂存后超过timeout_ms或sync时作为一次写入交给设备
+#[repr(C)]
+pub struct ahci_wcomb {
+    pub ahci_dev: *const ahci_device,
+    pub mem: *mut u8, // 暂存区，必须可用于dma
+    pub max_blks: u32,
+    pub timeout_ms: u32,
+    pub start: u64,     // 暂存的起始lba
+    pub count: u32,     // 暂存的逻辑扇区数，为0时暂存区为空
+    pub staged_us: u64, // 第一次暂存写入时的ahci_get_time_us()
 }
@@ -1,6 +1,10 @@
-#![allow(dead_code, unused_assignments, unused_mut, non_upper_case_globals)]
+#![allow(dead_code, unused_assignments, unused_mut, non_upper_case_globals, non_camel_case_types)]
 
 pub const SETFEATURES_XFER: u8 = 0x03;
+pub const SETFEATURES_WC_ON: u8 = 0x02;
+pub const SETFEATURES_WC_OFF: u8 = 0x82;
+pub const SETFEATURES_RA_ON: u8 = 0xaa;
+pub const SETFEATURES_RA_OFF: u8 = 0x55;
 pub const XFER_UDMA_7: u8 = 0x47;
 pub const XFER_UDMA_6: u8 = 0x46;
 pub const XFER_UDMA_5: u8 = 0x45;
@@ -115,6 +119,18 @@ pub const ATA_CMD_SANITIZE_DEVICE: u8 = 0xB4;
 pub const ATA_CMD_ZAC_MGMT_IN: u8 = 0x4A;
 pub const ATA_CMD_ZAC_MGMT_OUT: u8 = 0x9F;
 
+// FPDMA QUEUED命令count字段的15:14位为ncq优先级
+pub const ATA_SHIFT_PRIO: u8 = 6;
+pub const ATA_PRIO_HIGH: u8 = 2;
+
+// DATA SET MANAGEMENT，512字节的块中存放8字节的lba/count范围
+pub const ATA_DSM_TRIM: u8 = 0x01;
+
+// READ LOG EXT，ncq命令错误日志，第0字节为NQ和出错的tag
+pub const ATA_LOG_SATA_NCQ: u8 = 0x10;
+pub const ATA_LOG_NCQ_NQ: u8 = 0x80;
+pub const ATA_LOG_NCQ_TAG: u8 = 0x1f;
+
 pub const ATA_HOB: u8 = 0x80;
 pub const ATA_NIEN: u8 = 0x02;
 pub const ATA_LBA: u8 = 0x40;
@@ -202,6 +218,7 @@ pub const ATA_ID_CFA_KEY_MGMT: u32 = 162;
 pub const ATA_ID_CFA_MODES: u32 = 163;
 pub const ATA_ID_DATA_SET_MGMT: u32 = 169;
 pub const ATA_ID_SCT_CMD_XPORT: u32 = 206;
+pub const ATA_ID_LOGICAL_SECTOR_ALIGN: u32 = 209;
 pub const ATA_ID_ROT_SPEED: u32 = 217;
 pub const ATA_ID_PIO4: u32 = 2;
 
@@ -227,7 +244,7 @@ pub const SATA_FIS_TYPE_DMA_ACT_D2H: sata_fis_type = 57;
 pub const SATA_FIS_TYPE_REGISTER_D2H: sata_fis_type = 52;
 pub const SATA_FIS_TYPE_REGISTER_H2D: sata_fis_type = 39;
 
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, Default)]
 #[repr(C)]
 pub struct sata_fis_h2d {
     pub fis_type: u8,
@@ -249,12 +266,73 @@ pub struct sata_fis_h2d {
     pub res2: [u8; 4],
 }
 
+#[derive(Copy, Clone)]
+#[repr(C)]
+pub struct sata_fis_d2h {
+    pub fis_type: u8,
+    pub pm_port_i: u8,
+    pub status: u8,
+    pub error: u8,
+    pub lba_low: u8,
+    pub lba_mid: u8,
+    pub lba_high: u8,
+    pub device: u8,
+    pub lba_low_exp: u8,
+    pub lba_mid_exp: u8,
+    pub lba_high_exp: u8,
+    pub res1: u8,
+    pub sector_count: u8,
+    pub sector_count_exp: u8,
+    pub res2: [u8; 6],
+}
+
+#[derive(Copy, Clone)]
+#[repr(C)]
+pub struct sata_fis_pio_setup {
+    pub fis_type: u8,
+    pub pm_port_i: u8,
+    pub status: u8,
+    pub error: u8,
+    pub lba_low: u8,
+    pub lba_mid: u8,
+    pub lba_high: u8,
+    pub device: u8,
+    pub lba_low_exp: u8,
+    pub lba_mid_exp: u8,
+    pub lba_high_exp: u8,
+    pub res1: u8,
+    pub sector_count: u8,
+    pub sector_count_exp: u8,
+    pub res2: u8,
+    pub e_status: u8,
+    pub transfer_count: u16,
+    pub res3: [u8; 2],
+}
+
+#[derive(Copy, Clone)]
+#[repr(C)]
+pub struct sata_fis_sdb {
+    pub fis_type: u8,
+    pub pm_port_i: u8,
+    pub status: u8,
+    pub error: u8,
+    pub sactive: u32,
+}
+
 pub fn ata_id_has_lba(id: &[u16]) -> bool {
     return (id[ATA_ID_CAPABILITY as usize] & (1 << 9)) != 0;
 }
 
+pub fn ata_id_has_ncq(id: &[u16]) -> bool {
+    return (id[ATA_ID_SATA_CAPABILITY as usize] & (1 << 8)) != 0;
+}
+
+pub fn ata_id_has_ncq_prio(id: &[u16]) -> bool {
+    return (id[ATA_ID_SATA_CAPABILITY as usize] & (1 << 12)) != 0;
+}
+
 pub fn ata_id_queue_depth(id: &[u16]) -> u32 {
-    return (id[ATA_ID_QUEUE_DEPTH as usize] & 0x1f + 1) as u32;
+    return ((id[ATA_ID_QUEUE_DEPTH as usize] & 0x1f) + 1) as u32;
 }
 
 pub fn ata_id_u32(id: &[u16], n: u32) -> u32 {
@@ -270,6 +348,37 @@ pub fn ata_id_u64(id: &[u16], n: u32) -> u64 {
     return val;
 }
 
+// 参考linux/include/linux/ata.h
+pub fn ata_id_log2_per_physical_sector(id: &[u16]) -> u8 {
+    // bit 15为0，bit 14为1，bit 13表示一个物理扇区包含多个逻辑扇区
+    if (id[ATA_ID_SECTOR_SIZE as usize] & 0xe000) == 0x6000 {
+        return (id[ATA_ID_SECTOR_SIZE as usize] & 0xf) as u8;
+    }
+    return 0;
+}
+
+// 与物理扇区对齐的最小lba
+pub fn ata_id_logical_sector_offset(id: &[u16], log2_per_phys: u8) -> u16 {
+    let word_209: u16 = id[ATA_ID_LOGICAL_SECTOR_ALIGN as usize];
+
+    if log2_per_phys > 1 && (word_209 & 0xc000) == 0x4000 {
+        let first: u16 = word_209 & 0x3fff;
+        if first > 0 {
+            return (1 << log2_per_phys) - first;
+        }
+    }
+    return 0;
+}
+
+// word 117-118，单位为字节，0xd000忽略bit 13
+// 参考linux/drivers/ata/libata-scsi.c
+pub fn ata_id_logical_sector_size(id: &[u16]) -> u32 {
+    if (id[ATA_ID_SECTOR_SIZE as usize] & 0xd000) == 0x5000 {
+        return ata_id_u32(id, ATA_ID_LOGICAL_SECTOR_SIZE) * 2;
+    }
+    return ATA_SECT_SIZE;
+}
+
 pub fn ata_id_has_flush(id: &[u16]) -> bool {
     if (id[ATA_ID_COMMAND_SET_2 as usize] & 0xc000) != 0x4000 {
         return false;
@@ -308,6 +417,24 @@ pub fn ata_id_wcache_enabled(id: &[u16]) -> bool {
     return (id[ATA_ID_CFS_ENABLE_1 as usize] & (1 << 5)) != 0;
 }
 
+pub fn ata_id_has_trim(id: &[u16]) -> bool {
+    return (id[ATA_ID_DATA_SET_MGMT as usize] & 1) != 0;
+}
+
+pub fn ata_id_has_rahead(id: &[u16]) -> bool {
+    if (id[ATA_ID_COMMAND_SET_2 as usize] & 0xc000) != 0x4000 {
+        return false;
+    }
+    return (id[ATA_ID_COMMAND_SET_1 as usize] & (1 << 6)) != 0;
+}
+
+pub fn ata_id_rahead_enabled(id: &[u16]) -> bool {
+    if (id[ATA_ID_CSF_DEFAULT as usize] & 0xc000) != 0x4000 {
+        return false;
+    }
+    return (id[ATA_ID_CFS_ENABLE_1 as usize] & (1 << 6)) != 0;
+}
+
 pub fn ata_id_n_sectors(id: &[u16]) -> u64 {
     if ata_id_has_lba(id) {
         if ata_id_has_lba48(id) {
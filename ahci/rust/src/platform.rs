@@ -1,45 +1,287 @@
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
 use core::arch::asm;
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+use core::cell::UnsafeCell;
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+use core::sync::atomic::{AtomicUsize, Ordering};
 
-/*
-// for C ffi test
-unsafe extern "C" {
-    pub fn ahci_mdelay(ms: u32);
-    pub fn ahci_printf(fmt: *const u8, _: ...) -> i32;
-    pub fn ahci_malloc_align(size: u64, align: u32) -> u64;
-    pub fn ahci_sync_dcache();
-    pub fn ahci_phys_to_uncached(va: u64) -> u64;
-    pub fn ahci_virt_to_phys(va: u64) -> u64;
+// 驱动依赖的平台功能
+// 实现在编译时通过Plat选定，驱动中的调用都是静态分派，可以内联到热路径中
+pub trait AhciPlatform {
+    // 等待数毫秒
+    fn mdelay(ms: u32);
+
+    // 分配按align字节对齐的内存
+    fn malloc_align(size: u64, align: u32) -> u64;
+
+    // 同步dcache中所有cached和uncached访存请求
+    fn sync_dcache();
+
+    // 当前cpu的编号
+    fn cpu_id() -> u32;
+
+    // 单调递增的微秒时间
+    fn get_time_us() -> u64;
+
+    // 物理地址转换为uncached虚拟地址
+    fn phys_to_uncached(pa: u64) -> u64;
+
+    // cached虚拟地址转换为物理地址
+    // ahci dma可以接受64位的物理地址
+    fn virt_to_phys(va: u64) -> u64;
 }
-*/
 
 // 这里是测试时用于调用C的printf
-// 替换成OS实现的printf
+// 替换成OS实现的printf，可变参数无法放入trait
 unsafe extern "C" {
     pub fn ahci_printf(fmt: *const u8, _: ...) -> i32;
 }
 
-// 等待数毫秒
-pub fn ahci_mdelay(ms: u32) {}
+// 静态区域上的顺序分配器，驱动只在初始化时分配，不释放
+// 区域在镜像的bss中，裸机和主机上都是dma可以访问的低地址
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+#[repr(C, align(4096))]
+pub struct BumpHeap<const N: usize> {
+    mem: UnsafeCell<[u8; N]>,
+    used: AtomicUsize,
+}
 
-// 同步dcache中所有cached和uncached访存请求
-pub fn ahci_sync_dcache() {
-    unsafe {
-        asm!("dbar 0");
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+unsafe impl<const N: usize> Sync for BumpHeap<N> {}
+
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+impl<const N: usize> BumpHeap<N> {
+    pub const fn new() -> Self {
+        return BumpHeap { mem: UnsafeCell::new([0; N]), used: AtomicUsize::new(0) };
+    }
+
+    // 空间不足时返回0
+    pub fn alloc(&self, size: u64, align: u32) -> u64 {
+        let base: usize = self.mem.get() as usize;
+        let align: usize = (align as usize).max(1);
+        let mut used: usize = self.used.load(Ordering::Relaxed);
+
+        loop {
+            let start: usize = (base + used + align - 1) & !(align - 1);
+            let end: usize = start + size as usize;
+            if end > base + N {
+                return 0;
+            }
+
+            match self.used.compare_exchange_weak(used, end - base, Ordering::Relaxed, Ordering::Relaxed) {
+                Ok(_) => return start as u64,
+                Err(cur) => used = cur,
+            }
+        }
     }
 }
 
-// 分配按align字节对齐的内存
+// 龙芯2K1000LA裸机实现，未启用其他实现时使用
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub const LS2K_HEAP_SZ: usize = 256 << 10; // 每个端口的命令表和接收FIS区约34KiB
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+static LS2K_HEAP: BumpHeap<LS2K_HEAP_SZ> = BumpHeap::new();
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub struct Ls2kPlatform;
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+impl AhciPlatform for Ls2kPlatform {
+    // 忙等稳定计数器
+    fn mdelay(ms: u32) {
+        let end: u64 = Self::get_time_us() + ms as u64 * 1000;
+        while Self::get_time_us() < end {
+            core::hint::spin_loop();
+        }
+    }
+
+    #[inline(always)]
+    fn sync_dcache() {
+        unsafe {
+            asm!("dbar 0");
+        }
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        return LS2K_HEAP.alloc(size, align);
+    }
+
+    // 读取CSR.CPUID
+    #[inline(always)]
+    fn cpu_id() -> u32 {
+        let id: u64;
+        unsafe {
+            asm!("csrrd {}, 0x20", out(reg) id);
+        }
+        (id & 0x1ff) as u32
+    }
+
+    // ls2k稳定计数器频率为100MHz
+    #[inline(always)]
+    fn get_time_us() -> u64 {
+        let cnt: u64;
+        unsafe {
+            asm!("rdtime.d {}, $zero", out(reg) cnt);
+        }
+        cnt / 100
+    }
+
+    #[inline(always)]
+    fn phys_to_uncached(pa: u64) -> u64 {
+        pa
+    }
+
+    #[inline(always)]
+    fn virt_to_phys(va: u64) -> u64 {
+        va
+    }
+}
+
+// RT-Thread等C环境，调用ahci_platform.h中由系统提供的函数
+#[cfg(feature = "rtthread")]
+pub struct FfiPlatform;
+
+#[cfg(feature = "rtthread")]
+mod c {
+    unsafe extern "C" {
+        pub fn ahci_mdelay(ms: u32);
+        pub fn ahci_malloc_align(size: u64, align: u32) -> u64;
+        pub fn ahci_cpu_id() -> u32;
+        pub fn ahci_get_time_us() -> u64;
+        pub fn ahci_sync_dcache();
+        pub fn ahci_phys_to_uncached(va: u64) -> u64;
+        pub fn ahci_virt_to_phys(va: u64) -> u64;
+    }
+}
+
+#[cfg(feature = "rtthread")]
+impl AhciPlatform for FfiPlatform {
+    fn mdelay(ms: u32) {
+        unsafe { c::ahci_mdelay(ms) }
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        unsafe { c::ahci_malloc_align(size, align) }
+    }
+
+    fn sync_dcache() {
+        unsafe { c::ahci_sync_dcache() }
+    }
+
+    fn cpu_id() -> u32 {
+        unsafe { c::ahci_cpu_id() }
+    }
+
+    fn get_time_us() -> u64 {
+        unsafe { c::ahci_get_time_us() }
+    }
+
+    fn phys_to_uncached(pa: u64) -> u64 {
+        unsafe { c::ahci_phys_to_uncached(pa) }
+    }
+
+    fn virt_to_phys(va: u64) -> u64 {
+        unsafe { c::ahci_virt_to_phys(va) }
+    }
+}
+
+// 主机上的模拟实现，只用于单元测试（基准测试用rtthread，链接bench中的C平台函数）
+// 内存从静态区域中顺序分配，不释放；时间是虚拟时钟，
+// 每次读取前进1微秒，mdelay直接推进时钟
+#[cfg(feature = "mock")]
+pub struct MockPlatform;
+
+#[cfg(feature = "mock")]
+mod mock {
+    use super::BumpHeap;
+    use core::sync::atomic::AtomicU64;
+
+    pub const MOCK_HEAP_SZ: usize = 4 << 20;
+
+    pub static HEAP: BumpHeap<MOCK_HEAP_SZ> = BumpHeap::new();
+    pub static CLOCK_US: AtomicU64 = AtomicU64::new(0);
+}
+
+#[cfg(feature = "mock")]
+impl AhciPlatform for MockPlatform {
+    fn mdelay(ms: u32) {
+        mock::CLOCK_US.fetch_add(ms as u64 * 1000, core::sync::atomic::Ordering::Relaxed);
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        return mock::HEAP.alloc(size, align);
+    }
+
+    #[inline(always)]
+    fn sync_dcache() {
+        core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+    }
+
+    #[inline(always)]
+    fn cpu_id() -> u32 {
+        0
+    }
+
+    #[inline(always)]
+    fn get_time_us() -> u64 {
+        mock::CLOCK_US.fetch_add(1, core::sync::atomic::Ordering::Relaxed) + 1
+    }
+
+    #[inline(always)]
+    fn phys_to_uncached(pa: u64) -> u64 {
+        pa
+    }
+
+    #[inline(always)]
+    fn virt_to_phys(va: u64) -> u64 {
+        va
+    }
+}
+
+// 编译时选择的平台实现
+#[cfg(feature = "rtthread")]
+pub type Plat = FfiPlatform;
+
+#[cfg(all(feature = "mock", not(feature = "rtthread")))]
+pub type Plat = MockPlatform;
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub type Plat = Ls2kPlatform;
+
+// 驱动使用的平台函数，转发给Plat
+
+#[inline(always)]
+pub fn ahci_mdelay(ms: u32) {
+    Plat::mdelay(ms);
+}
+
+#[inline(always)]
+pub fn ahci_sync_dcache() {
+    Plat::sync_dcache();
+}
+
+#[inline(always)]
 pub fn ahci_malloc_align(size: u64, align: u32) -> u64 {
-    0
+    return Plat::malloc_align(size, align);
+}
+
+#[inline(always)]
+pub fn ahci_cpu_id() -> u32 {
+    return Plat::cpu_id();
+}
+
+#[inline(always)]
+pub fn ahci_get_time_us() -> u64 {
+    return Plat::get_time_us();
 }
 
-// 物理地址转换为uncached虚拟地址
+#[inline(always)]
 pub fn ahci_phys_to_uncached(pa: u64) -> u64 {
-    pa
+    return Plat::phys_to_uncached(pa);
 }
 
-// cached虚拟地址转换为物理地址
-// ahci dma可以接受64位的物理地址
+#[inline(always)]
 pub fn ahci_virt_to_phys(va: u64) -> u64 {
-    va
+    return Plat::virt_to_phys(va);
 }
@@ -0,0 +1,60 @@
+#ifndef __LS2K_BENCH_H__
+#define __LS2K_BENCH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef BENCH_RUST
+#define BENCH_DRIVER "rust"
+#else
+#define BENCH_DRIVER "c"
+#endif
+
+// dma memory of the simulated board, bump allocated and never freed
+// it lies below 4 GiB, gmac descriptors only hold 32 bit addresses
+void *bench_dma_alloc(uint64_t size, uint32_t align);
+
+// timestamp counter of the host cpu, tsc on x86
+uint64_t bench_cycles(void);
+
+// monotonic time in nanoseconds
+uint64_t bench_ns(void);
+
+// cpu count, the simulated devices want a cpu of their own
+uint32_t bench_ncpus(void);
+
+// called by a device thread with nothing to do
+// with a single cpu it sleeps briefly so the spinning driver gets preempted
+// as soon as the sleep ends, instead of at the end of its time slice
+void bench_device_idle(void);
+
+// run fn(arg) to completion on a thread with a painted stack
+// return the bytes of stack it touched beyond an empty thread
+uint64_t bench_run_measured(void (*fn)(void *), void *arg);
+
+// one json line per workload on stdout
+void bench_report(const char *driver, const char *device, const char *workload, uint64_t ops,
+                  uint64_t cycles, uint64_t ns, uint64_t stack, uint64_t errors);
+
+// bytes copied by eth_handle_tx_buffer, set per workload
+extern uint32_t bench_frame_len;
+
+// simulated ahci controller with one sata disk of disk_blks 512 byte sectors
+// return the base of its registers, ahci_phys_to_uncached maps 0x400e0000 there
+uint64_t sim_ahci_start(uint64_t disk_blks);
+void sim_ahci_stop(void);
+extern uint64_t sim_ahci_mmio;
+
+// simulated gmac0 and gmac1 with the chip configuration block selecting the
+// gmac1 pins, eth_phys_to_uncached maps 0x1fe00000 to sim_chip_cfg
+void sim_gmac_start(void);
+void sim_gmac_stop(void);
+extern uint64_t sim_chip_cfg;
+
+// base of the registers of a unit for net_device.iobase
+uint64_t sim_gmac_base(uint32_t unit);
+
+// let the simulated wire of a unit deliver 'frames' frames of 'len' bytes
+void sim_gmac_rx_inject(uint32_t unit, uint32_t frames, uint32_t len);
+
+#endif // __LS2K_BENCH_H__
@@ -0,0 +1,339 @@
+// storage workloads, built once against each ahci driver
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#ifdef BENCH_RUST
+#include "drv_ahci.h"
+
+// libahci.h values, the rust header has no constants
+enum {
+    HOST_CAP_NCQ             = 1 << 30,
+    SATA_FLAG_NCQ            = 0x00001000,
+    AHCI_PRIO_RESERVED_SLOTS = 4,
+    AHCI_COMPLETION_MMIO     = 0,
+    AHCI_COMPLETION_FIS      = 1,
+};
+#else
+#include "libahci.h"
+
+// drv_ahci.c has no header of its own
+int ahci_init(struct ahci_device *ahci_dev);
+uint32_t ahci_sata_read_common(struct ahci_device *ahci_dev, uint64_t blknr,
+                               uint32_t blkcnt, void *buffer);
+uint32_t ahci_sata_write_common(struct ahci_device *ahci_dev, uint64_t blknr,
+                                uint32_t blkcnt, void *buffer);
+uint32_t ahci_sata_read_prio(struct ahci_device *ahci_dev, uint64_t blknr,
+                             uint32_t blkcnt, void *buffer, uint32_t prio);
+int ahci_sata_set_wcache(struct ahci_device *ahci_dev, bool enable);
+int ahci_sata_set_rahead(struct ahci_device *ahci_dev, bool enable);
+void ahci_set_completion_mode(struct ahci_device *ahci_dev, uint32_t mode);
+void ahci_set_idle_time(struct ahci_device *ahci_dev, uint32_t ms);
+int ahci_sata_queue_trim(struct ahci_device *ahci_dev, uint64_t blknr, uint64_t blkcnt);
+uint32_t ahci_idle_poll(struct ahci_device *ahci_dev);
+int ahci_stream_open(struct ahci_device *ahci_dev, struct ahci_stream *st,
+                     uint64_t blknr, uint64_t blkcnt, uint32_t is_write,
+                     void *mem, uint32_t nbufs, uint32_t buf_blks);
+void *ahci_stream_acquire(struct ahci_stream *st, uint64_t *blknr, uint32_t *blkcnt);
+int ahci_stream_release(struct ahci_stream *st);
+int ahci_stream_close(struct ahci_stream *st);
+int ahci_wcomb_open(struct ahci_device *ahci_dev, struct ahci_wcomb *wc,
+                    void *mem, uint32_t max_blks, uint32_t timeout_ms);
+uint32_t ahci_wcomb_write(struct ahci_wcomb *wc, uint64_t blknr,
+                          uint32_t blkcnt, void *buffer);
+int ahci_wcomb_close(struct ahci_wcomb *wc);
+#endif
+
+enum {
+    BENCH_DISK_BLKS = 64 << 11, // 64 MiB of 512 byte sectors
+    BENCH_MAX_BLKS  = 128,
+
+    BENCH_STREAM_BUFS = 4,  // buffers of a stream in flight
+    BENCH_WCOMB_BLKS  = 128, // staging area of write combining
+
+    BENCH_WCACHE    = 1 << 0, // device write cache on
+    BENCH_RAHEAD    = 1 << 1, // device read look-ahead on
+    BENCH_FIS       = 1 << 2, // completion seen in the received fis area
+    BENCH_NCQ       = 1 << 3, // FPDMA QUEUED reads and writes, see bench_ahci_set_ncq
+};
+
+// how each operation reaches the disk
+enum ahci_api
+{
+    BENCH_RW,     // ahci_sata_read_common/ahci_sata_write_common
+    BENCH_STREAM, // acquire and release one buffer of an ahci_stream
+    BENCH_WCOMB,  // ahci_wcomb_write through a BENCH_WCOMB_BLKS staging area
+    BENCH_TRIM,   // ahci_sata_queue_trim, then ahci_idle_poll sends it
+};
+
+struct ahci_work
+{
+    const char *name;
+    uint32_t blkcnt;
+    uint32_t is_write;
+    bool random;
+    uint32_t mode; // BENCH_WCACHE | BENCH_RAHEAD | BENCH_FIS | BENCH_NCQ, all off otherwise
+    enum ahci_api api;
+};
+
+static const struct ahci_work works[] = {
+    { "seq_read_4k",         8,   0, false, 0,                           BENCH_RW },
+    { "seq_write_4k",        8,   1, false, 0,                           BENCH_RW },
+    { "rand_read_4k",        8,   0, true,  0,                           BENCH_RW },
+    { "rand_write_4k",       8,   1, true,  0,                           BENCH_RW },
+    { "seq_read_64k",        128, 0, false, 0,                           BENCH_RW },
+    { "seq_write_64k",       128, 1, false, 0,                           BENCH_RW },
+    { "seq_read_4k_wc",      8,   0, false, BENCH_WCACHE,                BENCH_RW },
+    { "seq_write_4k_wc",     8,   1, false, BENCH_WCACHE,                BENCH_RW },
+    { "rand_write_4k_wc",    8,   1, true,  BENCH_WCACHE,                BENCH_RW },
+    { "seq_write_64k_wc",    128, 1, false, BENCH_WCACHE,                BENCH_RW },
+    { "seq_read_4k_ra",      8,   0, false, BENCH_RAHEAD,                BENCH_RW },
+    { "seq_write_4k_ra",     8,   1, false, BENCH_RAHEAD,                BENCH_RW },
+    { "seq_read_64k_ra",     128, 0, false, BENCH_RAHEAD,                BENCH_RW },
+    { "seq_read_4k_wc_ra",   8,   0, false, BENCH_WCACHE | BENCH_RAHEAD, BENCH_RW },
+    { "seq_write_4k_wc_ra",  8,   1, false, BENCH_WCACHE | BENCH_RAHEAD, BENCH_RW },
+    { "seq_read_64k_wc_ra",  128, 0, false, BENCH_WCACHE | BENCH_RAHEAD, BENCH_RW },
+    { "seq_write_64k_wc_ra", 128, 1, false, BENCH_WCACHE | BENCH_RAHEAD, BENCH_RW },
+    { "seq_read_4k_fis",     8,   0, false, BENCH_FIS,                   BENCH_RW },
+    { "seq_write_4k_fis",    8,   1, false, BENCH_FIS,                   BENCH_RW },
+    { "rand_read_4k_fis",    8,   0, true,  BENCH_FIS,                   BENCH_RW },
+    { "seq_read_64k_fis",    128, 0, false, BENCH_FIS,                   BENCH_RW },
+    { "seq_read_4k_ncq",     8,   0, false, BENCH_NCQ,                   BENCH_RW },
+    { "seq_write_4k_ncq",    8,   1, false, BENCH_NCQ,                   BENCH_RW },
+    { "rand_read_4k_ncq",    8,   0, true,  BENCH_NCQ,                   BENCH_RW },
+    { "seq_read_64k_ncq",    128, 0, false, BENCH_NCQ,                   BENCH_RW },
+    { "rand_read_4k_ncq_fis",8,   0, true,  BENCH_NCQ | BENCH_FIS,       BENCH_RW },
+    { "stream_read_64k",     128, 0, false, 0,                           BENCH_STREAM },
+    { "stream_write_64k",    128, 1, false, 0,                           BENCH_STREAM },
+    { "stream_read_64k_ncq", 128, 0, false, BENCH_NCQ,                   BENCH_STREAM },
+    { "stream_write_64k_ncq",128, 1, false, BENCH_NCQ,                   BENCH_STREAM },
+    { "wcomb_write_4k",      8,   1, false, 0,                           BENCH_WCOMB },
+    { "wcomb_write_4k_wc",   8,   1, false, BENCH_WCACHE,                BENCH_WCOMB },
+    { "trim_64k",            128, 1, false, 0,                           BENCH_TRIM },
+    { "trim_4k",             8,   1, true,  0,                           BENCH_TRIM },
+};
+
+struct ahci_run
+{
+    struct ahci_device *ahci_dev;
+    const struct ahci_work *work;
+    uint64_t ops;
+    uint8_t *buf;  // BENCH_STREAM_BUFS buffers of BENCH_MAX_BLKS sectors
+    uint8_t *wmem; // BENCH_WCOMB_BLKS sectors of write combining staging
+    struct ahci_stream st;
+    struct ahci_wcomb wc;
+
+    uint64_t cycles;
+    uint64_t ns;
+    uint64_t errors;
+};
+
+// capability and ncq fields as left by ahci_init
+static uint32_t init_cap, init_slot_mask, init_prio_reserved;
+
+static void bench_ahci_init(void *arg)
+{
+    struct ahci_run *run = arg;
+    uint64_t c0 = bench_cycles(), t0 = bench_ns();
+
+    if (ahci_init(run->ahci_dev))
+        run->errors ++;
+
+    run->cycles = bench_cycles() - c0;
+    run->ns = bench_ns() - t0;
+
+    // a priority past AHCI_PRIO_HIGH has no ring and must move nothing
+    uint8_t sector[512];
+    if (ahci_sata_read_prio(run->ahci_dev, 0, 1, sector, 2))
+        run->errors ++;
+}
+
+// ahci_host_init rewrites HOST_CAP and the simulated hba cannot refuse the
+// write, so ncq is set up the way ahci_sata_init_ncq does on a board whose
+// firmware already set 32 slots and ncq: the disk reports a queue depth of
+// 32 and no ncq priority
+static void bench_ahci_set_ncq(struct ahci_device *ahci_dev, bool enable)
+{
+    if (enable)
+    {
+        ahci_dev->cap = init_cap | HOST_CAP_NCQ | (31 << 8); // NCS, 32 slots
+        ahci_dev->slot_mask = 0xffffffffu;
+        ahci_dev->ncq_mask = 0xffffffffu;
+        ahci_dev->prio_reserved = AHCI_PRIO_RESERVED_SLOTS;
+        ahci_dev->flags |= SATA_FLAG_NCQ;
+    }
+    else
+    {
+        ahci_dev->cap = init_cap;
+        ahci_dev->slot_mask = init_slot_mask;
+        ahci_dev->ncq_mask = 0;
+        ahci_dev->prio_reserved = init_prio_reserved;
+        ahci_dev->flags &= ~SATA_FLAG_NCQ;
+    }
+}
+
+// a stream over the whole disk in chunks of blkcnt sectors
+static int bench_ahci_stream_open(struct ahci_run *run)
+{
+    const struct ahci_work *w = run->work;
+
+    // ahci_stream_open must not rely on a zeroed stream
+    memset(&run->st, 0xa5, sizeof(run->st));
+
+    return ahci_stream_open(run->ahci_dev, &run->st, 0, BENCH_DISK_BLKS / w->blkcnt * w->blkcnt,
+                            w->is_write, run->buf, BENCH_STREAM_BUFS, w->blkcnt);
+}
+
+// acquire and release the next buffer, start over at the end of the disk
+static uint64_t bench_ahci_stream_next(struct ahci_run *run)
+{
+    if (!ahci_stream_acquire(&run->st, NULL, NULL))
+    {
+        if (ahci_stream_close(&run->st) || bench_ahci_stream_open(run) ||
+            !ahci_stream_acquire(&run->st, NULL, NULL))
+            return 0;
+    }
+
+    return ahci_stream_release(&run->st) ? 0 : run->work->blkcnt;
+}
+
+static void bench_ahci_io(struct ahci_run *run, uint64_t i, uint64_t *seed, uint64_t *errors)
+{
+    const struct ahci_work *w = run->work;
+    uint64_t span = BENCH_DISK_BLKS / w->blkcnt;
+    uint64_t blknr, rc = 0;
+
+    if (w->random)
+    {
+        *seed = *seed * 6364136223846793005ull + 1442695040888963407ull;
+        blknr = (*seed >> 33) % span * w->blkcnt;
+    }
+    else
+        blknr = i % span * w->blkcnt;
+
+    switch (w->api)
+    {
+    case BENCH_RW:
+        if (w->is_write)
+            rc = ahci_sata_write_common(run->ahci_dev, blknr, w->blkcnt, run->buf);
+        else
+            rc = ahci_sata_read_common(run->ahci_dev, blknr, w->blkcnt, run->buf);
+        break;
+
+    case BENCH_STREAM:
+        rc = bench_ahci_stream_next(run);
+        break;
+
+    case BENCH_WCOMB:
+        rc = ahci_wcomb_write(&run->wc, blknr, w->blkcnt, run->buf);
+        break;
+
+    case BENCH_TRIM:
+        // the disk counts as idle at once, so each poll sends the range just queued
+        if (!ahci_sata_queue_trim(run->ahci_dev, blknr, w->blkcnt) &&
+            ahci_idle_poll(run->ahci_dev) == 1)
+            rc = w->blkcnt;
+        break;
+    }
+
+    if (rc != w->blkcnt)
+        ++ *errors;
+}
+
+// a sixteenth of the operations warm up caches and branch predictors first
+// a stream or write combining area stays open across both, its close is not timed
+static void bench_ahci_work(void *arg)
+{
+    struct ahci_run *run = arg;
+    uint64_t seed = 1, errors = 0, c0, t0;
+
+    if (run->work->api == BENCH_STREAM && bench_ahci_stream_open(run))
+        ++ errors;
+    if (run->work->api == BENCH_WCOMB &&
+        ahci_wcomb_open(run->ahci_dev, &run->wc, run->wmem, BENCH_WCOMB_BLKS, 0))
+        ++ errors;
+    if (errors)
+    {
+        run->errors = errors;
+        return;
+    }
+
+    for (uint64_t i = 0; i < run->ops / 16; ++ i)
+        bench_ahci_io(run, i, &seed, &errors);
+
+    c0 = bench_cycles();
+    t0 = bench_ns();
+    for (uint64_t i = 0; i < run->ops; ++ i)
+        bench_ahci_io(run, i, &seed, &errors);
+    run->cycles = bench_cycles() - c0;
+    run->ns = bench_ns() - t0;
+
+    if (run->work->api == BENCH_STREAM && ahci_stream_close(&run->st))
+        ++ errors;
+    if (run->work->api == BENCH_WCOMB && ahci_wcomb_close(&run->wc))
+        ++ errors;
+    run->errors = errors;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 0) : 20000;
+    struct ahci_device *ahci_dev;
+    struct ahci_run run;
+    uint8_t *buf, *wmem;
+    uint64_t stack;
+
+    ahci_dev = aligned_alloc(64, (sizeof(*ahci_dev) + 63) & ~63ul);
+    memset(ahci_dev, 0, sizeof(*ahci_dev));
+    buf = bench_dma_alloc(BENCH_STREAM_BUFS * BENCH_MAX_BLKS * 512, 4096);
+    wmem = bench_dma_alloc(BENCH_WCOMB_BLKS * 512, 4096);
+
+    sim_ahci_start(BENCH_DISK_BLKS);
+
+    memset(&run, 0, sizeof(run));
+    run.ahci_dev = ahci_dev;
+    stack = bench_run_measured(bench_ahci_init, &run);
+    bench_report(BENCH_DRIVER, "ahci", "init", 1, run.cycles, run.ns, stack, run.errors);
+    if (run.errors || ahci_dev->blk_dev.lba != BENCH_DISK_BLKS)
+    {
+        fprintf(stderr, "ahci init failed\n");
+        return 1;
+    }
+
+    init_cap = ahci_dev->cap;
+    init_slot_mask = ahci_dev->slot_mask;
+    init_prio_reserved = ahci_dev->prio_reserved;
+    // trims go out from ahci_idle_poll without waiting for the disk to settle
+    ahci_set_idle_time(ahci_dev, 0);
+
+    for (uint32_t i = 0; i < sizeof(works) / sizeof(works[0]); ++ i)
+    {
+        uint32_t mode = works[i].mode;
+
+        memset(&run, 0, sizeof(run));
+        run.ahci_dev = ahci_dev;
+        run.work = &works[i];
+        run.ops = ops;
+        run.buf = buf;
+        run.wmem = wmem;
+        memset(run.buf, i, BENCH_STREAM_BUFS * BENCH_MAX_BLKS * 512);
+        if (ahci_sata_set_wcache(ahci_dev, mode & BENCH_WCACHE) ||
+            ahci_sata_set_rahead(ahci_dev, mode & BENCH_RAHEAD))
+        {
+            fprintf(stderr, "ahci cache mode change failed\n");
+            return 1;
+        }
+        ahci_set_completion_mode(ahci_dev, mode & BENCH_FIS ? AHCI_COMPLETION_FIS
+                                                            : AHCI_COMPLETION_MMIO);
+        bench_ahci_set_ncq(ahci_dev, mode & BENCH_NCQ);
+
+        stack = bench_run_measured(bench_ahci_work, &run);
+        bench_report(BENCH_DRIVER, "ahci", works[i].name, run.ops, run.cycles, run.ns, stack, run.errors);
+    }
+
+    sim_ahci_stop();
+    return 0;
+}
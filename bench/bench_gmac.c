@@ -0,0 +1,410 @@
+// network workloads, built once against each gmac driver
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#ifdef BENCH_RUST
+#include "drv_eth.h"
+#else
+#include "drv_eth.h"
+
+// drv_eth.h of the c driver only declares the newer entry points
+int eth_init(struct net_device *gmacdev);
+void eth_irq(struct net_device *gmacdev);
+uint64_t eth_rx(struct net_device *gmacdev);
+int eth_tx(struct net_device *gmacdev, uint64_t pbuf);
+#endif
+
+enum {
+    BENCH_TX_RECLAIM  = 64, // frames in flight before the tx interrupt is taken
+    BENCH_TX_BURST    = 32, // frames per eth_tx_burst call
+    BENCH_RX_BURST    = 32, // frames per eth_rx_burst call
+    BENCH_POLL_BUDGET = 64, // eth_poll budget
+    BENCH_TX_COALESCE = 16, // tx frames per completion interrupt of the coalescing workloads
+    BENCH_RX_USECS    = 50, // rx interrupt watchdog of the coalescing workloads
+    BENCH_FRAME_SZ    = 9216, // room for a jumbo frame
+};
+
+struct gmac_work
+{
+    const char *name;
+    uint32_t len;
+    uint32_t is_tx;
+    uint32_t burst;
+    uint32_t zero_copy;
+    uint32_t nseg;      // eth_tx_sg segments per frame, 0 copies with eth_tx
+    uint32_t poll;      // eth_poll budget, 0 receives without poll mode
+    uint32_t coalesce;  // tx frames per completion interrupt, also arms the rx watchdog
+    uint32_t dim;       // adaptive moderation, eth_irq steps the profile
+    uint32_t csum;      // checksum offload
+    uint32_t mtu;       // 0 keeps ETH_MTU
+    uint32_t dual;      // gmac0 and gmac1 at once, frames alternate between them
+};
+
+static const struct gmac_work works[] = {
+    { "tx_64",            64,   1, 0,              0, 0, 0, 0, 0, 0, 0, 0 },
+    { "tx_1514",          1514, 1, 0,              0, 0, 0, 0, 0, 0, 0, 0 },
+    { "tx_burst_64",      64,   1, BENCH_TX_BURST, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "tx_burst_1514",    1514, 1, BENCH_TX_BURST, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "tx_sg_64",         64,   1, 0,              0, 2, 0, 0, 0, 0, 0, 0 },
+    { "tx_sg_1514",       1514, 1, 0,              0, 3, 0, 0, 0, 0, 0, 0 },
+    { "rx_64",            64,   0, 0,              0, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_1514",          1514, 0, 0,              0, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_burst_64",      64,   0, BENCH_RX_BURST, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_burst_1514",    1514, 0, BENCH_RX_BURST, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_poll_64",       64,   0, 0,              0, 0, BENCH_POLL_BUDGET, 0, 0, 0, 0, 0 },
+    { "rx_poll_1514",     1514, 0, 0,              0, 0, BENCH_POLL_BUDGET, 0, 0, 0, 0, 0 },
+    { "tx_coal_64",       64,   1, 0,              0, 0, 0, BENCH_TX_COALESCE, 0, 0, 0, 0 },
+    { "tx_coal_1514",     1514, 1, 0,              0, 0, 0, BENCH_TX_COALESCE, 0, 0, 0, 0 },
+    { "rx_coal_64",       64,   0, 0,              0, 0, 0, BENCH_TX_COALESCE, 0, 0, 0, 0 },
+    { "rx_coal_1514",     1514, 0, 0,              0, 0, 0, BENCH_TX_COALESCE, 0, 0, 0, 0 },
+    { "tx_dim_64",        64,   1, 0,              0, 0, 0, 0, 1, 0, 0, 0 },
+    { "tx_dim_1514",      1514, 1, 0,              0, 0, 0, 0, 1, 0, 0, 0 },
+    { "tx_csum_64",       64,   1, 0,              0, 0, 0, 0, 0, 1, 0, 0 },
+    { "tx_csum_1514",     1514, 1, 0,              0, 0, 0, 0, 0, 1, 0, 0 },
+    { "rx_csum_64",       64,   0, 0,              0, 0, 0, 0, 0, 1, 0, 0 },
+    { "rx_csum_1514",     1514, 0, 0,              0, 0, 0, 0, 0, 1, 0, 0 },
+    { "tx_9014",          9014, 1, 0,              0, 0, 0, 0, 0, 0, ETH_MAX_MTU, 0 },
+    { "tx_burst_9014",    9014, 1, BENCH_TX_BURST, 0, 0, 0, 0, 0, 0, ETH_MAX_MTU, 0 },
+    { "rx_9014",          9014, 0, 0,              0, 0, 0, 0, 0, 0, ETH_MAX_MTU, 0 },
+    { "rx_burst_9014",    9014, 0, BENCH_RX_BURST, 0, 0, 0, 0, 0, 0, ETH_MAX_MTU, 0 },
+    { "tx_dual_1514",     1514, 1, 0,              0, 0, 0, 0, 0, 0, 0, 1 },
+    { "rx_dual_1514",     1514, 0, 0,              0, 0, 0, 0, 0, 0, 0, 1 },
+    // zero-copy stays on once enabled, these come last
+    { "rx_zc_64",         64,   0, 0,              1, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_zc_1514",       1514, 0, 0,              1, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_zc_burst_64",   64,   0, BENCH_RX_BURST, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { "rx_zc_burst_1514", 1514, 0, BENCH_RX_BURST, 1, 0, 0, 0, 0, 0, 0, 0 },
+};
+
+struct gmac_run
+{
+    struct net_device *gmacdev;
+    struct net_device *peer;      // gmac1 for the dual workloads
+    const struct gmac_work *work;
+    uint64_t ops;
+    uint8_t *frame;
+
+    uint64_t cycles;
+    uint64_t ns;
+    uint64_t errors;
+};
+
+static void bench_gmac_init(void *arg)
+{
+    struct gmac_run *run = arg;
+    uint64_t c0 = bench_cycles(), t0 = bench_ns();
+
+    if (eth_init(run->gmacdev))
+        run->errors ++;
+
+    run->cycles = bench_cycles() - c0;
+    run->ns = bench_ns() - t0;
+}
+
+// the driver never reclaims on its own, eth_irq stands in for the tx
+// interrupt once BENCH_TX_RECLAIM frames are outstanding and whenever
+// the ring is full; the ring can then never lap unreclaimed descriptors
+static void bench_gmac_tx(struct net_device *gmacdev, uint64_t frames, uint8_t *frame)
+{
+    uint64_t base = gmacdev->tx_packets;
+    uint64_t sent = 0;
+
+    while (sent < frames)
+    {
+        if (sent - (gmacdev->tx_packets - base) >= BENCH_TX_RECLAIM ||
+            eth_tx(gmacdev, (uint64_t)frame))
+        {
+            eth_irq(gmacdev);
+            continue;
+        }
+        sent ++;
+    }
+
+    while (gmacdev->tx_packets - base < frames)
+        eth_irq(gmacdev);
+}
+
+// the frame is cut into nseg equal segments, like a header pbuf chained
+// to payload pbufs, and sent without copying
+static void bench_gmac_tx_sg(struct net_device *gmacdev, uint64_t frames, uint8_t *frame,
+                             uint32_t nseg)
+{
+    struct eth_tx_seg segs[4];
+    uint64_t base = gmacdev->tx_packets;
+    uint64_t sent = 0;
+
+    for (uint32_t i = 0, off = 0; i < nseg; ++ i)
+    {
+        uint32_t len = (bench_frame_len - off) / (nseg - i);
+
+        segs[i].addr = (uint64_t)(frame + off);
+        segs[i].len = len;
+        off += len;
+    }
+
+    while (sent < frames)
+    {
+        if (sent - (gmacdev->tx_packets - base) >= BENCH_TX_RECLAIM ||
+            eth_tx_sg(gmacdev, segs, nseg, (uint64_t)frame))
+        {
+            eth_irq(gmacdev);
+            continue;
+        }
+        sent ++;
+    }
+
+    while (gmacdev->tx_packets - base < frames)
+        eth_irq(gmacdev);
+}
+
+static void bench_gmac_tx_burst(struct net_device *gmacdev, uint64_t frames, uint8_t *frame,
+                                uint32_t burst)
+{
+    uint64_t pbufs[BENCH_TX_BURST];
+    uint64_t base = gmacdev->tx_packets;
+    uint64_t sent = 0;
+
+    for (uint32_t i = 0; i < burst; ++ i)
+        pbufs[i] = (uint64_t)frame;
+
+    while (sent < frames)
+    {
+        uint32_t n = frames - sent < burst ? frames - sent : burst;
+
+        if (sent - (gmacdev->tx_packets - base) >= BENCH_TX_RECLAIM ||
+            (n = eth_tx_burst(gmacdev, pbufs, n)) == 0)
+        {
+            eth_irq(gmacdev);
+            continue;
+        }
+        sent += n;
+    }
+
+    while (gmacdev->tx_packets - base < frames)
+        eth_irq(gmacdev);
+}
+
+// with zero-copy the os returns every buffer as soon as it is done, so the
+// pool never runs dry and nothing falls back to copying
+static void bench_gmac_rx_release(struct net_device *gmacdev, uint64_t *pbufs, uint32_t n)
+{
+    if (!gmacdev->RxZeroCopy)
+        return;
+    for (uint32_t i = 0; i < n; ++ i)
+        eth_rx_release(gmacdev, pbufs[i]);
+}
+
+static void bench_gmac_rx(struct net_device *gmacdev, uint64_t frames)
+{
+    sim_gmac_rx_inject(gmacdev->Unit, frames, bench_frame_len);
+
+    for (uint64_t got = 0; got < frames;)
+    {
+        uint64_t pbuf = eth_rx(gmacdev);
+
+        if (!pbuf)
+            continue;
+        bench_gmac_rx_release(gmacdev, &pbuf, 1);
+        got ++;
+    }
+}
+
+static void bench_gmac_rx_burst(struct net_device *gmacdev, uint64_t frames, uint32_t burst)
+{
+    uint64_t pbufs[BENCH_RX_BURST];
+
+    sim_gmac_rx_inject(gmacdev->Unit, frames, bench_frame_len);
+
+    for (uint64_t got = 0; got < frames;)
+    {
+        uint32_t n = eth_rx_burst(gmacdev, pbufs, burst);
+
+        bench_gmac_rx_release(gmacdev, pbufs, n);
+        got += n;
+    }
+}
+
+// eth_poll stands in for the os poll loop scheduled by eth_rx_ready
+static void bench_gmac_rx_poll(struct net_device *gmacdev, uint64_t frames, uint32_t budget)
+{
+    uint64_t pbufs[BENCH_POLL_BUDGET];
+
+    sim_gmac_rx_inject(gmacdev->Unit, frames, bench_frame_len);
+
+    for (uint64_t got = 0; got < frames;)
+    {
+        uint32_t n;
+
+        eth_poll(gmacdev, pbufs, budget, &n);
+        bench_gmac_rx_release(gmacdev, pbufs, n);
+        got += n;
+    }
+}
+
+// both units send at once, each with its own ring and reclaim
+static void bench_gmac_tx_dual(struct net_device **devs, uint64_t frames, uint8_t *frame)
+{
+    uint64_t base[2] = { devs[0]->tx_packets, devs[1]->tx_packets };
+    uint64_t sent[2] = { 0, 0 };
+
+    for (uint32_t u = 0; sent[0] + sent[1] < frames; u ^= 1)
+    {
+        struct net_device *gmacdev = devs[u];
+
+        if (sent[u] - (gmacdev->tx_packets - base[u]) >= BENCH_TX_RECLAIM ||
+            eth_tx(gmacdev, (uint64_t)frame))
+        {
+            eth_irq(gmacdev);
+            continue;
+        }
+        sent[u] ++;
+    }
+
+    for (uint32_t u = 0; u < 2; ++ u)
+    {
+        while (devs[u]->tx_packets - base[u] < sent[u])
+            eth_irq(devs[u]);
+    }
+}
+
+// both units receive at once, half of the frames arrive on each
+static void bench_gmac_rx_dual(struct net_device **devs, uint64_t frames)
+{
+    uint64_t want[2] = { frames / 2, frames - frames / 2 };
+    uint64_t got[2] = { 0, 0 };
+
+    for (uint32_t u = 0; u < 2; ++ u)
+        sim_gmac_rx_inject(devs[u]->Unit, want[u], bench_frame_len);
+
+    for (uint32_t u = 0; got[0] + got[1] < frames; u ^= 1)
+    {
+        if (got[u] < want[u] && eth_rx(devs[u]))
+            got[u] ++;
+    }
+}
+
+static void bench_gmac_pass(struct gmac_run *run, uint64_t frames)
+{
+    struct net_device *devs[2] = { run->gmacdev, run->peer };
+
+    if (run->peer && run->work->is_tx)
+        bench_gmac_tx_dual(devs, frames, run->frame);
+    else if (run->peer)
+        bench_gmac_rx_dual(devs, frames);
+    else if (run->work->is_tx && run->work->nseg)
+        bench_gmac_tx_sg(run->gmacdev, frames, run->frame, run->work->nseg);
+    else if (run->work->is_tx && run->work->burst)
+        bench_gmac_tx_burst(run->gmacdev, frames, run->frame, run->work->burst);
+    else if (run->work->is_tx)
+        bench_gmac_tx(run->gmacdev, frames, run->frame);
+    else if (run->work->poll)
+        bench_gmac_rx_poll(run->gmacdev, frames, run->work->poll);
+    else if (run->work->burst)
+        bench_gmac_rx_burst(run->gmacdev, frames, run->work->burst);
+    else
+        bench_gmac_rx(run->gmacdev, frames);
+}
+
+static uint64_t bench_gmac_errors(struct gmac_run *run)
+{
+    uint64_t errors = run->gmacdev->tx_errors + run->gmacdev->rx_errors;
+
+    if (run->peer)
+        errors += run->peer->tx_errors + run->peer->rx_errors;
+
+    return errors;
+}
+
+// a sixteenth of the frames warm up caches and branch predictors first
+static void bench_gmac_work(void *arg)
+{
+    struct gmac_run *run = arg;
+    uint64_t err0, c0, t0;
+
+    bench_gmac_pass(run, run->ops / 16);
+
+    err0 = bench_gmac_errors(run);
+    c0 = bench_cycles();
+    t0 = bench_ns();
+    bench_gmac_pass(run, run->ops);
+    run->cycles = bench_cycles() - c0;
+    run->ns = bench_ns() - t0;
+    run->errors = bench_gmac_errors(run) - err0;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 0) : 100000;
+    static const uint8_t mac[6] = { 0x00, 0x55, 0x7b, 0xb5, 0x7d, 0xf7 };
+    static const char *const init_names[2] = { "init", "init_gmac1" };
+    struct net_device *gmacdevs[2];
+    struct net_device *gmacdev;
+    struct gmac_run run;
+    uint64_t stack;
+
+    sim_gmac_start();
+
+    // gmac0 runs every workload, gmac1 joins it in the dual ones
+    for (uint32_t u = 0; u < 2; ++ u)
+    {
+        gmacdevs[u] = calloc(1, sizeof(*gmacdevs[u]));
+        gmacdevs[u]->iobase = sim_gmac_base(u);
+        gmacdevs[u]->Unit = u;
+        memcpy(gmacdevs[u]->MacAddr, mac, sizeof(mac));
+        gmacdevs[u]->MacAddr[5] += u;
+
+        memset(&run, 0, sizeof(run));
+        run.gmacdev = gmacdevs[u];
+        stack = bench_run_measured(bench_gmac_init, &run);
+        bench_report(BENCH_DRIVER, "gmac", init_names[u], 1, run.cycles, run.ns, stack, run.errors);
+        if (run.errors)
+        {
+            fprintf(stderr, "gmac%u init failed\n", u);
+            return 1;
+        }
+    }
+    gmacdev = gmacdevs[0];
+
+    for (uint32_t i = 0; i < sizeof(works) / sizeof(works[0]); ++ i)
+    {
+        memset(&run, 0, sizeof(run));
+        run.gmacdev = gmacdev;
+        run.peer = works[i].dual ? gmacdevs[1] : NULL;
+        run.work = &works[i];
+        run.ops = ops;
+        run.frame = bench_dma_alloc(BENCH_FRAME_SZ, 64);
+        memset(run.frame, i, BENCH_FRAME_SZ);
+        bench_frame_len = works[i].len;
+        eth_poll_mode(gmacdev, works[i].poll != 0);
+        if (eth_set_mtu(gmacdev, works[i].mtu ? works[i].mtu : ETH_MTU))
+        {
+            fprintf(stderr, "gmac mtu change failed\n");
+            return 1;
+        }
+        if (eth_csum_offload(gmacdev, works[i].csum))
+        {
+            fprintf(stderr, "gmac checksum offload failed\n");
+            return 1;
+        }
+        // leaving adaptive moderation restores one interrupt per frame
+        eth_dim_mode(gmacdev, works[i].dim);
+        if (!works[i].dim)
+            eth_set_coalesce(gmacdev, works[i].coalesce ? BENCH_RX_USECS : 0,
+                             works[i].coalesce ? works[i].coalesce : 1);
+        if (works[i].zero_copy && !gmacdev->RxZeroCopy && eth_rx_zero_copy_init(gmacdev))
+        {
+            fprintf(stderr, "gmac zero-copy init failed\n");
+            return 1;
+        }
+
+        stack = bench_run_measured(bench_gmac_work, &run);
+        bench_report(BENCH_DRIVER, "gmac", works[i].name, run.ops, run.cycles, run.ns, stack, run.errors);
+    }
+
+    sim_gmac_stop();
+    return 0;
+}
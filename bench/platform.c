@@ -0,0 +1,401 @@
+// platform layer shared by the c and rust drivers
+// implements ahci_platform.h and eth_platform.h on the host, the rust
+// drivers reach the same functions through their rtthread feature
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+struct net_device;
+
+enum {
+    BENCH_DMA_SZ     = 64 << 20,
+    BENCH_STACK_SZ   = 1 << 20,
+    BENCH_STACK_FILL = 0xa5,
+};
+
+static uint8_t *dma_arena;
+static uint64_t dma_used;
+static int verbose = -1;
+
+uint32_t bench_frame_len = 64;
+
+void *bench_dma_alloc(uint64_t size, uint32_t align)
+{
+    uint64_t used, start;
+    uint8_t *arena = __atomic_load_n(&dma_arena, __ATOMIC_ACQUIRE);
+
+    if (!arena)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_32BIT
+        flags |= MAP_32BIT;
+#endif
+        void *mem = mmap(NULL, BENCH_DMA_SZ, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mem == MAP_FAILED || (uint64_t)mem + BENCH_DMA_SZ > (1ull << 32))
+        {
+            fprintf(stderr, "no dma memory below 4 GiB\n");
+            exit(1);
+        }
+
+        // lost races unmap their copy
+        if (!__atomic_compare_exchange_n(&dma_arena, &arena, mem, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            munmap(mem, BENCH_DMA_SZ);
+        else
+            arena = mem;
+    }
+
+    if (align == 0)
+        align = 1;
+
+    used = __atomic_load_n(&dma_used, __ATOMIC_RELAXED);
+    do
+    {
+        start = (used + align - 1) & ~(uint64_t)(align - 1);
+        if (start + size > BENCH_DMA_SZ)
+        {
+            fprintf(stderr, "out of dma memory\n");
+            exit(1);
+        }
+    } while (!__atomic_compare_exchange_n(&dma_used, &used, start + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return arena + start;
+}
+
+uint64_t bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cnt;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+    return cnt;
+#elif defined(__loongarch64)
+    uint64_t cnt;
+    __asm__ volatile("rdtime.d %0, $zero" : "=r"(cnt));
+    return cnt;
+#else
+    return bench_ns();
+#endif
+}
+
+uint32_t bench_ncpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
+
+void bench_device_idle(void)
+{
+    static const struct timespec nap = { 0, 20000 };
+    static int single = -1;
+
+    if (single < 0)
+        single = bench_ncpus() == 1;
+    if (single)
+        nanosleep(&nap, NULL);
+}
+
+struct bench_thread
+{
+    void (*fn)(void *);
+    void *arg;
+};
+
+static void *bench_thread_main(void *p)
+{
+    struct bench_thread *t = p;
+
+    t->fn(t->arg);
+    return NULL;
+}
+
+static void bench_nop(void *arg)
+{
+    (void)arg;
+}
+
+// workloads run on cpu 0, the simulated devices on the last cpu
+static uint64_t bench_stack_used(void (*fn)(void *), void *arg)
+{
+    struct bench_thread t = { fn, arg };
+    pthread_attr_t attr;
+    pthread_t tid;
+    cpu_set_t cpus;
+    uint8_t *stack;
+    uint64_t i;
+
+    stack = mmap(NULL, BENCH_STACK_SZ, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    memset(stack, BENCH_STACK_FILL, BENCH_STACK_SZ);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, BENCH_STACK_SZ);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+    if (pthread_create(&tid, &attr, bench_thread_main, &t))
+    {
+        fprintf(stderr, "cannot start the workload thread\n");
+        exit(1);
+    }
+    pthread_join(tid, NULL);
+    pthread_attr_destroy(&attr);
+
+    // the stack grows down, the deepest byte written is the first changed one
+    for (i = 0; i < BENCH_STACK_SZ && stack[i] == BENCH_STACK_FILL; ++ i);
+    munmap(stack, BENCH_STACK_SZ);
+
+    return BENCH_STACK_SZ - i;
+}
+
+uint64_t bench_run_measured(void (*fn)(void *), void *arg)
+{
+    static uint64_t baseline;
+    uint64_t used;
+
+    // thread descriptor and tls live at the top of the stack
+    if (!baseline)
+        baseline = bench_stack_used(bench_nop, NULL);
+
+    used = bench_stack_used(fn, arg);
+    return used > baseline ? used - baseline : 0;
+}
+
+void bench_report(const char *driver, const char *device, const char *workload, uint64_t ops,
+                  uint64_t cycles, uint64_t ns, uint64_t stack, uint64_t errors)
+{
+    printf("{\"driver\":\"%s\",\"device\":\"%s\",\"workload\":\"%s\",\"ops\":%lu,"
+           "\"cycles_per_op\":%.1f,\"ns_per_op\":%.1f,\"stack_bytes\":%lu,\"errors\":%lu}\n",
+           driver, device, workload, ops,
+           ops ? (double)cycles / ops : 0.0, ops ? (double)ns / ops : 0.0,
+           stack, errors);
+    fflush(stdout);
+}
+
+// driver messages only go out with BENCH_VERBOSE set, printing would
+// dominate both the init time and the stack depth
+static int bench_vprintf(const char *fmt, va_list ap)
+{
+    if (verbose < 0)
+        verbose = getenv("BENCH_VERBOSE") != NULL;
+    if (!verbose)
+        return 0;
+
+    return vfprintf(stderr, fmt, ap);
+}
+
+// ahci_platform.h
+
+void ahci_mdelay(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+int ahci_printf(const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = bench_vprintf(fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+void *ahci_memset(void *s, int c, uint64_t count)
+{
+    return memset(s, c, count);
+}
+
+void *ahci_memcpy(void *dest, const void *src, uint64_t n)
+{
+    return memcpy(dest, src, n);
+}
+
+uint64_t ahci_malloc_align(uint64_t size, uint32_t align)
+{
+    return (uint64_t)bench_dma_alloc(size, align);
+}
+
+uint32_t ahci_cpu_id()
+{
+    return 0;
+}
+
+uint64_t ahci_get_time_us()
+{
+    return bench_ns() / 1000;
+}
+
+// the simulated hba is another thread, a full fence orders the
+// command table before PORT_CMD_ISSUE like dbar does on the board
+void ahci_sync_dcache()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+uint64_t ahci_phys_to_uncached(uint64_t va)
+{
+    if (va == 0x400e0000)
+        return sim_ahci_mmio;
+
+    return va;
+}
+
+uint64_t ahci_virt_to_phys(uint64_t va)
+{
+    return va;
+}
+
+// eth_platform.h
+
+void eth_mdelay(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+uint64_t eth_get_time_us()
+{
+    return bench_ns() / 1000;
+}
+
+int eth_printf(const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = bench_vprintf(fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+void *eth_memcpy(void *dest, const void *src, uint64_t n)
+{
+    return memcpy(dest, src, n);
+}
+
+uint64_t eth_malloc_align(uint64_t size, uint32_t align)
+{
+    return (uint64_t)bench_dma_alloc(size, align);
+}
+
+void eth_sync_dcache()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+uint32_t eth_virt_to_phys(uint64_t va)
+{
+    return (uint32_t)va;
+}
+
+uint64_t eth_phys_to_virt(uint32_t pa)
+{
+    return pa;
+}
+
+uint64_t eth_phys_to_uncached(uint64_t pa)
+{
+    if (pa == 0x1fe00000)
+        return sim_chip_cfg;
+
+    return pa;
+}
+
+// p is a frame of bench_frame_len bytes owned by the workload
+uint32_t eth_handle_tx_buffer(struct net_device *gmacdev, uint64_t p, uint64_t buffer)
+{
+    (void)gmacdev;
+    memcpy((void *)buffer, (void *)p, bench_frame_len);
+    return bench_frame_len;
+}
+
+// the segments of eth_tx_sg point into the workload's frame, nothing to free
+void eth_handle_tx_done(struct net_device *gmacdev, uint64_t p)
+{
+    (void)gmacdev;
+    (void)p;
+}
+
+// the frames are not real ip packets, the simulated gmac ignores the request;
+// 0x2 is ETH_TX_CSUM_L4, the driver headers are not included here
+uint32_t eth_handle_tx_csum(struct net_device *gmacdev, uint64_t p)
+{
+    (void)gmacdev;
+    (void)p;
+    return 0x2;
+}
+
+// the copy an os makes into its own packet buffer, the workload only
+// counts the returned buffers, so both units share one
+uint64_t eth_handle_rx_buffer(struct net_device *gmacdev, uint64_t buffer, uint32_t length)
+{
+    static uint8_t copy[9216]; // a jumbo frame
+
+    (void)gmacdev;
+    memcpy(copy, (void *)buffer, length < sizeof(copy) ? length : sizeof(copy));
+    return (uint64_t)copy;
+}
+
+// the workload gives the buffer back with eth_rx_release
+uint64_t eth_handle_rx_zero_copy(struct net_device *gmacdev, uint64_t buffer, uint32_t length)
+{
+    (void)gmacdev;
+    (void)length;
+    return buffer;
+}
+
+// lwip would skip its own verification for ETH_RX_CSUM_OK
+void eth_handle_rx_csum(struct net_device *gmacdev, uint64_t pbuf, uint32_t csum)
+{
+    (void)gmacdev;
+    (void)pbuf;
+    (void)csum;
+}
+
+void eth_rx_ready(struct net_device *gmacdev)
+{
+    (void)gmacdev;
+}
+
+void eth_update_linkstate(struct net_device *gmacdev, uint32_t status)
+{
+    (void)gmacdev;
+    (void)status;
+}
+
+// the workloads call eth_irq themselves, there is no interrupt line
+void eth_isr_install(struct net_device *gmacdev)
+{
+    (void)gmacdev;
+}
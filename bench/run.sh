@@ -0,0 +1,80 @@
+#!/bin/sh
+# build the c and rust ahci/gmac drivers against the simulated devices in
+# this directory, run the same workloads on both and print one json object
+# per line: a meta record, code size of each driver, then per-workload
+# cycles, time and stack usage
+#
+# usage: bench/run.sh [ahci_ops] [gmac_ops]
+# CC, CFLAGS, RUSTC and RUSTFLAGS override the toolchain, OUT the build directory
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+OUT=${OUT:-$BENCH/out}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUSTC=${RUSTC:-rustc}
+RUSTFLAGS=${RUSTFLAGS:--C opt-level=3}
+AHCI_OPS=${1:-20000}
+GMAC_OPS=${2:-100000}
+
+mkdir -p "$OUT"
+log="$OUT/build.log"
+: > "$log"
+
+# the c drivers are built the way RT-Thread builds them, with -Wall, warnings end up in the build log
+cc_obj() {
+    $CC $CFLAGS -std=gnu11 -Wall -c -o "$@" >> "$log" 2>&1
+}
+
+# the rust drivers call the same c platform functions through the rtthread feature
+# one codegen unit, so the object holds only the crate and what it inlined
+rust_lib() {
+    $RUSTC --edition 2024 --crate-type staticlib -C panic=abort -C codegen-units=1 \
+        $RUSTFLAGS --cfg 'feature="rtthread"' \
+        --emit "obj=$OUT/$1_rust.o,link=$OUT/lib$1_rust.a" "$2" >> "$log" 2>&1
+}
+
+# text, data and bss of the driver objects
+size_json() {
+    size "$@" | awk -v drv="$drv" -v dev="$dev" \
+        'NR > 1 { t += $1; d += $2; b += $3 }
+         END { printf "{\"driver\":\"%s\",\"device\":\"%s\",\"workload\":\"code_size\",\"text\":%d,\"data\":%d,\"bss\":%d}\n", drv, dev, t, d, b }'
+}
+
+for f in platform sim_ahci sim_gmac; do
+    cc_obj "$OUT/$f.o" "$BENCH/$f.c"
+done
+cc_obj "$OUT/drv_ahci.o" "$ROOT/ahci/c/drv_ahci.c"
+cc_obj "$OUT/drv_eth.o" "$ROOT/gmac/c/drv_eth.c"
+cc_obj "$OUT/eth_dev.o" "$ROOT/gmac/c/eth_dev.c"
+rust_lib ahci "$ROOT/ahci/rust/src/lib.rs"
+rust_lib gmac "$ROOT/gmac/rust/src/lib.rs"
+
+common="$OUT/platform.o $OUT/sim_ahci.o $OUT/sim_gmac.o"
+link() {
+    $CC $CFLAGS -std=gnu11 -Wall -o "$@" $common -lpthread -Wl,--gc-sections,-z,now >> "$log" 2>&1
+}
+link "$OUT/bench_ahci_c" -I"$BENCH" -I"$ROOT/ahci/c" "$BENCH/bench_ahci.c" "$OUT/drv_ahci.o"
+link "$OUT/bench_ahci_rust" -DBENCH_RUST -I"$BENCH" -I"$ROOT/ahci/rust" "$BENCH/bench_ahci.c" "$OUT/libahci_rust.a"
+link "$OUT/bench_gmac_c" -I"$BENCH" -I"$ROOT/gmac/c" "$BENCH/bench_gmac.c" "$OUT/drv_eth.o" "$OUT/eth_dev.o"
+link "$OUT/bench_gmac_rust" -DBENCH_RUST -I"$BENCH" -I"$ROOT/gmac/rust" "$BENCH/bench_gmac.c" "$OUT/libgmac_rust.a"
+
+rev=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+printf '{"meta":"ls2k driver bench","rev":"%s","date":"%s","host":"%s","cpus":%s,"cc":"%s","cflags":"%s","rustc":"%s","rustflags":"%s","counter":"%s"}\n' \
+    "$rev" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -m)" "$(getconf _NPROCESSORS_ONLN)" \
+    "$($CC --version | head -n 1)" "$CFLAGS" "$($RUSTC --version)" "$RUSTFLAGS" \
+    "$(case $(uname -m) in x86_64|i?86) echo tsc;; aarch64) echo cntvct;; loongarch64) echo stable_counter;; *) echo ns;; esac)"
+
+drv=c dev=ahci size_json "$OUT/drv_ahci.o"
+drv=rust dev=ahci size_json "$OUT/ahci_rust.o"
+drv=c dev=gmac size_json "$OUT/drv_eth.o" "$OUT/eth_dev.o"
+drv=rust dev=gmac size_json "$OUT/gmac_rust.o"
+
+for b in ahci_c ahci_rust; do
+    "$OUT/bench_$b" "$AHCI_OPS"
+done
+for b in gmac_c gmac_rust; do
+    "$OUT/bench_$b" "$GMAC_OPS"
+done
@@ -0,0 +1,360 @@
+// simulated ahci controller with one sata disk
+// a device thread polls the register block the way the hba would see
+// driver writes: it completes resets and port start/stop handshakes and
+// executes the commands set in PORT_CMD_ISSUE against a ram disk
+//
+// HOST_CAP keeps whatever ahci_host_init writes, as on the board before
+// firmware has set it up, so both drivers run with one command slot,
+// one port and no ncq until bench_ahci_set_ncq fills in what a firmware
+// initialized board would report; queued commands then run in slot order
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+// register layout and bits, see the AHCI 1.3 specification
+enum {
+    SIM_HOST_CAP       = 0x00,
+    SIM_HOST_CTL       = 0x04,
+    SIM_HOST_VERSION   = 0x10,
+    SIM_HOST_CTL_HR    = 1u << 0,
+
+    SIM_PORT_BASE      = 0x100,
+    SIM_PORT_SZ        = 0x80,
+    SIM_MMIO_SZ        = SIM_PORT_BASE + 32 * SIM_PORT_SZ,
+
+    SIM_PORT_CLB       = 0x00,
+    SIM_PORT_CLBU      = 0x04,
+    SIM_PORT_FB        = 0x08,
+    SIM_PORT_FBU       = 0x0c,
+    SIM_PORT_CMD       = 0x18,
+    SIM_PORT_TFD       = 0x20,
+    SIM_PORT_SIG       = 0x24,
+    SIM_PORT_SSTS      = 0x28,
+    SIM_PORT_SACT      = 0x34,
+    SIM_PORT_CI        = 0x38,
+
+    SIM_CMD_ST         = 1u << 0,
+    SIM_CMD_CLO        = 1u << 3,
+    SIM_CMD_FRE        = 1u << 4,
+    SIM_CMD_FR         = 1u << 14,
+    SIM_CMD_CR         = 1u << 15,
+
+    SIM_CMD_TBL_PRDT   = 0x80,
+    SIM_RX_FIS_D2H     = 0x40,
+    SIM_RX_FIS_SDB     = 0x58,
+
+    SIM_TFD_READY      = 0x50, // DRDY | DSC
+    SIM_SSTS_LINK_UP   = 0x123, // gen2, device present, phy ready
+    SIM_SIG_ATA        = 0x101,
+    SIM_SECT_SZ        = 512,
+};
+
+struct sim_cmd_hdr
+{
+    uint32_t opts;
+    uint32_t prdbc;
+    uint32_t tbl_lo;
+    uint32_t tbl_hi;
+    uint32_t reserved[4];
+};
+
+struct sim_prd
+{
+    uint32_t addr_lo;
+    uint32_t addr_hi;
+    uint32_t reserved;
+    uint32_t flags_size;
+};
+
+uint64_t sim_ahci_mmio;
+
+static uint8_t *disk;
+static uint64_t disk_blks;
+static uint16_t identify[256];
+static pthread_t sim_thread;
+static volatile int sim_running;
+
+static uint32_t *sim_reg(uint32_t ofs)
+{
+    return (uint32_t *)(sim_ahci_mmio + ofs);
+}
+
+static uint32_t sim_rd(uint32_t ofs)
+{
+    return __atomic_load_n(sim_reg(ofs), __ATOMIC_ACQUIRE);
+}
+
+static void sim_wr(uint32_t ofs, uint32_t val)
+{
+    __atomic_store_n(sim_reg(ofs), val, __ATOMIC_RELEASE);
+}
+
+// ata strings are byte swapped within each word
+static void sim_id_string(uint32_t ofs, uint32_t len, const char *s)
+{
+    char buf[64];
+
+    memset(buf, ' ', sizeof(buf));
+    memcpy(buf, s, strlen(s));
+    for (uint32_t i = 0; i < len; i += 2)
+        identify[ofs + i / 2] = (buf[i] << 8) | buf[i + 1];
+}
+
+// lba48 disk with flush, write cache and look-ahead supported but off
+// until SET FEATURES turns them on, ncq advertised so the hba capability
+// is what disables it, dsm trim accepted and ignored
+static void sim_build_identify(void)
+{
+    memset(identify, 0, sizeof(identify));
+
+    sim_id_string(10, 20, "SIM0000000000001");
+    sim_id_string(23, 8, "1.0");
+    sim_id_string(27, 40, "LS2K BENCH SIMULATED DISK");
+
+    identify[0] = 0x0040;
+    identify[49] = (1 << 9) | (1 << 8);
+    identify[60] = disk_blks > 0x0fffffff ? 0xffff : disk_blks & 0xffff;
+    identify[61] = disk_blks > 0x0fffffff ? 0x0fff : disk_blks >> 16;
+    identify[75] = 31;
+    identify[76] = 1 << 8;
+    identify[82] = (1 << 5) | (1 << 6);
+    identify[83] = 0x4000 | (1 << 10) | (1 << 12) | (1 << 13);
+    identify[86] = (1 << 10) | (1 << 12) | (1 << 13);
+    identify[87] = 0x4000;
+    identify[88] = 0x007f;
+    identify[100] = disk_blks & 0xffff;
+    identify[101] = (disk_blks >> 16) & 0xffff;
+    identify[102] = (disk_blks >> 32) & 0xffff;
+    identify[106] = 0x4000;
+    identify[169] = 1 << 0;
+}
+
+// copy between the prd buffers and 'data', return the bytes moved
+static uint32_t sim_xfer(struct sim_prd *prd, uint32_t prdtl, uint8_t *data,
+                         uint64_t limit, bool to_host)
+{
+    uint64_t done = 0;
+
+    for (uint32_t i = 0; i < prdtl && done < limit; ++ i)
+    {
+        uint8_t *buf = (uint8_t *)(((uint64_t)prd[i].addr_hi << 32) | prd[i].addr_lo);
+        uint64_t len = (prd[i].flags_size & 0x3fffff) + 1;
+
+        if (len > limit - done)
+            len = limit - done;
+        if (to_host)
+            memcpy(buf, data + done, len);
+        else
+            memcpy(data + done, buf, len);
+        done += len;
+    }
+
+    return done;
+}
+
+// execute the command in 'slot', return false on a bad lba
+static bool sim_exec(uint32_t port, uint32_t slot, bool *ncq)
+{
+    uint32_t pbase = SIM_PORT_BASE + port * SIM_PORT_SZ;
+    uint64_t clb = ((uint64_t)sim_rd(pbase + SIM_PORT_CLBU) << 32) | sim_rd(pbase + SIM_PORT_CLB);
+    struct sim_cmd_hdr *hdr = (struct sim_cmd_hdr *)clb + slot;
+    uint8_t *tbl = (uint8_t *)(((uint64_t)hdr->tbl_hi << 32) | hdr->tbl_lo);
+    struct sim_prd *prd = (struct sim_prd *)(tbl + SIM_CMD_TBL_PRDT);
+    uint32_t prdtl = hdr->opts >> 16;
+    uint8_t cmd = tbl[2];
+    uint64_t lba, nbytes = 0;
+    bool ok = true;
+
+    lba = tbl[4] | (tbl[5] << 8) | ((uint64_t)tbl[6] << 16) |
+          ((uint64_t)tbl[8] << 24) | ((uint64_t)tbl[9] << 32) | ((uint64_t)tbl[10] << 40);
+    *ncq = false;
+
+    switch (cmd)
+    {
+    case 0xec: // IDENTIFY DEVICE
+        nbytes = sim_xfer(prd, prdtl, (uint8_t *)identify, sizeof(identify), true);
+        break;
+
+    case 0xc8: // READ DMA
+    case 0xca: // WRITE DMA
+        lba = tbl[4] | (tbl[5] << 8) | (tbl[6] << 16) | ((tbl[7] & 0xf) << 24);
+        // fall through
+    case 0x25: // READ DMA EXT
+    case 0x35: // WRITE DMA EXT
+    case 0x60: // READ FPDMA QUEUED
+    case 0x61: // WRITE FPDMA QUEUED
+        *ncq = cmd == 0x60 || cmd == 0x61;
+        if (lba >= disk_blks)
+        {
+            ok = false;
+            break;
+        }
+        nbytes = sim_xfer(prd, prdtl, disk + lba * SIM_SECT_SZ,
+                          (disk_blks - lba) * SIM_SECT_SZ,
+                          cmd == 0xc8 || cmd == 0x25 || cmd == 0x60);
+        break;
+
+    case 0xef: // SET FEATURES, the cache switches show up in identify word 85
+        if (tbl[3] == 0x02 || tbl[3] == 0x82)
+            identify[85] = tbl[3] == 0x02 ? identify[85] | (1 << 5) : identify[85] & ~(1 << 5);
+        else if (tbl[3] == 0xaa || tbl[3] == 0x55)
+            identify[85] = tbl[3] == 0xaa ? identify[85] | (1 << 6) : identify[85] & ~(1 << 6);
+        break;
+
+    default: // flush needs no data, dsm ranges are only a hint
+        break;
+    }
+
+    hdr->prdbc = nbytes;
+    return ok;
+}
+
+// post the d2h register fis, or set device bits for ncq
+static void sim_post_fis(uint32_t pbase, bool ncq, uint8_t status)
+{
+    uint64_t fb = ((uint64_t)sim_rd(pbase + SIM_PORT_FBU) << 32) | sim_rd(pbase + SIM_PORT_FB);
+    volatile uint8_t *fis;
+
+    if (!(sim_rd(pbase + SIM_PORT_CMD) & SIM_CMD_FRE) || !fb)
+        return;
+
+    fis = (uint8_t *)fb + (ncq ? SIM_RX_FIS_SDB : SIM_RX_FIS_D2H);
+    fis[2] = status;
+    __atomic_store_n(&fis[0], ncq ? 0xa1 : 0x34, __ATOMIC_RELEASE);
+}
+
+static void sim_port_reset(uint32_t pbase)
+{
+    sim_wr(pbase + SIM_PORT_CMD, 0);
+    sim_wr(pbase + SIM_PORT_CI, 0);
+    sim_wr(pbase + SIM_PORT_SACT, 0);
+    sim_wr(pbase + SIM_PORT_TFD, SIM_TFD_READY);
+    sim_wr(pbase + SIM_PORT_SIG, SIM_SIG_ATA);
+    sim_wr(pbase + SIM_PORT_SSTS, SIM_SSTS_LINK_UP);
+}
+
+// mirror ST and FRE into CR and FR, and finish clo
+// the driver writes PORT_CMD at any time, only swap in a value it has not changed
+static bool sim_port_cmd(uint32_t pbase)
+{
+    uint32_t *reg = sim_reg(pbase + SIM_PORT_CMD);
+    uint32_t cmd = __atomic_load_n(reg, __ATOMIC_ACQUIRE);
+    uint32_t want = cmd & ~(SIM_CMD_CR | SIM_CMD_FR | SIM_CMD_CLO);
+
+    if (cmd & SIM_CMD_ST)
+        want |= SIM_CMD_CR;
+    if (cmd & SIM_CMD_FRE)
+        want |= SIM_CMD_FR;
+
+    if (want == cmd)
+        return false;
+
+    __atomic_compare_exchange_n(reg, &cmd, want, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+// run every command issued on port 0
+static bool sim_port_issue(uint32_t pbase)
+{
+    uint32_t ci, slot, status = SIM_TFD_READY;
+    bool ncq, ok;
+
+    if (!(sim_rd(pbase + SIM_PORT_CMD) & SIM_CMD_ST))
+        return false;
+
+    ci = sim_rd(pbase + SIM_PORT_CI);
+    if (!ci)
+        return false;
+
+    while (ci)
+    {
+        slot = __builtin_ctz(ci);
+        ci &= ci - 1;
+
+        ok = sim_exec(0, slot, &ncq);
+        status = ok ? SIM_TFD_READY : SIM_TFD_READY | 0x01;
+        sim_wr(pbase + SIM_PORT_TFD, status);
+        sim_post_fis(pbase, ncq, status);
+
+        if (ncq)
+            __atomic_fetch_and(sim_reg(pbase + SIM_PORT_SACT), ~(1u << slot), __ATOMIC_RELEASE);
+        __atomic_fetch_and(sim_reg(pbase + SIM_PORT_CI), ~(1u << slot), __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static void *sim_main(void *arg)
+{
+    (void)arg;
+
+    while (__atomic_load_n(&sim_running, __ATOMIC_ACQUIRE))
+    {
+        bool busy = false;
+
+        if (sim_rd(SIM_HOST_CTL) & SIM_HOST_CTL_HR)
+        {
+            for (uint32_t i = 0; i < 32; ++ i)
+                sim_port_reset(SIM_PORT_BASE + i * SIM_PORT_SZ);
+            sim_wr(SIM_HOST_CTL, 0);
+            busy = true;
+        }
+
+        busy |= sim_port_cmd(SIM_PORT_BASE);
+        busy |= sim_port_issue(SIM_PORT_BASE);
+
+        if (!busy)
+            bench_device_idle();
+    }
+
+    return NULL;
+}
+
+uint64_t sim_ahci_start(uint64_t blks)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    disk_blks = blks;
+    disk = calloc(blks, SIM_SECT_SZ);
+    if (!disk)
+    {
+        fprintf(stderr, "no memory for the simulated disk\n");
+        exit(1);
+    }
+    sim_build_identify();
+
+    sim_ahci_mmio = (uint64_t)bench_dma_alloc(SIM_MMIO_SZ, 4096);
+    memset((void *)sim_ahci_mmio, 0, SIM_MMIO_SZ);
+    sim_wr(SIM_HOST_VERSION, 0x10300);
+    for (uint32_t i = 0; i < 32; ++ i)
+        sim_port_reset(SIM_PORT_BASE + i * SIM_PORT_SZ);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(bench_ncpus() - 1, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+    sim_running = 1;
+    if (pthread_create(&sim_thread, &attr, sim_main, NULL))
+    {
+        fprintf(stderr, "cannot start the simulated ahci\n");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+
+    return sim_ahci_mmio;
+}
+
+void sim_ahci_stop(void)
+{
+    __atomic_store_n(&sim_running, 0, __ATOMIC_RELEASE);
+    pthread_join(sim_thread, NULL);
+    free(disk);
+}
@@ -0,0 +1,310 @@
+// simulated gmac0 and gmac1, each with a YT8511 phy on mdio address 0
+// one device thread serves both: it completes dma reset and mdio cycles,
+// transmits every descriptor handed to the dma and fills receive
+// descriptors with the frames released by sim_gmac_rx_inject, spreading a
+// frame over several descriptors when it does not fit one buffer; both
+// checksum offload engines are advertised and every received frame passes
+// them; gmac1 stays silent until its pins are selected in the chip
+// configuration block
+//
+// DmaStatus is plain memory, the driver writing back the bits it read
+// leaves them set, so eth_irq sees a completion on every call
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+// register layout and bits, see the synopsys dwc gmac databook
+enum {
+    SIM_MAC_CONFIG      = 0x0000,
+    SIM_MAC_GMII_ADDR   = 0x0010,
+    SIM_MAC_GMII_DATA   = 0x0014,
+    SIM_MAC_VERSION     = 0x0020,
+    SIM_MAC_RGSMII_STAT = 0x00d8,
+
+    SIM_DMA_BUS_MODE    = 0x1000,
+    SIM_DMA_RX_BASE     = 0x100c,
+    SIM_DMA_TX_BASE     = 0x1010,
+    SIM_DMA_STATUS      = 0x1014,
+    SIM_DMA_CONTROL     = 0x1018,
+    SIM_DMA_HW_FEATURE  = 0x1058,
+    SIM_MMIO_SZ         = 0x2000,
+    SIM_GMAC_NUM        = 2,
+
+    SIM_CHIP_GENERAL_CFG0 = 0x0420,
+    SIM_CHIP_CFG_SZ     = 0x1000,
+    SIM_GMAC1_SEL       = 1u << 3,
+
+    SIM_GMII_BUSY       = 1u << 0,
+    SIM_GMII_WRITE      = 1u << 1,
+    SIM_GMII_REG_SHIFT  = 6,
+    SIM_DMA_RESET       = 1u << 0,
+    SIM_DMA_RX_START    = 1u << 1,
+    SIM_DMA_TX_START    = 1u << 13,
+    SIM_MAC_IPC         = 1u << 10,
+    SIM_FEAT_TX_COE     = 1u << 16,
+    SIM_FEAT_RX_COE2    = 1u << 18,
+    SIM_INT_TX_DONE     = 1u << 0,
+    SIM_INT_RX_DONE     = 1u << 6,
+
+    SIM_DESC_OWN        = 1u << 31,
+    SIM_DESC_RX_FIRST   = 1u << 9,
+    SIM_DESC_RX_LAST    = 1u << 8,
+    SIM_DESC_RX_FT      = 1u << 5,  // with ipc offload, checksums verified
+    SIM_TX_END_OF_RING  = 1u << 21, // in status
+    SIM_RX_END_OF_RING  = 1u << 15, // in length
+    SIM_LEN_SHIFT       = 16,
+    SIM_BUF_SIZE_MASK   = 0x1fff, // buffer 1 size, in length
+};
+
+struct sim_desc
+{
+    uint32_t status;
+    uint32_t length;
+    uint32_t buffer1;
+    uint32_t buffer2;
+};
+
+// walk a descriptor ring from the base the driver programmed
+struct sim_ring
+{
+    uint32_t base;
+    uint32_t cur;
+};
+
+struct sim_gmac
+{
+    uint64_t mmio;
+    struct sim_ring tx;
+    struct sim_ring rx;
+
+    uint32_t rx_frames; // frames still to be received
+    uint32_t rx_len;
+    uint32_t rx_left;   // bytes of the current frame not yet in a descriptor
+};
+
+uint64_t sim_chip_cfg;
+static struct sim_gmac sims[SIM_GMAC_NUM];
+static pthread_t sim_thread;
+static volatile int sim_running;
+
+static uint32_t *sim_reg(struct sim_gmac *g, uint32_t ofs)
+{
+    return (uint32_t *)(g->mmio + ofs);
+}
+
+static uint32_t sim_rd(struct sim_gmac *g, uint32_t ofs)
+{
+    return __atomic_load_n(sim_reg(g, ofs), __ATOMIC_ACQUIRE);
+}
+
+static void sim_wr(struct sim_gmac *g, uint32_t ofs, uint32_t val)
+{
+    __atomic_store_n(sim_reg(g, ofs), val, __ATOMIC_RELEASE);
+}
+
+static bool sim_mdio(struct sim_gmac *g)
+{
+    uint32_t addr = sim_rd(g, SIM_MAC_GMII_ADDR);
+    uint32_t reg = (addr >> SIM_GMII_REG_SHIFT) & 0x1f;
+
+    if (!(addr & SIM_GMII_BUSY))
+        return false;
+
+    // phy id of the YT8511 in registers 2 and 3, everything else reads 0
+    if (!(addr & SIM_GMII_WRITE))
+        sim_wr(g, SIM_MAC_GMII_DATA, reg == 3 ? 0x010a : 0);
+
+    sim_wr(g, SIM_MAC_GMII_ADDR, addr & ~SIM_GMII_BUSY);
+    return true;
+}
+
+static struct sim_desc *sim_ring_desc(struct sim_gmac *g, struct sim_ring *r, uint32_t base_reg)
+{
+    uint32_t base = sim_rd(g, base_reg);
+
+    if (!base)
+        return NULL;
+    if (base != r->base)
+    {
+        r->base = base;
+        r->cur = base;
+    }
+
+    return (struct sim_desc *)(uint64_t)r->cur;
+}
+
+static bool sim_tx(struct sim_gmac *g)
+{
+    struct sim_ring *r = &g->tx;
+    struct sim_desc *desc;
+    uint32_t status;
+
+    if (!(sim_rd(g, SIM_DMA_CONTROL) & SIM_DMA_TX_START))
+        return false;
+    desc = sim_ring_desc(g, r, SIM_DMA_TX_BASE);
+    if (!desc)
+        return false;
+
+    status = __atomic_load_n(&desc->status, __ATOMIC_ACQUIRE);
+    if (!(status & SIM_DESC_OWN))
+        return false;
+
+    // sent without error, the driver accounts the length itself
+    __atomic_store_n(&desc->status, status & ~SIM_DESC_OWN, __ATOMIC_RELEASE);
+    __atomic_fetch_or(sim_reg(g, SIM_DMA_STATUS), SIM_INT_TX_DONE, __ATOMIC_RELEASE);
+
+    r->cur = (status & SIM_TX_END_OF_RING) ? r->base : r->cur + sizeof(struct sim_desc);
+    return true;
+}
+
+static bool sim_rx(struct sim_gmac *g)
+{
+    struct sim_ring *r = &g->rx;
+    struct sim_desc *desc;
+    uint32_t status, length;
+
+    if (!__atomic_load_n(&g->rx_frames, __ATOMIC_ACQUIRE))
+        return false;
+    if (!(sim_rd(g, SIM_DMA_CONTROL) & SIM_DMA_RX_START))
+        return false;
+    desc = sim_ring_desc(g, r, SIM_DMA_RX_BASE);
+    if (!desc)
+        return false;
+
+    status = __atomic_load_n(&desc->status, __ATOMIC_ACQUIRE);
+    if (!(status & SIM_DESC_OWN))
+        return false;
+
+    // a frame larger than the buffer continues in the next descriptors,
+    // the last one carries the frame length; its payload is left as it is
+    // and passes the checksum offload engine when the driver enabled it
+    length = desc->length;
+    status = g->rx_left ? 0 : SIM_DESC_RX_FIRST;
+    if (!g->rx_left)
+        g->rx_left = g->rx_len;
+    if (g->rx_left > (length & SIM_BUF_SIZE_MASK))
+    {
+        g->rx_left -= length & SIM_BUF_SIZE_MASK;
+    }
+    else
+    {
+        g->rx_left = 0;
+        status |= (g->rx_len << SIM_LEN_SHIFT) | SIM_DESC_RX_LAST;
+        if (sim_rd(g, SIM_MAC_CONFIG) & SIM_MAC_IPC)
+            status |= SIM_DESC_RX_FT;
+        __atomic_fetch_sub(&g->rx_frames, 1, __ATOMIC_RELEASE);
+        __atomic_fetch_or(sim_reg(g, SIM_DMA_STATUS), SIM_INT_RX_DONE, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&desc->status, status, __ATOMIC_RELEASE);
+
+    r->cur = (length & SIM_RX_END_OF_RING) ? r->base : r->cur + sizeof(struct sim_desc);
+    return true;
+}
+
+// gmac1 is only wired up once eth_init selected its pins
+static bool sim_gmac_powered(uint32_t unit)
+{
+    uint32_t cfg = __atomic_load_n((uint32_t *)(sim_chip_cfg + SIM_CHIP_GENERAL_CFG0),
+                                   __ATOMIC_ACQUIRE);
+
+    return unit == 0 || (cfg & SIM_GMAC1_SEL);
+}
+
+static bool sim_gmac_step(struct sim_gmac *g)
+{
+    bool busy = false;
+
+    uint32_t bus_mode = sim_rd(g, SIM_DMA_BUS_MODE);
+    if (bus_mode & SIM_DMA_RESET)
+    {
+        sim_wr(g, SIM_DMA_CONTROL, 0);
+        sim_wr(g, SIM_DMA_BUS_MODE, bus_mode & ~SIM_DMA_RESET);
+        g->tx.base = g->rx.base = 0;
+        g->rx_left = 0;
+        busy = true;
+    }
+
+    busy |= sim_mdio(g);
+    busy |= sim_tx(g);
+    busy |= sim_rx(g);
+
+    return busy;
+}
+
+static void *sim_main(void *arg)
+{
+    (void)arg;
+
+    while (__atomic_load_n(&sim_running, __ATOMIC_ACQUIRE))
+    {
+        bool busy = false;
+
+        for (uint32_t i = 0; i < SIM_GMAC_NUM; ++ i)
+        {
+            if (sim_gmac_powered(i))
+                busy |= sim_gmac_step(&sims[i]);
+        }
+
+        if (!busy)
+            bench_device_idle();
+    }
+
+    return NULL;
+}
+
+void sim_gmac_rx_inject(uint32_t unit, uint32_t frames, uint32_t len)
+{
+    sims[unit].rx_len = len;
+    __atomic_fetch_add(&sims[unit].rx_frames, frames, __ATOMIC_RELEASE);
+}
+
+uint64_t sim_gmac_base(uint32_t unit)
+{
+    return sims[unit].mmio;
+}
+
+void sim_gmac_start(void)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    sim_chip_cfg = (uint64_t)bench_dma_alloc(SIM_CHIP_CFG_SZ, 4096);
+    memset((void *)sim_chip_cfg, 0, SIM_CHIP_CFG_SZ);
+
+    for (uint32_t i = 0; i < SIM_GMAC_NUM; ++ i)
+    {
+        struct sim_gmac *g = &sims[i];
+
+        g->mmio = (uint64_t)bench_dma_alloc(SIM_MMIO_SZ, 4096);
+        memset((void *)g->mmio, 0, SIM_MMIO_SZ);
+        sim_wr(g, SIM_MAC_VERSION, 0xd137);
+        sim_wr(g, SIM_DMA_HW_FEATURE, SIM_FEAT_TX_COE | SIM_FEAT_RX_COE2);
+        // link up, 1000 Mbps full duplex
+        sim_wr(g, SIM_MAC_RGSMII_STAT, 0xd);
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(bench_ncpus() - 1, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+    sim_running = 1;
+    if (pthread_create(&sim_thread, &attr, sim_main, NULL))
+    {
+        fprintf(stderr, "cannot start the simulated gmac\n");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void sim_gmac_stop(void)
+{
+    __atomic_store_n(&sim_running, 0, __ATOMIC_RELEASE);
+    pthread_join(sim_thread, NULL);
+}
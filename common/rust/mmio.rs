@@ -0,0 +1,143 @@
+#![allow(dead_code)]
+
+// 类型化的mmio寄存器访问
+// 寄存器偏移和位域都是编译期常量，寄存器只能在它所属类型的寄存器块上访问，
+// 内联后每次read/write只是一条volatile访存指令
+
+use core::marker::PhantomData;
+use core::ptr::{read_volatile, write_volatile};
+
+// 寄存器块B中的一个32位寄存器
+pub struct Reg<B> {
+    ofs: u64,
+    _block: PhantomData<B>,
+}
+
+impl<B> Reg<B> {
+    pub const fn new(ofs: u64) -> Self {
+        return Reg {
+            ofs,
+            _block: PhantomData,
+        };
+    }
+
+    pub const fn offset(self) -> u64 {
+        return self.ofs;
+    }
+}
+
+impl<B> Clone for Reg<B> {
+    fn clone(&self) -> Self {
+        return *self;
+    }
+}
+
+impl<B> Copy for Reg<B> {}
+
+// 寄存器中从shift开始的width位
+#[derive(Clone, Copy)]
+pub struct Field {
+    pub shift: u32,
+    pub width: u32,
+}
+
+impl Field {
+    pub const fn new(shift: u32, width: u32) -> Self {
+        return Field { shift, width };
+    }
+
+    pub const fn mask(self) -> u32 {
+        return (u32::MAX >> (32 - self.width)) << self.shift;
+    }
+
+    // 从寄存器值中取出位域
+    pub const fn get(self, val: u32) -> u32 {
+        return (val & self.mask()) >> self.shift;
+    }
+
+    // 位域值v在寄存器中的位置
+    pub const fn val(self, v: u32) -> u32 {
+        return (v << self.shift) & self.mask();
+    }
+
+    // 把寄存器值val中的位域替换为v
+    pub const fn put(self, val: u32, v: u32) -> u32 {
+        return (val & !self.mask()) | self.val(v);
+    }
+}
+
+// 基址为base的寄存器块B
+// 与u64布局相同，可以直接放在导出给C的结构体中
+#[repr(transparent)]
+pub struct Mmio<B> {
+    base: u64,
+    _block: PhantomData<B>,
+}
+
+impl<B> Clone for Mmio<B> {
+    fn clone(&self) -> Self {
+        return *self;
+    }
+}
+
+impl<B> Copy for Mmio<B> {}
+
+impl<B> Mmio<B> {
+    #[inline(always)]
+    pub const fn new(base: u64) -> Self {
+        return Mmio {
+            base,
+            _block: PhantomData,
+        };
+    }
+
+    #[inline(always)]
+    pub const fn base(self) -> u64 {
+        return self.base;
+    }
+
+    #[inline(always)]
+    pub fn read(self, reg: Reg<B>) -> u32 {
+        return unsafe { read_volatile((self.base + reg.ofs) as *const u32) };
+    }
+
+    #[inline(always)]
+    pub fn write(self, reg: Reg<B>, val: u32) {
+        unsafe { write_volatile((self.base + reg.ofs) as *mut u32, val) };
+    }
+
+    // 读-改-写：清除clear中的位，再置位set中的位
+    #[inline(always)]
+    pub fn modify(self, reg: Reg<B>, clear: u32, set: u32) {
+        let val: u32 = self.read(reg);
+        self.write(reg, (val & !clear) | set);
+    }
+
+    #[inline(always)]
+    pub fn set_bits(self, reg: Reg<B>, bits: u32) {
+        self.modify(reg, 0, bits);
+    }
+
+    #[inline(always)]
+    pub fn clear_bits(self, reg: Reg<B>, bits: u32) {
+        self.modify(reg, bits, 0);
+    }
+
+    #[inline(always)]
+    pub fn read_field(self, reg: Reg<B>, field: Field) -> u32 {
+        return field.get(self.read(reg));
+    }
+
+    #[inline(always)]
+    pub fn write_field(self, reg: Reg<B>, field: Field, v: u32) {
+        self.modify(reg, field.mask(), field.val(v));
+    }
+
+    // 写1清除的状态寄存器：读出当前置位的位并写回，返回读到的值
+    #[inline(always)]
+    pub fn ack(self, reg: Reg<B>) -> u32 {
+        let val: u32 = self.read(reg);
+        self.write(reg, val);
+        return val;
+    }
+}
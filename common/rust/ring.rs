@@ -0,0 +1,123 @@
+#![allow(dead_code)]
+
+// 按深度参数化的环和槽表
+// 深度在编译期检查必须是2的幂，下标回绕只是一次按位与，
+// 下标经过掩码后编译器也能省去越界检查；
+// 两者都与[T; N]布局相同，可以直接放在导出给C的结构体中
+
+use core::ops::{Index, IndexMut};
+use core::slice::{Iter, IterMut};
+
+// 深度为N的环，用自由增长的u32位置访问，位置对N取模即为单元
+#[derive(Clone, Copy)]
+#[repr(transparent)]
+pub struct Ring<T, const N: usize> {
+    slot: [T; N],
+}
+
+impl<T, const N: usize> Ring<T, N> {
+    // 用到时求值，N不是2的幂时编译失败
+    const MASK: u32 = {
+        assert!(N.is_power_of_two() && N <= 1 << 31, "ring depth must be a power of two");
+        (N - 1) as u32
+    };
+
+    pub const DEPTH: u32 = Self::MASK + 1;
+
+    pub const fn new(slot: [T; N]) -> Self {
+        return Ring { slot };
+    }
+
+    #[inline(always)]
+    pub const fn depth(&self) -> u32 {
+        return Self::DEPTH;
+    }
+
+    // 位置对应的单元下标
+    #[inline(always)]
+    pub const fn wrap(&self, pos: u32) -> u32 {
+        return pos & Self::MASK;
+    }
+
+    // 单元idx之后的下标，最后一个单元之后回到0
+    #[inline(always)]
+    pub const fn next(&self, idx: u32) -> u32 {
+        return idx.wrapping_add(1) & Self::MASK;
+    }
+
+    #[inline(always)]
+    pub const fn is_last(&self, idx: u32) -> bool {
+        return idx & Self::MASK == Self::MASK;
+    }
+
+    pub fn iter(&self) -> Iter<'_, T> {
+        return self.slot.iter();
+    }
+
+    pub fn iter_mut(&mut self) -> IterMut<'_, T> {
+        return self.slot.iter_mut();
+    }
+}
+
+impl<T, const N: usize> Index<u32> for Ring<T, N> {
+    type Output = T;
+
+    #[inline(always)]
+    fn index(&self, pos: u32) -> &T {
+        return &self.slot[(pos & Self::MASK) as usize];
+    }
+}
+
+impl<T, const N: usize> IndexMut<u32> for Ring<T, N> {
+    #[inline(always)]
+    fn index_mut(&mut self, pos: u32) -> &mut T {
+        return &mut self.slot[(pos & Self::MASK) as usize];
+    }
+}
+
+// 按槽号索引的N个单元，空闲槽用u32位图管理，因此N不能超过32
+#[derive(Clone, Copy)]
+#[repr(transparent)]
+pub struct SlotTable<T, const N: usize> {
+    slot: [T; N],
+}
+
+impl<T, const N: usize> SlotTable<T, N> {
+    const MASK: u32 = {
+        assert!(N.is_power_of_two() && N <= 32, "slot count must be a power of two up to 32");
+        (N - 1) as u32
+    };
+
+    pub const SLOTS: u32 = Self::MASK + 1;
+
+    // 所有槽组成的位图
+    pub const ALL: u32 = u32::MAX >> (32 - Self::SLOTS);
+
+    pub const fn new(slot: [T; N]) -> Self {
+        return SlotTable { slot };
+    }
+
+    pub fn iter(&self) -> Iter<'_, T> {
+        return self.slot.iter();
+    }
+
+    pub fn iter_mut(&mut self) -> IterMut<'_, T> {
+        return self.slot.iter_mut();
+    }
+}
+
+impl<T, const N: usize> Index<u32> for SlotTable<T, N> {
+    type Output = T;
+
+    #[inline(always)]
+    fn index(&self, slot: u32) -> &T {
+        return &self.slot[(slot & Self::MASK) as usize];
+    }
+}
+
+impl<T, const N: usize> IndexMut<u32> for SlotTable<T, N> {
+    #[inline(always)]
+    fn index_mut(&mut self, slot: u32) -> &mut T {
+        return &mut self.slot[(slot & Self::MASK) as usize];
+    }
+}
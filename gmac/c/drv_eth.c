@@ -1,3 +1,4 @@
+#include "drv_eth.h"
 #include "eth_dev.h"
 #include "eth_platform.h"
 
@@ -64,6 +65,301 @@ void eth_phy_init(struct net_device *gmacdev)
     }
 }
 
+// 使用desc_idx的包是否请求发送完成中断
+// 每TxIntFrames个包请求一次，在途desc达到TX_INT_FILL时每个包都请求，
+// 环满之前一定有一个会产生中断的desc在途
+static uint32_t eth_tx_int_flag(struct net_device *gmacdev, uint32_t desc_idx)
+{
+    uint32_t inflight = (desc_idx + TX_DESC_NUM - gmacdev->TxBusy) % TX_DESC_NUM;
+
+    if (++ gmacdev->TxIntCount < gmacdev->TxIntFrames && inflight < TX_INT_FILL)
+        return 0;
+
+    gmacdev->TxIntCount = 0;
+    return DescTxIntEnable;
+}
+
+// 按RxIntWdt和RxWdtDrain写RIWT
+// 关闭看门狗后，之前重新填充的desc仍带RxDisIntCompl，全部重新填充之前RIWT保持最小值
+static void eth_rx_wdt_sync(struct net_device *gmacdev)
+{
+    uint32_t riwt;
+    uint32_t drain;
+
+    // refills and eth_set_coalesce race on the register, recheck after the write so the last state wins
+    do {
+        riwt = __atomic_load_n(&gmacdev->RxIntWdt, __ATOMIC_SEQ_CST);
+        drain = __atomic_load_n(&gmacdev->RxWdtDrain, __ATOMIC_SEQ_CST);
+        eth_mac_write_reg(gmacdev->DmaBase, DmaRxIntWdt, riwt ? riwt : (drain ? 1 : 0));
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (riwt != __atomic_load_n(&gmacdev->RxIntWdt, __ATOMIC_SEQ_CST) ||
+             !drain != !__atomic_load_n(&gmacdev->RxWdtDrain, __ATOMIC_SEQ_CST));
+}
+
+// 重新填充一个desc时调用，返回1表示关闭看门狗之前填充的desc已经全部替换
+static int eth_rx_wdt_drained(struct net_device *gmacdev)
+{
+    uint32_t drain = __atomic_load_n(&gmacdev->RxWdtDrain, __ATOMIC_SEQ_CST);
+
+    while (drain && !__atomic_compare_exchange_n(&gmacdev->RxWdtDrain, &drain, drain - 1, 0,
+                                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+
+    return drain == 1;
+}
+
+// 写入riwt后读回，判断硬件有没有接收中断看门狗，之后按RxIntWdt恢复RIWT
+static int eth_rx_wdt_probe(struct net_device *gmacdev, uint32_t riwt)
+{
+    int found;
+
+    eth_mac_write_reg(gmacdev->DmaBase, DmaRxIntWdt, riwt);
+    found = eth_mac_read_reg(gmacdev->DmaBase, DmaRxIntWdt) == riwt;
+    eth_rx_wdt_sync(gmacdev);
+
+    return found;
+}
+
+// 设置中断合并
+// rx_usecs: 收到包后经过rx_usecs微秒由RIWT触发接收中断，期间收到的包合并为一次中断，0表示每个包一次中断
+// tx_frames: 每tx_frames个包请求一次发送完成中断，0和1表示每个包一次
+// 运行时可以随时调用，rx_usecs从非0改为0时，RIWT保持最小值直到所有接收desc重新填充一遍
+// 硬件不支持RIWT时返回-1，rx保持每个包一次中断
+int eth_set_coalesce(struct net_device *gmacdev, uint32_t rx_usecs, uint32_t tx_frames)
+{
+    uint32_t riwt = (rx_usecs * ETH_DMA_CLK_MHZ + 255) / 256;
+    int ret = 0;
+
+    gmacdev->TxIntFrames = tx_frames;
+
+    if (riwt > 0xff)
+        riwt = 0xff;
+
+    if (riwt && !eth_rx_wdt_probe(gmacdev, riwt))
+    {
+        // without the watchdog, desc with RxDisIntCompl never raise an interrupt
+        eth_printf("gmac rx interrupt watchdog not supported\n");
+        riwt = 0;
+        ret = -1;
+    }
+
+    // takes effect on each rx desc as it is refilled, the ones refilled under the old
+    // value still hold back their interrupt and need the watchdog until then
+    if (!riwt && __atomic_load_n(&gmacdev->RxIntWdt, __ATOMIC_SEQ_CST))
+    {
+        __atomic_store_n(&gmacdev->RxIntWdt, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&gmacdev->RxWdtDrain, RX_DESC_NUM, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        __atomic_store_n(&gmacdev->RxIntWdt, riwt, __ATOMIC_SEQ_CST);
+    }
+    eth_rx_wdt_sync(gmacdev);
+
+    return ret;
+}
+
+// 距上次调用的每秒中断次数
+uint32_t eth_get_irq_rate(struct net_device *gmacdev)
+{
+    uint64_t now = eth_get_time_us();
+    uint64_t elapsed = now - gmacdev->IrqRateStamp;
+    uint64_t irqs = gmacdev->irqs - gmacdev->IrqRateIrqs;
+
+    gmacdev->IrqRateStamp = now;
+    gmacdev->IrqRateIrqs = gmacdev->irqs;
+
+    return elapsed ? (uint32_t)(irqs * 1000000 / elapsed) : 0;
+}
+
+// 自适应中断合并的档位，由轻到重
+// 收发的包速率或字节速率超过up时升一档，两者都低于down时降一档，
+// down低于下一档的up，速率在两者之间时保持不变
+static const struct eth_dim_profile
+{
+    uint32_t rx_usecs;
+    uint32_t tx_frames;
+    uint32_t up_pps;
+    uint32_t up_bps;            // bytes per second
+    uint32_t down_pps;
+    uint32_t down_bps;
+} eth_dim_profiles[] = {
+    {   0,  1,      20000,   10000000,      0,        0 },
+    {  16,  4,      60000,   40000000,  10000,  5000000 },
+    {  64, 16,     150000,   90000000,  40000, 25000000 },
+    { 256, 32, UINT32_MAX, UINT32_MAX, 100000, 70000000 },
+};
+
+#define DIM_PROFILE_NUM (sizeof(eth_dim_profiles) / sizeof(eth_dim_profiles[0]))
+
+static void eth_dim_apply(struct net_device *gmacdev)
+{
+    const struct eth_dim_profile *prof = &eth_dim_profiles[gmacdev->DimProfile];
+
+    eth_set_coalesce(gmacdev, gmacdev->DimRxWdt ? prof->rx_usecs : 0, prof->tx_frames);
+}
+
+// 开启或关闭自适应中断合并，从不合并的一档开始，关闭后恢复每个包一次中断
+void eth_dim_mode(struct net_device *gmacdev, uint32_t enable)
+{
+    gmacdev->DimMode = 0;
+    gmacdev->DimProfile = 0;
+    gmacdev->DimVotes = 0;
+    gmacdev->DimStamp = eth_get_time_us();
+    gmacdev->DimPackets = gmacdev->rx_packets + gmacdev->tx_packets;
+    gmacdev->DimBytes = gmacdev->rx_bytes + gmacdev->tx_bytes;
+
+    // probe the watchdog once, a missing one only leaves tx moderation
+    // leaves RxIntWdt alone so entering profile 0 does not start a drain
+    if (enable)
+        gmacdev->DimRxWdt = eth_rx_wdt_probe(gmacdev, 1);
+    eth_dim_apply(gmacdev);
+
+    gmacdev->DimMode = enable;
+}
+
+// 对收发计数采样，每DIM_INTERVAL_US最多一次，按速率调整合并档位
+// 开启时由eth_irq调用；流量停止后没有中断，OS还应该用定时器周期调用，
+// 把合并降回轻档，定时器的调用需要与eth_irq互斥
+void eth_dim_update(struct net_device *gmacdev)
+{
+    const struct eth_dim_profile *prof;
+    uint64_t now, elapsed, packets, bytes, pps, bps;
+
+    if (!gmacdev->DimMode)
+        return;
+
+    now = eth_get_time_us();
+    elapsed = now - gmacdev->DimStamp;
+    if (elapsed < DIM_INTERVAL_US)
+        return;
+
+    packets = gmacdev->rx_packets + gmacdev->tx_packets;
+    bytes = gmacdev->rx_bytes + gmacdev->tx_bytes;
+    pps = (packets - gmacdev->DimPackets) * 1000000 / elapsed;
+    bps = (bytes - gmacdev->DimBytes) * 1000000 / elapsed;
+
+    gmacdev->DimStamp = now;
+    gmacdev->DimPackets = packets;
+    gmacdev->DimBytes = bytes;
+
+    prof = &eth_dim_profiles[gmacdev->DimProfile];
+    if (pps > prof->up_pps || bps > prof->up_bps)
+        gmacdev->DimVotes = gmacdev->DimVotes > 0 ? gmacdev->DimVotes + 1 : 1;
+    else if (pps < prof->down_pps && bps < prof->down_bps)
+        gmacdev->DimVotes = gmacdev->DimVotes < 0 ? gmacdev->DimVotes - 1 : -1;
+    else
+        gmacdev->DimVotes = 0;
+
+    if (gmacdev->DimVotes >= DIM_HYSTERESIS && gmacdev->DimProfile < DIM_PROFILE_NUM - 1)
+        gmacdev->DimProfile ++;
+    else if (gmacdev->DimVotes <= -DIM_HYSTERESIS && gmacdev->DimProfile > 0)
+        gmacdev->DimProfile --;
+    else
+        return;
+
+    gmacdev->DimVotes = 0;
+    eth_dim_apply(gmacdev);
+}
+
+// 开启或关闭ip/tcp/udp校验和offload，按eth_init读到的DmaHWFeature开启硬件支持的方向
+// 发送需要Tx COE，接收需要Type 2 Rx COE（ip头和ipv4/ipv6的tcp/udp/icmp）
+// 开启时两个方向都不支持返回-1
+int eth_csum_offload(struct net_device *gmacdev, uint32_t enable)
+{
+    gmacdev->TxCoe = enable && gmacdev->DmaCap.tx_coe;
+    gmacdev->RxCoe = enable && gmacdev->DmaCap.rx_coe_type2;
+
+    if (gmacdev->RxCoe)
+        eth_mac_set_bits(gmacdev->MacBase, GmacConfig, GmacRxIpcOffload);
+    else
+        eth_mac_clear_bits(gmacdev->MacBase, GmacConfig, GmacRxIpcOffload);
+
+    if (enable && !gmacdev->TxCoe && !gmacdev->RxCoe)
+    {
+        eth_printf("gmac checksum offload not supported\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// 包p需要硬件插入的校验和，只在第一个desc中有效
+// tx需要store and forward，eth_dma_control_init已经开启
+static uint32_t eth_tx_csum(struct net_device *gmacdev, uint64_t p)
+{
+    uint32_t csum;
+
+    if (!gmacdev->TxCoe)
+        return DescTxCisBypass;
+
+    csum = eth_handle_tx_csum(gmacdev, p);
+    if (csum & ETH_TX_CSUM_L4)
+        return DescTxCisTcpPseudoCs;
+    if (csum & ETH_TX_CSUM_IP)
+        return DescTxCisIpv4HdrCs;
+
+    return DescTxCisBypass;
+}
+
+// 把接收校验和的检查结果交给OS
+// Bit(5:7:0)为RxNoChkError时校验和正确，校验和错误的包带DescError，已经按错误丢弃
+static void eth_rx_csum(struct net_device *gmacdev, uint64_t pbuf, uint32_t status)
+{
+    uint32_t coe = status & (DescRxChkBit5 | DescRxChkBit7 | DescRxChkBit0);
+
+    if (!gmacdev->RxCoe || !pbuf)
+        return;
+
+    eth_handle_rx_csum(gmacdev, pbuf, coe == DescRxChkBit5 ? ETH_RX_CSUM_OK : ETH_RX_CSUM_NONE);
+}
+
+// 设置MTU，最大ETH_MAX_MTU，大于ETH_MTU时开启jumbo帧，OS发送的帧不能超过MTU
+// 第一次开启时一次分配JUMBO_BUF_SIZE的tx buffer和拼接接收帧的RxJumbo，之后一直保留，
+// 原来2KiB的tx buffer不能释放，也一直保留
+// rx buffer仍是RX_BUF_SIZE，jumbo帧跨多个desc接收
+int eth_set_mtu(struct net_device *gmacdev, uint32_t mtu)
+{
+    if (mtu == 0 || mtu > ETH_MAX_MTU)
+        return -1;
+
+    if (mtu > ETH_MTU && !gmacdev->RxJumbo)
+    {
+        uint8_t *block = (uint8_t *)eth_malloc_align(JUMBO_BUF_SIZE * (TX_DESC_NUM + 1), 16);
+
+        if (!block)
+        {
+            eth_printf("cannot allocate jumbo frame buffers\n");
+            return -1;
+        }
+
+        // the desc in flight keep pointing at the old buffers
+        for (int i = 0; i < TX_DESC_NUM; i ++)
+            gmacdev->TxBuffer[i] = block + (i + 1) * JUMBO_BUF_SIZE;
+        gmacdev->RxJumbo = block;
+    }
+
+    if (mtu > ETH_MTU)
+        eth_mac_set_bits(gmacdev->MacBase, GmacConfig, GmacJumboFrame);
+    else
+        eth_mac_clear_bits(gmacdev->MacBase, GmacConfig, GmacJumboFrame);
+
+    gmacdev->Mtu = mtu;
+
+    return 0;
+}
+
+// 设置tx desc的buffer，一个buffer最多DescSize1Mask字节，jumbo帧超过4KiB的部分放在buffer2
+static void eth_tx_set_buffer(DmaDesc *txdesc, uint32_t dma_addr, uint32_t length)
+{
+    uint32_t len1 = length > BUF_SIZE_4KiB ? BUF_SIZE_4KiB : length;
+
+    txdesc->length = ((len1 << DescSize1Shift) & DescSize1Mask);
+    txdesc->length |= (((length - len1) << DescSize2Shift) & DescSize2Mask);
+    txdesc->buffer1 = dma_addr;
+    txdesc->buffer2 = length > len1 ? dma_addr + len1 : 0;
+}
+
 // 操作系统传递接收数据的单元pbuf给驱动
 // pbuf可能是操作系统自定义结构
 // 返回接收到的数据字节数
@@ -76,23 +372,28 @@ int eth_tx(struct net_device *gmacdev, uint64_t pbuf)
     uint32_t desc_idx = gmacdev->TxNext;
     DmaDesc *txdesc = gmacdev->TxDesc[desc_idx];
     uint32_t is_last = eth_is_last_tx_desc(txdesc);
+    uint32_t status;
 
-    // 如果desc由dma持有，说明满了
-    if (eth_get_desc_owner(txdesc))
+    // 如果desc由dma持有，或者还没有被eth_tx_reclaim回收，说明满了
+    if (eth_get_desc_owner(txdesc) || !eth_is_desc_empty(txdesc))
     {
         // eth_printf("[eth_tx] tx desc is full\n");
         return -1;
     }
 
     buffer = gmacdev->TxBuffer[desc_idx];
-    length = eth_handle_tx_buffer(pbuf, (uint64_t)buffer);
+    length = eth_handle_tx_buffer(gmacdev, pbuf, (uint64_t)buffer);
     dma_addr = eth_virt_to_phys((uint64_t)buffer);
 
-    // set desc
-    txdesc->status |= (DescOwnByDma | DescTxIntEnable | DescTxLast | DescTxFirst);
-    txdesc->length = ((length << DescSize1Shift) & DescSize1Mask);
-    txdesc->buffer1 = dma_addr;
-    txdesc->buffer2 = 0;
+    // set desc, the status of the last frame is rebuilt, not carried over
+    status = (txdesc->status & TxDescEndOfRing) | DescOwnByDma | DescTxLast | DescTxFirst;
+    status |= eth_tx_int_flag(gmacdev, desc_idx);
+    status |= eth_tx_csum(gmacdev, pbuf);
+    eth_tx_set_buffer(txdesc, dma_addr, length);
+
+    // the buffer is visible before dma owns the desc
+    eth_sync_dcache();
+    txdesc->status = status;
 
     gmacdev->TxNext = is_last ? 0 : (desc_idx + 1);
 
@@ -104,62 +405,456 @@ int eth_tx(struct net_device *gmacdev, uint64_t pbuf)
     return 0;
 }
 
+// 一次发送最多count个包，pbufs是操作系统传递的数据单元
+// 除第一个以外的desc先交给dma，同步一次之后才设置第一个desc的OWN位
+// dma不会在整批写完之前开始处理，最后只唤醒一次dma
+// 返回接受的包个数，desc不够时少于count
+uint32_t eth_tx_burst(struct net_device *gmacdev, const uint64_t *pbufs, uint32_t count)
+{
+    uint32_t desc_idx = gmacdev->TxNext;
+    DmaDesc *first = gmacdev->TxDesc[desc_idx];
+    uint32_t first_status = 0;
+    uint32_t sent = 0;
+
+    // the first desc is not owned by dma yet, never wrap onto it
+    if (count > TX_DESC_NUM)
+        count = TX_DESC_NUM;
+
+    while (sent < count)
+    {
+        DmaDesc *txdesc = gmacdev->TxDesc[desc_idx];
+        uint32_t is_last = eth_is_last_tx_desc(txdesc);
+        void *buffer;
+        uint32_t length, status;
+
+        // 如果desc由dma持有，或者还没有被eth_tx_reclaim回收，说明满了
+        if (eth_get_desc_owner(txdesc) || !eth_is_desc_empty(txdesc))
+            break;
+
+        buffer = gmacdev->TxBuffer[desc_idx];
+        length = eth_handle_tx_buffer(gmacdev, pbufs[sent], (uint64_t)buffer);
+
+        // set desc
+        status = (txdesc->status & TxDescEndOfRing) | DescOwnByDma | DescTxLast | DescTxFirst;
+        status |= eth_tx_int_flag(gmacdev, desc_idx);
+        status |= eth_tx_csum(gmacdev, pbufs[sent]);
+        eth_tx_set_buffer(txdesc, eth_virt_to_phys((uint64_t)buffer), length);
+
+        if (sent == 0)
+            first_status = status;
+        else
+            txdesc->status = status;
+
+        sent ++;
+        desc_idx = is_last ? 0 : (desc_idx + 1);
+    }
+
+    if (sent == 0)
+        return 0;
+
+    gmacdev->TxNext = desc_idx;
+
+    // the whole batch is visible before dma may start on the first desc
+    eth_sync_dcache();
+    first->status = first_status;
+    eth_sync_dcache();
+
+    // start tx
+    eth_gmac_resume_dma_tx(gmacdev);
+
+    return sent;
+}
+
+// 零拷贝发送一个由nseg段操作系统缓冲区组成的包，例如lwip的pbuf链
+// 每个desc的buffer1/buffer2各挂一段，按需要占用多个desc，首尾desc带First/Last标志
+// 缓冲区不拷贝，发送完成前必须保持有效，eth_handle_tx_over回收最后一个desc时
+// 调用eth_handle_tx_done(p)通知操作系统释放
+// p不能为0，desc不够或某段长度超过DescSize1Mask时返回-1，什么也不占用
+int eth_tx_sg(struct net_device *gmacdev, const struct eth_tx_seg *segs, uint32_t nseg, uint64_t p)
+{
+    uint32_t ndesc = (nseg + 1) / 2;
+    uint32_t desc_idx = gmacdev->TxNext;
+    DmaDesc *first = gmacdev->TxDesc[desc_idx];
+    uint32_t first_status = 0;
+
+    if (nseg == 0 || ndesc > TX_DESC_NUM)
+        return -1;
+
+    // check every desc the frame needs before touching any of them
+    for (uint32_t i = 0; i < nseg; i ++)
+    {
+        if (segs[i].len == 0 || segs[i].len > DescSize1Mask)
+            return -1;
+    }
+    for (uint32_t i = 0, idx = desc_idx; i < ndesc; i ++)
+    {
+        DmaDesc *txdesc = gmacdev->TxDesc[idx];
+
+        if (eth_get_desc_owner(txdesc) || !eth_is_desc_empty(txdesc))
+            return -1;
+        idx = eth_is_last_tx_desc(txdesc) ? 0 : (idx + 1);
+    }
+
+    for (uint32_t i = 0; i < ndesc; i ++)
+    {
+        DmaDesc *txdesc = gmacdev->TxDesc[desc_idx];
+        const struct eth_tx_seg *seg = &segs[i * 2];
+        uint32_t is_last = eth_is_last_tx_desc(txdesc);
+        uint32_t status = (txdesc->status & TxDescEndOfRing) | DescOwnByDma;
+
+        // set desc
+        txdesc->length = ((seg[0].len << DescSize1Shift) & DescSize1Mask);
+        txdesc->buffer1 = eth_virt_to_phys(seg[0].addr);
+        txdesc->buffer2 = 0;
+        if (i * 2 + 1 < nseg)
+        {
+            txdesc->length |= ((seg[1].len << DescSize2Shift) & DescSize2Mask);
+            txdesc->buffer2 = eth_virt_to_phys(seg[1].addr);
+        }
+
+        if (i == 0)
+            status |= DescTxFirst | eth_tx_csum(gmacdev, p);
+        if (i == ndesc - 1)
+        {
+            // always interrupt, the os buffers stay pinned until reclaimed
+            status |= DescTxLast | DescTxIntEnable;
+            gmacdev->TxIntCount = 0;
+            gmacdev->TxCookie[desc_idx] = p;
+        }
+
+        // the first desc goes to dma last, after the whole frame is written
+        if (i == 0)
+            first_status = status;
+        else
+            txdesc->status = status;
+
+        desc_idx = is_last ? 0 : (desc_idx + 1);
+    }
+
+    gmacdev->TxNext = desc_idx;
+
+    eth_sync_dcache();
+    first->status = first_status;
+    eth_sync_dcache();
+
+    // start tx
+    eth_gmac_resume_dma_tx(gmacdev);
+
+    return 0;
+}
+
+// 把接收到的数据交给操作系统
+// zero-copy时buffer直接交出，desc换上缓冲池中的buffer，dma_addr随之更新
+// 缓冲池为空时（buffer都在操作系统手里）退回到拷贝
+static uint64_t eth_rx_deliver(struct net_device *gmacdev, uint32_t desc_idx,
+                               uint32_t *dma_addr, uint32_t length)
+{
+    struct eth_rx_pool *pool = &gmacdev->RxPool;
+    uint64_t buffer = eth_phys_to_virt(*dma_addr);
+    uint64_t pbuf;
+    void *fresh;
+
+    if (!gmacdev->RxZeroCopy ||
+        pool->head == __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE))
+        return eth_handle_rx_buffer(gmacdev, buffer, length);
+
+    // the os keeps nothing on failure, the buffer stays on the desc
+    pbuf = eth_handle_rx_zero_copy(gmacdev, buffer, length);
+    if (!pbuf)
+        return 0;
+
+    fresh = pool->buf[pool->head & (RX_POOL_NUM - 1)];
+    __atomic_store_n(&pool->head, pool->head + 1, __ATOMIC_RELEASE);
+
+    gmacdev->RxBuffer[desc_idx] = fresh;
+    *dma_addr = eth_virt_to_phys((uint64_t)fresh);
+
+    return pbuf;
+}
+
+// 开启zero-copy rx，分配RX_POOL_NUM个备用buffer
+// 在eth_init之后、操作系统开始接收之前调用
+int eth_rx_zero_copy_init(struct net_device *gmacdev)
+{
+    struct eth_rx_pool *pool = &gmacdev->RxPool;
+
+    for (int i = 0; i < RX_POOL_NUM; i ++)
+    {
+        pool->buf[i] = (void *)eth_malloc_align(RX_BUF_SIZE, 16);
+        if (!pool->buf[i])
+        {
+            eth_printf("cannot allocate rx buffer pool\n");
+            return -1;
+        }
+    }
+
+    pool->head = 0;
+    pool->tail = RX_POOL_NUM;
+    gmacdev->RxZeroCopy = 1;
+
+    return 0;
+}
+
+// 操作系统用完eth_handle_rx_zero_copy交出的buffer后调用，放回缓冲池
+// 可以在rx以外的线程调用，但同一时刻只能有一个调用者
+void eth_rx_release(struct net_device *gmacdev, uint64_t buffer)
+{
+    struct eth_rx_pool *pool = &gmacdev->RxPool;
+    uint32_t tail = pool->tail;
+
+    pool->buf[tail & (RX_POOL_NUM - 1)] = (void *)buffer;
+    __atomic_store_n(&pool->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// desc_idx开始的包占用的desc个数，dma还没有交还包的最后一个desc时返回0
+// 帧超过一个desc的buffer时（jumbo帧）跨多个desc，只有最后一个desc带DescRxLast
+static uint32_t eth_rx_frame_descs(struct net_device *gmacdev, uint32_t desc_idx)
+{
+    for (uint32_t n = 1; n <= RX_DESC_NUM; ++ n)
+    {
+        DmaDesc *rxdesc = gmacdev->RxDesc[desc_idx];
+
+        if (eth_is_desc_empty(rxdesc) || eth_get_desc_owner(rxdesc))
+            return 0;
+        if (rxdesc->status & DescRxLast)
+            return n;
+
+        desc_idx = eth_is_last_rx_desc(rxdesc) ? 0 : (desc_idx + 1);
+    }
+
+    return 0;
+}
+
+// 跨ndesc个desc的帧先拼接到RxJumbo，再交给操作系统拷贝，zero-copy rx也一样
+static uint64_t eth_rx_gather(struct net_device *gmacdev, uint32_t desc_idx, uint32_t ndesc,
+                              uint32_t length)
+{
+    uint8_t *jumbo = gmacdev->RxJumbo;
+    uint32_t ofs = 0;
+
+    // only a jumbo mtu lets frames outgrow one desc
+    if (!jumbo || length > JUMBO_BUF_SIZE)
+        return 0;
+
+    for (uint32_t i = 0; i < ndesc; ++ i)
+    {
+        uint32_t len = length - ofs < RX_BUF_SIZE ? length - ofs : RX_BUF_SIZE;
+
+        eth_memcpy(jumbo + ofs, gmacdev->RxBuffer[desc_idx], len);
+        ofs += len;
+        desc_idx = (desc_idx + 1) % RX_DESC_NUM;
+    }
+
+    return eth_handle_rx_buffer(gmacdev, (uint64_t)jumbo, length);
+}
+
+// 把desc交还给dma，dma_addr是desc的buffer
+static void eth_rx_refill(struct net_device *gmacdev, uint32_t desc_idx, uint32_t dma_addr)
+{
+    DmaDesc *rxdesc = gmacdev->RxDesc[desc_idx];
+    uint32_t is_last = eth_is_last_rx_desc(rxdesc);
+    // counted before RxIntWdt is read, a desc counted here never gets the old flag
+    int drained = eth_rx_wdt_drained(gmacdev);
+    uint32_t length = is_last ? RxDescEndOfRing : 0;
+
+    length |= __atomic_load_n(&gmacdev->RxIntWdt, __ATOMIC_SEQ_CST) ? RxDisIntCompl : 0;
+    length |= ((RX_BUF_SIZE << DescSize1Shift) & DescSize1Mask);
+
+    // a running dma may fetch the desc as soon as it owns it, the length
+    // and buffer are complete before OWN is set
+    rxdesc->length = length;
+    rxdesc->buffer1 = dma_addr;
+    rxdesc->buffer2 = 0;
+    eth_sync_dcache();
+    rxdesc->status = DescOwnByDma;
+
+    if (drained)
+        eth_rx_wdt_sync(gmacdev);
+}
+
+// 处理desc_idx开始的ndesc个desc组成的包，desc全部交还给dma
+// 返回交给操作系统的数据单元，错误的包或操作系统没有接收时为0
+static uint64_t eth_rx_frame(struct net_device *gmacdev, uint32_t desc_idx, uint32_t ndesc)
+{
+    DmaDesc *first = gmacdev->RxDesc[desc_idx];
+    DmaDesc *last = gmacdev->RxDesc[(desc_idx + ndesc - 1) % RX_DESC_NUM];
+    uint32_t dma_addr = first->buffer1;
+    uint64_t pbuf = 0;
+
+    // handle received packet
+    if (eth_is_rx_frame_valid(first, last))
+    {
+        uint32_t length = eth_get_rx_length(last);
+
+        // 创建length长度的pbuf，将buffer拷贝到pbuf中
+        // 或者zero-copy rx，desc换上缓冲池中的buffer
+        if (ndesc == 1)
+            pbuf = eth_rx_deliver(gmacdev, desc_idx, &dma_addr, length);
+        else
+            pbuf = eth_rx_gather(gmacdev, desc_idx, ndesc, length);
+        eth_rx_csum(gmacdev, pbuf, last->status);
+
+        // a frame nobody took, e.g. a jumbo frame without a jumbo mtu, is dropped
+        if (pbuf)
+        {
+            gmacdev->rx_bytes += length;
+            gmacdev->rx_packets ++;
+        }
+        else
+        {
+            gmacdev->rx_errors ++;
+        }
+    }
+    else
+    {
+        gmacdev->rx_errors ++;
+    }
+
+    // set desc, only a single-desc frame may have swapped its buffer
+    eth_rx_refill(gmacdev, desc_idx, dma_addr);
+    for (uint32_t i = 1; i < ndesc; ++ i)
+    {
+        desc_idx = (desc_idx + 1) % RX_DESC_NUM;
+        eth_rx_refill(gmacdev, desc_idx, gmacdev->RxDesc[desc_idx]->buffer1);
+    }
+
+    return pbuf;
+}
+
+// 按RxPending计算DmaInterrupt，已经通知操作系统的中断在它重新打开之前保持屏蔽
+// 轮询模式下是所有收发完成中断，否则是rx中断
+static void eth_int_sync(struct net_device *gmacdev)
+{
+    uint32_t pending;
+    uint32_t masked;
+
+    // the isr and an os thread re-arming on another cpu race on the register,
+    // recheck after the write so the last state wins
+    do {
+        pending = __atomic_load_n(&gmacdev->RxPending, __ATOMIC_SEQ_CST);
+        masked = gmacdev->PollMode ? DmaIntPoll : (DmaIntRxCompleted | DmaIntRxNoBuffer);
+        eth_dma_enable_interrupt(gmacdev, pending ? DmaIntEnable & ~masked : DmaIntEnable);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (pending != __atomic_load_n(&gmacdev->RxPending, __ATOMIC_SEQ_CST));
+}
+
+// 中断中通知操作系统，之后由eth_rx_rearm恢复中断
+static void eth_rx_notify(struct net_device *gmacdev)
+{
+    __atomic_store_n(&gmacdev->RxPending, 1, __ATOMIC_SEQ_CST);
+    eth_rx_ready(gmacdev);
+}
+
+// 操作系统处理完通知的收发，恢复中断
+// status bits raised while masked fire as soon as they are enabled again
+static void eth_rx_rearm(struct net_device *gmacdev)
+{
+    __atomic_store_n(&gmacdev->RxPending, 0, __ATOMIC_SEQ_CST);
+    eth_int_sync(gmacdev);
+}
+
 // pbuf是返回给操作系统的数据单元
 // 可能是操作系统自定义结构
 uint64_t eth_rx(struct net_device *gmacdev)
 {
     uint32_t desc_idx = gmacdev->RxBusy;
-    DmaDesc *rxdesc = gmacdev->RxDesc[desc_idx];
-    uint32_t is_last = eth_is_last_rx_desc(rxdesc);
+    uint32_t ndesc = eth_rx_frame_descs(gmacdev, desc_idx);
+    uint64_t pbuf;
 
     // 如果desc为空或仍由DMA持有，则表示没有新数据包
-    // 恢复rx中断并退出
-    if (eth_is_desc_empty(rxdesc) || eth_get_desc_owner(rxdesc))
+    // 恢复rx中断并退出，轮询模式下由eth_poll恢复
+    if (ndesc == 0)
     {
         // eth_printf("[eth_rx] no rx desc available\n");
-        eth_dma_enable_interrupt(gmacdev, DmaIntEnable);
+        if (!gmacdev->PollMode)
+            eth_rx_rearm(gmacdev);
         return 0;
     }
 
-    void *pbuf = 0;
-    uint32_t dma_addr = rxdesc->buffer1;
+    eth_sync_dcache();
 
-    // handle received packet
-    if (eth_is_rx_desc_valid(rxdesc))
-    {
-        uint32_t length = eth_get_rx_length(rxdesc);
-        void *buffer = (void *)eth_phys_to_virt(dma_addr);
+    pbuf = eth_rx_frame(gmacdev, desc_idx, ndesc);
+    gmacdev->RxBusy = (desc_idx + ndesc) % RX_DESC_NUM;
 
-        eth_sync_dcache();
+    return pbuf;
+}
 
-        // 创建length长度的pbuf，将buffer拷贝到pbuf中
-        // 或者实现zero-copy rx
-        pbuf = (void *)eth_handle_rx_buffer((uint64_t)buffer, length);
+// 收取最多max个dma已经交还的包，pbufs保存返回给操作系统的数据单元
+// 整批只同步一次cache，desc全部重新交给dma后同步一次，并只写一次DmaRxPollDemand
+// harvested是收取的包个数（包括错误的包），返回pbufs中包的个数，不恢复中断
+static uint32_t eth_rx_harvest(struct net_device *gmacdev, uint64_t *pbufs, uint32_t max,
+                               uint32_t *harvested)
+{
+    uint32_t desc_idx = gmacdev->RxBusy;
+    uint32_t ready = 0, count = 0, descs = 0;
+
+    *harvested = 0;
 
-        gmacdev->rx_bytes += length;
-        gmacdev->rx_packets ++;
+    // find the frames completed by dma, within one lap of the ring
+    while (ready < max)
+    {
+        uint32_t ndesc = eth_rx_frame_descs(gmacdev, desc_idx);
+
+        if (ndesc == 0 || descs + ndesc > RX_DESC_NUM)
+            break;
+
+        ready ++;
+        descs += ndesc;
+        desc_idx = (desc_idx + ndesc) % RX_DESC_NUM;
     }
-    else
+
+    if (ready == 0)
+        return 0;
+
+    eth_sync_dcache();
+
+    desc_idx = gmacdev->RxBusy;
+    for (uint32_t i = 0; i < ready; ++ i)
     {
-        gmacdev->rx_errors ++;
+        uint32_t ndesc = eth_rx_frame_descs(gmacdev, desc_idx);
+        uint64_t pbuf = eth_rx_frame(gmacdev, desc_idx, ndesc);
+
+        if (pbuf)
+            pbufs[count ++] = pbuf;
+
+        desc_idx = (desc_idx + ndesc) % RX_DESC_NUM;
     }
 
-    // set desc
-    rxdesc->status = DescOwnByDma;
-    rxdesc->length = is_last ? RxDescEndOfRing : 0;
-    rxdesc->length |= ((RX_BUF_SIZE << DescSize1Shift) & DescSize1Mask);
-    rxdesc->buffer1 = dma_addr;
-    rxdesc->buffer2 = 0;
+    gmacdev->RxBusy = desc_idx;
 
-    gmacdev->RxBusy = is_last ? 0 : (desc_idx + 1);
+    // refilled desc must be visible before dma polls again
+    eth_sync_dcache();
+    eth_gmac_resume_dma_rx(gmacdev);
 
-    return (uint64_t)pbuf;
+    *harvested = ready;
+    return count;
 }
 
-// handle all transmitted packet
-void eth_handle_tx_over(struct net_device *gmacdev)
+// 一次接收最多max个包，pbufs保存返回给操作系统的数据单元
+// 返回pbufs中包的个数，环中的包收完时恢复rx中断，轮询模式下由eth_poll恢复
+uint32_t eth_rx_burst(struct net_device *gmacdev, uint64_t *pbufs, uint32_t max)
+{
+    uint32_t ready, count;
+
+    if (max > RX_DESC_NUM)
+        max = RX_DESC_NUM;
+
+    count = eth_rx_harvest(gmacdev, pbufs, max, &ready);
+
+    // ring drained, wait for the next rx interrupt
+    // in poll mode the interrupts stay masked until eth_poll finishes
+    if (ready < max && !gmacdev->PollMode)
+        eth_rx_rearm(gmacdev);
+
+    return count;
+}
+
+// reclaim at most budget transmitted desc, return how many were reclaimed
+static uint32_t eth_tx_reclaim(struct net_device *gmacdev, uint32_t budget)
 {
-    while (1)
+    uint32_t done = 0;
+
+    while (done < budget)
     {
         uint32_t desc_idx = gmacdev->TxBusy;
         DmaDesc *txdesc = gmacdev->TxDesc[desc_idx];
@@ -171,9 +866,16 @@ void eth_handle_tx_over(struct net_device *gmacdev)
             break;
         }
 
-        if (eth_is_tx_desc_valid(txdesc))
+        uint32_t length = ((txdesc->length & DescSize1Mask) >> DescSize1Shift) +
+                          ((txdesc->length & DescSize2Mask) >> DescSize2Shift);
+
+        // error status is only valid in the last segment of a frame
+        if (!(txdesc->status & DescTxLast))
+        {
+            gmacdev->tx_bytes += length;
+        }
+        else if (eth_is_tx_desc_valid(txdesc))
         {
-            uint32_t length = (txdesc->length & DescSize1Mask) >> DescSize1Shift;
             gmacdev->tx_bytes += length;
             gmacdev->tx_packets ++;
         }
@@ -182,6 +884,13 @@ void eth_handle_tx_over(struct net_device *gmacdev)
             gmacdev->tx_errors ++;
         }
 
+        // os buffers of a scatter-gather frame are released once it is sent
+        if (gmacdev->TxCookie[desc_idx])
+        {
+            eth_handle_tx_done(gmacdev, gmacdev->TxCookie[desc_idx]);
+            gmacdev->TxCookie[desc_idx] = 0;
+        }
+
         uint32_t is_last = eth_is_last_tx_desc(txdesc);
 
         // clear desc
@@ -191,22 +900,69 @@ void eth_handle_tx_over(struct net_device *gmacdev)
         txdesc->buffer2 = 0;
 
         gmacdev->TxBusy = is_last ? 0 : (desc_idx + 1);
+        done ++;
+    }
+
+    return done;
+}
+
+// handle all transmitted packet
+void eth_handle_tx_over(struct net_device *gmacdev)
+{
+    eth_tx_reclaim(gmacdev, TX_DESC_NUM);
+}
+
+// 开启或关闭轮询模式
+// 轮询模式下中断只屏蔽收发完成中断并调用eth_rx_ready，收包和回收发送desc都交给eth_poll
+void eth_poll_mode(struct net_device *gmacdev, uint32_t enable)
+{
+    gmacdev->PollMode = enable;
+
+    // whatever the os was told in the old mode, start the new one with everything armed
+    eth_rx_rearm(gmacdev);
+}
+
+// 轮询模式下eth_rx_ready之后由操作系统调用，类似linux的napi
+// 收取最多budget个包到pbufs，received是pbufs中包的个数，再回收最多budget个已发送的desc
+// 都在budget之内完成时恢复中断并返回0，否则中断保持屏蔽，返回1，操作系统需要再次调用
+uint32_t eth_poll(struct net_device *gmacdev, uint64_t *pbufs, uint32_t budget,
+                  uint32_t *received)
+{
+    uint32_t rx_done, tx_done;
+
+    if (budget > RX_DESC_NUM)
+        budget = RX_DESC_NUM;
+
+    gmacdev->polls ++;
+
+    *received = eth_rx_harvest(gmacdev, pbufs, budget, &rx_done);
+    tx_done = eth_tx_reclaim(gmacdev, budget);
+
+    if (rx_done == budget || tx_done == budget)
+    {
+        gmacdev->poll_exhausted ++;
+        return 1;
     }
+
+    eth_rx_rearm(gmacdev);
+    return 0;
 }
 
 // 中断处理程序
 // gmac分为dma和gmac两部分中断，主要通过dma线触发
 // eth_rx_ready通知操作系统可以接收数据
 // eth_handle_tx_over用于处理已经发送完的描述符
+// 轮询模式下收发完成都只通知操作系统调用eth_poll
 void eth_irq(struct net_device *gmacdev)
 {
     uint32_t dma_status;
-    uint32_t dma_int_enable = DmaIntEnable;
 
     dma_status = eth_mac_read_reg(gmacdev->DmaBase, DmaStatus);
     if (dma_status == 0)
         return;
 
+    gmacdev->irqs ++;
+
     // disable interrupt
     eth_dma_disable_interrupt_all(gmacdev);
 
@@ -282,9 +1038,8 @@ void eth_irq(struct net_device *gmacdev)
     {
         eth_printf("gmac receive buffer unavailable\n");
         // try to recover
-        dma_int_enable &= ~DmaIntRxNoBuffer;
         eth_gmac_resume_dma_rx(gmacdev);
-        eth_rx_ready(gmacdev);
+        eth_rx_notify(gmacdev);
     }
 
     // 6 receive interrupt (reception completed)
@@ -292,8 +1047,7 @@ void eth_irq(struct net_device *gmacdev)
     if (dma_status & DmaIntRxCompleted)
     {
         //eth_printf("gmac dma rx normal\n");
-        dma_int_enable &= ~DmaIntRxCompleted;
-        eth_rx_ready(gmacdev);
+        eth_rx_notify(gmacdev);
     }
 
     // 5 transmit underflow
@@ -331,17 +1085,44 @@ void eth_irq(struct net_device *gmacdev)
     if (dma_status & DmaIntTxCompleted)
     {
         // eth_printf("gmac dma tx normal\n");
-        eth_handle_tx_over(gmacdev);
+        // poll mode reclaims in eth_poll, schedule it unless rx already did
+        if (!gmacdev->PollMode)
+            eth_handle_tx_over(gmacdev);
+        else if (!(dma_status & (DmaIntRxCompleted | DmaIntRxNoBuffer)))
+            eth_rx_notify(gmacdev);
     }
 
-    // enable interrupt
-    eth_dma_enable_interrupt(gmacdev, dma_int_enable);
+    eth_dim_update(gmacdev);
+
+    // enable interrupt, masked while the os has not re-armed what it was told about
+    // computed from RxPending, a re-arm that ran on another cpu meanwhile is kept
+    eth_int_sync(gmacdev);
 }
 
+// gmac1的引脚与gpio复用，使用前需要在通用配置寄存器0中选择gmac1
+// 寄存器由两个实例共用，两个eth_init不能同时执行
+static void eth_pinmux(struct net_device *gmacdev)
+{
+    if (gmacdev->Unit != 1)
+        return;
+
+    eth_mac_set_bits(eth_phys_to_uncached(LS2K_CHIP_CFG_BASE), LS2K_GENERAL_CFG0, LS2K_GMAC1_SEL);
+}
+
+// 每个实例使用独立的net_device，驱动没有全局状态，两个实例可以同时收发
 int eth_init(struct net_device *gmacdev)
 {
-    // 需要在eth_init内或外初始化gmacdev->iobase
-    // iobase = eth_phys_to_uncached(0x40040000);
+    // 需要在eth_init之前初始化gmacdev->iobase和Unit，例如gmac1：
+    // iobase = eth_phys_to_uncached(ETH_GMAC1_BASE); Unit = 1;
+    if (gmacdev->Unit >= ETH_GMAC_NUM)
+    {
+        eth_printf("gmac%d does not exist\n", gmacdev->Unit);
+        return -1;
+    }
+    gmacdev->Irq = gmacdev->Unit ? ETH_GMAC1_IRQ : ETH_GMAC0_IRQ;
+
+    // select the gmac1 pins before touching its registers
+    eth_pinmux(gmacdev);
 
     // set mac reg address
     gmacdev->MacBase = (gmacdev->iobase + MACBASE);
@@ -363,6 +1144,17 @@ int eth_init(struct net_device *gmacdev)
     // init phy
     eth_phy_init(gmacdev);
 
+    // one interrupt per frame until eth_set_coalesce
+    gmacdev->RxIntWdt = 0;
+    gmacdev->RxWdtDrain = 0;
+    gmacdev->TxIntFrames = 1;
+    gmacdev->TxIntCount = 0;
+    gmacdev->DimMode = 0;
+    gmacdev->TxCoe = 0;
+    gmacdev->RxCoe = 0;
+    gmacdev->Mtu = ETH_MTU;
+    gmacdev->RxJumbo = 0;
+
     // setup rx/tx desc_queue
     eth_setup_rx_desc_queue(gmacdev, RX_DESC_NUM);
     eth_setup_tx_desc_queue(gmacdev, TX_DESC_NUM);
@@ -383,6 +1175,7 @@ int eth_init(struct net_device *gmacdev)
     eth_dma_clear_curr_irq(gmacdev);
 
     // enable interrupt
+    gmacdev->RxPending = 0;
     eth_dma_enable_interrupt(gmacdev, DmaIntEnable);
 
     // enable gmac-phy rx and tx
@@ -394,7 +1187,7 @@ int eth_init(struct net_device *gmacdev)
     eth_dma_enable_tx(gmacdev);
 
     // install isr
-    eth_isr_install();
+    eth_isr_install(gmacdev);
 
     return 0;
 }
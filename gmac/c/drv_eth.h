@@ -1,4 +1,33 @@
 #ifndef __LS2K_DRV_ETH_H__
 #define __LS2K_DRV_ETH_H__
 
+#include "eth_dev.h"
+
+uint32_t eth_tx_burst(struct net_device *gmacdev, const uint64_t *pbufs, uint32_t count);
+
+int eth_tx_sg(struct net_device *gmacdev, const struct eth_tx_seg *segs, uint32_t nseg, uint64_t p);
+
+uint32_t eth_rx_burst(struct net_device *gmacdev, uint64_t *pbufs, uint32_t max);
+
+int eth_rx_zero_copy_init(struct net_device *gmacdev);
+
+void eth_rx_release(struct net_device *gmacdev, uint64_t buffer);
+
+void eth_poll_mode(struct net_device *gmacdev, uint32_t enable);
+
+uint32_t eth_poll(struct net_device *gmacdev, uint64_t *pbufs, uint32_t budget,
+                  uint32_t *received);
+
+int eth_set_coalesce(struct net_device *gmacdev, uint32_t rx_usecs, uint32_t tx_frames);
+
+uint32_t eth_get_irq_rate(struct net_device *gmacdev);
+
+void eth_dim_mode(struct net_device *gmacdev, uint32_t enable);
+
+void eth_dim_update(struct net_device *gmacdev);
+
+int eth_csum_offload(struct net_device *gmacdev, uint32_t enable);
+
+int eth_set_mtu(struct net_device *gmacdev, uint32_t mtu);
+
 #endif // __LS2K_DRV_ETH_H__
@@ -396,7 +396,7 @@ void eth_setup_tx_desc_queue(struct net_device *gmacdev, uint32_t desc_num)
     uint32_t dma_addr; // physical desc addr
     void *buffer; // buffer addr
 
-    desc = eth_malloc_align(sizeof(DmaDesc) * desc_num, 16);
+    desc = (DmaDesc *)eth_malloc_align(sizeof(DmaDesc) * desc_num, 16);
     dma_addr = eth_virt_to_phys((uint64_t)desc);
 
     gmacdev->TxNext = 0;
@@ -408,7 +408,7 @@ void eth_setup_tx_desc_queue(struct net_device *gmacdev, uint32_t desc_num)
     for (int i = 0; i < desc_num; i ++, desc ++)
     {
         // allocate tx buffer
-        buffer = eth_malloc_align(TX_BUF_SIZE, 16);
+        buffer = (void *)eth_malloc_align(TX_BUF_SIZE, 16);
 
         // init desc
         gmacdev->TxDesc[i] = desc;
@@ -428,7 +428,7 @@ void eth_setup_rx_desc_queue(struct net_device *gmacdev, uint32_t desc_num)
     uint32_t dma_addr; // physical desc addr
     void *buffer; // buffer addr
 
-    desc = eth_malloc_align(sizeof(DmaDesc) * desc_num, 16);
+    desc = (DmaDesc *)eth_malloc_align(sizeof(DmaDesc) * desc_num, 16);
     dma_addr = eth_virt_to_phys((uint64_t)desc);
 
     gmacdev->RxBusy = 0;
@@ -439,7 +439,7 @@ void eth_setup_rx_desc_queue(struct net_device *gmacdev, uint32_t desc_num)
     for (int i = 0; i < desc_num; i ++, desc ++)
     {
         // allocate rx buffer
-        buffer = eth_malloc_align(RX_BUF_SIZE, 16);
+        buffer = (void *)eth_malloc_align(RX_BUF_SIZE, 16);
         // trans virtual addr to physical addr
         dma_addr = eth_virt_to_phys((uint64_t)buffer);
 
@@ -475,10 +475,10 @@ bool eth_is_desc_empty(DmaDesc *desc)
     return (((desc->length & DescSize1Mask) == 0) && ((desc->length & DescSize2Mask) == 0));
 }
 
-bool eth_is_rx_desc_valid(DmaDesc *desc)
+// a frame spans the desc from first to last, the error status is only valid in the last
+bool eth_is_rx_frame_valid(DmaDesc *first, DmaDesc *last)
 {
-    uint32_t status = desc->status;
-    return ((status & DescError) == 0) && ((status & DescRxFirst) == DescRxFirst) && ((status & DescRxLast) == DescRxLast);
+    return ((last->status & DescError) == 0) && ((first->status & DescRxFirst) == DescRxFirst) && ((last->status & DescRxLast) == DescRxLast);
 }
 
 bool eth_is_last_rx_desc(DmaDesc *desc)
@@ -492,7 +492,6 @@ bool eth_is_last_tx_desc(DmaDesc *desc)
 }
 
 // get dma hw feature
-/*
 void eth_mac_get_hw_feature(struct net_device *gmacdev)
 {
     struct DmaFeature *dma_cap;
@@ -527,4 +526,3 @@ void eth_mac_get_hw_feature(struct net_device *gmacdev)
     dma_cap->number_tx_channel = (hw_cap & DMA_HW_FEAT_TXCHCNT) >> 22;
     dma_cap->enh_desc = (hw_cap & DMA_HW_FEAT_ENHDESSEL) >> 24;
 }
-*/
@@ -12,8 +12,38 @@
 #define MACBASE     0x0000
 #define DMABASE     0x1000
 
+// gmac instances, net_device.Unit selects one; iobase maps its register base
+#define ETH_GMAC_NUM     2
+#define ETH_GMAC0_BASE   0x40040000
+#define ETH_GMAC0_IRQ    12
+#define ETH_GMAC1_BASE   0x40050000
+#define ETH_GMAC1_IRQ    14
+
+// gmac1 shares its pins with gpio, general configuration register 0 of the
+// chip configuration block selects it
+#define LS2K_CHIP_CFG_BASE 0x1fe00000
+#define LS2K_GENERAL_CFG0  0x0420
+#define LS2K_GMAC1_SEL     (1 << 3)
+
 #define TX_DESC_NUM     128           // Tx Descriptors needed in the Descriptor queue
 #define RX_DESC_NUM     128           // Rx Descriptors needed in the Descriptor queue
+#define RX_POOL_NUM     128           // spare Rx buffers for zero-copy receive, power of 2
+#define TX_INT_FILL     (TX_DESC_NUM * 3 / 4) // Tx desc in flight that always ask for an interrupt
+
+// clock of the dma, the rx interrupt watchdog counts in units of 256 cycles
+#define ETH_DMA_CLK_MHZ  125
+
+// checksum offload, eth_handle_tx_csum returns ETH_TX_CSUM_* for each tx frame
+// and eth_handle_rx_csum gets ETH_RX_CSUM_* for each rx frame
+#define ETH_TX_CSUM_IP   0x1          // insert the IPv4 header checksum
+#define ETH_TX_CSUM_L4   0x2          // also insert the TCP/UDP/ICMP checksum, pseudo header included
+#define ETH_RX_CSUM_NONE 0            // not verified, the os checks it
+#define ETH_RX_CSUM_OK   1            // IP header and TCP/UDP/ICMP checksums verified
+
+// adaptive interrupt moderation, traffic is sampled every DIM_INTERVAL_US and
+// a profile change needs DIM_HYSTERESIS samples in a row voting for it
+#define DIM_INTERVAL_US  1000
+#define DIM_HYSTERESIS   2
 
 // 802.3 ethernet frame structure
 // the default ethernet frame is 1,518/1,522 bytes
@@ -39,6 +69,12 @@
 #define TX_BUF_SIZE     BUF_SIZE_2KiB
 #define RX_BUF_SIZE     BUF_SIZE_2KiB
 
+// mtu set by eth_set_mtu, tx buffers grow to JUMBO_BUF_SIZE for jumbo frames
+// and rx frames span several RX_BUF_SIZE descriptors
+#define ETH_MTU         MAX_ETHERNET_PAYLOAD
+#define ETH_MAX_MTU     JUMBO_FRAME_PAYLOAD
+#define JUMBO_BUF_SIZE  9216          // jumbo frame with a vlan tag and crc, rounded up to 1KiB
+
 
 
 // !!! NEVER TOUCH IT !!!
@@ -86,18 +122,37 @@ struct DmaFeature {
     uint32_t enh_desc : 1;           // 24
 };
 
+// one os buffer of a scatter-gather tx frame
+struct eth_tx_seg
+{
+    uint64_t addr;                // cached virtual address
+    uint32_t len;                 // bytes, at most DescSize1Mask
+};
+
+// recycling pool of spare rx buffers for zero-copy receive
+// rx takes buffers at head, eth_rx_release returns them at tail
+// buffers outside the desc ring never exceed RX_POOL_NUM, so it never overflows
+struct eth_rx_pool
+{
+    void *buf[RX_POOL_NUM];       // free buffers, indexed modulo RX_POOL_NUM
+    uint32_t head;                // free-running, only written by rx
+    uint32_t tail;                // free-running, only written by eth_rx_release
+};
+
 struct net_device
 {
     void *parent;                 // point to OS defined net struct
 
     uint64_t iobase;              // base address of MAC
+    uint32_t Unit;                // 0 for gmac0, 1 for gmac1, set with iobase before eth_init
+    uint32_t Irq;                 // interrupt line of the unit, for eth_isr_install
     uint8_t MacAddr[6];           // mac address
 
     uint64_t MacBase;             // base address of GMAC
     uint64_t DmaBase;             // base address of DMA
     uint64_t PhyBase;             // phy device addr, 0 by default
     uint32_t Version;             // MAC version
-    // struct DmaFeature DmaCap;     // DMA hardware feature
+    struct DmaFeature DmaCap;     // DMA hardware feature
 
     uint32_t TxBusy;              // index of the first tx desc owned by DMA
     uint32_t TxNext;              // index of the first tx desc available
@@ -121,6 +176,45 @@ struct net_device
     uint32_t LinkStatus;          // link status
     uint32_t DuplexMode;          // duplex mode
     uint32_t Speed;               // link speed
+
+    // zero-copy rx
+    uint32_t RxZeroCopy;          // hand rx buffers up instead of copying
+    struct eth_rx_pool RxPool;    // buffers swapped onto the rx desc
+
+    // zero-copy tx
+    uint64_t TxCookie[TX_DESC_NUM]; // os unit pinned until the frame ending at this desc is sent
+
+    // poll mode
+    uint32_t PollMode;            // rx and tx completions are handled by eth_poll
+    uint32_t RxPending;           // os told by eth_rx_ready, its interrupts stay masked until re-armed
+    uint64_t irqs;                // interrupts taken
+    uint64_t polls;               // eth_poll calls
+    uint64_t poll_exhausted;      // eth_poll calls that used up their budget
+
+    // interrupt moderation
+    uint32_t RxIntWdt;            // RIWT value, 0 raises an rx interrupt per frame
+    uint32_t RxWdtDrain;          // rx desc left to refill since RxIntWdt dropped to 0
+    uint32_t TxIntFrames;         // tx frames per completion interrupt
+    uint32_t TxIntCount;          // tx frames since the last one asking for an interrupt
+    uint64_t IrqRateStamp;        // time and irqs at the last eth_get_irq_rate
+    uint64_t IrqRateIrqs;
+
+    // adaptive interrupt moderation
+    uint32_t DimMode;             // eth_dim_update picks the coalescing profile
+    uint32_t DimRxWdt;            // the rx interrupt watchdog is usable
+    uint32_t DimProfile;          // current profile
+    int32_t  DimVotes;            // samples in a row above (>0) or below (<0) the profile
+    uint64_t DimStamp;            // time, packets and bytes at the last sample
+    uint64_t DimPackets;
+    uint64_t DimBytes;
+
+    // checksum offload
+    uint32_t TxCoe;               // tx frames get the checksums eth_handle_tx_csum asks for
+    uint32_t RxCoe;               // rx frames carry the result to eth_handle_rx_csum
+
+    // jumbo frames
+    uint32_t Mtu;
+    void *RxJumbo;                // rx frames spanning several desc are gathered here
 };
 
 
@@ -512,6 +606,7 @@ enum DmaRegisters
     DmaControl        = 0x0018,    /* CSR6 - Dma Operation Mode Register           */
     DmaInterrupt      = 0x001C,    /* CSR7 - Interrupt enable                      */
     DmaMissedFr       = 0x0020,    /* CSR8 - Missed Frame & Buffer overflow Counter */
+    DmaRxIntWdt       = 0x0024,    /* CSR9 - Receive Interrupt Watchdog Timer      */
     DmaTxCurrDesc     = 0x0048,    /* CSR18 - Current host Tx Desc Register        */
     DmaRxCurrDesc     = 0x004C,    /* CSR19 - Current host Rx Desc Register        */
     DmaTxCurrAddr     = 0x0050,    /* CSR20 - Current host transmit buffer address */
@@ -1027,6 +1122,11 @@ enum InitialRegisters
                              DmaIntTxStopped   | // 1
                              DmaIntTxCompleted,  // 0
 
+    // completion interrupts masked while eth_poll is pending
+    DmaIntPoll             = DmaIntRxNoBuffer  | // 7
+                             DmaIntRxCompleted | // 6
+                             DmaIntTxCompleted,  // 0
+
     DmaIntDisable          = 0,
 };
 
@@ -1114,7 +1214,7 @@ bool eth_is_tx_desc_valid(DmaDesc *desc);
 
 bool eth_is_desc_empty(DmaDesc *desc);
 
-bool eth_is_rx_desc_valid(DmaDesc *desc);
+bool eth_is_rx_frame_valid(DmaDesc *first, DmaDesc *last);
 
 bool eth_is_last_rx_desc(DmaDesc *desc);
 
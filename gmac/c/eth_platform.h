@@ -4,9 +4,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+struct net_device;
+
 // 替换成平台自定义的printf
 int eth_printf(const char *fmt, ...);
 
+// 单调递增的微秒时间
+uint64_t eth_get_time_us();
+
+// 替换成平台自定义的memcpy
+void *eth_memcpy(void *dest, const void *src, uint64_t n);
+
 // aligned malloc
 uint64_t eth_malloc_align(uint64_t size, uint32_t align);
 
@@ -20,16 +28,40 @@ uint32_t eth_virt_to_phys(uint64_t va);
 // 物理地址转换为cached虚拟地址
 uint64_t eth_phys_to_virt(uint32_t pa);
 
+// 物理地址转换为uncached虚拟地址，用于访问寄存器
+uint64_t eth_phys_to_uncached(uint64_t pa);
+
+// 以下函数的gmacdev是调用它的实例，OS据此区分gmac0和gmac1
+
 // OS可能会有自定义格式的存储单元
 // p是OS传递给驱动的存储单元
 // buffer是驱动分配的dma内存
 // 将p的数据copy到buffer中
 // 返回数据总长度
-uint32_t eth_handle_tx_buffer(uint64_t p, uint64_t buffer);
+uint32_t eth_handle_tx_buffer(struct net_device *gmacdev, uint64_t p, uint64_t buffer);
+
+// eth_tx_sg发送的包发送完成（或出错）后调用
+// p是传给eth_tx_sg的存储单元，OS此时可以释放其中的缓冲区
+void eth_handle_tx_done(struct net_device *gmacdev, uint64_t p);
+
+// 开启发送校验和offload后，每个包发送前调用
+// p是传给eth_tx/eth_tx_burst/eth_tx_sg的存储单元
+// 返回需要硬件插入的校验和，ETH_TX_CSUM_IP/ETH_TX_CSUM_L4，0表示由OS计算
+uint32_t eth_handle_tx_csum(struct net_device *gmacdev, uint64_t p);
 
 // buffer是接收到的数据，length是字节数
 // OS需要分配内存，memcpy接收到的数据，并将地址返回
-uint64_t eth_handle_rx_buffer(uint64_t buffer, uint32_t length);
+uint64_t eth_handle_rx_buffer(struct net_device *gmacdev, uint64_t buffer, uint32_t length);
+
+// zero-copy rx时代替eth_handle_rx_buffer
+// buffer是接收到的数据，length是字节数，OS不拷贝，直接用buffer构造存储单元并返回
+// OS用完后调用eth_rx_release把buffer还给驱动，返回0时buffer仍归驱动
+uint64_t eth_handle_rx_zero_copy(struct net_device *gmacdev, uint64_t buffer, uint32_t length);
+
+// 开启接收校验和offload后，每个交给OS的包调用
+// pbuf是eth_handle_rx_buffer/eth_handle_rx_zero_copy返回的存储单元
+// csum为ETH_RX_CSUM_OK时OS不需要再检查ip头和tcp/udp/icmp的校验和
+void eth_handle_rx_csum(struct net_device *gmacdev, uint64_t pbuf, uint32_t csum);
 
 // 中断isr通知OS可以调用rx函数
 void eth_rx_ready(struct net_device *gmacdev);
@@ -38,7 +70,8 @@ void eth_rx_ready(struct net_device *gmacdev);
 // 链路目前仅支持1000Mbps duplex
 void eth_update_linkstate(struct net_device *gmacdev, uint32_t status);
 
-// OS注册中断，中断号为12
-void eth_isr_install();
+// OS注册gmacdev->Irq的中断，isr调用eth_irq(gmacdev)
+// gmac0为12，gmac1为14，两个实例各自注册
+void eth_isr_install(struct net_device *gmacdev);
 
 #endif // __LS2K_ETH_PLATFORM_H__
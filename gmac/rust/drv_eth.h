@@ -4,6 +4,27 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#define ETH_GMAC0_BASE 0x40040000
+
+#define ETH_GMAC0_IRQ 12
+
+#define ETH_GMAC1_BASE 0x40050000
+
+#define ETH_GMAC1_IRQ 14
+
+#define ETH_GMAC_NUM 2
+
+#define ETH_MAX_MTU 9000
+
+#define ETH_MTU 1500
+
+#define ETH_RX_CSUM_NONE 0
+
+#define ETH_RX_CSUM_OK 1
+
+#define ETH_TX_CSUM_IP 1
+
+#define ETH_TX_CSUM_L4 2
 
 typedef struct DmaDesc {
   uint32_t status;
@@ -12,13 +33,28 @@ typedef struct DmaDesc {
   uint32_t buffer2;
 } DmaDesc;
 
+typedef struct eth_tx_seg {
+  uint64_t addr;
+  uint32_t len;
+} eth_tx_seg;
+
+typedef struct eth_rx_pool {
+  uint64_t buf[128];
+  uint32_t head;
+  uint32_t tail;
+} eth_rx_pool;
+
 typedef struct net_device {
+  uint8_t *parent;
   uint64_t iobase;
+  uint32_t Unit;
+  uint32_t Irq;
   uint8_t MacAddr[6];
   uint64_t MacBase;
   uint64_t DmaBase;
   uint64_t PhyBase;
   uint32_t Version;
+  uint32_t DmaCap;
   uint32_t TxBusy;
   uint32_t TxNext;
   uint32_t RxBusy;
@@ -36,26 +72,91 @@ typedef struct net_device {
   uint32_t LinkStatus;
   uint32_t DuplexMode;
   uint32_t Speed;
+  uint32_t RxZeroCopy;
+  struct eth_rx_pool RxPool;
+  uint64_t TxCookie[128];
+  uint32_t PollMode;
+  uint32_t RxPending;
+  uint64_t irqs;
+  uint64_t polls;
+  uint64_t poll_exhausted;
+  uint32_t RxIntWdt;
+  uint32_t RxWdtDrain;
+  uint32_t TxIntFrames;
+  uint32_t TxIntCount;
+  uint64_t IrqRateStamp;
+  uint64_t IrqRateIrqs;
+  uint32_t DimMode;
+  uint32_t DimRxWdt;
+  uint32_t DimProfile;
+  int32_t DimVotes;
+  uint64_t DimStamp;
+  uint64_t DimPackets;
+  uint64_t DimBytes;
+  uint32_t TxCoe;
+  uint32_t RxCoe;
+  uint32_t Mtu;
+  uint64_t RxJumbo;
 } net_device;
 
+int32_t eth_csum_offload(struct net_device *gmacdev, uint32_t enable);
+
+void eth_dim_mode(struct net_device *gmacdev, uint32_t enable);
+
+void eth_dim_update(struct net_device *gmacdev);
+
 int32_t eth_init(struct net_device *gmacdev);
 
+uint32_t eth_get_irq_rate(struct net_device *gmacdev);
+
 void eth_irq(struct net_device *gmacdev);
 
+uint32_t eth_poll(struct net_device *gmacdev, uint64_t *pbufs, uint32_t budget, uint32_t *received);
+
+void eth_poll_mode(struct net_device *gmacdev, uint32_t enable);
+
 uint64_t eth_rx(struct net_device *gmacdev);
 
+uint32_t eth_rx_burst(struct net_device *gmacdev, uint64_t *pbufs, uint32_t max);
+
+void eth_rx_release(struct net_device *gmacdev, uint64_t buffer);
+
+int32_t eth_rx_zero_copy_init(struct net_device *gmacdev);
+
+int32_t eth_set_coalesce(struct net_device *gmacdev, uint32_t rx_usecs, uint32_t tx_frames);
+
+int32_t eth_set_mtu(struct net_device *gmacdev, uint32_t mtu);
+
 int32_t eth_tx(struct net_device *gmacdev, uint64_t pbuf);
 
-extern uint64_t eth_handle_rx_buffer(uint64_t buffer, uint32_t length);
+uint32_t eth_tx_burst(struct net_device *gmacdev, const uint64_t *pbufs, uint32_t count);
+
+int32_t eth_tx_sg(struct net_device *gmacdev, const struct eth_tx_seg *segs, uint32_t nseg, uint64_t p);
 
-extern uint32_t eth_handle_tx_buffer(uint64_t p, uint64_t buffer);
+extern uint64_t eth_get_time_us(void);
 
-extern void eth_isr_install(void);
+extern void eth_handle_rx_csum(struct net_device *gmacdev, uint64_t pbuf, uint32_t csum);
+
+extern uint64_t eth_handle_rx_buffer(struct net_device *gmacdev, uint64_t buffer, uint32_t length);
+
+extern uint64_t eth_handle_rx_zero_copy(struct net_device *gmacdev, uint64_t buffer, uint32_t length);
+
+extern uint32_t eth_handle_tx_buffer(struct net_device *gmacdev, uint64_t p, uint64_t buffer);
+
+extern uint32_t eth_handle_tx_csum(struct net_device *gmacdev, uint64_t p);
+
+extern void eth_handle_tx_done(struct net_device *gmacdev, uint64_t p);
+
+extern void eth_isr_install(struct net_device *gmacdev);
+
+extern void eth_mdelay(uint32_t ms);
 
 extern uint64_t eth_malloc_align(uint64_t size, uint32_t align);
 
 extern uint64_t eth_phys_to_virt(uint32_t pa);
 
+extern uint64_t eth_phys_to_uncached(uint64_t pa);
+
 extern int eth_printf(const char *fmt, ...);
 
 extern void eth_rx_ready(struct net_device *gmacdev);
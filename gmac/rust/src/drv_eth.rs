@@ -2,19 +2,22 @@
 
 use crate::eth_defs::*;
 use crate::eth_dev::*;
+use crate::mmio::Mmio;
 use crate::platform::*;
 
+use core::sync::atomic::{Ordering, fence};
+
 // 检查rgmii链路状态
 // eth_update_linkstate通知操作系统链路状态
 pub fn eth_phy_rgsmii_check(gmacdev: &mut net_device) {
     let mut value: u32 = 0;
     let mut status: u32 = 0;
 
-    value = eth_mac_read_reg(gmacdev.MacBase, GmacRgsmiiStatus);
+    value = gmacdev.MacBase.read(GmacRgsmiiStatus);
     status = value & (MacLinkStatus >> MacLinkStatusOff);
 
     if gmacdev.LinkStatus != status {
-        unsafe { eth_update_linkstate(gmacdev, status) };
+        eth_update_linkstate(gmacdev, status);
     }
 
     if status != 0 {
@@ -75,36 +78,341 @@ pub fn eth_phy_init(gmacdev: &mut net_device) {
     };
 }
 
-pub fn eth_handle_tx_over(gmacdev: &mut net_device) {
-    loop {
+// 回收最多budget个已发送的描述符，返回回收的个数
+fn eth_tx_reclaim(gmacdev: &mut net_device, budget: u32) -> u32 {
+    let mut done: u32 = 0;
+
+    while done < budget {
         let mut desc_idx: u32 = gmacdev.TxBusy;
-        let mut txdesc: DmaDesc = unsafe { gmacdev.TxDesc[desc_idx as usize].read() } as DmaDesc;
+        let desc: *mut DmaDesc = gmacdev.TxDesc[desc_idx];
+        let status: u32 = eth_desc_status(desc);
+
+        if eth_get_desc_owner(status) {
+            break;
+        }
+        eth_desc_acquire();
 
-        if eth_get_desc_owner(&txdesc) || eth_is_desc_empty(&txdesc) {
+        let length: u32 = eth_desc_length(desc);
+        if eth_is_desc_empty(length) {
             break;
         }
 
-        if eth_is_tx_desc_valid(&txdesc) {
-            let mut length: u32 = (txdesc.length & DescSize1Mask) >> DescSize1Shift;
-            gmacdev.tx_bytes += length as u64;
+        // 错误状态只在包的最后一个描述符中有效
+        let bytes: u64 = (DescSize1.get(length) + DescSize2.get(length)) as u64;
+        if status & DescTxLast == 0 {
+            gmacdev.tx_bytes += bytes;
+        } else if eth_is_tx_desc_valid(status) {
+            gmacdev.tx_bytes += bytes;
             gmacdev.tx_packets += 1;
         } else {
             gmacdev.tx_errors += 1;
         }
 
-        let is_last: bool = eth_is_last_tx_desc(&txdesc);
-        txdesc.status = if is_last { TxDescEndOfRing } else { 0 };
-        txdesc.length = 0;
-        txdesc.buffer1 = 0;
-        txdesc.buffer2 = 0;
-        unsafe {
-            gmacdev.TxDesc[desc_idx as usize].write(txdesc);
+        // 分散聚集发送的包发送完成后才释放OS的缓冲区
+        if gmacdev.TxCookie[desc_idx] != 0 {
+            eth_handle_tx_done(gmacdev, gmacdev.TxCookie[desc_idx]);
+            gmacdev.TxCookie[desc_idx] = 0;
         }
 
-        gmacdev.TxBusy = if is_last { 0 } else { desc_idx + 1 };
+        let is_last: bool = gmacdev.TxDesc.is_last(desc_idx);
+        eth_desc_set(desc, 0, 0, 0);
+        eth_desc_release(desc, if is_last { TxDescEndOfRing } else { 0 });
+
+        gmacdev.TxBusy = gmacdev.TxDesc.next(desc_idx);
+        done += 1;
+    }
+    return done;
+}
+
+pub fn eth_handle_tx_over(gmacdev: &mut net_device) {
+    eth_tx_reclaim(gmacdev, gmacdev.TxDesc.depth());
+}
+
+// 使用desc_idx的包是否请求发送完成中断
+// 每TxIntFrames个包请求一次，在途描述符达到TX_INT_FILL时每个包都请求，
+// 环满之前一定有一个会产生中断的描述符在途
+fn eth_tx_int_flag(gmacdev: &mut net_device, desc_idx: u32) -> u32 {
+    let inflight: u32 = desc_idx.wrapping_sub(gmacdev.TxBusy) % TX_DESC_NUM as u32;
+
+    gmacdev.TxIntCount += 1;
+    if gmacdev.TxIntCount < gmacdev.TxIntFrames && inflight < TX_INT_FILL {
+        return 0;
+    }
+
+    gmacdev.TxIntCount = 0;
+    return DescTxIntEnable;
+}
+
+// 按RxIntWdt和RxWdtDrain写RIWT
+// 关闭看门狗后，之前重新填充的描述符仍带RxDisIntCompl，全部重新填充之前RIWT保持最小值
+fn eth_rx_wdt_sync(gmacdev: &net_device) {
+    // 重新填充和eth_set_coalesce会同时写寄存器，写完再检查一次，保证最后写入的是最新的状态
+    loop {
+        let riwt: u32 = gmacdev.RxIntWdt.load(Ordering::SeqCst);
+        let drain: u32 = gmacdev.RxWdtDrain.load(Ordering::SeqCst);
+
+        gmacdev.DmaBase.write(DmaRxIntWdt, if riwt != 0 { riwt } else if drain != 0 { 1 } else { 0 });
+        fence(Ordering::SeqCst);
+
+        if riwt == gmacdev.RxIntWdt.load(Ordering::SeqCst)
+            && (drain != 0) == (gmacdev.RxWdtDrain.load(Ordering::SeqCst) != 0)
+        {
+            return;
+        }
     }
 }
 
+// 重新填充一个描述符时调用，返回true表示关闭看门狗之前填充的描述符已经全部替换
+fn eth_rx_wdt_drained(gmacdev: &net_device) -> bool {
+    let prev = gmacdev.RxWdtDrain.fetch_update(Ordering::SeqCst, Ordering::SeqCst, |drain| drain.checked_sub(1));
+
+    return prev == Ok(1);
+}
+
+// 写入riwt后读回，判断硬件有没有接收中断看门狗，之后按RxIntWdt恢复RIWT
+fn eth_rx_wdt_probe(gmacdev: &net_device, riwt: u32) -> bool {
+    gmacdev.DmaBase.write(DmaRxIntWdt, riwt);
+    let found: bool = gmacdev.DmaBase.read(DmaRxIntWdt) == riwt;
+    eth_rx_wdt_sync(gmacdev);
+
+    return found;
+}
+
+// 设置中断合并
+// rx_usecs: 收到包后经过rx_usecs微秒由RIWT触发接收中断，期间收到的包合并为一次中断，0表示每个包一次中断
+// tx_frames: 每tx_frames个包请求一次发送完成中断，0和1表示每个包一次
+// 运行时可以随时调用，rx_usecs从非0改为0时，RIWT保持最小值直到所有接收描述符重新填充一遍
+// 硬件不支持RIWT时返回-1，rx保持每个包一次中断
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_set_coalesce(gmacdev: &mut net_device, rx_usecs: u32, tx_frames: u32) -> i32 {
+    let mut riwt: u32 = ((rx_usecs as u64 * ETH_DMA_CLK_MHZ as u64 + 255) / 256).min(0xff) as u32;
+    let mut ret: i32 = 0;
+
+    gmacdev.TxIntFrames = tx_frames;
+
+    if riwt != 0 && !eth_rx_wdt_probe(gmacdev, riwt) {
+        // 没有看门狗时，带RxDisIntCompl的描述符永远不会产生中断
+        unsafe { eth_printf(b"gmac rx interrupt watchdog not supported\n\0" as *const u8) };
+        riwt = 0;
+        ret = -1;
+    }
+
+    // 之后重新填充的每个接收描述符生效，之前填充的仍然屏蔽完成中断，在被替换之前需要看门狗
+    if riwt == 0 && gmacdev.RxIntWdt.load(Ordering::SeqCst) != 0 {
+        gmacdev.RxIntWdt.store(0, Ordering::SeqCst);
+        gmacdev.RxWdtDrain.store(RX_DESC_NUM as u32, Ordering::SeqCst);
+    } else {
+        gmacdev.RxIntWdt.store(riwt, Ordering::SeqCst);
+    }
+    eth_rx_wdt_sync(gmacdev);
+
+    return ret;
+}
+
+// 距上次调用的每秒中断次数
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_get_irq_rate(gmacdev: &mut net_device) -> u32 {
+    let now: u64 = eth_get_time_us();
+    let elapsed: u64 = now - gmacdev.IrqRateStamp;
+    let irqs: u64 = gmacdev.irqs - gmacdev.IrqRateIrqs;
+
+    gmacdev.IrqRateStamp = now;
+    gmacdev.IrqRateIrqs = gmacdev.irqs;
+
+    return if elapsed != 0 { (irqs * 1000000 / elapsed) as u32 } else { 0 };
+}
+
+// 自适应中断合并的档位，由轻到重
+// 收发的包速率或字节速率超过up时升一档，两者都低于down时降一档，
+// down低于下一档的up，速率在两者之间时保持不变
+struct EthDimProfile {
+    rx_usecs: u32,
+    tx_frames: u32,
+    up_pps: u64,
+    up_bps: u64, // 每秒字节数
+    down_pps: u64,
+    down_bps: u64,
+}
+
+const ETH_DIM_PROFILES: [EthDimProfile; 4] = [
+    EthDimProfile { rx_usecs: 0, tx_frames: 1, up_pps: 20000, up_bps: 10000000, down_pps: 0, down_bps: 0 },
+    EthDimProfile { rx_usecs: 16, tx_frames: 4, up_pps: 60000, up_bps: 40000000, down_pps: 10000, down_bps: 5000000 },
+    EthDimProfile { rx_usecs: 64, tx_frames: 16, up_pps: 150000, up_bps: 90000000, down_pps: 40000, down_bps: 25000000 },
+    EthDimProfile { rx_usecs: 256, tx_frames: 32, up_pps: u64::MAX, up_bps: u64::MAX, down_pps: 100000, down_bps: 70000000 },
+];
+
+fn eth_dim_apply(gmacdev: &mut net_device) {
+    let prof: &EthDimProfile = &ETH_DIM_PROFILES[gmacdev.DimProfile as usize];
+
+    eth_set_coalesce(gmacdev, if gmacdev.DimRxWdt != 0 { prof.rx_usecs } else { 0 }, prof.tx_frames);
+}
+
+// 开启或关闭自适应中断合并，从不合并的一档开始，关闭后恢复每个包一次中断
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_dim_mode(gmacdev: &mut net_device, enable: u32) {
+    gmacdev.DimMode = 0;
+    gmacdev.DimProfile = 0;
+    gmacdev.DimVotes = 0;
+    gmacdev.DimStamp = eth_get_time_us();
+    gmacdev.DimPackets = gmacdev.rx_packets + gmacdev.tx_packets;
+    gmacdev.DimBytes = gmacdev.rx_bytes + gmacdev.tx_bytes;
+
+    // 只探测一次看门狗，没有看门狗时只合并发送中断
+    // 不改RxIntWdt，进入不合并的一档时不需要等描述符重新填充
+    if enable != 0 {
+        gmacdev.DimRxWdt = eth_rx_wdt_probe(gmacdev, 1) as u32;
+    }
+    eth_dim_apply(gmacdev);
+
+    gmacdev.DimMode = enable;
+}
+
+// 对收发计数采样，每DIM_INTERVAL_US最多一次，按速率调整合并档位
+// 开启时由eth_irq调用；流量停止后没有中断，OS还应该用定时器周期调用，
+// 把合并降回轻档，定时器的调用需要与eth_irq互斥
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_dim_update(gmacdev: &mut net_device) {
+    if gmacdev.DimMode == 0 {
+        return;
+    }
+
+    let now: u64 = eth_get_time_us();
+    let elapsed: u64 = now - gmacdev.DimStamp;
+    if elapsed < DIM_INTERVAL_US {
+        return;
+    }
+
+    let packets: u64 = gmacdev.rx_packets + gmacdev.tx_packets;
+    let bytes: u64 = gmacdev.rx_bytes + gmacdev.tx_bytes;
+    let pps: u64 = (packets - gmacdev.DimPackets) * 1000000 / elapsed;
+    let bps: u64 = (bytes - gmacdev.DimBytes) * 1000000 / elapsed;
+
+    gmacdev.DimStamp = now;
+    gmacdev.DimPackets = packets;
+    gmacdev.DimBytes = bytes;
+
+    let prof: &EthDimProfile = &ETH_DIM_PROFILES[gmacdev.DimProfile as usize];
+    if pps > prof.up_pps || bps > prof.up_bps {
+        gmacdev.DimVotes = if gmacdev.DimVotes > 0 { gmacdev.DimVotes + 1 } else { 1 };
+    } else if pps < prof.down_pps && bps < prof.down_bps {
+        gmacdev.DimVotes = if gmacdev.DimVotes < 0 { gmacdev.DimVotes - 1 } else { -1 };
+    } else {
+        gmacdev.DimVotes = 0;
+    }
+
+    if gmacdev.DimVotes >= DIM_HYSTERESIS && (gmacdev.DimProfile as usize) < ETH_DIM_PROFILES.len() - 1 {
+        gmacdev.DimProfile += 1;
+    } else if gmacdev.DimVotes <= -DIM_HYSTERESIS && gmacdev.DimProfile > 0 {
+        gmacdev.DimProfile -= 1;
+    } else {
+        return;
+    }
+
+    gmacdev.DimVotes = 0;
+    eth_dim_apply(gmacdev);
+}
+
+// 开启或关闭ip/tcp/udp校验和offload，按eth_init读到的DmaHWFeature开启硬件支持的方向
+// 发送需要Tx COE，接收需要Type 2 Rx COE（ip头和ipv4/ipv6的tcp/udp/icmp）
+// 开启时两个方向都不支持返回-1
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_csum_offload(gmacdev: &mut net_device, enable: u32) -> i32 {
+    let hw_cap: u32 = gmacdev.DmaCap;
+
+    gmacdev.TxCoe = (enable != 0 && hw_cap & DMA_HW_FEAT_TXCOESEL != 0) as u32;
+    gmacdev.RxCoe = (enable != 0 && hw_cap & DMA_HW_FEAT_RXTYP2COE != 0) as u32;
+
+    if gmacdev.RxCoe != 0 {
+        gmacdev.MacBase.set_bits(GmacConfig, GmacRxIpcOffload);
+    } else {
+        gmacdev.MacBase.clear_bits(GmacConfig, GmacRxIpcOffload);
+    }
+
+    if enable != 0 && gmacdev.TxCoe == 0 && gmacdev.RxCoe == 0 {
+        unsafe { eth_printf(b"gmac checksum offload not supported\n\0" as *const u8) };
+        return -1;
+    }
+
+    return 0;
+}
+
+// 包p需要硬件插入的校验和，只在第一个描述符中有效
+// 发送需要store and forward，eth_dma_control_init已经开启
+fn eth_tx_csum(gmacdev: &mut net_device, p: u64) -> u32 {
+    if gmacdev.TxCoe == 0 {
+        return DescTxCisBypass;
+    }
+
+    let csum: u32 = eth_handle_tx_csum(gmacdev, p);
+    if csum & ETH_TX_CSUM_L4 != 0 {
+        return DescTxCisTcpPseudoCs;
+    }
+    if csum & ETH_TX_CSUM_IP != 0 {
+        return DescTxCisIpv4HdrCs;
+    }
+    return DescTxCisBypass;
+}
+
+// 把接收校验和的检查结果交给OS
+// Bit(5:7:0)为RxNoChkError时校验和正确，校验和错误的包带DescError，已经按错误丢弃
+fn eth_rx_csum(gmacdev: &mut net_device, pbuf: u64, status: u32) {
+    let coe: u32 = status & (DescRxChkBit5 | DescRxChkBit7 | DescRxChkBit0);
+
+    if gmacdev.RxCoe == 0 || pbuf == 0 {
+        return;
+    }
+
+    eth_handle_rx_csum(gmacdev, pbuf, if coe == DescRxChkBit5 { ETH_RX_CSUM_OK } else { ETH_RX_CSUM_NONE });
+}
+
+// 设置MTU，最大ETH_MAX_MTU，大于ETH_MTU时开启jumbo帧，OS发送的帧不能超过MTU
+// 第一次开启时一次分配JUMBO_BUF_SIZE的发送缓冲区和拼接接收帧的RxJumbo，之后一直保留，
+// 原来2KiB的发送缓冲区不能释放，也一直保留
+// 接收缓冲区仍是RX_BUF_SIZE，jumbo帧跨多个描述符接收
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_set_mtu(gmacdev: &mut net_device, mtu: u32) -> i32 {
+    if mtu == 0 || mtu > ETH_MAX_MTU {
+        return -1;
+    }
+
+    if mtu > ETH_MTU && gmacdev.RxJumbo == 0 {
+        let size: u64 = JUMBO_BUF_SIZE as u64 * (TX_DESC_NUM as u64 + 1);
+        let block: u64 = eth_malloc_align(size, 16);
+
+        if block == 0 {
+            unsafe { eth_printf(b"cannot allocate jumbo frame buffers\n\0" as *const u8) };
+            return -1;
+        }
+
+        // 在途的描述符仍指向原来的缓冲区
+        for (i, buffer) in gmacdev.TxBuffer.iter_mut().enumerate() {
+            *buffer = block + (i as u64 + 1) * JUMBO_BUF_SIZE as u64;
+        }
+        gmacdev.RxJumbo = block;
+    }
+
+    if mtu > ETH_MTU {
+        gmacdev.MacBase.set_bits(GmacConfig, GmacJumboFrame);
+    } else {
+        gmacdev.MacBase.clear_bits(GmacConfig, GmacJumboFrame);
+    }
+
+    gmacdev.Mtu = mtu;
+
+    return 0;
+}
+
+// 发送描述符的length字段和buffer2，一个缓冲区最多4KiB，
+// jumbo帧超过的部分放在buffer2
+fn eth_tx_buffers(dma_addr: u32, length: u32) -> (u32, u32) {
+    let len1: u32 = length.min(4096);
+
+    if length == len1 {
+        return (DescSize1.val(length), 0);
+    }
+    return (DescSize1.val(len1) | DescSize2.val(length - len1), dma_addr + len1);
+}
+
 // 操作系统传递接收数据的单元pbuf给驱动
 // pbuf可能是操作系统自定义结构
 // 返回接收到的数据字节数
@@ -114,91 +422,513 @@ pub extern "C" fn eth_tx(gmacdev: &mut net_device, pbuf: u64) -> i32 {
     let mut length: u32 = 0;
     let mut dma_addr: u32 = 0;
     let mut desc_idx: u32 = gmacdev.TxNext;
-    let mut txdesc: DmaDesc = unsafe { gmacdev.TxDesc[desc_idx as usize].read() } as DmaDesc;
-    let mut is_last: bool = eth_is_last_tx_desc(&txdesc);
+    let desc: *mut DmaDesc = gmacdev.TxDesc[desc_idx];
+    let is_last: bool = gmacdev.TxDesc.is_last(desc_idx);
 
-    if eth_get_desc_owner(&txdesc) {
+    // 描述符由dma持有，或者还没有被eth_tx_reclaim回收，说明满了
+    if eth_get_desc_owner(eth_desc_status(desc)) {
         return -1;
     }
+    eth_desc_acquire();
+    if !eth_is_desc_empty(eth_desc_length(desc)) {
+        return -1;
+    }
+
+    buffer = gmacdev.TxBuffer[desc_idx];
+    length = eth_handle_tx_buffer(gmacdev, pbuf, buffer);
+    dma_addr = eth_virt_to_phys(buffer);
+
+    // 数据和其他字段在OWN之前对dma可见
+    let (length, buffer2) = eth_tx_buffers(dma_addr, length);
+    eth_desc_set(desc, length, dma_addr, buffer2);
+    let status: u32 = (if is_last { TxDescEndOfRing } else { 0 })
+        | DescOwnByDma
+        | DescTxLast
+        | DescTxFirst
+        | eth_tx_int_flag(gmacdev, desc_idx)
+        | eth_tx_csum(gmacdev, pbuf);
+    eth_desc_release(desc, status);
+
+    gmacdev.TxNext = gmacdev.TxDesc.next(desc_idx);
+
+    // 描述符写入完成后才能唤醒dma
+    fence(Ordering::SeqCst);
+    eth_gmac_resume_dma_tx(gmacdev);
+
+    return 0;
+}
+
+// 一次发送最多count个包，pbufs是操作系统传递的数据单元
+// 除第一个以外的描述符先交给dma，最后才设置第一个描述符的OWN位
+// dma不会在整批写完之前开始处理，最后只唤醒一次dma
+// 返回接受的包个数，描述符不够时少于count
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_tx_burst(gmacdev: &mut net_device, pbufs: *const u64, count: u32) -> u32 {
+    // 第一个描述符还不属于dma，不能绕回到它
+    let count: u32 = if count > TX_DESC_NUM as u32 { TX_DESC_NUM as u32 } else { count };
+    let first: *mut DmaDesc = gmacdev.TxDesc[gmacdev.TxNext];
+    let mut first_status: u32 = 0;
+    let mut desc_idx: u32 = gmacdev.TxNext;
+    let mut sent: u32 = 0;
+
+    while sent < count {
+        let desc: *mut DmaDesc = gmacdev.TxDesc[desc_idx];
+        let is_last: bool = gmacdev.TxDesc.is_last(desc_idx);
+
+        // 描述符由dma持有，或者还没有被eth_tx_reclaim回收，说明满了
+        if eth_get_desc_owner(eth_desc_status(desc)) {
+            break;
+        }
+        eth_desc_acquire();
+        if !eth_is_desc_empty(eth_desc_length(desc)) {
+            break;
+        }
+
+        let buffer: u64 = gmacdev.TxBuffer[desc_idx];
+        let pbuf: u64 = unsafe { pbufs.add(sent as usize).read() };
+        let length: u32 = eth_handle_tx_buffer(gmacdev, pbuf, buffer);
+        let dma_addr: u32 = eth_virt_to_phys(buffer);
+        let status: u32 = (if is_last { TxDescEndOfRing } else { 0 })
+            | DescOwnByDma
+            | DescTxLast
+            | DescTxFirst
+            | eth_tx_int_flag(gmacdev, desc_idx)
+            | eth_tx_csum(gmacdev, pbuf);
+
+        let (length, buffer2) = eth_tx_buffers(dma_addr, length);
+        eth_desc_set(desc, length, dma_addr, buffer2);
+        if sent == 0 {
+            first_status = status;
+        } else {
+            eth_desc_release_relaxed(desc, status);
+        }
+
+        sent += 1;
+        desc_idx = gmacdev.TxDesc.next(desc_idx);
+    }
+
+    if sent == 0 {
+        return 0;
+    }
+    gmacdev.TxNext = desc_idx;
+
+    // 整批的数据和字段在第一个OWN之前对dma可见
+    eth_desc_release(first, first_status);
+
+    // 描述符写入完成后才能唤醒dma
+    fence(Ordering::SeqCst);
+    eth_gmac_resume_dma_tx(gmacdev);
+
+    return sent;
+}
+
+// 零拷贝发送一个由nseg段OS缓冲区组成的包，例如lwip的pbuf链
+// 每个描述符的buffer1/buffer2各挂一段，按需要占用多个描述符，首尾描述符带First/Last标志
+// 缓冲区不拷贝，发送完成前必须保持有效，eth_handle_tx_over回收最后一个描述符时
+// 调用eth_handle_tx_done(p)通知OS释放，p不能为0
+// 描述符不够或某段长度超过DescSize1Mask时返回-1，什么也不占用
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_tx_sg(
+    gmacdev: &mut net_device,
+    segs: *const eth_tx_seg,
+    nseg: u32,
+    p: u64,
+) -> i32 {
+    let ndesc: u32 = (nseg + 1) / 2;
+    let first: *mut DmaDesc = gmacdev.TxDesc[gmacdev.TxNext];
+    let mut first_status: u32 = 0;
+    let mut desc_idx: u32 = gmacdev.TxNext;
 
-    buffer = gmacdev.TxBuffer[desc_idx as usize];
-    length = unsafe { eth_handle_tx_buffer(pbuf, buffer) };
-    dma_addr = unsafe { eth_virt_to_phys(buffer) };
+    if nseg == 0 || ndesc > gmacdev.TxDesc.depth() {
+        return -1;
+    }
+    let segs: &[eth_tx_seg] = unsafe { core::slice::from_raw_parts(segs, nseg as usize) };
 
-    txdesc.status |= DescOwnByDma | DescTxIntEnable | DescTxLast | DescTxFirst;
-    txdesc.length = length << DescSize1Shift & DescSize1Mask;
-    txdesc.buffer1 = dma_addr;
-    txdesc.buffer2 = 0;
-    unsafe {
-        gmacdev.TxDesc[desc_idx as usize].write(txdesc);
+    // 先检查包需要的所有描述符，任何一个不可用都不修改
+    if segs.iter().any(|seg| seg.len == 0 || seg.len > DescSize1Mask) {
+        return -1;
+    }
+    for i in 0..ndesc {
+        let desc: *mut DmaDesc = gmacdev.TxDesc[desc_idx.wrapping_add(i)];
+        if eth_get_desc_owner(eth_desc_status(desc)) {
+            return -1;
+        }
+        eth_desc_acquire();
+        if !eth_is_desc_empty(eth_desc_length(desc)) {
+            return -1;
+        }
     }
 
-    gmacdev.TxNext = if is_last { 0 } else { desc_idx + 1 };
+    for (i, pair) in segs.chunks(2).enumerate() {
+        let desc: *mut DmaDesc = gmacdev.TxDesc[desc_idx];
+        let is_last: bool = gmacdev.TxDesc.is_last(desc_idx);
+        let mut status: u32 = (if is_last { TxDescEndOfRing } else { 0 }) | DescOwnByDma;
+        let mut length: u32 = DescSize1.val(pair[0].len);
+        let mut buffer2: u32 = 0;
+
+        if pair.len() > 1 {
+            length |= DescSize2.val(pair[1].len);
+            buffer2 = eth_virt_to_phys(pair[1].addr);
+        }
+        eth_desc_set(desc, length, eth_virt_to_phys(pair[0].addr), buffer2);
+
+        if i == 0 {
+            status |= DescTxFirst | eth_tx_csum(gmacdev, p);
+        }
+        if i as u32 == ndesc - 1 {
+            // 总是请求中断，OS的缓冲区在回收之前不能释放
+            status |= DescTxLast | DescTxIntEnable;
+            gmacdev.TxIntCount = 0;
+            gmacdev.TxCookie[desc_idx] = p;
+        }
+
+        // 第一个描述符在整个包写完之后才交给dma
+        if i == 0 {
+            first_status = status;
+        } else {
+            eth_desc_release_relaxed(desc, status);
+        }
+
+        desc_idx = gmacdev.TxDesc.next(desc_idx);
+    }
+    gmacdev.TxNext = desc_idx;
 
-    unsafe { eth_sync_dcache() };
+    eth_desc_release(first, first_status);
 
+    // 描述符写入完成后才能唤醒dma
+    fence(Ordering::SeqCst);
     eth_gmac_resume_dma_tx(gmacdev);
 
     return 0;
 }
 
-// pbuf是返回给操作系统的数据单元
-// 可能是操作系统自定义结构
-#[unsafe(no_mangle)]
-pub extern "C" fn eth_rx(gmacdev: &mut net_device) -> u64 {
-    let mut desc_idx: u32 = gmacdev.RxBusy;
-    let mut rxdesc: DmaDesc = unsafe { gmacdev.RxDesc[desc_idx as usize].read() } as DmaDesc;
-    let mut is_last: bool = eth_is_last_rx_desc(&rxdesc);
+// 把接收到的数据交给操作系统
+// zero-copy时buffer直接交出，描述符换上缓冲池中的缓冲区，dma_addr随之更新
+// 缓冲池为空时（缓冲区都在操作系统手里）退回到拷贝
+fn eth_rx_deliver(gmacdev: &mut net_device, desc_idx: u32, dma_addr: &mut u32, length: u32) -> u64 {
+    let buffer: u64 = eth_phys_to_virt(*dma_addr);
+    let head: u32 = gmacdev.RxPool.head.load(Ordering::Relaxed);
 
-    if eth_is_desc_empty(&rxdesc) || eth_get_desc_owner(&rxdesc) {
-        eth_dma_enable_interrupt(gmacdev, DmaIntEnable);
+    if gmacdev.RxZeroCopy == 0 || head == gmacdev.RxPool.tail.load(Ordering::Acquire) {
+        return eth_handle_rx_buffer(gmacdev, buffer, length);
+    }
+
+    // 失败时操作系统不持有buffer，buffer留在描述符上
+    let pbuf: u64 = eth_handle_rx_zero_copy(gmacdev, buffer, length);
+    if pbuf == 0 {
         return 0;
     }
 
-    let mut pbuf: u64 = 0;
-    let mut dma_addr = rxdesc.buffer1;
+    let fresh: u64 = gmacdev.RxPool.buf[head];
+    gmacdev.RxPool.head.store(head.wrapping_add(1), Ordering::Release);
 
-    if eth_is_rx_desc_valid(&rxdesc) {
-        let mut length: u32 = eth_get_rx_length(&rxdesc);
-        let mut buffer: u64 = unsafe { eth_phys_to_virt(dma_addr) };
+    gmacdev.RxBuffer[desc_idx] = fresh;
+    *dma_addr = eth_virt_to_phys(fresh);
+    return pbuf;
+}
+
+// 开启zero-copy rx，分配RX_POOL_NUM个备用缓冲区
+// 在eth_init之后、操作系统开始接收之前调用
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_rx_zero_copy_init(gmacdev: &mut net_device) -> i32 {
+    for i in 0..gmacdev.RxPool.buf.depth() {
+        let buffer: u64 = eth_malloc_align(2048, 16);
+        if buffer == 0 {
+            unsafe { eth_printf(b"cannot allocate rx buffer pool\n\0" as *const u8) };
+            return -1;
+        }
+        gmacdev.RxPool.buf[i] = buffer;
+    }
+
+    gmacdev.RxPool.head.store(0, Ordering::Relaxed);
+    gmacdev.RxPool.tail.store(RX_POOL_NUM as u32, Ordering::Release);
+    gmacdev.RxZeroCopy = 1;
+    return 0;
+}
+
+// 操作系统用完eth_handle_rx_zero_copy交出的缓冲区后调用，放回缓冲池
+// 可以在rx以外的线程调用，但同一时刻只能有一个调用者
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_rx_release(gmacdev: &mut net_device, buffer: u64) {
+    let tail: u32 = gmacdev.RxPool.tail.load(Ordering::Relaxed);
+
+    gmacdev.RxPool.buf[tail] = buffer;
+    gmacdev.RxPool.tail.store(tail.wrapping_add(1), Ordering::Release);
+}
+
+// desc_idx开始的包占用的描述符个数，包还没有全部收到时为0
+// 只看OWN和LS，之后读其他字段前需要eth_desc_acquire
+fn eth_rx_frame_descs(gmacdev: &net_device, desc_idx: u32) -> u32 {
+    let mut desc_idx: u32 = desc_idx;
+
+    for n in 1..=gmacdev.RxDesc.depth() {
+        let desc: *mut DmaDesc = gmacdev.RxDesc[desc_idx];
+        let status: u32 = eth_desc_status(desc);
+
+        if eth_get_desc_owner(status) || eth_is_desc_empty(eth_desc_length(desc)) {
+            return 0;
+        }
+        if status & DescRxLast == DescRxLast {
+            return n;
+        }
+        desc_idx = gmacdev.RxDesc.next(desc_idx);
+    }
+    return 0;
+}
+
+// 跨ndesc个描述符的包先拼接到RxJumbo，再交给操作系统拷贝，zero-copy rx也一样
+fn eth_rx_gather(gmacdev: &mut net_device, desc_idx: u32, ndesc: u32, length: u32) -> u64 {
+    let jumbo: u64 = gmacdev.RxJumbo;
+    let mut desc_idx: u32 = desc_idx;
+    let mut ofs: u32 = 0;
+
+    // 只有jumbo MTU下包才会超过一个描述符
+    if jumbo == 0 || length > JUMBO_BUF_SIZE {
+        return 0;
+    }
+
+    for _ in 0..ndesc {
+        let len: u32 = (length - ofs).min(RX_BUF_SIZE);
 
         unsafe {
-            eth_sync_dcache();
+            core::ptr::copy_nonoverlapping(
+                gmacdev.RxBuffer[desc_idx] as *const u8,
+                (jumbo + ofs as u64) as *mut u8,
+                len as usize,
+            );
         }
+        ofs += len;
+        desc_idx = gmacdev.RxDesc.next(desc_idx);
+    }
+    return eth_handle_rx_buffer(gmacdev, jumbo, length);
+}
+
+// 把描述符交还给dma，dma_addr是描述符的缓冲区，缓冲区读完之后才能调用
+fn eth_rx_refill(gmacdev: &net_device, desc_idx: u32, dma_addr: u32) {
+    let desc: *mut DmaDesc = gmacdev.RxDesc[desc_idx];
+    // 先计数再读RxIntWdt，计入的描述符不会再带上旧的标志
+    let drained: bool = eth_rx_wdt_drained(gmacdev);
+
+    eth_desc_set(
+        desc,
+        (if gmacdev.RxDesc.is_last(desc_idx) { RxDescEndOfRing } else { 0 })
+            | (if gmacdev.RxIntWdt.load(Ordering::SeqCst) != 0 { RxDisIntCompl } else { 0 })
+            | DescSize1.val(RX_BUF_SIZE),
+        dma_addr,
+        0,
+    );
+    eth_desc_release(desc, DescOwnByDma);
+
+    if drained {
+        eth_rx_wdt_sync(gmacdev);
+    }
+}
+
+// 处理desc_idx开始的ndesc个描述符组成的包，描述符全部交还给dma
+// 返回交给操作系统的数据单元，错误的包或操作系统没有接收时为0
+fn eth_rx_frame(gmacdev: &mut net_device, desc_idx: u32, ndesc: u32) -> u64 {
+    let first: u32 = eth_desc_status(gmacdev.RxDesc[desc_idx]);
+    let last: u32 = eth_desc_status(gmacdev.RxDesc[desc_idx + ndesc - 1]);
+    let mut dma_addr: u32 = eth_desc_buffer1(gmacdev.RxDesc[desc_idx]);
+    let mut pbuf: u64 = 0;
+
+    if eth_is_rx_frame_valid(first, last) {
+        let length: u32 = eth_get_rx_length(last);
 
-        pbuf = unsafe { eth_handle_rx_buffer(buffer, length) };
-        gmacdev.rx_bytes += length as u64;
-        gmacdev.rx_packets += 1;
+        pbuf = if ndesc == 1 {
+            eth_rx_deliver(gmacdev, desc_idx, &mut dma_addr, length)
+        } else {
+            eth_rx_gather(gmacdev, desc_idx, ndesc, length)
+        };
+        eth_rx_csum(gmacdev, pbuf, last);
+
+        // 没有交出去的包被丢弃，例如没有开启jumbo MTU时收到的jumbo帧
+        if pbuf != 0 {
+            gmacdev.rx_bytes += length as u64;
+            gmacdev.rx_packets += 1;
+        } else {
+            gmacdev.rx_errors += 1;
+        }
     } else {
         gmacdev.rx_errors += 1;
     }
 
-    rxdesc.status = DescOwnByDma;
-    rxdesc.length = if is_last { RxDescEndOfRing } else { 0 };
-    rxdesc.length |= (2048) << DescSize1Shift & DescSize1Mask;
-    rxdesc.buffer1 = dma_addr;
-    rxdesc.buffer2 = 0;
-    unsafe {
-        gmacdev.RxDesc[desc_idx as usize].write(rxdesc);
+    // 只有单个描述符的包可能换了缓冲区
+    eth_rx_refill(gmacdev, desc_idx, dma_addr);
+    for i in 1..ndesc {
+        let idx: u32 = gmacdev.RxDesc.wrap(desc_idx + i);
+        eth_rx_refill(gmacdev, idx, eth_desc_buffer1(gmacdev.RxDesc[idx]));
+    }
+    return pbuf;
+}
+
+// 按RxPending计算DmaInterrupt，已经通知操作系统的中断在它重新打开之前保持屏蔽
+// 轮询模式下是所有收发完成中断，否则是rx中断
+fn eth_int_sync(gmacdev: &net_device) {
+    // 中断和另一个cpu上重新打开中断的线程会同时写寄存器，写完再检查一次，保证最后写入的是最新的状态
+    loop {
+        let pending: u32 = gmacdev.RxPending.load(Ordering::SeqCst);
+        let masked: u32 =
+            if gmacdev.PollMode != 0 { DmaIntPoll } else { DmaIntRxCompleted | DmaIntRxNoBuffer };
+
+        let value: u32 = if pending != 0 { DmaIntEnable & !masked } else { DmaIntEnable };
+
+        eth_dma_enable_interrupt(gmacdev, value);
+        fence(Ordering::SeqCst);
+
+        if pending == gmacdev.RxPending.load(Ordering::SeqCst) {
+            return;
+        }
+    }
+}
+
+// 中断中通知操作系统，之后由eth_rx_rearm恢复中断
+fn eth_rx_notify(gmacdev: &mut net_device) {
+    gmacdev.RxPending.store(1, Ordering::SeqCst);
+    eth_rx_ready(gmacdev);
+}
+
+// 操作系统处理完通知的收发，恢复中断
+// 屏蔽期间置位的状态位在重新使能后立即触发中断
+fn eth_rx_rearm(gmacdev: &net_device) {
+    gmacdev.RxPending.store(0, Ordering::SeqCst);
+    eth_int_sync(gmacdev);
+}
+
+// pbuf是返回给操作系统的数据单元
+// 可能是操作系统自定义结构
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_rx(gmacdev: &mut net_device) -> u64 {
+    let desc_idx: u32 = gmacdev.RxBusy;
+    let ndesc: u32 = eth_rx_frame_descs(gmacdev, desc_idx);
+
+    // 没有新的包，恢复rx中断，轮询模式下由eth_poll恢复
+    if ndesc == 0 {
+        if gmacdev.PollMode == 0 {
+            eth_rx_rearm(gmacdev);
+        }
+        return 0;
     }
+    // 之后读到的描述符字段和接收数据都不早于status
+    eth_desc_acquire();
+
+    let pbuf: u64 = eth_rx_frame(gmacdev, desc_idx, ndesc);
 
-    gmacdev.RxBusy = if is_last { 0 } else { desc_idx + 1 };
+    gmacdev.RxBusy = gmacdev.RxDesc.wrap(desc_idx + ndesc);
     return pbuf;
 }
 
+// 收取最多max个dma已经交还的包，pbufs保存返回给操作系统的数据单元
+// 整批只需要一次屏障，描述符全部重新交给dma后只写一次DmaRxPollDemand
+// 返回(pbufs中包的个数, 收取的包个数，包括错误的包)，不恢复中断
+fn eth_rx_harvest(gmacdev: &mut net_device, pbufs: *mut u64, max: u32) -> (u32, u32) {
+    let mut desc_idx: u32 = gmacdev.RxBusy;
+    let mut ready: u32 = 0;
+    let mut count: u32 = 0;
+    let mut descs: u32 = 0;
+
+    // 在环的一圈之内找dma已经收完的包
+    while ready < max {
+        let ndesc: u32 = eth_rx_frame_descs(gmacdev, desc_idx);
+        if ndesc == 0 || descs + ndesc > gmacdev.RxDesc.depth() {
+            break;
+        }
+        ready += 1;
+        descs += ndesc;
+        desc_idx = gmacdev.RxDesc.wrap(desc_idx + ndesc);
+    }
+
+    if ready == 0 {
+        return (0, 0);
+    }
+    // 之后读到的描述符字段和接收数据都不早于这一批的status
+    eth_desc_acquire();
+
+    desc_idx = gmacdev.RxBusy;
+    for _ in 0..ready {
+        let ndesc: u32 = eth_rx_frame_descs(gmacdev, desc_idx);
+        let pbuf: u64 = eth_rx_frame(gmacdev, desc_idx, ndesc);
+
+        if pbuf != 0 {
+            unsafe { pbufs.add(count as usize).write(pbuf) };
+            count += 1;
+        }
+        desc_idx = gmacdev.RxDesc.wrap(desc_idx + ndesc);
+    }
+    gmacdev.RxBusy = desc_idx;
+
+    // 描述符写入完成后才能唤醒dma
+    fence(Ordering::SeqCst);
+    eth_gmac_resume_dma_rx(gmacdev);
+
+    return (count, ready);
+}
+
+// 一次接收最多max个包，pbufs保存返回给操作系统的数据单元
+// 返回pbufs中包的个数，环中的包收完时恢复rx中断，轮询模式下由eth_poll恢复
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_rx_burst(gmacdev: &mut net_device, pbufs: *mut u64, max: u32) -> u32 {
+    let max: u32 = if max > RX_DESC_NUM as u32 { RX_DESC_NUM as u32 } else { max };
+    let (count, ready) = eth_rx_harvest(gmacdev, pbufs, max);
+
+    if ready < max && gmacdev.PollMode == 0 {
+        eth_rx_rearm(gmacdev);
+    }
+    return count;
+}
+
+// 开启或关闭轮询模式
+// 轮询模式下中断只屏蔽收发完成中断并调用eth_rx_ready，收包和回收发送描述符都交给eth_poll
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_poll_mode(gmacdev: &mut net_device, enable: u32) {
+    gmacdev.PollMode = enable;
+
+    // 不管之前的模式下通知了什么，新的模式从所有中断都打开开始
+    eth_rx_rearm(gmacdev);
+}
+
+// 轮询模式下eth_rx_ready之后由操作系统调用，类似linux的napi
+// 收取最多budget个包到pbufs，received是pbufs中包的个数，再回收最多budget个已发送的描述符
+// 都在budget之内完成时恢复中断并返回0，否则中断保持屏蔽，返回1，操作系统需要再次调用
+#[unsafe(no_mangle)]
+pub extern "C" fn eth_poll(
+    gmacdev: &mut net_device,
+    pbufs: *mut u64,
+    budget: u32,
+    received: &mut u32,
+) -> u32 {
+    let budget: u32 = if budget > RX_DESC_NUM as u32 { RX_DESC_NUM as u32 } else { budget };
+
+    gmacdev.polls += 1;
+
+    let (count, rx_done) = eth_rx_harvest(gmacdev, pbufs, budget);
+    let tx_done: u32 = eth_tx_reclaim(gmacdev, budget);
+    *received = count;
+
+    if rx_done == budget || tx_done == budget {
+        gmacdev.poll_exhausted += 1;
+        return 1;
+    }
+
+    eth_rx_rearm(gmacdev);
+    return 0;
+}
+
 // 中断处理程序
 // eth_rx_ready通知操作系统可以接收数据
 // eth_handle_tx_over用于处理已经发送完的描述符
+// 轮询模式下收发完成都只通知操作系统调用eth_poll
 #[unsafe(no_mangle)]
 pub extern "C" fn eth_irq(gmacdev: &mut net_device) {
     let mut dma_status: u32 = 0;
-    let mut dma_int_enable: u32 = DmaIntEnable;
 
-    dma_status = eth_mac_read_reg(gmacdev.DmaBase, DmaStatus);
+    dma_status = gmacdev.DmaBase.read(DmaStatus);
     if dma_status == 0 {
         return;
     }
 
+    gmacdev.irqs += 1;
+
     eth_dma_disable_interrupt_all(gmacdev);
 
     if dma_status & GmacPmtIntr != 0 {
@@ -208,15 +938,15 @@ pub extern "C" fn eth_irq(gmacdev: &mut net_device) {
         unsafe { eth_printf(b"gmac mmc interrupt\n\0" as *const u8) };
     }
     if dma_status & GmacLineIntfIntr != 0 {
-        eth_mac_read_reg(gmacdev.MacBase, GmacInterruptStatus);
-        eth_mac_read_reg(gmacdev.MacBase, GmacInterruptMask);
-        if eth_mac_read_reg(gmacdev.MacBase, GmacInterruptStatus) & GmacRgmiiIntSts != 0 {
-            eth_mac_read_reg(gmacdev.MacBase, GmacRgsmiiStatus);
+        gmacdev.MacBase.read(GmacInterruptStatus);
+        gmacdev.MacBase.read(GmacInterruptMask);
+        if gmacdev.MacBase.read(GmacInterruptStatus) & GmacRgmiiIntSts != 0 {
+            gmacdev.MacBase.read(GmacRgsmiiStatus);
         }
         eth_phy_rgsmii_check(gmacdev);
     }
 
-    eth_mac_write_reg(gmacdev.DmaBase, DmaStatus, dma_status);
+    gmacdev.DmaBase.write(DmaStatus, dma_status);
 
     if dma_status & DmaIntBusError != 0 {
         unsafe { eth_printf(b"gmac fatal bus error interrupt\n\0" as *const u8) };
@@ -227,13 +957,11 @@ pub extern "C" fn eth_irq(gmacdev: &mut net_device) {
     }
     if dma_status & DmaIntRxNoBuffer != 0 {
         unsafe { eth_printf(b"gmac receive buffer unavailable\n\0" as *const u8) };
-        dma_int_enable &= !DmaIntRxNoBuffer;
         eth_gmac_resume_dma_rx(gmacdev);
-        unsafe { eth_rx_ready(gmacdev) };
+        eth_rx_notify(gmacdev);
     }
     if dma_status & DmaIntRxCompleted != 0 {
-        dma_int_enable &= !DmaIntRxCompleted;
-        unsafe { eth_rx_ready(gmacdev) };
+        eth_rx_notify(gmacdev);
     }
     if dma_status & DmaIntTxUnderflow != 0 {
         unsafe { eth_printf(b"gmac transmit underflow\n\0" as *const u8) };
@@ -246,35 +974,78 @@ pub extern "C" fn eth_irq(gmacdev: &mut net_device) {
         unsafe { eth_printf(b"gmac transmit process stopped\n\0" as *const u8) };
     }
     if dma_status & DmaIntTxCompleted != 0 {
-        eth_handle_tx_over(gmacdev);
+        // 轮询模式下在eth_poll中回收，rx没有通知时通知操作系统
+        if gmacdev.PollMode == 0 {
+            eth_handle_tx_over(gmacdev);
+        } else if dma_status & (DmaIntRxCompleted | DmaIntRxNoBuffer) == 0 {
+            eth_rx_notify(gmacdev);
+        }
+    }
+
+    eth_dim_update(gmacdev);
+
+    // 按RxPending打开中断，期间另一个cpu上重新打开的中断不会被覆盖
+    eth_int_sync(gmacdev);
+}
+
+// gmac1的引脚与gpio复用，使用前需要在通用配置寄存器0中选择gmac1
+// 寄存器由两个实例共用，两个eth_init不能同时执行
+fn eth_pinmux(gmacdev: &net_device) {
+    if gmacdev.Unit != 1 {
+        return;
     }
-    eth_dma_enable_interrupt(gmacdev, dma_int_enable);
+
+    let chip: Mmio<ChipRegs> = Mmio::new(eth_phys_to_uncached(LS2K_CHIP_CFG_BASE));
+    chip.set_bits(GeneralCfg0, Gmac1Sel);
 }
 
 // 初始化
+// 每个实例使用独立的net_device，驱动没有全局状态，两个实例可以同时收发
 #[unsafe(no_mangle)]
 pub extern "C" fn eth_init(gmacdev: &mut net_device) -> i32 {
-    // 在eth_init内或外，利用uncached地址初始化结构体的iobase
-    // gmacdev.iobase = eth_phys_to_uncached(0x40040000);
-    gmacdev.MacBase = gmacdev.iobase + 0x0000;
-    gmacdev.DmaBase = gmacdev.iobase + 0x1000;
+    // eth_init之前利用uncached地址初始化结构体的iobase和Unit，例如gmac1：
+    // gmacdev.iobase = eth_phys_to_uncached(ETH_GMAC1_BASE); gmacdev.Unit = 1;
+    if gmacdev.Unit >= ETH_GMAC_NUM {
+        unsafe { eth_printf(b"gmac%d does not exist\n\0" as *const u8, gmacdev.Unit) };
+        return -1;
+    }
+    gmacdev.Irq = if gmacdev.Unit == 1 { ETH_GMAC1_IRQ } else { ETH_GMAC0_IRQ };
+
+    // 访问gmac1的寄存器之前先选择引脚
+    eth_pinmux(gmacdev);
+
+    gmacdev.MacBase = Mmio::new(gmacdev.iobase + 0x0000);
+    gmacdev.DmaBase = Mmio::new(gmacdev.iobase + 0x1000);
     gmacdev.PhyBase = 0;
-    gmacdev.Version = eth_mac_read_reg(gmacdev.MacBase, GmacVersion);
+    gmacdev.Version = gmacdev.MacBase.read(GmacVersion);
 
     eth_dma_reset(gmacdev);
     eth_mac_set_addr(gmacdev);
+    eth_mac_get_hw_feature(gmacdev);
     eth_phy_init(gmacdev);
 
-    eth_setup_rx_desc_queue(gmacdev, 128);
-    eth_setup_tx_desc_queue(gmacdev, 128);
+    // 调用eth_set_coalesce之前每个包一次中断
+    gmacdev.RxIntWdt.store(0, Ordering::Relaxed);
+    gmacdev.RxWdtDrain.store(0, Ordering::Relaxed);
+    gmacdev.TxIntFrames = 1;
+    gmacdev.TxIntCount = 0;
+    gmacdev.DimMode = 0;
+    gmacdev.TxCoe = 0;
+    gmacdev.RxCoe = 0;
+    gmacdev.Mtu = ETH_MTU;
+    gmacdev.RxJumbo = 0;
+
+    eth_setup_rx_desc_queue(gmacdev);
+    eth_setup_tx_desc_queue(gmacdev);
 
     eth_dma_reg_init(gmacdev);
     eth_gmac_reg_init(gmacdev);
 
-    unsafe { eth_sync_dcache() };
+    eth_sync_dcache();
 
     eth_gmac_disable_mmc_irq(gmacdev);
     eth_dma_clear_curr_irq(gmacdev);
+    gmacdev.RxPending.store(0, Ordering::Relaxed);
     eth_dma_enable_interrupt(gmacdev, DmaIntEnable);
 
     eth_gmac_enable_rx(gmacdev);
@@ -282,7 +1053,375 @@ pub extern "C" fn eth_init(gmacdev: &mut net_device) -> i32 {
     eth_dma_enable_rx(gmacdev);
     eth_dma_enable_tx(gmacdev);
 
-    unsafe { eth_isr_install() };
+    eth_isr_install(gmacdev);
 
     return 0;
 }
+
+// 主机上的描述符环模型，检查发送路径把描述符交给dma的顺序：
+// 每个描述符的OWN最后写入，dma经由OWN取到描述符时其他字段都已可见
+#[cfg(all(test, feature = "mock"))]
+mod tests {
+    extern crate std;
+
+    use super::*;
+    use crate::eth_dev::desc_trace::{self, DescWrite};
+
+    use std::alloc::{Layout, alloc_zeroed};
+    use std::boxed::Box;
+    use std::vec;
+    use std::vec::Vec;
+
+    // 寄存器块是普通内存，dma并不运行，描述符由eth_dma_complete收回
+    fn eth_test_dev() -> Box<net_device> {
+        let regs: &'static mut [u32] = vec![0u32; 0x2000 / 4].leak();
+        let layout: Layout = Layout::new::<net_device>();
+        let mut gmacdev: Box<net_device> =
+            unsafe { Box::from_raw(alloc_zeroed(layout) as *mut net_device) };
+
+        gmacdev.iobase = regs.as_mut_ptr() as u64;
+        gmacdev.MacBase = Mmio::new(gmacdev.iobase + 0x0000);
+        gmacdev.DmaBase = Mmio::new(gmacdev.iobase + 0x1000);
+        gmacdev.DmaBase.write(DmaHWFeature, mock::MOCK_DMA_HW_FEATURE);
+        eth_mac_get_hw_feature(&mut gmacdev);
+        gmacdev.TxIntFrames = 1;
+        gmacdev.Mtu = ETH_MTU;
+        eth_setup_tx_desc_queue(&mut gmacdev);
+
+        return gmacdev;
+    }
+
+    // dma发送完所有交给它的描述符，驱动随后回收
+    fn eth_dma_complete(gmacdev: &mut net_device) {
+        for i in 0..gmacdev.TxDesc.depth() {
+            let desc: *mut DmaDesc = gmacdev.TxDesc[i];
+            let status: u32 = eth_desc_status(desc);
+            unsafe { core::ptr::write_volatile(&raw mut (*desc).status, status & !DescOwnByDma) };
+        }
+        eth_handle_tx_over(gmacdev);
+        desc_trace::take();
+    }
+
+    // dma从head开始取描述符，遇到OWN为0时停止
+    // 最悲观地假设每次写入都可能立即被dma看到，只有屏障保证之前的写入可见：
+    // 取到的描述符必须已经由某个屏障之后的OWN同步过，且它的其他字段都写在该屏障之前
+    // 返回取到的描述符个数
+    fn eth_dma_walk(gmacdev: &net_device, head: u32, trace: &[DescWrite]) -> u32 {
+        let mut desc_idx: u32 = head;
+        let mut sync: Option<usize> = None;
+        let mut fetched: u32 = 0;
+
+        while fetched < gmacdev.TxDesc.depth() {
+            let desc: usize = gmacdev.TxDesc[desc_idx] as usize;
+            let own = trace
+                .iter()
+                .rposition(|w| matches!(*w, DescWrite::Status(d, _) if d == desc));
+            let Some(pos) = own else { break };
+            let DescWrite::Status(_, status) = trace[pos] else { unreachable!() };
+            if !eth_get_desc_owner(status) {
+                break;
+            }
+
+            if pos > 0 && trace[pos - 1] == DescWrite::Fence {
+                sync = Some(sync.map_or(pos - 1, |s| s.max(pos - 1)));
+            }
+            let Some(fence_pos) = sync else {
+                panic!("desc {} handed over before any release fence", desc_idx);
+            };
+            for (i, w) in trace.iter().enumerate() {
+                if *w == DescWrite::Fields(desc) {
+                    assert!(i < fence_pos, "desc {} fields not visible before its OWN", desc_idx);
+                }
+            }
+
+            fetched += 1;
+            desc_idx = gmacdev.TxDesc.next(desc_idx);
+        }
+
+        return fetched;
+    }
+
+    // 检查一次发送调用的记录，dma最终应取到ndesc个描述符
+    fn eth_check_handover(gmacdev: &net_device, head: u32, ndesc: u32) {
+        let trace: Vec<DescWrite> = desc_trace::take();
+
+        // OWN之后不再写该描述符的其他字段
+        for (i, w) in trace.iter().enumerate() {
+            if let DescWrite::Status(desc, status) = *w {
+                if eth_get_desc_owner(status) {
+                    assert!(!trace[i..].contains(&DescWrite::Fields(desc)), "fields written after OWN");
+                }
+            }
+        }
+
+        // 调用过程中的每一时刻dma看到的都是完整的描述符
+        for end in 1..trace.len() {
+            eth_dma_walk(gmacdev, head, &trace[..end]);
+        }
+        assert_eq!(eth_dma_walk(gmacdev, head, &trace), ndesc);
+    }
+
+    #[test]
+    fn tx_own_written_last() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+
+        // 跨过环尾几次
+        for i in 0..3 * TX_DESC_NUM as u32 {
+            let head: u32 = gmacdev.TxNext;
+            assert_eq!(eth_tx(&mut gmacdev, 0), 0);
+            eth_check_handover(&gmacdev, head, 1);
+
+            if i % 7 == 6 {
+                eth_dma_complete(&mut gmacdev);
+            }
+        }
+    }
+
+    #[test]
+    fn tx_burst_first_own_written_last() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let pbufs: [u64; 5] = [0; 5];
+
+        for _ in 0..3 * TX_DESC_NUM / 5 {
+            let head: u32 = gmacdev.TxNext;
+            assert_eq!(eth_tx_burst(&mut gmacdev, pbufs.as_ptr(), 5), 5);
+            eth_check_handover(&gmacdev, head, 5);
+            eth_dma_complete(&mut gmacdev);
+        }
+
+        // 环快满时只交出剩余的描述符
+        for _ in 0..TX_DESC_NUM / 5 {
+            assert_eq!(eth_tx_burst(&mut gmacdev, pbufs.as_ptr(), 5), 5);
+        }
+        desc_trace::take();
+        let head: u32 = gmacdev.TxNext;
+        let left: u32 = (TX_DESC_NUM % 5) as u32;
+        assert_eq!(eth_tx_burst(&mut gmacdev, pbufs.as_ptr(), 5), left);
+        eth_check_handover(&gmacdev, head, left);
+    }
+
+    #[test]
+    fn tx_sg_first_own_written_last() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let data: &'static mut [u8] = vec![0u8; 5 * 256].leak();
+        let segs: Vec<eth_tx_seg> = (0..5)
+            .map(|i| eth_tx_seg { addr: data.as_ptr() as u64 + i * 256, len: 256 })
+            .collect();
+
+        for i in 0..TX_DESC_NUM as u32 {
+            let nseg: u32 = 1 + i % 5;
+            let head: u32 = gmacdev.TxNext;
+            assert_eq!(eth_tx_sg(&mut gmacdev, segs.as_ptr(), nseg, 1 + i as u64), 0);
+            eth_check_handover(&gmacdev, head, (nseg + 1) / 2);
+
+            if i % 4 == 3 {
+                eth_dma_complete(&mut gmacdev);
+            }
+        }
+    }
+
+    // dma发送完成但还没有回收的描述符不能重新使用
+    #[test]
+    fn tx_waits_for_reclaim() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let pbufs: [u64; 2] = [0; 2];
+
+        for _ in 0..TX_DESC_NUM {
+            assert_eq!(eth_tx(&mut gmacdev, 0), 0);
+        }
+        for i in 0..gmacdev.TxDesc.depth() {
+            let desc: *mut DmaDesc = gmacdev.TxDesc[i];
+            let status: u32 = eth_desc_status(desc);
+            unsafe { core::ptr::write_volatile(&raw mut (*desc).status, status & !DescOwnByDma) };
+        }
+        desc_trace::take();
+
+        assert_eq!(eth_tx(&mut gmacdev, 0), -1);
+        assert_eq!(eth_tx_burst(&mut gmacdev, pbufs.as_ptr(), 2), 0);
+
+        eth_handle_tx_over(&mut gmacdev);
+        desc_trace::take();
+        let head: u32 = gmacdev.TxNext;
+        assert_eq!(eth_tx_burst(&mut gmacdev, pbufs.as_ptr(), 2), 2);
+        eth_check_handover(&gmacdev, head, 2);
+    }
+
+    // dma收完从RxBusy开始的n个单描述符的包
+    fn eth_dma_receive(gmacdev: &mut net_device, n: u32) {
+        let mut desc_idx: u32 = gmacdev.RxBusy;
+
+        for _ in 0..n {
+            let desc: *mut DmaDesc = gmacdev.RxDesc[desc_idx];
+            let status: u32 = DescRxFirst | DescRxLast | DescFrameLength.val(64);
+            unsafe { core::ptr::write_volatile(&raw mut (*desc).status, status) };
+            desc_idx = gmacdev.RxDesc.next(desc_idx);
+        }
+    }
+
+    // dma从RxBusy开始收一个跨ndesc个描述符的包
+    fn eth_dma_receive_frame(gmacdev: &mut net_device, ndesc: u32, length: u32) {
+        let mut desc_idx: u32 = gmacdev.RxBusy;
+
+        for i in 0..ndesc {
+            let desc: *mut DmaDesc = gmacdev.RxDesc[desc_idx];
+            let mut status: u32 = if i == 0 { DescRxFirst } else { 0 };
+            if i == ndesc - 1 {
+                status |= DescRxLast | DescFrameLength.val(length);
+            }
+            unsafe { core::ptr::write_volatile(&raw mut (*desc).status, status) };
+            desc_idx = gmacdev.RxDesc.next(desc_idx);
+        }
+    }
+
+    // 拼接不了的多描述符包计为错误，有拼接缓冲区（jumbo MTU）时才计为收到的包
+    #[test]
+    fn rx_gather_drop_counted_as_error() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let mut pbufs: [u64; 1] = [0; 1];
+        let length: u32 = 3000;
+
+        eth_setup_rx_desc_queue(&mut gmacdev);
+        eth_dma_receive_frame(&mut gmacdev, 2, length);
+        assert_eq!(eth_rx_burst(&mut gmacdev, pbufs.as_mut_ptr(), 1), 0);
+        assert_eq!((gmacdev.rx_packets, gmacdev.rx_bytes, gmacdev.rx_errors), (0, 0, 1));
+
+        // 只需要拼接缓冲区，不经过eth_set_mtu分配jumbo发送缓冲区，测试共用的堆很小
+        gmacdev.RxJumbo = vec![0u8; JUMBO_BUF_SIZE as usize].leak().as_mut_ptr() as u64;
+        eth_dma_receive_frame(&mut gmacdev, 2, length);
+        assert_eq!(eth_rx_burst(&mut gmacdev, pbufs.as_mut_ptr(), 1), 1);
+        assert_eq!((gmacdev.rx_packets, gmacdev.rx_bytes, gmacdev.rx_errors), (1, length as u64, 1));
+    }
+
+    // 屏蔽了完成中断、只能由看门狗报告的接收描述符个数
+    fn eth_rx_wdt_flagged(gmacdev: &net_device) -> u32 {
+        return (0..gmacdev.RxDesc.depth())
+            .filter(|&i| eth_desc_length(gmacdev.RxDesc[i]) & RxDisIntCompl != 0)
+            .count() as u32;
+    }
+
+    // 关闭接收中断合并后，之前填充的描述符全部替换之前RIWT不能为0
+    #[test]
+    fn rx_wdt_kept_until_flagged_desc_refilled() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let mut pbufs: [u64; RX_DESC_NUM] = [0; RX_DESC_NUM];
+        let batch: u32 = 16;
+
+        eth_setup_rx_desc_queue(&mut gmacdev);
+        assert_eq!(eth_set_coalesce(&mut gmacdev, 16, 1), 0);
+        eth_dma_receive(&mut gmacdev, RX_DESC_NUM as u32);
+        let count: u32 = eth_rx_burst(&mut gmacdev, pbufs.as_mut_ptr(), RX_DESC_NUM as u32);
+        assert_eq!(count, RX_DESC_NUM as u32);
+        assert_eq!(eth_rx_wdt_flagged(&gmacdev), RX_DESC_NUM as u32);
+
+        assert_eq!(eth_set_coalesce(&mut gmacdev, 0, 1), 0);
+        for _ in 0..RX_DESC_NUM as u32 / batch {
+            assert_ne!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+            eth_dma_receive(&mut gmacdev, batch);
+            assert_eq!(eth_rx_burst(&mut gmacdev, pbufs.as_mut_ptr(), batch), batch);
+        }
+        assert_eq!(eth_rx_wdt_flagged(&gmacdev), 0);
+        assert_eq!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+
+        // 打开后立即生效，之后的描述符重新带上标志
+        assert_eq!(eth_set_coalesce(&mut gmacdev, 16, 1), 0);
+        assert_ne!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+    }
+
+    // 自适应中断合并降回不合并的一档或关闭时，同样要等带标志的描述符全部替换
+    #[test]
+    fn dim_step_down_keeps_rx_wdt() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let mut pbufs: [u64; RX_DESC_NUM] = [0; RX_DESC_NUM];
+
+        // 每100ms采样一次，包速率远高于升档阈值或为0，直到换到profile
+        let dim_step = |gmacdev: &mut net_device, packets: u64, profile: u32| {
+            for _ in 0..4 * DIM_HYSTERESIS {
+                gmacdev.rx_packets += packets;
+                eth_mdelay(100);
+                eth_dim_update(gmacdev);
+                if gmacdev.DimProfile == profile {
+                    return;
+                }
+            }
+            panic!("dim stuck at profile {}", gmacdev.DimProfile);
+        };
+        let mut rx_ring = |gmacdev: &mut net_device| {
+            eth_dma_receive(gmacdev, RX_DESC_NUM as u32);
+            let count: u32 = eth_rx_burst(gmacdev, pbufs.as_mut_ptr(), RX_DESC_NUM as u32);
+            assert_eq!(count, RX_DESC_NUM as u32);
+        };
+
+        eth_setup_rx_desc_queue(&mut gmacdev);
+        eth_dim_mode(&mut gmacdev, 1);
+        assert_eq!(gmacdev.DimRxWdt, 1);
+        assert_eq!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+        assert_eq!(gmacdev.RxWdtDrain.load(Ordering::Relaxed), 0);
+
+        for mode_off in [false, true] {
+            dim_step(&mut gmacdev, 1000000, 1);
+            assert_eq!(gmacdev.DimProfile, 1);
+            rx_ring(&mut gmacdev);
+            assert_eq!(eth_rx_wdt_flagged(&gmacdev), RX_DESC_NUM as u32);
+
+            if mode_off {
+                eth_dim_mode(&mut gmacdev, 0);
+            } else {
+                dim_step(&mut gmacdev, 0, 0);
+            }
+            assert_eq!(gmacdev.DimProfile, 0);
+            assert_ne!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+
+            rx_ring(&mut gmacdev);
+            assert_eq!(eth_rx_wdt_flagged(&gmacdev), 0);
+            assert_eq!(gmacdev.DmaBase.read(DmaRxIntWdt), 0);
+        }
+    }
+
+    // 轮询模式下中断屏蔽收发完成中断直到eth_poll重新打开；
+    // eth_poll在中断通知之后、中断写回DmaInterrupt之前重新打开时，中断不能再把它屏蔽
+    #[test]
+    fn poll_rearm_survives_irq_tail() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+        let mut pbufs: [u64; 16] = [0; 16];
+        let mut received: u32 = 0;
+
+        eth_setup_rx_desc_queue(&mut gmacdev);
+        eth_poll_mode(&mut gmacdev, 1);
+        assert_eq!(gmacdev.DmaBase.read(DmaInterrupt), DmaIntEnable);
+
+        gmacdev.DmaBase.write(DmaStatus, DmaIntRxCompleted);
+        eth_irq(&mut gmacdev);
+        assert_eq!(gmacdev.DmaBase.read(DmaInterrupt), DmaIntEnable & !DmaIntPoll);
+
+        // 屏蔽期间其他中断不会提前打开
+        gmacdev.DmaBase.write(DmaStatus, DmaIntRcvOverflow);
+        eth_irq(&mut gmacdev);
+        assert_eq!(gmacdev.DmaBase.read(DmaInterrupt), DmaIntEnable & !DmaIntPoll);
+
+        assert_eq!(eth_poll(&mut gmacdev, pbufs.as_mut_ptr(), 16, &mut received), 0);
+        assert_eq!(gmacdev.DmaBase.read(DmaInterrupt), DmaIntEnable);
+
+        // eth_irq的通知和最后的写入之间，另一个cpu上的eth_poll已经重新打开
+        eth_rx_notify(&mut gmacdev);
+        assert_eq!(eth_poll(&mut gmacdev, pbufs.as_mut_ptr(), 16, &mut received), 0);
+        eth_int_sync(&gmacdev);
+        assert_eq!(gmacdev.DmaBase.read(DmaInterrupt), DmaIntEnable);
+    }
+
+    // 校验和offload按eth_init读到的DmaHWFeature开启，硬件都不支持时返回-1
+    #[test]
+    fn csum_offload_follows_hw_feature() {
+        let mut gmacdev: Box<net_device> = eth_test_dev();
+
+        assert_eq!(eth_csum_offload(&mut gmacdev, 1), 0);
+        assert_eq!((gmacdev.TxCoe, gmacdev.RxCoe), (1, 1));
+        assert_ne!(gmacdev.MacBase.read(GmacConfig) & GmacRxIpcOffload, 0);
+
+        assert_eq!(eth_csum_offload(&mut gmacdev, 0), 0);
+        assert_eq!((gmacdev.TxCoe, gmacdev.RxCoe), (0, 0));
+        assert_eq!(gmacdev.MacBase.read(GmacConfig) & GmacRxIpcOffload, 0);
+
+        gmacdev.DmaCap = 0;
+        assert_eq!(eth_csum_offload(&mut gmacdev, 1), -1);
+    }
+}
@@ -1,5 +1,10 @@
 #![allow(non_upper_case_globals, non_snake_case, non_camel_case_types)]
 
+use crate::mmio::{Field, Mmio, Reg};
+use crate::ring::Ring;
+
+use core::sync::atomic::AtomicU32;
+
 #[derive(Copy, Clone)]
 #[repr(C)]
 pub struct DmaDesc {
@@ -9,23 +14,78 @@ pub struct DmaDesc {
     pub buffer2: u32,
 }
 
+// 描述符环的深度，必须是2的幂
+pub const TX_DESC_NUM: usize = 128;
+pub const RX_DESC_NUM: usize = 128;
+// zero-copy接收的备用缓冲区个数，必须是2的幂
+pub const RX_POOL_NUM: usize = 128;
+// 接收缓冲区大小，jumbo帧跨多个描述符接收
+pub const RX_BUF_SIZE: u32 = 2048;
+// eth_set_mtu设置的MTU，jumbo帧时发送缓冲区换成JUMBO_BUF_SIZE
+pub const ETH_MTU: u32 = 1500;
+pub const ETH_MAX_MTU: u32 = 9000;
+pub const JUMBO_BUF_SIZE: u32 = 9216; // 带vlan tag和crc的jumbo帧，按1KiB向上取整
+
+// gmac实例，net_device.Unit选择其中一个，iobase映射它的寄存器基地址
+pub const ETH_GMAC_NUM: u32 = 2;
+pub const ETH_GMAC0_BASE: u64 = 0x40040000;
+pub const ETH_GMAC0_IRQ: u32 = 12;
+pub const ETH_GMAC1_BASE: u64 = 0x40050000;
+pub const ETH_GMAC1_IRQ: u32 = 14;
+
+// 在途描述符达到该数目后每个包都请求发送完成中断
+pub const TX_INT_FILL: u32 = (TX_DESC_NUM * 3 / 4) as u32;
+
+// dma时钟，接收中断看门狗以256个周期为单位计数
+pub const ETH_DMA_CLK_MHZ: u32 = 125;
+
+// 校验和offload，eth_handle_tx_csum返回每个发送包的ETH_TX_CSUM_*，
+// eth_handle_rx_csum得到每个接收包的ETH_RX_CSUM_*
+pub const ETH_TX_CSUM_IP: u32 = 0x1; // 插入ipv4头校验和
+pub const ETH_TX_CSUM_L4: u32 = 0x2; // 同时插入tcp/udp/icmp校验和，包括伪首部
+pub const ETH_RX_CSUM_NONE: u32 = 0; // 没有检查，由OS检查
+pub const ETH_RX_CSUM_OK: u32 = 1; // ip头和tcp/udp/icmp校验和正确
+// 自适应中断合并每DIM_INTERVAL_US采样一次，连续DIM_HYSTERESIS次采样同一方向才换档
+pub const DIM_INTERVAL_US: u64 = 1000;
+pub const DIM_HYSTERESIS: i32 = 2;
+
+// 分散聚集发送时OS的一段缓冲区
 #[derive(Copy, Clone)]
+#[repr(C)]
+pub struct eth_tx_seg {
+    pub addr: u64, // cached虚拟地址
+    pub len: u32,  // 字节数，不超过DescSize1Mask
+}
+
+// zero-copy接收的缓冲池
+// rx从head取出缓冲区，eth_rx_release从tail放回，head和tail都是不回绕的计数
+// 不在描述符环上的缓冲区始终不超过RX_POOL_NUM个，放回时不会溢出
+#[repr(C)]
+pub struct eth_rx_pool {
+    pub buf: Ring<u64, RX_POOL_NUM>,
+    pub head: AtomicU32, // 只由rx写
+    pub tail: AtomicU32, // 只由eth_rx_release写
+}
+
 #[repr(C)]
 pub struct net_device {
     pub parent: *mut u8,
     pub iobase: u64,
+    pub Unit: u32, // 0为gmac0，1为gmac1，在eth_init之前与iobase一起设置
+    pub Irq: u32,  // 实例的中断号，供eth_isr_install注册
     pub MacAddr: [u8; 6],
-    pub MacBase: u64,
-    pub DmaBase: u64,
+    pub MacBase: Mmio<MacRegs>,
+    pub DmaBase: Mmio<DmaRegs>,
     pub PhyBase: u64,
     pub Version: u32,
+    pub DmaCap: u32, // eth_init时读到的DmaHWFeature
     pub TxBusy: u32,
     pub TxNext: u32,
     pub RxBusy: u32,
-    pub TxDesc: [*mut DmaDesc; 128],
-    pub RxDesc: [*mut DmaDesc; 128],
-    pub TxBuffer: [u64; 128],
-    pub RxBuffer: [u64; 128],
+    pub TxDesc: Ring<*mut DmaDesc, TX_DESC_NUM>,
+    pub RxDesc: Ring<*mut DmaDesc, RX_DESC_NUM>,
+    pub TxBuffer: Ring<u64, TX_DESC_NUM>,
+    pub RxBuffer: Ring<u64, RX_DESC_NUM>,
     pub rx_packets: u64,
     pub tx_packets: u64,
     pub rx_bytes: u64,
@@ -36,20 +96,59 @@ pub struct net_device {
     pub LinkStatus: u32,
     pub DuplexMode: u32,
     pub Speed: u32,
+    pub RxZeroCopy: u32,
+    pub RxPool: eth_rx_pool,
+    pub TxCookie: Ring<u64, TX_DESC_NUM>, // 以该描述符结束的包发送完成前，OS的存储单元不能释放
+    pub PollMode: u32,       // 收发完成由eth_poll处理
+    pub RxPending: AtomicU32, // 已经由eth_rx_ready通知操作系统，对应的中断在重新打开之前保持屏蔽
+    pub irqs: u64,           // 进入中断的次数
+    pub polls: u64,          // eth_poll调用次数
+    pub poll_exhausted: u64, // 用完budget的eth_poll调用次数
+    pub RxIntWdt: AtomicU32,   // RIWT的值，0表示每个接收的包一次中断
+    pub RxWdtDrain: AtomicU32, // RxIntWdt改为0之后还需要重新填充的接收描述符数
+    pub TxIntFrames: u32,    // 每多少个发送的包请求一次完成中断
+    pub TxIntCount: u32,     // 上次请求中断之后发送的包数
+    pub IrqRateStamp: u64,   // 上次eth_get_irq_rate的时间和中断次数
+    pub IrqRateIrqs: u64,
+    pub DimMode: u32,    // 由eth_dim_update选择中断合并档位
+    pub DimRxWdt: u32,   // 接收中断看门狗可用
+    pub DimProfile: u32, // 当前档位
+    pub DimVotes: i32,   // 连续高于(>0)或低于(<0)当前档位的采样次数
+    pub DimStamp: u64,   // 上次采样的时间、包数和字节数
+    pub DimPackets: u64,
+    pub DimBytes: u64,
+    pub TxCoe: u32, // 发送的包按eth_handle_tx_csum插入校验和
+    pub RxCoe: u32, // 接收的包把检查结果交给eth_handle_rx_csum
+    pub Mtu: u32,
+    pub RxJumbo: u64, // 跨多个描述符的接收帧在这里拼接
 }
 
-pub type GmacRegisters = u32;
-pub const GmacRgsmiiStatus: GmacRegisters = 0x00D8;
-pub const GmacAddr0Low: GmacRegisters = 0x0044;
-pub const GmacAddr0High: GmacRegisters = 0x0040;
-pub const GmacInterruptMask: GmacRegisters = 0x003C;
-pub const GmacInterruptStatus: GmacRegisters = 0x0038;
-pub const GmacVersion: GmacRegisters = 0x0020;
-pub const GmacFlowControl: GmacRegisters = 0x0018;
-pub const GmacGmiiData: GmacRegisters = 0x0014;
-pub const GmacGmiiAddr: GmacRegisters = 0x0010;
-pub const GmacFrameFilter: GmacRegisters = 0x0004;
-pub const GmacConfig: GmacRegisters = 0x0000;
+// mac寄存器块，位于iobase
+pub enum MacRegs {}
+
+// dma寄存器块，位于iobase + 0x1000
+pub enum DmaRegs {}
+
+// 芯片配置寄存器块，位于LS2K_CHIP_CFG_BASE
+pub enum ChipRegs {}
+
+pub const LS2K_CHIP_CFG_BASE: u64 = 0x1fe00000;
+// gmac1的引脚与gpio复用，由通用配置寄存器0选择
+pub const GeneralCfg0: Reg<ChipRegs> = Reg::new(0x0420);
+pub const Gmac1Sel: u32 = 1 << 3;
+
+pub type GmacRegisters = Reg<MacRegs>;
+pub const GmacRgsmiiStatus: GmacRegisters = Reg::new(0x00D8);
+pub const GmacAddr0Low: GmacRegisters = Reg::new(0x0044);
+pub const GmacAddr0High: GmacRegisters = Reg::new(0x0040);
+pub const GmacInterruptMask: GmacRegisters = Reg::new(0x003C);
+pub const GmacInterruptStatus: GmacRegisters = Reg::new(0x0038);
+pub const GmacVersion: GmacRegisters = Reg::new(0x0020);
+pub const GmacFlowControl: GmacRegisters = Reg::new(0x0018);
+pub const GmacGmiiData: GmacRegisters = Reg::new(0x0014);
+pub const GmacGmiiAddr: GmacRegisters = Reg::new(0x0010);
+pub const GmacFrameFilter: GmacRegisters = Reg::new(0x0004);
+pub const GmacConfig: GmacRegisters = Reg::new(0x0000);
 
 pub type GmacInterruptStatus = u32;
 pub const GmacRgmiiIntSts: GmacInterruptStatus = 0x00000001;
@@ -60,10 +159,12 @@ pub const GmacTx: GmacConfigReg = 0x00000008;
 pub const GmacDeferralCheck: GmacConfigReg = 0x00000010;
 pub const GmacBackoffLimit0: GmacConfigReg = 0x00000000;
 pub const GmacBackoffLimit: GmacConfigReg = 0x00000060;
+pub const GmacBackoff: Field = Field::new(5, 2);
 pub const GmacPadCrcStrip: GmacConfigReg = 0x00000080;
 pub const GmacLinkDown: GmacConfigReg = 0x00000100;
 pub const GmacLinkUp: GmacConfigReg = 0x00000100;
 pub const GmacRetry: GmacConfigReg = 0x00000200;
+pub const GmacRxIpcOffload: GmacConfigReg = 0x00000400;
 pub const GmacHalfDuplex: GmacConfigReg = 0x00000000;
 pub const GmacFullDuplex: GmacConfigReg = 0x00000800;
 pub const GmacDuplex: GmacConfigReg = 0x00000800;
@@ -87,6 +188,7 @@ pub const GmacMulticastFilter: GmacFrameFilterReg = 0x00000010;
 pub const GmacBroadcast: GmacFrameFilterReg = 0x00000020;
 pub const GmacPassControl0: GmacFrameFilterReg = 0x00000000;
 pub const GmacPassControl: GmacFrameFilterReg = 0x000000C0;
+pub const GmacPassCtrl: Field = Field::new(6, 2);
 pub const GmacSrcAddrFilter: GmacFrameFilterReg = 0x00000200;
 pub const GmacFilter: GmacFrameFilterReg = 0x80000000;
 
@@ -99,26 +201,36 @@ pub const GmiiRegShift: GmacGmiiAddrReg = 6;
 pub const GmiiRegMask: GmacGmiiAddrReg = 0x000007C0;
 pub const GmiiDevShift: GmacGmiiAddrReg = 11;
 pub const GmiiDevMask: GmacGmiiAddrReg = 0x0000F800;
+pub const GmiiReg: Field = Field::new(6, 5);
+pub const GmiiDev: Field = Field::new(11, 5);
 
 pub type GmacFlowControlReg = u32;
 pub const GmacTxFlowControl: GmacFlowControlReg = 0x00000002;
 pub const GmacRxFlowControl: GmacFlowControlReg = 0x00000004;
 pub const GmacPauseTimeMask: GmacFlowControlReg = 0xFFFF0000;
+pub const GmacPauseTime: Field = Field::new(16, 16);
+
+pub type DmaRegisters = Reg<DmaRegs>;
+pub const DmaAxiBusMode: DmaRegisters = Reg::new(0x0028);
+pub const DmaHWFeature: DmaRegisters = Reg::new(0x0058);
+pub const DmaRxCurrAddr: DmaRegisters = Reg::new(0x0054);
+pub const DmaTxCurrAddr: DmaRegisters = Reg::new(0x0050);
+pub const DmaRxCurrDesc: DmaRegisters = Reg::new(0x004C);
+pub const DmaTxCurrDesc: DmaRegisters = Reg::new(0x0048);
+pub const DmaRxIntWdt: DmaRegisters = Reg::new(0x0024);
+pub const DmaInterrupt: DmaRegisters = Reg::new(0x001C);
+pub const DmaControl: DmaRegisters = Reg::new(0x0018);
+pub const DmaStatus: DmaRegisters = Reg::new(0x0014);
+pub const DmaTxBaseAddr: DmaRegisters = Reg::new(0x0010);
+pub const DmaRxBaseAddr: DmaRegisters = Reg::new(0x000C);
+pub const DmaRxPollDemand: DmaRegisters = Reg::new(0x0008);
+pub const DmaTxPollDemand: DmaRegisters = Reg::new(0x0004);
+pub const DmaBusMode: DmaRegisters = Reg::new(0x0000);
 
-pub type DmaRegisters = u32;
-pub const DmaHWFeature: DmaRegisters = 0x0058;
-pub const DmaRxCurrAddr: DmaRegisters = 0x0054;
-pub const DmaTxCurrAddr: DmaRegisters = 0x0050;
-pub const DmaRxCurrDesc: DmaRegisters = 0x004C;
-pub const DmaTxCurrDesc: DmaRegisters = 0x0048;
-pub const DmaInterrupt: DmaRegisters = 0x001C;
-pub const DmaControl: DmaRegisters = 0x0018;
-pub const DmaStatus: DmaRegisters = 0x0014;
-pub const DmaTxBaseAddr: DmaRegisters = 0x0010;
-pub const DmaRxBaseAddr: DmaRegisters = 0x000C;
-pub const DmaRxPollDemand: DmaRegisters = 0x0008;
-pub const DmaTxPollDemand: DmaRegisters = 0x0004;
-pub const DmaBusMode: DmaRegisters = 0x0000;
+pub type DmaHWFeatureReg = u32;
+pub const DMA_HW_FEAT_TXCOESEL: DmaHWFeatureReg = 0x00010000;
+pub const DMA_HW_FEAT_RXTYP1COE: DmaHWFeatureReg = 0x00020000;
+pub const DMA_HW_FEAT_RXTYP2COE: DmaHWFeatureReg = 0x00040000;
 
 pub type DmaStatusReg = u32;
 pub const DmaIntTxCompleted: DmaStatusReg = 0x00000001;
@@ -174,11 +286,20 @@ pub const DescSize1Shift: DmaDescriptorStatus = 0;
 pub const DescSize1Mask: DmaDescriptorStatus = 0x00001FFF;
 pub const DescSize2Shift: DmaDescriptorStatus = 16;
 pub const DescSize2Mask: DmaDescriptorStatus = 0x1FFF0000;
+pub const DescSize1: Field = Field::new(0, 13);
+pub const DescSize2: Field = Field::new(16, 13);
 pub const RxDescEndOfRing: DmaDescriptorStatus = 0x00008000;
 pub const RxDisIntCompl: DmaDescriptorStatus = 0x80000000;
+pub const DescRxChkBit0: DmaDescriptorStatus = 0x00000001;
+pub const DescRxChkBit5: DmaDescriptorStatus = 0x00000020;
+pub const DescRxChkBit7: DmaDescriptorStatus = 0x00000080;
 pub const DescTxDeferred: DmaDescriptorStatus = 0x00000001;
 pub const DescTxUnderflow: DmaDescriptorStatus = 0x00000002;
 pub const TxDescChain: DmaDescriptorStatus = 0x00100000;
+pub const DescTxCisBypass: DmaDescriptorStatus = 0x00000000;
+pub const DescTxCisIpv4HdrCs: DmaDescriptorStatus = 0x00400000;
+pub const DescTxCisTcpOnlyCs: DmaDescriptorStatus = 0x00800000;
+pub const DescTxCisTcpPseudoCs: DmaDescriptorStatus = 0x00c00000;
 pub const TxDescEndOfRing: DmaDescriptorStatus = 0x00200000;
 pub const DescTxFirst: DmaDescriptorStatus = 0x10000000;
 pub const DescTxLast: DmaDescriptorStatus = 0x20000000;
@@ -188,15 +309,16 @@ pub const DescRxFirst: DmaDescriptorStatus = 0x00000200;
 pub const DescError: DmaDescriptorStatus = 0x00008000;
 pub const DescFrameLengthShift: DmaDescriptorStatus = 16;
 pub const DescFrameLengthMask: DmaDescriptorStatus = 0x3FFF0000;
+pub const DescFrameLength: Field = Field::new(16, 14);
 pub const DescOwnByDma: DmaDescriptorStatus = 0x80000000;
 
-pub type MMC_ENABLE = u32;
-pub const GmacMmcIntrMaskTx: MMC_ENABLE = 0x0110;
-pub const GmacMmcIntrMaskRx: MMC_ENABLE = 0x010C;
+pub type MMC_ENABLE = Reg<MacRegs>;
+pub const GmacMmcIntrMaskTx: MMC_ENABLE = Reg::new(0x0110);
+pub const GmacMmcIntrMaskRx: MMC_ENABLE = Reg::new(0x010C);
 
-pub type MMC_IP_RELATED = u32;
-pub const GmacMmcRxIpcIntr: MMC_IP_RELATED = 0x0208;
-pub const GmacMmcRxIpcIntrMask: MMC_IP_RELATED = 0x0200;
+pub type MMC_IP_RELATED = Reg<MacRegs>;
+pub const GmacMmcRxIpcIntr: MMC_IP_RELATED = Reg::new(0x0208);
+pub const GmacMmcRxIpcIntrMask: MMC_IP_RELATED = Reg::new(0x0200);
 
 pub type InitialRegisters = u32;
 pub const DmaIntDisable: InitialRegisters = 0;
@@ -211,3 +333,7 @@ pub const DmaIntEnable: InitialRegisters = DmaIntNormal      | // 16
                                            DmaIntTxNoBuffer  | // 2
                                            DmaIntTxStopped   | // 1
                                            DmaIntTxCompleted; // 0
+// eth_poll等待处理期间屏蔽的收发完成中断
+pub const DmaIntPoll: InitialRegisters = DmaIntRxNoBuffer  | // 7
+                                         DmaIntRxCompleted | // 6
+                                         DmaIntTxCompleted;  // 0
@@ -1,58 +1,32 @@
 #![allow(dead_code, unused_assignments, unused_mut)]
 
 use crate::eth_defs::*;
+use crate::mmio::Mmio;
 use crate::platform::*;
 
 use core::ptr::{null_mut, read_volatile, write_volatile};
+use core::sync::atomic::{Ordering, fence};
 
-pub fn eth_mac_read_reg(base: u64, offset: u32) -> u32 {
-    let mut addr: u64 = 0;
-    let mut data: u32 = 0;
-    addr = base + offset as u64;
-    unsafe { data = read_volatile(addr as *mut u32) };
-    return data;
-}
-
-pub fn eth_mac_write_reg(mut base: u64, mut offset: u32, mut data: u32) {
-    let mut addr: u64;
-    addr = base + offset as u64;
-    unsafe { write_volatile(addr as *mut u32, data) };
-}
-
-pub fn eth_mac_set_bits(base: u64, offset: u32, pos: u32) {
-    let mut data: u32 = 0;
-    data = eth_mac_read_reg(base, offset);
-    data |= pos;
-    eth_mac_write_reg(base, offset, data);
-}
-
-pub fn eth_mac_clear_bits(base: u64, offset: u32, pos: u32) {
-    let mut data: u32 = 0;
-    data = eth_mac_read_reg(base, offset);
-    data &= !pos;
-    eth_mac_write_reg(base, offset, data);
-}
-
-pub fn eth_mdio_read(regbase: u64, phybase: u32, offset: u32) -> u16 {
+pub fn eth_mdio_read(regbase: Mmio<MacRegs>, phybase: u32, offset: u32) -> u16 {
     let mut addr: u32 = 0;
-    addr = (phybase << GmiiDevShift) & GmiiDevMask | (offset << GmiiRegShift) & GmiiRegMask;
+    addr = GmiiDev.val(phybase) | GmiiReg.val(offset);
     addr |= GmiiCsrClk4 | GmiiBusy;
 
-    eth_mac_write_reg(regbase, GmacGmiiAddr, addr);
-    while eth_mac_read_reg(regbase, GmacGmiiAddr) & GmiiBusy != 0 {}
+    regbase.write(GmacGmiiAddr, addr);
+    while regbase.read(GmacGmiiAddr) & GmiiBusy != 0 {}
 
-    return (eth_mac_read_reg(regbase, GmacGmiiData) & 0xffff) as u16;
+    return (regbase.read(GmacGmiiData) & 0xffff) as u16;
 }
 
-pub fn eth_mdio_write(regbase: u64, phybase: u32, offset: u32, data: u16) {
-    eth_mac_write_reg(regbase, GmacGmiiData, data as u32);
+pub fn eth_mdio_write(regbase: Mmio<MacRegs>, phybase: u32, offset: u32, data: u16) {
+    regbase.write(GmacGmiiData, data as u32);
 
     let mut addr: u32 = 0;
-    addr = phybase << GmiiDevShift & GmiiDevMask | offset << GmiiRegShift & GmiiRegMask;
+    addr = GmiiDev.val(phybase) | GmiiReg.val(offset);
     addr |= GmiiWrite | GmiiCsrClk4 | GmiiBusy;
 
-    eth_mac_write_reg(regbase, GmacGmiiAddr, addr);
-    while eth_mac_read_reg(regbase, GmacGmiiAddr) & GmiiBusy != 0 {}
+    regbase.write(GmacGmiiAddr, addr);
+    while regbase.read(GmacGmiiAddr) & GmiiBusy != 0 {}
 }
 
 pub fn eth_mac_set_addr(gmacdev: &net_device) {
@@ -60,35 +34,40 @@ pub fn eth_mac_set_addr(gmacdev: &net_device) {
     let mut data: u32;
 
     data = ((addr[5] as u32) << 8) | (addr[4] as u32);
-    eth_mac_write_reg(gmacdev.MacBase, GmacAddr0High, data);
+    gmacdev.MacBase.write(GmacAddr0High, data);
 
     data = ((addr[3] as u32) << 24)
         | ((addr[2] as u32) << 16)
         | ((addr[1] as u32) << 8)
         | (addr[0] as u32);
-    eth_mac_write_reg(gmacdev.MacBase, GmacAddr0Low, data);
+    gmacdev.MacBase.write(GmacAddr0Low, data);
 }
 
 pub fn eth_gmac_get_mac_addr(gmacdev: &net_device, addr: &mut [u8; 6]) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacAddr0High);
+    data = gmacdev.MacBase.read(GmacAddr0High);
     addr[5] = ((data >> 8) & 0xff) as u8;
     addr[4] = (data & 0xff) as u8;
 
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacAddr0Low);
+    data = gmacdev.MacBase.read(GmacAddr0Low);
     addr[3] = ((data >> 24) & 0xff) as u8;
     addr[2] = ((data >> 16) & 0xff) as u8;
     addr[1] = ((data >> 8) & 0xff) as u8;
     addr[0] = (data & 0xff) as u8;
 }
 
+// 读取dma硬件功能，各位的含义见DMA_HW_FEAT_*
+pub fn eth_mac_get_hw_feature(gmacdev: &mut net_device) {
+    gmacdev.DmaCap = gmacdev.DmaBase.read(DmaHWFeature);
+}
+
 pub fn eth_dma_reset(gmacdev: &net_device) {
     let mut data: u32 = 0;
 
-    eth_mac_write_reg(gmacdev.DmaBase, DmaBusMode, DmaResetOn);
+    gmacdev.DmaBase.write(DmaBusMode, DmaResetOn);
 
     loop {
-        data = eth_mac_read_reg(gmacdev.DmaBase, DmaBusMode);
+        data = gmacdev.DmaBase.read(DmaBusMode);
         if (data & 1) == 0 {
             break;
         }
@@ -96,95 +75,95 @@ pub fn eth_dma_reset(gmacdev: &net_device) {
 }
 
 pub fn eth_gmac_resume_dma_rx(gmacdev: &net_device) {
-    eth_mac_write_reg(gmacdev.DmaBase, DmaRxPollDemand, 0);
+    gmacdev.DmaBase.write(DmaRxPollDemand, 0);
 }
 
 pub fn eth_gmac_resume_dma_tx(gmacdev: &net_device) {
-    eth_mac_write_reg(gmacdev.DmaBase, DmaTxPollDemand, 0);
+    gmacdev.DmaBase.write(DmaTxPollDemand, 0);
 }
 
 pub fn eth_dma_enable_rx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.DmaBase, DmaControl);
+    data = gmacdev.DmaBase.read(DmaControl);
     data |= DmaRxStart;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, data);
+    gmacdev.DmaBase.write(DmaControl, data);
 }
 
 pub fn eth_dma_enable_tx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.DmaBase, DmaControl);
+    data = gmacdev.DmaBase.read(DmaControl);
     data |= DmaTxStart;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, data);
+    gmacdev.DmaBase.write(DmaControl, data);
 }
 
 pub fn eth_gmac_disable_dma_tx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.DmaBase, DmaControl);
+    data = gmacdev.DmaBase.read(DmaControl);
     data &= !DmaTxStart;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, data);
+    gmacdev.DmaBase.write(DmaControl, data);
 }
 
 pub fn eth_gmac_disable_dma_rx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.DmaBase, DmaControl);
+    data = gmacdev.DmaBase.read(DmaControl);
     data &= !DmaRxStart;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, data);
+    gmacdev.DmaBase.write(DmaControl, data);
 }
 
 pub fn eth_gmac_enable_rx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacConfig);
+    data = gmacdev.MacBase.read(GmacConfig);
     data |= GmacRx;
-    eth_mac_write_reg(gmacdev.MacBase, GmacConfig, data);
+    gmacdev.MacBase.write(GmacConfig, data);
 }
 
 pub fn eth_gmac_enable_tx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacConfig);
+    data = gmacdev.MacBase.read(GmacConfig);
     data |= GmacTx;
-    eth_mac_write_reg(gmacdev.MacBase, GmacConfig, data);
+    gmacdev.MacBase.write(GmacConfig, data);
 }
 
 pub fn eth_gmac_disable_rx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacConfig);
+    data = gmacdev.MacBase.read(GmacConfig);
     data &= !GmacRx;
-    eth_mac_write_reg(gmacdev.MacBase, GmacConfig, data);
+    gmacdev.MacBase.write(GmacConfig, data);
 }
 
 pub fn eth_gmac_disable_tx(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacConfig);
+    data = gmacdev.MacBase.read(GmacConfig);
     data &= !GmacTx;
-    eth_mac_write_reg(gmacdev.MacBase, GmacConfig, data);
+    gmacdev.MacBase.write(GmacConfig, data);
 }
 
 pub fn eth_dma_clear_curr_irq(gmacdev: &net_device) {
     let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.DmaBase, DmaStatus);
-    eth_mac_write_reg(gmacdev.DmaBase, DmaStatus, data);
+    data = gmacdev.DmaBase.read(DmaStatus);
+    gmacdev.DmaBase.write(DmaStatus, data);
 }
 
 pub fn eth_dma_clear_irq(gmacdev: &net_device, value: u32) {
-    eth_mac_write_reg(gmacdev.DmaBase, DmaStatus, value);
+    gmacdev.DmaBase.write(DmaStatus, value);
 }
 
 pub fn eth_dma_enable_interrupt(gmacdev: &net_device, value: u32) {
-    eth_mac_write_reg(gmacdev.DmaBase, DmaInterrupt, value);
+    gmacdev.DmaBase.write(DmaInterrupt, value);
 }
 
 pub fn eth_dma_disable_interrupt_all(gmacdev: &net_device) {
-    eth_mac_write_reg(gmacdev.DmaBase, DmaInterrupt, DmaIntDisable);
+    gmacdev.DmaBase.write(DmaInterrupt, DmaIntDisable);
 }
 
 pub fn eth_dma_disable_interrupt(gmacdev: &net_device, value: u32) {
-    eth_mac_clear_bits(gmacdev.DmaBase, DmaInterrupt, value);
+    gmacdev.DmaBase.clear_bits(DmaInterrupt, value);
 }
 
 pub fn eth_gmac_disable_mmc_irq(gmacdev: &net_device) {
-    eth_mac_write_reg(gmacdev.MacBase, GmacMmcIntrMaskTx, 0xffffffff);
-    eth_mac_write_reg(gmacdev.MacBase, GmacMmcIntrMaskRx, 0xffffffff);
-    eth_mac_write_reg(gmacdev.MacBase, GmacMmcRxIpcIntrMask, 0xffffffff);
+    gmacdev.MacBase.write(GmacMmcIntrMaskTx, 0xffffffff);
+    gmacdev.MacBase.write(GmacMmcIntrMaskRx, 0xffffffff);
+    gmacdev.MacBase.write(GmacMmcRxIpcIntrMask, 0xffffffff);
 }
 
 pub fn eth_dma_bus_mode_init(gmacdev: &net_device) {
@@ -192,20 +171,20 @@ pub fn eth_dma_bus_mode_init(gmacdev: &net_device) {
     value |= DmaMixedBurstEnable;
     value |= DmaBurstLengthx8 | DmaBurstLength32;
     value |= DmaDescriptor4DWords | DmaDescriptorSkip0;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaBusMode, value);
+    gmacdev.DmaBase.write(DmaBusMode, value);
 }
 
 pub fn eth_dma_control_init(gmacdev: &net_device) {
     let mut value: u32 = 0;
     value |= DmaStoreAndForward | DmaTxSecondFrame;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, value);
+    gmacdev.DmaBase.write(DmaControl, value);
 }
 
 pub fn eth_dma_axi_bus_mode_init(gmacdev: &net_device) {
     let mut value: u32 = 0;
     value |= 0xff;
     value |= 0x77 << 16;
-    eth_mac_write_reg(gmacdev.DmaBase, 0x28, value);
+    gmacdev.DmaBase.write(DmaAxiBusMode, value);
 }
 
 pub fn eth_dma_reg_init(gmacdev: &net_device) {
@@ -215,59 +194,51 @@ pub fn eth_dma_reg_init(gmacdev: &net_device) {
 }
 
 pub fn eth_gmac_back_off_limit(gmacdev: &net_device, value: u32) {
-    let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacConfig);
-    data &= !GmacBackoffLimit;
-    data |= value;
-    eth_mac_write_reg(gmacdev.MacBase, GmacConfig, data);
+    gmacdev.MacBase.modify(GmacConfig, GmacBackoffLimit, value);
 }
 
 pub fn eth_gmac_config_init(gmacdev: &net_device) {
-    eth_mac_set_bits(gmacdev.MacBase, GmacConfig, GmacTxConfig);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacWatchdog);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacJabber);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacFrameBurst);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacJumboFrame);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacRxOwn);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacLoopback);
-    eth_mac_set_bits(gmacdev.MacBase, GmacConfig, GmacDuplex);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacRetry);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacPadCrcStrip);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacConfig, GmacDeferralCheck);
+    gmacdev.MacBase.set_bits(GmacConfig, GmacTxConfig);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacWatchdog);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacJabber);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacFrameBurst);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacJumboFrame);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacRxOwn);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacLoopback);
+    gmacdev.MacBase.set_bits(GmacConfig, GmacDuplex);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacRetry);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacPadCrcStrip);
+    gmacdev.MacBase.clear_bits(GmacConfig, GmacDeferralCheck);
     eth_gmac_back_off_limit(gmacdev, GmacBackoffLimit0);
 }
 
 pub fn eth_gmac_set_pass_control(gmacdev: &net_device, value: u32) {
-    let mut data: u32 = 0;
-    data = eth_mac_read_reg(gmacdev.MacBase, GmacFrameFilter);
-    data &= !GmacPassControl;
-    data |= value;
-    eth_mac_write_reg(gmacdev.MacBase, GmacFrameFilter, data);
+    gmacdev.MacBase.modify(GmacFrameFilter, GmacPassControl, value);
 }
 
 pub fn eth_gmac_frame_filter(gmacdev: &net_device) {
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacSrcAddrFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacSrcAddrFilter);
     eth_gmac_set_pass_control(gmacdev, GmacPassControl0);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacBroadcast);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacMulticastFilter);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacDestAddrFilter);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacMcastHashFilter);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacUcastHashFilter);
-    eth_mac_clear_bits(gmacdev.MacBase, GmacFrameFilter, GmacPromiscuousMode);
-    eth_mac_set_bits(gmacdev.MacBase, GmacFrameFilter, GmacFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacBroadcast);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacMulticastFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacDestAddrFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacMcastHashFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacUcastHashFilter);
+    gmacdev.MacBase.clear_bits(GmacFrameFilter, GmacPromiscuousMode);
+    gmacdev.MacBase.set_bits(GmacFrameFilter, GmacFilter);
 }
 
 pub fn eth_gmac_flow_control(gmacdev: &net_device) {
     let mut dma_ctrl: u32 = 0;
-    dma_ctrl = eth_mac_read_reg(gmacdev.DmaBase, DmaControl);
+    dma_ctrl = gmacdev.DmaBase.read(DmaControl);
     dma_ctrl &= !(DmaRxFlowCtrlAct | DmaRxFlowCtrlDeact);
     dma_ctrl &= !DmaEnHwFlowCtrl;
-    eth_mac_write_reg(gmacdev.DmaBase, DmaControl, dma_ctrl);
+    gmacdev.DmaBase.write(DmaControl, dma_ctrl);
 
     let mut flow_ctrl: u32 = 0;
     flow_ctrl |= GmacPauseTimeMask;
     flow_ctrl &= !(GmacRxFlowControl | GmacTxFlowControl);
-    eth_mac_write_reg(gmacdev.MacBase, GmacFlowControl, flow_ctrl);
+    gmacdev.MacBase.write(GmacFlowControl, flow_ctrl);
 }
 
 pub fn eth_gmac_reg_init(gmacdev: &net_device) {
@@ -276,26 +247,27 @@ pub fn eth_gmac_reg_init(gmacdev: &net_device) {
     eth_gmac_flow_control(gmacdev);
 }
 
-pub fn eth_setup_tx_desc_queue(gmacdev: &mut net_device, desc_num: u32) {
+pub fn eth_setup_tx_desc_queue(gmacdev: &mut net_device) {
+    let desc_num: u32 = gmacdev.TxDesc.depth();
     let mut desc: *mut DmaDesc = null_mut();
     let mut dma_addr: u32 = 0;
     let mut buffer: u64 = 0;
 
-    desc = unsafe { eth_malloc_align((size_of::<DmaDesc>() * (desc_num as usize)) as u64, 16) }
+    desc = eth_malloc_align((size_of::<DmaDesc>() * (desc_num as usize)) as u64, 16)
         as *mut DmaDesc;
-    dma_addr = unsafe { eth_virt_to_phys(desc as u64) };
+    dma_addr = eth_virt_to_phys(desc as u64);
 
     gmacdev.TxNext = 0;
     gmacdev.TxBusy = 0;
 
-    eth_mac_write_reg(gmacdev.DmaBase, DmaTxBaseAddr, dma_addr);
+    gmacdev.DmaBase.write(DmaTxBaseAddr, dma_addr);
 
     for i in 0..desc_num {
-        buffer = unsafe { eth_malloc_align(2048, 16) };
-        gmacdev.TxDesc[i as usize] = desc;
-        gmacdev.TxBuffer[i as usize] = buffer;
+        buffer = eth_malloc_align(2048, 16);
+        gmacdev.TxDesc[i] = desc;
+        gmacdev.TxBuffer[i] = buffer;
 
-        let is_last = i == desc_num - 1;
+        let is_last = gmacdev.TxDesc.is_last(i);
         unsafe {
             (*desc).status = if is_last { TxDescEndOfRing } else { 0 };
             (*desc).length = 0;
@@ -306,30 +278,31 @@ pub fn eth_setup_tx_desc_queue(gmacdev: &mut net_device, desc_num: u32) {
     }
 }
 
-pub fn eth_setup_rx_desc_queue(gmacdev: &mut net_device, desc_num: u32) {
+pub fn eth_setup_rx_desc_queue(gmacdev: &mut net_device) {
+    let desc_num: u32 = gmacdev.RxDesc.depth();
     let mut desc: *mut DmaDesc = null_mut();
     let mut dma_addr: u32 = 0;
     let mut buffer: u64 = 0;
 
-    desc = unsafe { eth_malloc_align((size_of::<DmaDesc>() * (desc_num as usize)) as u64, 16) }
+    desc = eth_malloc_align((size_of::<DmaDesc>() * (desc_num as usize)) as u64, 16)
         as *mut DmaDesc;
-    dma_addr = unsafe { eth_virt_to_phys(desc as u64) };
+    dma_addr = eth_virt_to_phys(desc as u64);
 
     gmacdev.RxBusy = 0;
 
-    eth_mac_write_reg(gmacdev.DmaBase, DmaRxBaseAddr, dma_addr);
+    gmacdev.DmaBase.write(DmaRxBaseAddr, dma_addr);
 
     for i in 0..desc_num {
-        buffer = unsafe { eth_malloc_align(2048, 16) };
-        dma_addr = unsafe { eth_virt_to_phys(buffer) };
-        gmacdev.RxDesc[i as usize] = desc;
-        gmacdev.RxBuffer[i as usize] = buffer;
+        buffer = eth_malloc_align(2048, 16);
+        dma_addr = eth_virt_to_phys(buffer);
+        gmacdev.RxDesc[i] = desc;
+        gmacdev.RxBuffer[i] = buffer;
 
-        let is_last = i == desc_num - 1;
+        let is_last = gmacdev.RxDesc.is_last(i);
         unsafe {
             (*desc).status = DescOwnByDma;
             (*desc).length = if is_last { RxDescEndOfRing } else { 0 };
-            (*desc).length |= ((2048 << DescSize1Shift) & DescSize1Mask) as u32;
+            (*desc).length |= DescSize1.val(2048);
             (*desc).buffer1 = dma_addr;
             (*desc).buffer2 = 0;
             desc = desc.offset(1);
@@ -337,26 +310,79 @@ pub fn eth_setup_rx_desc_queue(gmacdev: &mut net_device, desc_num: u32) {
     }
 }
 
-pub fn eth_get_desc_owner(desc: &DmaDesc) -> bool {
-    return (desc.status & DescOwnByDma) == DescOwnByDma;
+// 描述符由dma引擎并发读写，只逐个字段volatile访问，不整体复制：
+// 收回时先读status，OWN位已清除后eth_desc_acquire，再读其他字段；
+// 交给dma时先写其他字段，最后由eth_desc_release在屏障之后写status
+pub fn eth_desc_status(desc: *const DmaDesc) -> u32 {
+    return unsafe { read_volatile(&raw const (*desc).status) };
+}
+
+pub fn eth_desc_length(desc: *const DmaDesc) -> u32 {
+    return unsafe { read_volatile(&raw const (*desc).length) };
+}
+
+pub fn eth_desc_buffer1(desc: *const DmaDesc) -> u32 {
+    return unsafe { read_volatile(&raw const (*desc).buffer1) };
+}
+
+// status中OWN位已清除，之后读到的字段和缓冲区数据不早于status
+pub fn eth_desc_acquire() {
+    fence(Ordering::Acquire);
+}
+
+// 填写除status以外的字段
+pub fn eth_desc_set(desc: *mut DmaDesc, length: u32, buffer1: u32, buffer2: u32) {
+    #[cfg(test)]
+    desc_trace::push(desc_trace::DescWrite::Fields(desc as usize));
+
+    unsafe {
+        write_volatile(&raw mut (*desc).length, length);
+        write_volatile(&raw mut (*desc).buffer1, buffer1);
+        write_volatile(&raw mut (*desc).buffer2, buffer2);
+    }
+}
+
+// 其他字段和缓冲区数据之后写入status，status带DescOwnByDma时描述符交给dma
+pub fn eth_desc_release(desc: *mut DmaDesc, status: u32) {
+    #[cfg(test)]
+    desc_trace::push(desc_trace::DescWrite::Fence);
+    #[cfg(test)]
+    desc_trace::push(desc_trace::DescWrite::Status(desc as usize, status));
+
+    fence(Ordering::Release);
+    unsafe { write_volatile(&raw mut (*desc).status, status) };
+}
+
+// 不带屏障写入status，只用于一批中排在后面的描述符
+// dma读到它之前一定先读到带屏障释放的第一个描述符
+pub fn eth_desc_release_relaxed(desc: *mut DmaDesc, status: u32) {
+    #[cfg(test)]
+    desc_trace::push(desc_trace::DescWrite::Status(desc as usize, status));
+
+    unsafe { write_volatile(&raw mut (*desc).status, status) };
+}
+
+pub fn eth_get_desc_owner(status: u32) -> bool {
+    return (status & DescOwnByDma) == DescOwnByDma;
 }
 
-pub fn eth_get_rx_length(desc: &DmaDesc) -> u32 {
-    return (desc.status & DescFrameLengthMask) >> DescFrameLengthShift;
+pub fn eth_get_rx_length(status: u32) -> u32 {
+    return DescFrameLength.get(status);
 }
 
-pub fn eth_is_tx_desc_valid(desc: &DmaDesc) -> bool {
-    return (desc.status & DescError) == 0;
+pub fn eth_is_tx_desc_valid(status: u32) -> bool {
+    return (status & DescError) == 0;
 }
 
-pub fn eth_is_desc_empty(desc: &DmaDesc) -> bool {
-    return (desc.length & DescSize1Mask == 0) && (desc.length & DescSize2Mask == 0);
+pub fn eth_is_desc_empty(length: u32) -> bool {
+    return (length & DescSize1Mask == 0) && (length & DescSize2Mask == 0);
 }
 
-pub fn eth_is_rx_desc_valid(desc: &DmaDesc) -> bool {
-    return (desc.status & DescError == 0)
-        && (desc.status & DescRxFirst == DescRxFirst)
-        && (desc.status & DescRxLast == DescRxLast);
+// 包从first跨到last描述符，错误状态只在last中有效
+pub fn eth_is_rx_frame_valid(first: u32, last: u32) -> bool {
+    return (last & DescError == 0)
+        && (first & DescRxFirst == DescRxFirst)
+        && (last & DescRxLast == DescRxLast);
 }
 
 pub fn eth_is_last_rx_desc(desc: &DmaDesc) -> bool {
@@ -366,3 +392,33 @@ pub fn eth_is_last_rx_desc(desc: &DmaDesc) -> bool {
 pub fn eth_is_last_tx_desc(desc: &DmaDesc) -> bool {
     return desc.status & TxDescEndOfRing == TxDescEndOfRing;
 }
+
+// 单元测试中按顺序记录上面几个函数对描述符的写入，
+// drv_eth.rs的测试据此模拟dma能看到的描述符
+#[cfg(test)]
+pub mod desc_trace {
+    extern crate std;
+
+    use std::cell::RefCell;
+    use std::vec::Vec;
+
+    #[derive(Clone, Copy, Debug, PartialEq)]
+    pub enum DescWrite {
+        Fields(usize),      // eth_desc_set写入length、buffer1和buffer2
+        Fence,              // 释放屏障，之前的写入对dma可见
+        Status(usize, u32), // 写入status
+    }
+
+    std::thread_local! {
+        static TRACE: RefCell<Vec<DescWrite>> = RefCell::new(Vec::new());
+    }
+
+    pub fn push(w: DescWrite) {
+        TRACE.with(|t| t.borrow_mut().push(w));
+    }
+
+    // 取出并清空当前线程的记录
+    pub fn take() -> Vec<DescWrite> {
+        return TRACE.with(|t| t.take());
+    }
+}
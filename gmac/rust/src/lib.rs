@@ -4,10 +4,16 @@
 mod drv_eth;
 mod eth_defs;
 mod eth_dev;
+#[path = "../../../common/rust/mmio.rs"]
+mod mmio;
 mod platform;
+#[path = "../../../common/rust/ring.rs"]
+mod ring;
 
+#[cfg(not(test))]
 use core::panic::PanicInfo;
 
+#[cfg(not(test))]
 #[panic_handler]
 fn panic(_info: &PanicInfo) -> ! {
     loop {}
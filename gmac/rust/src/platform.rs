@@ -1,80 +1,487 @@
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
 use core::arch::asm;
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+use core::cell::UnsafeCell;
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+use core::sync::atomic::{AtomicUsize, Ordering};
 
 use crate::eth_defs::*;
 
-/*
-// for C test
+// 驱动依赖的平台功能
+// 实现在编译时通过Plat选定，驱动中的调用都是静态分派，可以内联到热路径中
+pub trait EthPlatform {
+    // 等待数毫秒
+    fn mdelay(ms: u32);
+
+    // 单调递增的微秒时间
+    fn get_time_us() -> u64;
+
+    // 分配按align字节对齐的内存
+    fn malloc_align(size: u64, align: u32) -> u64;
+
+    // 同步dcache中所有cached和uncached访存请求
+    fn sync_dcache();
+
+    // cached虚拟地址转换为物理地址
+    // dma仅接受32位的物理地址
+    fn virt_to_phys(va: u64) -> u32;
+
+    // 物理地址转换为cached虚拟地址
+    fn phys_to_virt(pa: u32) -> u64;
+
+    // 物理地址转换为uncached虚拟地址
+    fn phys_to_uncached(pa: u64) -> u64;
+
+    // 以下函数的gmacdev是调用它的实例，OS据此区分gmac0和gmac1
+
+    // 处理tx buffer
+    //（OS可能会有自定义格式的存储单元）
+    // p是OS传递给驱动的存储单元
+    // buffer是驱动分配的dma内存
+    // 将p的数据copy到buffer中
+    // 返回数据总长度
+    fn handle_tx_buffer(gmacdev: *mut net_device, p: u64, buffer: u64) -> u32;
+
+    // eth_tx_sg发送的包发送完成（或出错）后调用
+    // p是传给eth_tx_sg的存储单元，OS此时可以释放其中的缓冲区
+    fn handle_tx_done(gmacdev: *mut net_device, p: u64);
+
+    // 开启发送校验和offload后，每个包发送前调用
+    // p是传给eth_tx/eth_tx_burst/eth_tx_sg的存储单元
+    // 返回需要硬件插入的校验和，ETH_TX_CSUM_IP/ETH_TX_CSUM_L4，0表示由OS计算
+    fn handle_tx_csum(gmacdev: *mut net_device, p: u64) -> u32;
+
+    // 处理rx buffer
+    // buffer是接收到的数据，length是字节数
+    // OS需要分配内存，memcpy接收到的数据，并将地址返回
+    fn handle_rx_buffer(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64;
+
+    // zero-copy rx时代替handle_rx_buffer
+    // OS不拷贝，直接用buffer构造存储单元并返回
+    // OS用完后调用eth_rx_release把buffer还给驱动，返回0时buffer仍归驱动
+    fn handle_rx_zero_copy(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64;
+
+    // 开启接收校验和offload后，每个交给OS的包调用
+    // csum为ETH_RX_CSUM_OK时OS不需要再检查ip头和tcp/udp/icmp的校验和
+    fn handle_rx_csum(gmacdev: *mut net_device, pbuf: u64, csum: u32);
+
+    // 中断isr通知OS可以调用rx函数
+    fn rx_ready(gmacdev: *mut net_device);
+
+    // 中断isr通知链路状态发生变化，status - 1表示up，0表示down
+    // 链路目前仅支持1000Mbps duplex
+    fn update_linkstate(gmacdev: *mut net_device, status: u32);
+
+    // OS注册gmacdev.Irq的中断，isr调用eth_irq(gmacdev)
+    // gmac0为12，gmac1为14，两个实例各自注册
+    fn isr_install(gmacdev: *mut net_device);
+}
+
+// 这里是测试时用于调用C的printf
+// 替换成OS实现的printf，可变参数无法放入trait
+#[cfg(not(test))]
 unsafe extern "C" {
     pub fn eth_printf(fmt: *const u8, _: ...) -> i32;
-    pub fn eth_sync_dcache();
-    pub fn eth_virt_to_phys(va: u64) -> u32;
-    pub fn eth_phys_to_virt(pa: u32) -> u64;
-    pub fn eth_malloc_align(size: u64, align: u32) -> u64;
-    pub fn eth_handle_tx_buffer(p: u64, buffer: u64) -> u32;
-    pub fn eth_handle_rx_buffer(buffer: u64, length: u32) -> u64;
-    pub fn eth_rx_ready(gmacdev: *mut net_device);
-    pub fn eth_update_linkstate(gmacdev: *mut net_device, status: u32);
-    pub fn eth_isr_install();
-}
-*/
+}
 
-// 这里是测试时用于调用C的printf
-// 替换成OS实现的printf
+// 主机上的单元测试直接使用libc的printf
+#[cfg(test)]
 unsafe extern "C" {
+    #[link_name = "printf"]
     pub fn eth_printf(fmt: *const u8, _: ...) -> i32;
 }
 
-// 同步dcache中所有cached和uncached访存请求
-pub fn eth_sync_dcache() {
-    unsafe {
-        asm!("dbar 0");
+// 静态区域上的顺序分配器，驱动只在初始化时分配，不释放
+// 区域在镜像的bss中，裸机和主机上都是dma可以访问的低地址
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+#[repr(C, align(4096))]
+pub struct BumpHeap<const N: usize> {
+    mem: UnsafeCell<[u8; N]>,
+    used: AtomicUsize,
+}
+
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+unsafe impl<const N: usize> Sync for BumpHeap<N> {}
+
+#[cfg(any(feature = "mock", not(feature = "rtthread")))]
+impl<const N: usize> BumpHeap<N> {
+    pub const fn new() -> Self {
+        return BumpHeap { mem: UnsafeCell::new([0; N]), used: AtomicUsize::new(0) };
+    }
+
+    // 空间不足时返回0
+    pub fn alloc(&self, size: u64, align: u32) -> u64 {
+        let base: usize = self.mem.get() as usize;
+        let align: usize = (align as usize).max(1);
+        let mut used: usize = self.used.load(Ordering::Relaxed);
+
+        loop {
+            let start: usize = (base + used + align - 1) & !(align - 1);
+            let end: usize = start + size as usize;
+            if end > base + N {
+                return 0;
+            }
+
+            match self.used.compare_exchange_weak(used, end - base, Ordering::Relaxed, Ordering::Relaxed) {
+                Ok(_) => return start as u64,
+                Err(cur) => used = cur,
+            }
+        }
+    }
+}
+
+// 龙芯2K1000LA裸机实现，未启用其他实现时使用
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub const LS2K_HEAP_SZ: usize = 8 << 20; // 两个实例都开启jumbo帧和zero-copy接收时约用4MiB
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+static LS2K_HEAP: BumpHeap<LS2K_HEAP_SZ> = BumpHeap::new();
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub struct Ls2kPlatform;
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+impl EthPlatform for Ls2kPlatform {
+    // 忙等稳定计数器
+    fn mdelay(ms: u32) {
+        let end: u64 = Self::get_time_us() + ms as u64 * 1000;
+        while Self::get_time_us() < end {
+            core::hint::spin_loop();
+        }
     }
+
+    // ls2k稳定计数器频率为100MHz
+    #[inline(always)]
+    fn get_time_us() -> u64 {
+        let cnt: u64;
+        unsafe {
+            asm!("rdtime.d {}, $zero", out(reg) cnt);
+        }
+        cnt / 100
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        return LS2K_HEAP.alloc(size, align);
+    }
+
+    #[inline(always)]
+    fn sync_dcache() {
+        unsafe {
+            asm!("dbar 0");
+        }
+    }
+
+    #[inline(always)]
+    fn virt_to_phys(va: u64) -> u32 {
+        va as u32
+    }
+
+    #[inline(always)]
+    fn phys_to_virt(pa: u32) -> u64 {
+        pa as u64
+    }
+
+    #[inline(always)]
+    fn phys_to_uncached(pa: u64) -> u64 {
+        pa
+    }
+
+    fn handle_tx_buffer(_gmacdev: *mut net_device, _p: u64, _buffer: u64) -> u32 {
+        0
+    }
+
+    fn handle_tx_done(_gmacdev: *mut net_device, _p: u64) {}
+
+    fn handle_tx_csum(_gmacdev: *mut net_device, _p: u64) -> u32 {
+        0
+    }
+
+    fn handle_rx_buffer(_gmacdev: *mut net_device, _buffer: u64, _length: u32) -> u64 {
+        0
+    }
+
+    fn handle_rx_zero_copy(_gmacdev: *mut net_device, _buffer: u64, _length: u32) -> u64 {
+        0
+    }
+
+    fn handle_rx_csum(_gmacdev: *mut net_device, _pbuf: u64, _csum: u32) {}
+
+    fn rx_ready(_gmacdev: *mut net_device) {}
+
+    fn update_linkstate(_gmacdev: *mut net_device, _status: u32) {}
+
+    fn isr_install(_gmacdev: *mut net_device) {}
 }
 
-// cached虚拟地址转换为物理地址
-// dma仅接受32位的物理地址
+// RT-Thread等C环境，调用eth_platform.h中由系统提供的函数
+#[cfg(feature = "rtthread")]
+pub struct FfiPlatform;
+
+#[cfg(feature = "rtthread")]
+mod c {
+    use crate::eth_defs::net_device;
+
+    unsafe extern "C" {
+        pub fn eth_mdelay(ms: u32);
+        pub fn eth_get_time_us() -> u64;
+        pub fn eth_malloc_align(size: u64, align: u32) -> u64;
+        pub fn eth_sync_dcache();
+        pub fn eth_virt_to_phys(va: u64) -> u32;
+        pub fn eth_phys_to_virt(pa: u32) -> u64;
+        pub fn eth_phys_to_uncached(pa: u64) -> u64;
+        pub fn eth_handle_tx_buffer(gmacdev: *mut net_device, p: u64, buffer: u64) -> u32;
+        pub fn eth_handle_tx_done(gmacdev: *mut net_device, p: u64);
+        pub fn eth_handle_tx_csum(gmacdev: *mut net_device, p: u64) -> u32;
+        pub fn eth_handle_rx_buffer(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64;
+        pub fn eth_handle_rx_zero_copy(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64;
+        pub fn eth_handle_rx_csum(gmacdev: *mut net_device, pbuf: u64, csum: u32);
+        pub fn eth_rx_ready(gmacdev: *mut net_device);
+        pub fn eth_update_linkstate(gmacdev: *mut net_device, status: u32);
+        pub fn eth_isr_install(gmacdev: *mut net_device);
+    }
+}
+
+#[cfg(feature = "rtthread")]
+impl EthPlatform for FfiPlatform {
+    fn mdelay(ms: u32) {
+        unsafe { c::eth_mdelay(ms) }
+    }
+
+    fn get_time_us() -> u64 {
+        unsafe { c::eth_get_time_us() }
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        unsafe { c::eth_malloc_align(size, align) }
+    }
+
+    fn sync_dcache() {
+        unsafe { c::eth_sync_dcache() }
+    }
+
+    fn virt_to_phys(va: u64) -> u32 {
+        unsafe { c::eth_virt_to_phys(va) }
+    }
+
+    fn phys_to_virt(pa: u32) -> u64 {
+        unsafe { c::eth_phys_to_virt(pa) }
+    }
+
+    fn phys_to_uncached(pa: u64) -> u64 {
+        unsafe { c::eth_phys_to_uncached(pa) }
+    }
+
+    fn handle_tx_buffer(gmacdev: *mut net_device, p: u64, buffer: u64) -> u32 {
+        unsafe { c::eth_handle_tx_buffer(gmacdev, p, buffer) }
+    }
+
+    fn handle_tx_done(gmacdev: *mut net_device, p: u64) {
+        unsafe { c::eth_handle_tx_done(gmacdev, p) }
+    }
+
+    fn handle_tx_csum(gmacdev: *mut net_device, p: u64) -> u32 {
+        unsafe { c::eth_handle_tx_csum(gmacdev, p) }
+    }
+
+    fn handle_rx_buffer(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64 {
+        unsafe { c::eth_handle_rx_buffer(gmacdev, buffer, length) }
+    }
+
+    fn handle_rx_zero_copy(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64 {
+        unsafe { c::eth_handle_rx_zero_copy(gmacdev, buffer, length) }
+    }
+
+    fn handle_rx_csum(gmacdev: *mut net_device, pbuf: u64, csum: u32) {
+        unsafe { c::eth_handle_rx_csum(gmacdev, pbuf, csum) }
+    }
+
+    fn rx_ready(gmacdev: *mut net_device) {
+        unsafe { c::eth_rx_ready(gmacdev) }
+    }
+
+    fn update_linkstate(gmacdev: *mut net_device, status: u32) {
+        unsafe { c::eth_update_linkstate(gmacdev, status) }
+    }
+
+    fn isr_install(gmacdev: *mut net_device) {
+        unsafe { c::eth_isr_install(gmacdev) }
+    }
+}
+
+// 主机上的模拟实现，只用于单元测试（基准测试用rtthread，链接bench中的C平台函数）
+// 内存从静态区域中顺序分配，不释放；时间是虚拟时钟，
+// 每次读取前进1微秒，mdelay直接推进时钟；
+// 发送时不复制数据，只返回固定的包长，接收的数据直接丢弃；
+// 寄存器由调用者分配，DmaHWFeature填入MOCK_DMA_HW_FEATURE
+#[cfg(feature = "mock")]
+pub struct MockPlatform;
+
+#[cfg(feature = "mock")]
+pub mod mock {
+    use super::BumpHeap;
+    use crate::eth_defs::{DMA_HW_FEAT_RXTYP2COE, DMA_HW_FEAT_TXCOESEL};
+    use core::sync::atomic::AtomicU64;
+
+    pub const MOCK_HEAP_SZ: usize = 4 << 20;
+    pub const MOCK_TX_LEN: u32 = 1514;
+    // DmaHWFeature：支持发送和Type 2接收校验和offload，与板上的gmac相同
+    pub const MOCK_DMA_HW_FEATURE: u32 = DMA_HW_FEAT_TXCOESEL | DMA_HW_FEAT_RXTYP2COE;
+
+    // dma地址只有32位，区域需要位于低4G
+    pub static HEAP: BumpHeap<MOCK_HEAP_SZ> = BumpHeap::new();
+    pub static CLOCK_US: AtomicU64 = AtomicU64::new(0);
+}
+
+#[cfg(feature = "mock")]
+impl EthPlatform for MockPlatform {
+    fn mdelay(ms: u32) {
+        mock::CLOCK_US.fetch_add(ms as u64 * 1000, core::sync::atomic::Ordering::Relaxed);
+    }
+
+    #[inline(always)]
+    fn get_time_us() -> u64 {
+        mock::CLOCK_US.fetch_add(1, core::sync::atomic::Ordering::Relaxed) + 1
+    }
+
+    fn malloc_align(size: u64, align: u32) -> u64 {
+        return mock::HEAP.alloc(size, align);
+    }
+
+    #[inline(always)]
+    fn sync_dcache() {
+        core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+    }
+
+    #[inline(always)]
+    fn virt_to_phys(va: u64) -> u32 {
+        va as u32
+    }
+
+    #[inline(always)]
+    fn phys_to_virt(pa: u32) -> u64 {
+        pa as u64
+    }
+
+    #[inline(always)]
+    fn phys_to_uncached(pa: u64) -> u64 {
+        pa
+    }
+
+    fn handle_tx_buffer(_gmacdev: *mut net_device, _p: u64, _buffer: u64) -> u32 {
+        mock::MOCK_TX_LEN
+    }
+
+    fn handle_tx_done(_gmacdev: *mut net_device, _p: u64) {}
+
+    fn handle_tx_csum(_gmacdev: *mut net_device, _p: u64) -> u32 {
+        0
+    }
+
+    fn handle_rx_buffer(_gmacdev: *mut net_device, buffer: u64, _length: u32) -> u64 {
+        buffer
+    }
+
+    fn handle_rx_zero_copy(_gmacdev: *mut net_device, buffer: u64, _length: u32) -> u64 {
+        buffer
+    }
+
+    fn handle_rx_csum(_gmacdev: *mut net_device, _pbuf: u64, _csum: u32) {}
+
+    fn rx_ready(_gmacdev: *mut net_device) {}
+
+    fn update_linkstate(_gmacdev: *mut net_device, _status: u32) {}
+
+    fn isr_install(_gmacdev: *mut net_device) {}
+}
+
+// 编译时选择的平台实现
+#[cfg(feature = "rtthread")]
+pub type Plat = FfiPlatform;
+
+#[cfg(all(feature = "mock", not(feature = "rtthread")))]
+pub type Plat = MockPlatform;
+
+#[cfg(not(any(feature = "rtthread", feature = "mock")))]
+pub type Plat = Ls2kPlatform;
+
+// 驱动使用的平台函数，转发给Plat
+
+#[inline(always)]
+pub fn eth_mdelay(ms: u32) {
+    Plat::mdelay(ms);
+}
+
+#[inline(always)]
+pub fn eth_get_time_us() -> u64 {
+    return Plat::get_time_us();
+}
+
+#[inline(always)]
+pub fn eth_sync_dcache() {
+    Plat::sync_dcache();
+}
+
+#[inline(always)]
 pub fn eth_virt_to_phys(va: u64) -> u32 {
-    va as u32
+    return Plat::virt_to_phys(va);
 }
 
-// 物理地址转换为cached虚拟地址
+#[inline(always)]
 pub fn eth_phys_to_virt(pa: u32) -> u64 {
-    pa as u64
+    return Plat::phys_to_virt(pa);
 }
 
-// 物理地址转换为uncached虚拟地址
+#[inline(always)]
 pub fn eth_phys_to_uncached(pa: u64) -> u64 {
-    pa
+    return Plat::phys_to_uncached(pa);
 }
 
-// 分配按align字节对齐的内存
+#[inline(always)]
 pub fn eth_malloc_align(size: u64, align: u32) -> u64 {
-    0
+    return Plat::malloc_align(size, align);
 }
 
-// 处理tx buffer
-pub fn eth_handle_tx_buffer(p: u64, buffer: u64) -> u32 {
-    //（OS可能会有自定义格式的存储单元）
-    // p是OS传递给驱动的存储单元
-    // buffer是驱动分配的dma内存
-    // 将p的数据copy到buffer中
-    // 返回数据总长度
-    0
+#[inline(always)]
+pub fn eth_handle_tx_buffer(gmacdev: *mut net_device, p: u64, buffer: u64) -> u32 {
+    return Plat::handle_tx_buffer(gmacdev, p, buffer);
 }
 
-// 处理rx buffer
-pub fn eth_handle_rx_buffer(buffer: u64, length: u32) -> u64 {
-    // buffer是接收到的数据，length是字节数
-    // OS需要分配内存，memcpy接收到的数据，并将地址返回
-    0
+#[inline(always)]
+pub fn eth_handle_tx_done(gmacdev: *mut net_device, p: u64) {
+    Plat::handle_tx_done(gmacdev, p);
+}
+
+#[inline(always)]
+pub fn eth_handle_tx_csum(gmacdev: *mut net_device, p: u64) -> u32 {
+    return Plat::handle_tx_csum(gmacdev, p);
+}
+
+#[inline(always)]
+pub fn eth_handle_rx_buffer(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64 {
+    return Plat::handle_rx_buffer(gmacdev, buffer, length);
+}
+
+#[inline(always)]
+pub fn eth_handle_rx_zero_copy(gmacdev: *mut net_device, buffer: u64, length: u32) -> u64 {
+    return Plat::handle_rx_zero_copy(gmacdev, buffer, length);
 }
 
-// 中断isr通知OS可以调用rx函数
-pub fn eth_rx_ready(gmacdev: *mut net_device) {}
+#[inline(always)]
+pub fn eth_handle_rx_csum(gmacdev: *mut net_device, pbuf: u64, csum: u32) {
+    Plat::handle_rx_csum(gmacdev, pbuf, csum);
+}
 
-// 中断isr通知链路状态发生变化，status - 1表示up，0表示down
-// 链路目前仅支持1000Mbps duplex
-pub fn eth_update_linkstate(gmacdev: *mut net_device, status: u32) {}
+#[inline(always)]
+pub fn eth_rx_ready(gmacdev: *mut net_device) {
+    Plat::rx_ready(gmacdev);
+}
 
-// OS注册中断，中断号为12
-pub fn eth_isr_install() {}
+#[inline(always)]
+pub fn eth_update_linkstate(gmacdev: *mut net_device, status: u32) {
+    Plat::update_linkstate(gmacdev, status);
+}
+
+#[inline(always)]
+pub fn eth_isr_install(gmacdev: *mut net_device) {
+    Plat::isr_install(gmacdev);
+}